@@ -0,0 +1,399 @@
+/**
+ * @file lmdb-bench.cpp - standalone storage engine benchmark.
+ *
+ * Runs a timed, closed-loop mix of reads, inserts and deletes against a BTTable from
+ * several threads and reports throughput and latency percentiles for each kind of
+ * operation, as CSV or JSON, so runs with different settings can be compared.
+ *
+ * Reads go straight to the table. Writes go through a CommitQueue, which is how
+ * concurrent writers share LMDB's single write transaction. Reads pick one of the
+ * preloaded rows (uniformly or with a scrambled Zipfian skew); a delete removes a
+ * row its own thread inserted earlier, so the preloaded rows stay readable.
+ *
+ * Environment options (--map-size, --durability, ...) are the same as lmdb-lab's.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include "commit_queue.h"
+#include "db_env.h"
+#include "heap_storage.h"
+#include "latency_histogram.h"
+
+using std::chrono::steady_clock;
+
+enum Operation {
+    READ, INSERT, DELETE, N_OPERATIONS
+};
+
+static const char *OPERATION_NAMES[N_OPERATIONS] = {"read", "insert", "delete"};
+
+struct BenchConfig {
+    unsigned int mix[N_OPERATIONS] = {90, 10, 0};
+    size_t record_size = 100;
+    size_t records = 10000;
+    std::string distribution = "uniform";
+    double zipf_theta = 0.99;
+    unsigned int threads = 1;
+    double duration = 10.0;
+    std::string format = "csv";
+    u_int64_t seed = 42;
+    size_t max_batch = CommitQueue::DEFAULT_MAX_BATCH;
+    long max_latency_us = CommitQueue::DEFAULT_MAX_LATENCY.count();
+
+    static const std::vector<std::string> OPTIONS;
+
+    void set(const std::string &name, const std::string &value);
+
+    std::string mix_string() const;
+};
+
+// "read:80,insert:15,delete:5"; operations not named get 0
+static void parse_mix(const std::string &value, unsigned int mix[N_OPERATIONS]) {
+    unsigned int parsed[N_OPERATIONS] = {0, 0, 0};
+    std::stringstream in(value);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        int op = 0;
+        while (op < N_OPERATIONS && name != OPERATION_NAMES[op])
+            op++;
+        if (op == N_OPERATIONS || colon == std::string::npos)
+            throw std::invalid_argument("bad mix entry '" + item + "', expected read|insert|delete:WEIGHT");
+        parsed[op] = std::stoul(item.substr(colon + 1));
+    }
+    if (parsed[READ] + parsed[INSERT] + parsed[DELETE] == 0)
+        throw std::invalid_argument("mix '" + value + "' has no operations");
+    std::copy(parsed, parsed + N_OPERATIONS, mix);
+}
+
+const std::vector<std::string> BenchConfig::OPTIONS = {
+        "mix", "record-size", "records", "distribution", "zipf-theta", "threads", "duration", "format", "seed",
+        "max-batch", "max-latency-us"};
+
+void BenchConfig::set(const std::string &name, const std::string &value) {
+    if (std::find(OPTIONS.begin(), OPTIONS.end(), name) == OPTIONS.end())
+        throw std::invalid_argument("unknown option '" + name + "'");
+    if (name == "mix")
+        parse_mix(value, this->mix);
+    else if (name == "distribution")
+        this->distribution = value;
+    else if (name == "format")
+        this->format = value;
+    else {
+        try {
+            if (name == "record-size")
+                this->record_size = EnvConfig::parse_size(value);
+            else if (name == "records")
+                this->records = std::stoul(value);
+            else if (name == "zipf-theta")
+                this->zipf_theta = std::stod(value);
+            else if (name == "threads")
+                this->threads = std::stoul(value);
+            else if (name == "duration")
+                this->duration = std::stod(value);
+            else if (name == "seed")
+                this->seed = std::stoull(value);
+            else if (name == "max-batch")
+                this->max_batch = std::stoul(value);
+            else
+                this->max_latency_us = std::stol(value);
+        } catch (std::logic_error &e) {
+            throw std::invalid_argument("bad value '" + value + "' for option '" + name + "'");
+        }
+    }
+
+    if (this->distribution != "uniform" && this->distribution != "zipfian")
+        throw std::invalid_argument("distribution must be uniform or zipfian");
+    if (this->format != "csv" && this->format != "json")
+        throw std::invalid_argument("format must be csv or json");
+    if (this->zipf_theta <= 0.0 || this->zipf_theta >= 1.0)
+        throw std::invalid_argument("zipf-theta must be between 0 and 1");
+    // one row (an INT key plus the TEXT payload and its length) must fit in a block
+    if (this->record_size > DbBlock::BLOCK_SZ - 64)
+        throw std::invalid_argument("record-size must be at most " + std::to_string(DbBlock::BLOCK_SZ - 64));
+    if (this->threads == 0 || this->records == 0 || this->duration <= 0.0)
+        throw std::invalid_argument("threads, records and duration must be positive");
+}
+
+std::string BenchConfig::mix_string() const {
+    std::string s;
+    for (int op = 0; op < N_OPERATIONS; op++)
+        s += (op ? "," : "") + std::string(OPERATION_NAMES[op]) + ":" + std::to_string(this->mix[op]);
+    return s;
+}
+
+/**
+ * @class KeyChooser - picks row numbers in [0, n) uniformly or with a Zipfian skew.
+ *
+ *      The Zipfian generator is Gray et al.'s ("Quickly Generating Billion-Record
+ *      Synthetic Databases"), as used by YCSB. Its ranks are scrambled with a hash so the
+ *      hot rows are spread over the file instead of sitting in the first few blocks.
+ */
+class KeyChooser {
+public:
+    KeyChooser(size_t n, bool zipfian, double theta) : n(n), zipfian(zipfian), theta(theta) {
+        if (!zipfian)
+            return;
+        this->zetan = zeta(n, theta);
+        this->alpha = 1.0 / (1.0 - theta);
+        this->eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / this->zetan);
+    }
+
+    size_t next(std::mt19937_64 &rng) const {
+        if (!this->zipfian)
+            return rng() % this->n;
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * this->zetan;
+        size_t rank;
+        if (uz < 1.0)
+            rank = 0;
+        else if (uz < 1.0 + std::pow(0.5, this->theta))
+            rank = 1;
+        else
+            rank = (size_t) (this->n * std::pow(this->eta * u - this->eta + 1.0, this->alpha));
+        return fnv1a(std::min(rank, this->n - 1)) % this->n;
+    }
+
+protected:
+    size_t n;
+    bool zipfian;
+    double theta, zetan = 0.0, alpha = 0.0, eta = 0.0;
+
+    static double zeta(size_t n, double theta) {
+        double sum = 0.0;
+        for (size_t i = 1; i <= n; i++)
+            sum += 1.0 / std::pow((double) i, theta);
+        return sum;
+    }
+
+    static u_int64_t fnv1a(u_int64_t value) {
+        u_int64_t hash = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < 8; i++) {
+            hash ^= value & 0xff;
+            hash *= 0x100000001b3ULL;
+            value >>= 8;
+        }
+        return hash;
+    }
+};
+
+struct WorkerResult {
+    LatencyHistogram latency[N_OPERATIONS];
+    u_int64_t errors[N_OPERATIONS] = {0, 0, 0};
+};
+
+static void worker(const BenchConfig &config, unsigned int thread_num, DbRelation &table, CommitQueue &queue,
+                   const Handles &preloaded, const KeyChooser &keys, steady_clock::time_point deadline,
+                   WorkerResult &result) {
+    std::mt19937_64 rng(config.seed + thread_num);
+    unsigned int total_weight = config.mix[READ] + config.mix[INSERT] + config.mix[DELETE];
+    Handles inserted;
+    ValueDict row = {{"id",      Value(0)},
+                     {"payload", Value(std::string(config.record_size, 'a' + thread_num % 26))}};
+    int32_t next_id = (int32_t) (config.records + (u_int64_t) thread_num * 100000000ULL);
+
+    while (steady_clock::now() < deadline) {
+        unsigned int pick = rng() % total_weight;
+        Operation op = pick < config.mix[READ] ? READ : pick < config.mix[READ] + config.mix[INSERT] ? INSERT : DELETE;
+        if (op == DELETE && inserted.empty())
+            op = INSERT;
+
+        steady_clock::time_point start = steady_clock::now();
+        try {
+            if (op == READ) {
+                delete table.project(preloaded[keys.next(rng)]);
+            } else if (op == INSERT) {
+                row["id"] = Value(next_id++);
+                inserted.push_back(queue.insert(table, row).get());
+            } else {
+                Handle victim = inserted.back();
+                inserted.pop_back();
+                queue.del(table, victim).get();
+            }
+        } catch (std::exception &e) {
+            result.errors[op]++;
+            continue;
+        }
+        result.latency[op].record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - start).count());
+    }
+}
+
+static void preload(const BenchConfig &config, DbRelation &table, Handles &handles) {
+    const size_t per_transaction = 1000;
+    ValueDict row = {{"id",      Value(0)},
+                     {"payload", Value(std::string(config.record_size, 'p'))}};
+    for (size_t first = 0; first < config.records; first += per_transaction) {
+        Handles batch;
+        DbEnv::write_transaction([&]() {
+            batch.clear();  // the body is rerun if the map had to grow
+            for (size_t i = first; i < std::min(first + per_transaction, config.records); i++) {
+                row["id"] = Value((int32_t) i);
+                batch.push_back(table.insert(&row));
+            }
+        });
+        handles.insert(handles.end(), batch.begin(), batch.end());
+    }
+}
+
+static void report(const BenchConfig &config, const EnvConfig &env_config, const WorkerResult &total,
+                   double seconds) {
+    u_int64_t all_ops = 0;
+    for (int op = 0; op < N_OPERATIONS; op++)
+        all_ops += total.latency[op].count();
+    auto us = [](u_int64_t ns) { return ns / 1000.0; };
+
+    std::cout.setf(std::ios::fixed);
+    std::cout.precision(3);
+    if (config.format == "csv") {
+        std::cout << "op,threads,record_size,distribution,mix,durability,seconds,ops,errors,ops_per_sec,"
+                     "mean_us,p50_us,p99_us,p999_us,max_us" << std::endl;
+        for (int op = 0; op < N_OPERATIONS; op++) {
+            const LatencyHistogram &h = total.latency[op];
+            if (h.count() == 0 && total.errors[op] == 0)
+                continue;
+            std::cout << OPERATION_NAMES[op] << "," << config.threads << "," << config.record_size << ","
+                      << config.distribution << ",\"" << config.mix_string() << "\"," << env_config.durability << ","
+                      << seconds << "," << h.count() << "," << total.errors[op] << "," << h.count() / seconds << ","
+                      << us(h.mean()) << "," << us(h.percentile(0.50)) << "," << us(h.percentile(0.99)) << ","
+                      << us(h.percentile(0.999)) << "," << us(h.max()) << std::endl;
+        }
+        return;
+    }
+
+    std::cout << "{\"config\": {\"threads\": " << config.threads << ", \"record_size\": " << config.record_size
+              << ", \"records\": " << config.records << ", \"distribution\": \"" << config.distribution
+              << "\", \"mix\": \"" << config.mix_string() << "\", \"durability\": \"" << env_config.durability
+              << "\", \"map_size\": " << env_config.map_size << ", \"max_batch\": " << config.max_batch
+              << ", \"max_latency_us\": " << config.max_latency_us << ", \"seed\": " << config.seed << "},"
+              << std::endl << " \"seconds\": " << seconds << ", \"ops\": " << all_ops
+              << ", \"ops_per_sec\": " << all_ops / seconds << "," << std::endl << " \"operations\": {";
+    const char *separator = "";
+    for (int op = 0; op < N_OPERATIONS; op++) {
+        const LatencyHistogram &h = total.latency[op];
+        if (h.count() == 0 && total.errors[op] == 0)
+            continue;
+        std::cout << separator << std::endl << "  \"" << OPERATION_NAMES[op] << "\": {\"ops\": " << h.count()
+                  << ", \"errors\": " << total.errors[op] << ", \"ops_per_sec\": " << h.count() / seconds
+                  << ", \"mean_us\": " << us(h.mean()) << ", \"p50_us\": " << us(h.percentile(0.50))
+                  << ", \"p99_us\": " << us(h.percentile(0.99)) << ", \"p999_us\": " << us(h.percentile(0.999))
+                  << ", \"max_us\": " << us(h.max()) << "}";
+        separator = ",";
+    }
+    std::cout << std::endl << " }}" << std::endl;
+}
+
+static void usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options] [dbenvpath]" << std::endl
+              << "  --mix=read:90,insert:10,delete:0  operation weights" << std::endl
+              << "  --record-size=100                 payload bytes per row" << std::endl
+              << "  --records=10000                   rows loaded before the run" << std::endl
+              << "  --distribution=uniform|zipfian    which preloaded rows reads pick" << std::endl
+              << "  --zipf-theta=0.99                 skew of the zipfian distribution" << std::endl
+              << "  --threads=1                       client threads" << std::endl
+              << "  --duration=10                     seconds to run" << std::endl
+              << "  --format=csv|json                 output format" << std::endl
+              << "  --seed=42                         random seed" << std::endl
+              << "  --max-batch=N --max-latency-us=N  commit queue batching" << std::endl
+              << "  plus lmdb-lab's environment options (--map-size, --durability, ...)" << std::endl
+              << "Without dbenvpath a temporary environment is used and removed afterwards." << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    EnvConfig env_config;
+    std::vector<std::string> args(argv + 1, argv + argc), env_args;
+    try {
+        for (size_t i = 0; i < args.size(); i++) {
+            const std::string &arg = args[i];
+            if (arg == "--help") {
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            }
+            size_t eq = arg.find('=');
+            std::string name = arg.rfind("--", 0) == 0 ? arg.substr(2, eq == std::string::npos ? eq : eq - 2) : "";
+            if (std::find(BenchConfig::OPTIONS.begin(), BenchConfig::OPTIONS.end(), name) == BenchConfig::OPTIONS.end()) {
+                env_args.push_back(arg);  // an environment option, its value, or the path
+                continue;
+            }
+            if (eq == std::string::npos && i + 1 == args.size())
+                throw std::invalid_argument("option --" + name + " needs a value");
+            config.set(name, eq != std::string::npos ? arg.substr(eq + 1) : args[++i]);
+        }
+        env_config.parse_args(env_args);
+    } catch (std::invalid_argument &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (env_args.size() > 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bool temporary = env_args.empty();
+    std::string envdir;
+    if (temporary) {
+        envdir = std::string(std::filesystem::temp_directory_path()) + "/lmdb-bench-XXXXXX";
+        if (mkdtemp(envdir.data()) == nullptr) {
+            perror("mkdtemp");
+            return EXIT_FAILURE;
+        }
+    } else {
+        envdir = env_args[0];
+        std::filesystem::create_directories(envdir);
+    }
+
+    int exit_code = EXIT_SUCCESS;
+    try {
+        DbEnv::open(envdir.c_str(), env_config);
+        {
+            BTTable table("bench", {"id", "payload"},
+                          {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+            table.create();
+            Handles preloaded;
+            preload(config, table, preloaded);
+
+            KeyChooser keys(preloaded.size(), config.distribution == "zipfian", config.zipf_theta);
+            CommitQueue queue(config.max_batch, std::chrono::microseconds(config.max_latency_us));
+            std::vector<WorkerResult> results(config.threads);
+            std::vector<std::thread> threads;
+            steady_clock::time_point start = steady_clock::now();
+            steady_clock::time_point deadline =
+                    start + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(config.duration));
+            for (unsigned int t = 0; t < config.threads; t++)
+                threads.emplace_back(worker, std::cref(config), t, std::ref(table), std::ref(queue),
+                                     std::cref(preloaded), std::cref(keys), deadline, std::ref(results[t]));
+            for (auto &thread : threads)
+                thread.join();
+            double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+            queue.stop();
+
+            WorkerResult total;
+            for (auto const &result : results) {
+                for (int op = 0; op < N_OPERATIONS; op++) {
+                    total.latency[op].merge(result.latency[op]);
+                    total.errors[op] += result.errors[op];
+                }
+            }
+            report(config, env_config, total, seconds);
+            if (!temporary)
+                table.drop();
+        }
+        DbEnv::close();
+    } catch (std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        exit_code = EXIT_FAILURE;
+    }
+    if (temporary)
+        std::filesystem::remove_all(envdir);
+    return exit_code;
+}
@@ -0,0 +1,742 @@
+/**
+ * @file lmdb-microbench.cpp - Google Benchmark suite for the storage primitives.
+ *
+ * Times SlottedPage add/get/put/del/ids/slide over a range of record sizes and page
+ * fill levels, BTTable marshal/unmarshal over record sizes, BTFile get/put, a page
+ * modified from a copy and in place, INSERT statements over the number of rows per statement, the INT comparison kernels at each
+ * SIMD level, a filtered table scan row-at-a-time and vectorized, a range scan with and
+ * without zone maps, a TEXT equality lookup over Bloom filter sizes, a hash join, an ORDER BY and a GROUP BY in memory and spilled, a CSV
+ * bulk load and export, a DELETE row by row and as a set, and reports ns/op along with the
+ * heap bytes allocated per op ("bytes/op"), so that a page-layout change that slows a
+ * primitive down or makes it allocate shows up here.
+ *
+ * Benchmark flags (--benchmark_filter, --benchmark_format, ...) are Google Benchmark's;
+ * anything else is taken as an lmdb-lab environment option. The BTFile benchmarks run
+ * in a temporary environment with the nosync durability profile unless told otherwise.
+ */
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include "csv_reader.h"
+#include "db_env.h"
+#include "heap_storage.h"
+#include "query_plan.h"
+#include "simd_filter.h"
+#include "sql_exec.h"
+#include "stats.h"
+
+// Everything allocated with new is counted, so each benchmark can report bytes/op
+static u_int64_t allocated_bytes = 0;
+
+// GCC can't see that our operator new hands out malloc'd memory
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(std::size_t size) {
+    allocated_bytes += size;
+    if (void *p = std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+/**
+ * Count the bytes allocated during a benchmark's loop and report them per iteration.
+ */
+class AllocationCounter {
+public:
+    explicit AllocationCounter(benchmark::State &state) : state(state), start(allocated_bytes) {}
+
+    ~AllocationCounter() {
+        state.counters["bytes/op"] = benchmark::Counter((double) (allocated_bytes - start),
+                                                        benchmark::Counter::kAvgIterations);
+    }
+
+protected:
+    benchmark::State &state;
+    u_int64_t start;
+};
+
+/**
+ * SlottedPage with its layout internals exposed to the benchmarks.
+ */
+class MicroPage : public SlottedPage {
+public:
+    using SlottedPage::SlottedPage;
+    using SlottedPage::has_room;
+    using SlottedPage::slide;
+    using SlottedPage::get_header;
+
+    // bytes taken by the block header, record headers and record data
+    u_int16_t used() { return (DbBlock::BLOCK_SZ - 1 - end_free) + 4 * (num_records + 1); }
+
+    // re-read the header after the block's bytes have been replaced
+    void reload() { get_header(num_records, end_free); }
+};
+
+/**
+ * A page in its own buffer, filled with records of one size, plus a copy of the filled
+ * block so benchmarks that use the page up can put it back without allocating.
+ */
+class PageFixture {
+public:
+    /**
+     * @param record_size  bytes per record
+     * @param fill         percent of the block to fill, always at least one record
+     * @param reserve      bytes to leave free for the benchmark itself
+     */
+    PageFixture(size_t record_size, int fill, size_t reserve)
+            : record(record_size, 'r'), data(record.size(), record.data()),
+              buffer{}, saved{}, block(DbBlock::BLOCK_SZ, buffer), page(block, 1, true) {
+        size_t target = DbBlock::BLOCK_SZ * fill / 100;
+        do {
+            page.add(&data);
+        } while (page.used() + record_size + 4 <= target && page.has_room(record_size + reserve + 4));
+        memcpy(saved, buffer, DbBlock::BLOCK_SZ);
+        RecordIDs *record_ids = page.ids();
+        ids = *record_ids;
+        delete record_ids;
+    }
+
+    void restore() {
+        memcpy(buffer, saved, DbBlock::BLOCK_SZ);
+        page.reload();
+    }
+
+    std::string record;
+    MDB_val data;
+    char buffer[DbBlock::BLOCK_SZ];
+    char saved[DbBlock::BLOCK_SZ];
+    MDB_val block;
+    MicroPage page;
+    RecordIDs ids;
+};
+
+// record sizes x fill percentages
+static void page_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"size", "fill"})->ArgsProduct({{16, 64, 256, 1024}, {10, 50, 90}});
+}
+
+static void BM_SlottedPage_add(benchmark::State &state) {
+    PageFixture fixture(state.range(0), state.range(1), state.range(0));
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        if (!fixture.page.has_room(fixture.data.mv_size)) {
+            state.PauseTiming();
+            fixture.restore();
+            state.ResumeTiming();
+        }
+        benchmark::DoNotOptimize(fixture.page.add(&fixture.data));
+    }
+}
+BENCHMARK(BM_SlottedPage_add)->Apply(page_args);
+
+static void BM_SlottedPage_get(benchmark::State &state) {
+    PageFixture fixture(state.range(0), state.range(1), 0);
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _: state) {
+        MDB_val *value = fixture.page.get(fixture.ids[i++ % fixture.ids.size()]);
+        benchmark::DoNotOptimize(value->mv_data);
+        delete value;
+    }
+}
+BENCHMARK(BM_SlottedPage_get)->Apply(page_args);
+
+// alternately grow and shrink a record by 8 bytes, so every put slides the page
+static void BM_SlottedPage_put(benchmark::State &state) {
+    PageFixture fixture(state.range(0), state.range(1), 8);
+    std::string longer(state.range(0) + 8, 'p');
+    MDB_val grown(longer.size(), longer.data());
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _: state) {
+        RecordID id = fixture.ids[(i / 2) % fixture.ids.size()];
+        fixture.page.put(id, i % 2 ? fixture.data : grown);
+        i++;
+    }
+}
+BENCHMARK(BM_SlottedPage_put)->Apply(page_args);
+
+static void BM_SlottedPage_del(benchmark::State &state) {
+    PageFixture fixture(state.range(0), state.range(1), 0);
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _: state) {
+        if (i == fixture.ids.size()) {
+            state.PauseTiming();
+            fixture.restore();
+            i = 0;
+            state.ResumeTiming();
+        }
+        fixture.page.del(fixture.ids[i++]);
+    }
+}
+BENCHMARK(BM_SlottedPage_del)->Apply(page_args);
+
+static void BM_SlottedPage_ids(benchmark::State &state) {
+    PageFixture fixture(state.range(0), state.range(1), 0);
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        RecordIDs *record_ids = fixture.page.ids();
+        benchmark::DoNotOptimize(record_ids->data());
+        delete record_ids;
+    }
+}
+BENCHMARK(BM_SlottedPage_ids)->Apply(page_args);
+
+// move every record but the oldest down 8 bytes and back again
+static void BM_SlottedPage_slide(benchmark::State &state) {
+    PageFixture fixture(state.range(0), state.range(1), 8);
+    u_int16_t size, start;
+    fixture.page.get_header(size, start, fixture.ids[0]);
+    AllocationCounter counter(state);
+    size_t i = 0;
+    for (auto _: state) {
+        if (i++ % 2)
+            fixture.page.slide(start - 8, start);
+        else
+            fixture.page.slide(start, start - 8);
+    }
+}
+BENCHMARK(BM_SlottedPage_slide)->Apply(page_args);
+
+/**
+ * BTTable with marshal/unmarshal exposed; never touches the database.
+ */
+class MicroTable : public BTTable {
+public:
+    MicroTable() : BTTable("_microbench", {"id", "payload"},
+                           {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)}) {}
+
+    using BTTable::marshal;
+    using BTTable::unmarshal;
+};
+
+static void BM_BTTable_marshal(benchmark::State &state) {
+    MicroTable table;
+    ValueDict row = {{"id", Value(42)}, {"payload", Value(std::string(state.range(0), 'm'))}};
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        MDB_val *data = table.marshal(&row);
+        benchmark::DoNotOptimize(data->mv_data);
+        delete[] (char *) data->mv_data;
+        delete data;
+    }
+}
+BENCHMARK(BM_BTTable_marshal)->ArgName("size")->Arg(16)->Arg(64)->Arg(256)->Arg(1024);
+
+static void BM_BTTable_unmarshal(benchmark::State &state) {
+    MicroTable table;
+    ValueDict row = {{"id", Value(42)}, {"payload", Value(std::string(state.range(0), 'm'))}};
+    MDB_val *data = table.marshal(&row);
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        ValueDict *values = table.unmarshal(data);
+        benchmark::DoNotOptimize(values);
+        delete values;
+    }
+    delete[] (char *) data->mv_data;
+    delete data;
+}
+BENCHMARK(BM_BTTable_unmarshal)->ArgName("size")->Arg(16)->Arg(64)->Arg(256)->Arg(1024);
+
+static const BlockID FILE_BLOCKS = 1024;
+
+// a file of FILE_BLOCKS half-full blocks, made on first use
+static BTFile &micro_file() {
+    static BTFile *file = nullptr;
+    if (file == nullptr) {
+        file = new BTFile("_microbench");
+        PageFixture fixture(64, 50, 0);
+        DbEnv::write_transaction([&]() {
+            file->create();
+            for (BlockID block_id = 2; block_id <= FILE_BLOCKS; block_id++)
+                delete file->get_new();
+            for (BlockID block_id = 1; block_id <= FILE_BLOCKS; block_id++) {
+                MicroPage page(fixture.block, block_id);
+                file->put(&page);
+            }
+        });
+    }
+    return *file;
+}
+
+static void BM_BTFile_get(benchmark::State &state) {
+    BTFile &file = micro_file();
+    AllocationCounter counter(state);
+    BlockID block_id = 0;
+    for (auto _: state) {
+        SlottedPage *page = file.get(block_id++ % FILE_BLOCKS + 1);
+        benchmark::DoNotOptimize(page);
+        delete page;
+    }
+}
+BENCHMARK(BM_BTFile_get);
+
+// each put commits its own transaction
+static void BM_BTFile_put(benchmark::State &state) {
+    BTFile &file = micro_file();
+    PageFixture fixture(64, 50, 0);
+    AllocationCounter counter(state);
+    BlockID block_id = 0;
+    for (auto _: state) {
+        MicroPage page(fixture.block, block_id++ % FILE_BLOCKS + 1);
+        file.put(&page);
+    }
+}
+BENCHMARK(BM_BTFile_put);
+
+// all puts share one transaction, committed after the timed loop
+static void BM_BTFile_put_batched(benchmark::State &state) {
+    BTFile &file = micro_file();
+    PageFixture fixture(64, 50, 0);
+    BTTransaction txn;
+    {
+        AllocationCounter counter(state);
+        BlockID block_id = 0;
+        for (auto _: state) {
+            MicroPage page(fixture.block, block_id++ % FILE_BLOCKS + 1);
+            file.put(&page);
+        }
+    }
+    txn.commit();
+}
+BENCHMARK(BM_BTFile_put_batched);
+
+// change a record of a block and write it back, all in one transaction: from a copy of the
+// page (range(0) 0), or with get_for_write (1), which changes it in the map under
+// --durability=writemap and is a copy otherwise
+static void BM_BTFile_modify(benchmark::State &state) {
+    BTFile &file = micro_file();
+    std::string bytes(64, 'm');
+    MDB_val record(bytes.size(), bytes.data());
+    BTTransaction txn;
+    {
+        AllocationCounter counter(state);
+        BlockID block_id = 0;
+        for (auto _: state) {
+            BlockID modified = block_id++ % FILE_BLOCKS + 1;
+            SlottedPage *page;
+            if (state.range(0)) {
+                page = file.get_for_write(modified);
+            } else {
+                SlottedPage *stored = file.get(modified);
+                page = new SlottedPage(*stored);
+                delete stored;
+            }
+            page->put(1, record);
+            file.put(page);
+            delete page;
+        }
+    }
+    txn.commit();
+}
+BENCHMARK(BM_BTFile_modify)->ArgName("in_place")->Arg(0)->Arg(1);
+
+// run one statement the way the shell does
+static void execute_sql(const std::string &sql) {
+    QueryResult *result = SQLExec::execute_extension(sql);
+    if (result == nullptr) {
+        hsql::SQLParserResult parse;
+        if (!hsql::SQLParser::parseSQLString(sql, &parse))
+            throw std::invalid_argument("invalid SQL: " + sql);
+        result = SQLExec::execute(parse.getStatement(0));
+    }
+    delete result;
+}
+
+// INSERT statements of range(0) rows each, parse to commit; items/s is rows per second
+static void BM_SQLExec_insert(benchmark::State &state) {
+    static bool created = false;
+    if (!created) {
+        initialize_schema_tables();
+        execute_sql("CREATE TABLE _microbench_insert (id INT, payload TEXT)");
+        created = true;
+    }
+    std::string sql = "INSERT INTO _microbench_insert VALUES ";
+    for (int64_t i = 0; i < state.range(0); i++)
+        sql += (i ? ", (" : "(") + std::to_string(i) + ", '" + std::string(32, 'i') + "')";
+    AllocationCounter counter(state);
+    for (auto _: state)
+        execute_sql(sql);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SQLExec_insert)->ArgName("rows")->RangeMultiplier(10)->Range(1, 1000);
+
+// a SELECT's rows, read and thrown away
+static void drain(QueryResult *result) {
+    if (result->get_plan() != nullptr)
+        result->stream_rows([](const ValueDict *) {});
+    delete result;
+}
+
+// SELECT * FROM a 100-row table WHERE id = 42: range(0) 0 parsed and planned every time,
+// 1 from the statement cache, 2 EXECUTE of a prepared statement (whose EXECUTE is parsed)
+static void BM_SQLExec_point_select(benchmark::State &state) {
+    static bool created = false;
+    if (!created) {
+        initialize_schema_tables();
+        execute_sql("CREATE TABLE _microbench_point (id INT, payload TEXT)");
+        std::string sql = "INSERT INTO _microbench_point VALUES ";
+        for (int i = 0; i < 100; i++)
+            sql += (i ? ", (" : "(") + std::to_string(i) + ", '" + std::string(32, 'p') + "')";
+        execute_sql(sql);
+        execute_sql("PREPARE _microbench_point FROM 'SELECT * FROM _microbench_point WHERE id = ?'");
+        created = true;
+    }
+    const std::string select = "SELECT * FROM _microbench_point WHERE id = 42";
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        if (state.range(0) == 1) {
+            drain(SQLExec::execute_cached(select));
+            continue;
+        }
+        hsql::SQLParserResult parse;
+        hsql::SQLParser::parseSQLString(state.range(0) == 0 ? select : "EXECUTE _microbench_point(42)", &parse);
+        drain(SQLExec::execute(parse.getStatement(0)));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SQLExec_point_select)->ArgName("mode")->DenseRange(0, 2);
+
+// a batch of value < 0 over range(1) (a SimdLevel); items/s is rows compared per second
+static void BM_compare_int32(benchmark::State &state) {
+    SimdLevel level = (SimdLevel) state.range(0);
+    if (!set_simd_level(level)) {
+        state.SkipWithError("not supported by this CPU");
+        return;
+    }
+    std::vector<int32_t> values(ColumnBatch::CAPACITY);
+    for (size_t i = 0; i < values.size(); i++)
+        values[i] = (int32_t) ((i * 2654435761U) % 2001) - 1000;
+    u_int64_t bitmap[ColumnBatch::CAPACITY / 64];
+    u_int16_t selection[ColumnBatch::CAPACITY];
+    for (auto _: state) {
+        compare_int32(values.data(), values.size(), COMPARE_LT, 0, bitmap);
+        benchmark::DoNotOptimize(bitmap_to_selection(bitmap, values.size(), selection));
+    }
+    state.SetItemsProcessed(state.iterations() * values.size());
+    state.SetLabel(simd_level_name(level));
+    set_simd_level(simd_supported());
+}
+BENCHMARK(BM_compare_int32)->ArgName("level")->DenseRange(SIMD_SCALAR, SIMD_AVX2);
+
+static const int FILTER_ROWS = 100000;
+
+static BTTable &filter_table() {
+    static BTTable *table = nullptr;
+    if (table == nullptr) {
+        table = new BTTable("_microbench_filter", {"id", "payload"},
+                            {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table->create_if_not_exists();
+        ValueDicts rows;
+        for (int i = 0; i < FILTER_ROWS; i++)
+            rows.push_back(new ValueDict({{"id", Value((int) ((i * 2654435761U) % 2001) - 1000)},
+                                          {"payload", Value(std::string(16, 'f'))}}));
+        delete table->insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+    }
+    return *table;
+}
+
+// SELECT * ... WHERE id < 0 over the whole table, by Filter (range(0) 0) or VectorFilter (1)
+static void BM_filter_scan(benchmark::State &state) {
+    BTTable &table = filter_table();
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        TableScan *scan = new TableScan(table, "_microbench_filter");
+        Condition *condition = new Condition(Condition::LT, "id", Value(0));
+        PlanNode *plan = state.range(0) ? new VectorFilter(scan, condition) : new Filter(scan, condition);
+        plan->open();
+        while (ValueDict *row = plan->next())
+            delete row;
+        plan->close();
+        delete plan;
+    }
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+}
+BENCHMARK(BM_filter_scan)->ArgName("vectorized")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// WHERE ts >= 50000 AND ts < 50100 over a 100,000-row table in ts order, reading every block
+// (range(0) 0) or skipping blocks by their zone maps (1); items/s is table rows per second
+static void BM_zone_map_scan(benchmark::State &state) {
+    static BTTable *table = nullptr;
+    if (table == nullptr) {
+        table = new BTTable("_microbench_zones", {"ts", "payload"},
+                            {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table->create_if_not_exists();
+        ValueDicts rows;
+        for (int i = 0; i < FILTER_ROWS; i++)
+            rows.push_back(new ValueDict({{"ts", Value(i)}, {"payload", Value(std::string(16, 'z'))}}));
+        delete table->insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+    }
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        TableScan *scan = new TableScan(*table, "_microbench_zones");
+        Condition *condition = new Condition(Condition::AND, new Condition(Condition::GE, "ts", Value(50000)),
+                                             new Condition(Condition::LT, "ts", Value(50100)));
+        if (state.range(0))
+            scan->set_bounds(condition);
+        PlanNode *plan = new VectorFilter(scan, condition);
+        plan->open();
+        while (ValueDict *row = plan->next())
+            delete row;
+        plan->close();
+        delete plan;
+    }
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+}
+BENCHMARK(BM_zone_map_scan)->ArgName("zone_maps")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// select(where name = ...) over a 100,000-row table of distinct names, with Bloom filters of
+// range(0) bits per row (0 for none), for names that are there and names that aren't; reports
+// the share of blocks the filters ruled out and, from the absent names, the false positive rate
+static void BM_bloom_select(benchmark::State &state) {
+    const uint bits = state.range(0);
+    const std::string table_name = "_microbench_bloom_" + std::to_string(bits);
+    BTTable table(table_name, {"name", "payload"},
+                  {ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::TEXT)});
+    table.set_bloom_filters({"name"}, bits);
+    try {
+        table.open();
+    } catch (DbException &e) {
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < FILTER_ROWS; i++)
+            rows.push_back(new ValueDict({{"name", Value("name" + std::to_string(i))},
+                                          {"payload", Value(std::string(16, 'z'))}}));
+        delete table.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+    }
+    u_int64_t probes = Stats::local_count(COUNTER_BLOOM_PROBES), skips = Stats::local_count(COUNTER_BLOOM_SKIPS);
+    u_int64_t absent_probes = 0, absent_skips = 0;
+    AllocationCounter counter(state);
+    int i = 0;
+    for (auto _: state) {
+        bool absent = i % 2;
+        u_int64_t before_probes = Stats::local_count(COUNTER_BLOOM_PROBES);
+        u_int64_t before_skips = Stats::local_count(COUNTER_BLOOM_SKIPS);
+        ValueDict where = {{"name", Value((absent ? "absent" : "name") + std::to_string(i++ * 7919 % FILTER_ROWS))}};
+        delete table.select(&where);
+        if (absent) {
+            absent_probes += Stats::local_count(COUNTER_BLOOM_PROBES) - before_probes;
+            absent_skips += Stats::local_count(COUNTER_BLOOM_SKIPS) - before_skips;
+        }
+    }
+    probes = Stats::local_count(COUNTER_BLOOM_PROBES) - probes;
+    skips = Stats::local_count(COUNTER_BLOOM_SKIPS) - skips;
+    state.counters["skip_rate"] = probes ? (double) skips / probes : 0.0;
+    state.counters["fp_rate"] = absent_probes ? 1.0 - (double) absent_skips / absent_probes : 1.0;
+}
+BENCHMARK(BM_bloom_select)->ArgName("bits")->Arg(0)->Arg(5)->Arg(10)->Arg(16)->Unit(benchmark::kMillisecond);
+
+// the filter table joined with one dim row per id; range(0) 1 spills the build side
+static void BM_hash_join(benchmark::State &state) {
+    BTTable &fact = filter_table();
+    static BTTable *dim = nullptr;
+    if (dim == nullptr) {
+        dim = new BTTable("_microbench_dim", {"id", "name"},
+                          {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        dim->create_if_not_exists();
+        ValueDicts rows;
+        for (int i = -1000; i <= 1000; i++)
+            rows.push_back(new ValueDict({{"id", Value(i)}, {"name", Value("dim " + std::to_string(i))}}));
+        delete dim->insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+    }
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        HashJoin join(new TableScan(fact, "_microbench_filter", "f"), new TableScan(*dim, "_microbench_dim", "d"),
+                      {"f.id"}, {"d.id"}, state.range(0) ? 16 * 1024 : SIZE_MAX);
+        join.open();
+        while (ValueDict *row = join.next())
+            delete row;
+        join.close();
+    }
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+}
+BENCHMARK(BM_hash_join)->ArgName("spill")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// ORDER BY id DESC over the filter table: range(0) 0 in memory, 1 spilled to runs, 2 LIMIT 10
+static void BM_sort(benchmark::State &state) {
+    BTTable &table = filter_table();
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        TableScan *scan = new TableScan(table, "_microbench_filter");
+        Sort *sort = state.range(0) == 2 ? new TopN(scan, {"id"}, {true}, 10)
+                                         : new Sort(scan, {"id"}, {true}, state.range(0) ? 1024 * 1024 : SIZE_MAX);
+        sort->open();
+        while (ValueDict *row = sort->next())
+            delete row;
+        sort->close();
+        delete sort;
+    }
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+}
+BENCHMARK(BM_sort)->ArgName("mode")->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+// over the filter table: range(0) 0 GROUP BY id with COUNT(*), SUM(id) and MAX(payload),
+// 1 the same spilling, 2 COUNT(*) alone
+static void BM_aggregate(benchmark::State &state) {
+    typedef HashAggregate::Aggregate Aggregate;
+    BTTable &table = filter_table();
+    std::vector<Aggregate> aggregates = {{Aggregate::COUNT, "", ColumnAttribute::INT, "count(*)"}};
+    ColumnNames group_by;
+    if (state.range(0) < 2) {
+        group_by = {"id"};
+        aggregates.push_back({Aggregate::SUM, "id", ColumnAttribute::INT, "sum(id)"});
+        aggregates.push_back({Aggregate::MAX, "payload", ColumnAttribute::TEXT, "max(payload)"});
+    }
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        HashAggregate aggregate(new TableScan(table, "_microbench_filter"), group_by, aggregates,
+                                state.range(0) == 1 ? 16 * 1024 : SIZE_MAX);
+        aggregate.open();
+        while (ValueDict *row = aggregate.next())
+            delete row;
+        aggregate.close();
+    }
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+}
+BENCHMARK(BM_aggregate)->ArgName("mode")->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+// the filter table's rows as a CSV file loaded into an empty table, as COPY ... FROM does
+static void BM_copy_from(benchmark::State &state) {
+    std::string path = (std::filesystem::temp_directory_path() / "_microbench_copy.csv").string();
+    FILE *csv = fopen(path.c_str(), "w");
+    for (int i = 0; i < FILTER_ROWS; i++)
+        fprintf(csv, "%d,%s\n", (int) ((i * 2654435761U) % 2001) - 1000, std::string(16, 'f').c_str());
+    fclose(csv);
+    std::vector<std::string_view> fields;
+    size_t bytes = 0;
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        state.PauseTiming();
+        BTTable table("_microbench_copy", {"id", "payload"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        state.ResumeTiming();
+        CsvReader reader(path);
+        BTTableLoader loader(table);
+        while (reader.next(fields))
+            loader.add(fields);
+        loader.finish();
+        bytes = reader.get_bytes();
+        state.PauseTiming();
+        table.drop();
+        state.ResumeTiming();
+    }
+    std::filesystem::remove(path);
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_copy_from)->Unit(benchmark::kMillisecond);
+
+// the filter table written out a batch at a time as COPY ... TO does, to /dev/null: range(0) 0 CSV, 1 binary
+static void BM_copy_to(benchmark::State &state) {
+    BTTable &table = filter_table();
+    std::ofstream out("/dev/null", std::ios::binary);
+    u_int64_t bytes = 0;
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        std::unique_ptr<ResultWriter> writer = ResultWriter::create(state.range(0) ? "binary" : "csv", out, false);
+        writer->begin({"id", "payload"});
+        TableScan scan(table, "_microbench_filter");
+        ColumnBatch batch;
+        scan.open();
+        while (scan.next_batch(batch))
+            writer->batch(batch);
+        scan.close();
+        writer->end("");
+        bytes = writer->get_bytes();
+    }
+    state.SetItemsProcessed(state.iterations() * FILTER_ROWS);
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_copy_to)->ArgName("binary")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+static const int DELETE_ROWS = 10000;
+
+// every third row of a 10,000-row table deleted one at a time, each in its own transaction
+// (range(0) 0), or as a set, a block at a time in one transaction (1); in rows deleted per second
+static void BM_delete(benchmark::State &state) {
+    const std::string table_name = "_microbench_delete";
+    AllocationCounter counter(state);
+    for (auto _: state) {
+        state.PauseTiming();
+        BTTable table(table_name, {"id", "payload"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < DELETE_ROWS; i++)
+            rows.push_back(new ValueDict({{"id", Value(i)}, {"payload", Value(std::string(16, 'd'))}}));
+        Handles *handles = table.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+        Handles doomed;
+        for (size_t i = 0; i < handles->size(); i += 3)
+            doomed.push_back((*handles)[i]);
+        delete handles;
+        state.ResumeTiming();
+
+        if (state.range(0))
+            table.del(&doomed);
+        else
+            for (auto const &handle : doomed)
+                table.del(handle);
+
+        state.PauseTiming();
+        table.drop();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * ((DELETE_ROWS + 2) / 3));
+}
+BENCHMARK(BM_delete)->ArgName("set")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char *argv[]) {
+    benchmark::Initialize(&argc, argv);
+
+    EnvConfig config;
+    config.durability = "nosync";
+    std::vector<std::string> args(argv + 1, argv + argc);
+    try {
+        config.parse_args(args);
+    } catch (std::invalid_argument &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!args.empty()) {
+        std::cerr << argv[0] << ": unexpected argument '" << args[0] << "'" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string envdir = std::string(std::filesystem::temp_directory_path()) + "/lmdb-microbench-XXXXXX";
+    if (mkdtemp(envdir.data()) == nullptr) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    int exit_code = EXIT_SUCCESS;
+    try {
+        DbEnv::open(envdir.c_str(), config);
+        benchmark::RunSpecifiedBenchmarks();
+        DbEnv::close();
+    } catch (std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        exit_code = EXIT_FAILURE;
+    }
+    benchmark::Shutdown();
+    std::filesystem::remove_all(envdir);
+    return exit_code;
+}
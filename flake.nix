@@ -24,7 +24,7 @@
 
         devShells.default = pkgs.mkShell {
           inputsFrom = [ self.packages.${system}.lmdb-lab ];
-          packages = with pkgs; [ gnumake gcc gdb valgrind clang-tools ];
+          packages = with pkgs; [ gnumake gcc gdb valgrind clang-tools gbenchmark ];
         };
       });
 }
@@ -27,7 +27,7 @@ void Benchmark::run(std::string filename) {
         delete file;
         file = new BenchFile(filename);
         file->open();
-        printf("%lu,read,%f\n", n[i], write_test(*file, n[i]).count());
+        printf("%lu,read,%f\n", n[i], read_test(*file, n[i]).count());
         file->drop();
         delete file;
     }
@@ -64,7 +64,7 @@ TimeSpan Benchmark::read_test(BenchFile &file, size_t n) {
     // Begin benchmark
     TimePoint start_time = steady_clock::now();
 
-    for (size_t j = 0; j < n; j++) {
+    for (size_t j = 1; j <= n; j++) {
         BenchPage *page = file.get(j);
         RecordIDs *ids = page->ids();
         for (size_t i = 0; i < ids->size(); i++) {
@@ -76,6 +76,7 @@ TimeSpan Benchmark::read_test(BenchFile &file, size_t n) {
             delete data;
         }
         delete ids;
+        delete page;
     }
 
     // End benchmark
@@ -0,0 +1,230 @@
+/**
+ * @file commit_queue.cpp - implementation of the single-writer commit queue
+ */
+#include "commit_queue.h"
+#include <memory>
+#include "db_env.h"
+
+// thrown to roll a batch back and run it again without the intent that failed
+struct RetryBatch {};
+
+CommitQueue::CommitQueue(size_t max_batch, std::chrono::microseconds max_latency)
+        : max_batch(max_batch > 0 ? max_batch : 1), max_latency(max_latency), head(&stub), tail(&stub),
+          pending(0), stopping(false), sleeping(false), batches(0), committed(0) {
+    this->writer = std::thread(&CommitQueue::writer_loop, this);
+}
+
+CommitQueue::~CommitQueue() {
+    this->stop();
+}
+
+std::future<Handle> CommitQueue::insert(DbRelation &table, const ValueDict &row) {
+    WriteIntent *intent = new WriteIntent();
+    intent->kind = WriteIntent::INSERT;
+    intent->table = &table;
+    intent->row = row;
+    return this->submit(intent);
+}
+
+std::future<Handle> CommitQueue::del(DbRelation &table, Handle handle) {
+    WriteIntent *intent = new WriteIntent();
+    intent->kind = WriteIntent::DELETE;
+    intent->table = &table;
+    intent->handle = handle;
+    return this->submit(intent);
+}
+
+void CommitQueue::stop() {
+    if (!this->writer.joinable())
+        return;
+    this->stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(this->doorbell_mutex);
+        this->doorbell.notify_one();
+    }
+    this->writer.join();
+
+    // a submit that counted itself before seeing stopping pushes its intent, so wait for it
+    while (this->pending.load() > 0) {
+        WriteIntent *intent = this->pop();
+        if (intent == nullptr) {
+            std::this_thread::yield();
+            continue;
+        }
+        this->pending--;
+        intent->done.set_exception(std::make_exception_ptr(DbRelationError("commit queue stopped")));
+        delete intent;
+    }
+}
+
+// protected
+std::future<Handle> CommitQueue::submit(WriteIntent *intent) {
+    std::future<Handle> result = intent->done.get_future();
+    // count before checking stopping: either stop() sees the count and waits for the push, or
+    // this sees stopping (and the writer never sees more intents than pending says exist)
+    this->pending++;
+    if (this->stopping) {
+        this->pending--;
+        intent->done.set_exception(std::make_exception_ptr(DbRelationError("commit queue stopped")));
+        delete intent;
+        return result;
+    }
+    this->push(intent);
+    if (this->sleeping) {
+        std::lock_guard<std::mutex> lock(this->doorbell_mutex);
+        this->doorbell.notify_one();
+    }
+    return result;
+}
+
+void CommitQueue::push(WriteIntent *intent) {
+    intent->next.store(nullptr, std::memory_order_relaxed);
+    WriteIntent *prev = this->head.exchange(intent, std::memory_order_acq_rel);
+    prev->next.store(intent, std::memory_order_release);
+}
+
+// Pop the oldest intent; nullptr if empty or a producer is half way through push()
+CommitQueue::WriteIntent *CommitQueue::pop() {
+    WriteIntent *first = this->tail;
+    WriteIntent *next = first->next.load(std::memory_order_acquire);
+    if (first == &this->stub) {
+        if (next == nullptr)
+            return nullptr;
+        this->tail = next;
+        first = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+        this->tail = next;
+        return first;
+    }
+    if (first != this->head.load(std::memory_order_acquire))
+        return nullptr;
+    this->push(&this->stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+        this->tail = next;
+        return first;
+    }
+    return nullptr;
+}
+
+void CommitQueue::writer_loop() {
+    std::vector<WriteIntent *> batch;
+    batch.reserve(this->max_batch);
+    while (this->collect(batch) > 0) {
+        this->apply(batch);
+        batch.clear();
+    }
+}
+
+// Gather the next batch, blocking until there is at least one intent; 0 means shut down
+size_t CommitQueue::collect(std::vector<WriteIntent *> &batch) {
+    using clock = std::chrono::steady_clock;
+
+    while (this->pending.load() == 0) {
+        if (this->stopping)
+            return 0;
+        std::unique_lock<std::mutex> lock(this->doorbell_mutex);
+        this->sleeping = true;
+        this->doorbell.wait(lock, [this] { return this->pending.load() > 0 || this->stopping; });
+        this->sleeping = false;
+    }
+
+    clock::time_point deadline = clock::now() + this->max_latency;
+    while (batch.size() < this->max_batch) {
+        WriteIntent *intent = this->pop();
+        if (intent != nullptr) {
+            this->pending--;
+            batch.push_back(intent);
+            continue;
+        }
+        if (this->pending.load() > 0) {
+            std::this_thread::yield();  // a producer is mid-push
+            continue;
+        }
+        if (this->stopping || clock::now() >= deadline)
+            break;
+        std::unique_lock<std::mutex> lock(this->doorbell_mutex);
+        this->sleeping = true;
+        this->doorbell.wait_until(lock, deadline, [this] { return this->pending.load() > 0 || this->stopping; });
+        this->sleeping = false;
+    }
+    return batch.size();
+}
+
+// Run the whole batch in one write transaction, each intent in a nested one. LMDB has no
+// nested transactions under MDB_WRITEMAP, so there the intents go straight into the batch's,
+// and one that fails rolls the batch back to be run again without it.
+void CommitQueue::apply(std::vector<WriteIntent *> &batch) {
+    unsigned int env_flags = 0;
+    mdb_env_get_flags(_MDB_ENV, &env_flags);
+    bool nested = !(env_flags & MDB_WRITEMAP);
+    std::vector<std::pair<WriteIntent *, Handle>> written;
+    std::vector<std::pair<WriteIntent *, std::exception_ptr>> failed;
+    auto has_failed = [&failed](WriteIntent *intent) {
+        for (auto &item : failed)
+            if (item.first == intent)
+                return true;
+        return false;
+    };
+    try {
+        bool again;
+        do {
+            again = false;
+            try {
+                // repeated from scratch if the map has to grow part way through
+                DbEnv::write_transaction([&]() {
+                    written.clear();
+                    if (nested)
+                        failed.clear();
+                    for (WriteIntent *intent : batch) {
+                        if (!nested && has_failed(intent))
+                            continue;
+                        try {
+                            std::unique_ptr<BTTransaction> step(nested ? new BTTransaction(0, BTTransaction::NESTED)
+                                                                       : nullptr);
+                            Handle handle = intent->handle;
+                            if (intent->kind == WriteIntent::INSERT)
+                                handle = intent->table->insert(&intent->row);
+                            else
+                                intent->table->del(handle);
+                            if (step)
+                                step->commit();
+                            written.push_back({intent, handle});
+                        } catch (DbException &e) {
+                            if (DbEnv::is_map_full(e))
+                                throw;
+                            failed.push_back({intent, std::current_exception()});
+                            if (!nested)
+                                throw RetryBatch();
+                        } catch (...) {
+                            failed.push_back({intent, std::current_exception()});
+                            if (!nested)
+                                throw RetryBatch();
+                        }
+                    }
+                });
+            } catch (const RetryBatch &) {
+                again = true;
+            }
+        } while (again);
+    } catch (...) {
+        for (WriteIntent *intent : batch) {
+            intent->done.set_exception(std::current_exception());
+            delete intent;
+        }
+        return;
+    }
+
+    this->batches++;
+    this->committed += written.size();
+    for (auto &item : failed) {
+        item.first->done.set_exception(item.second);
+        delete item.first;
+    }
+    for (auto &item : written) {
+        item.first->done.set_value(item.second);
+        delete item.first;
+    }
+}
@@ -0,0 +1,123 @@
+/**
+ * @file commit_queue.h - single-writer commit queue with group commit.
+ * CommitQueue
+ *
+ * LMDB allows one write transaction at a time, so concurrent inserters would otherwise
+ * queue on the writer lock and each pay for their own commit (and fsync). Instead,
+ * submitters push write intents onto a lock-free MPSC queue and one writer thread applies
+ * them in batches, one LMDB transaction per batch.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include "heap_storage.h"
+
+/**
+ * @class CommitQueue - funnels inserts and deletes from any thread through one writer thread.
+ *
+ *      Each insert() or del() returns a future that becomes ready once the batch holding
+ *      the write has been committed (and so is durable under the environment's sync
+ *      settings). A batch is closed when it reaches max_batch intents or when its oldest
+ *      intent has waited max_latency, whichever comes first. Every intent runs in its own
+ *      nested transaction, so a failing write only fails its own future. Under MDB_WRITEMAP,
+ *      which allows no nested transactions, a failing write rolls back its batch instead, and
+ *      the batch is run again without it.
+ */
+class CommitQueue {
+public:
+    static const size_t DEFAULT_MAX_BATCH = 256;
+    static constexpr std::chrono::microseconds DEFAULT_MAX_LATENCY{1000};
+
+    CommitQueue(size_t max_batch = DEFAULT_MAX_BATCH,
+                std::chrono::microseconds max_latency = DEFAULT_MAX_LATENCY);
+
+    virtual ~CommitQueue();
+
+    CommitQueue(const CommitQueue &other) = delete;
+
+    CommitQueue(CommitQueue &&temp) = delete;
+
+    CommitQueue &operator=(const CommitQueue &other) = delete;
+
+    CommitQueue &operator=(CommitQueue &&temp) = delete;
+
+    /**
+     * Queue a row for insertion.
+     * @param table  table to insert into (must outlive the returned future)
+     * @param row    row to insert (copied)
+     * @returns      future for the new row's handle
+     */
+    virtual std::future<Handle> insert(DbRelation &table, const ValueDict &row);
+
+    /**
+     * Queue a row for deletion.
+     * @param table   table to delete from (must outlive the returned future)
+     * @param handle  row to delete
+     * @returns       future for the deleted handle
+     */
+    virtual std::future<Handle> del(DbRelation &table, Handle handle);
+
+    /**
+     * Commit everything queued so far and stop the writer thread.
+     * Writes submitted after stop() fail with a DbRelationError.
+     */
+    virtual void stop();
+
+    size_t get_max_batch() const { return max_batch; }
+
+    std::chrono::microseconds get_max_latency() const { return max_latency; }
+
+    // number of batches (transactions) committed so far
+    u_int64_t get_batches() const { return batches.load(std::memory_order_relaxed); }
+
+    // number of intents committed so far
+    u_int64_t get_committed() const { return committed.load(std::memory_order_relaxed); }
+
+protected:
+    struct WriteIntent {
+        enum Kind {
+            INSERT, DELETE
+        } kind;
+        DbRelation *table;
+        ValueDict row;
+        Handle handle;
+        std::promise<Handle> done;
+        std::atomic<WriteIntent *> next;
+
+        WriteIntent() : kind(INSERT), table(nullptr), next(nullptr) {}
+    };
+
+    size_t max_batch;
+    std::chrono::microseconds max_latency;
+
+    // Vyukov intrusive MPSC queue: producers swap themselves in at head, the writer pops at tail
+    std::atomic<WriteIntent *> head;
+    WriteIntent *tail;
+    WriteIntent stub;
+
+    std::atomic<size_t> pending;
+    std::atomic<bool> stopping;
+    std::atomic<bool> sleeping;
+    std::mutex doorbell_mutex;
+    std::condition_variable doorbell;
+    std::atomic<u_int64_t> batches;
+    std::atomic<u_int64_t> committed;
+    std::thread writer;
+
+    virtual std::future<Handle> submit(WriteIntent *intent);
+
+    virtual void push(WriteIntent *intent);
+
+    virtual WriteIntent *pop();
+
+    virtual void writer_loop();
+
+    virtual size_t collect(std::vector<WriteIntent *> &batch);
+
+    virtual void apply(std::vector<WriteIntent *> &batch);
+};
@@ -0,0 +1,109 @@
+/**
+ * @file csv_reader.cpp - implementation of CsvReader
+ */
+#include "csv_reader.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+CsvReader::CsvReader(const std::string &path, size_t buffer_size)
+        : path(path), fd(-1), buffer(buffer_size), start(0), end(0), bytes(0), line(0), eof(false) {
+    this->fd = ::open(path.c_str(), O_RDONLY);
+    if (this->fd < 0)
+        throw std::invalid_argument("cannot read file '" + path + "': " + strerror(errno));
+}
+
+CsvReader::~CsvReader() {
+    if (this->fd >= 0)
+        ::close(this->fd);
+}
+
+// move what's left to the front of the buffer (growing it if it is all one record) and read more
+bool CsvReader::fill() {
+    if (this->eof)
+        return false;
+    size_t left = this->end - this->start;
+    if (left == this->buffer.size())
+        this->buffer.resize(this->buffer.size() * 2);
+    else if (this->start > 0)
+        memmove(this->buffer.data(), this->buffer.data() + this->start, left);
+    this->start = 0;
+    this->end = left;
+    ssize_t n;
+    do {
+        n = ::read(this->fd, this->buffer.data() + this->end, this->buffer.size() - this->end);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        throw std::invalid_argument("cannot read file '" + this->path + "': " + strerror(errno));
+    if (n == 0)
+        this->eof = true;
+    this->end += n;
+    this->bytes += n;
+    return n > 0;
+}
+
+bool CsvReader::next(std::vector<std::string_view> &fields) {
+    while (true) {
+        char *record = this->buffer.data() + this->start;
+        char *newline = (char *) memchr(record, '\n', this->end - this->start);
+        char *record_end;
+        if (newline != nullptr) {
+            record_end = newline;
+            this->start = newline + 1 - this->buffer.data();
+        } else if (this->fill()) {
+            continue;
+        } else if (this->start < this->end) {
+            record = this->buffer.data() + this->start;  // fill() moved it
+            record_end = this->buffer.data() + this->end;  // last line without a newline
+            this->start = this->end;
+        } else {
+            return false;
+        }
+        this->line++;
+        if (record_end > record && record_end[-1] == '\r')
+            record_end--;
+        if (record_end == record)
+            continue;
+        this->split(record, record_end, fields);
+        return true;
+    }
+}
+
+void CsvReader::split(char *record, char *record_end, std::vector<std::string_view> &fields) {
+    fields.clear();
+    char *p = record;
+    while (true) {
+        if (p < record_end && *p == '"') {
+            // unquote in place: the field only gets shorter
+            char *out = ++p, *field = out;
+            while (p < record_end) {
+                if (*p == '"') {
+                    if (p + 1 < record_end && p[1] == '"') {
+                        *out++ = '"';
+                        p += 2;
+                        continue;
+                    }
+                    p++;
+                    break;
+                }
+                *out++ = *p++;
+            }
+            fields.emplace_back(field, out - field);
+            char *comma = (char *) memchr(p, ',', record_end - p);
+            if (comma == nullptr)
+                return;
+            p = comma + 1;
+        } else {
+            char *comma = (char *) memchr(p, ',', record_end - p);
+            if (comma == nullptr) {
+                fields.emplace_back(p, record_end - p);
+                return;
+            }
+            fields.emplace_back(p, comma - p);
+            p = comma + 1;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/**
+ * @file csv_reader.h - reading CSV files a record at a time, for bulk loads.
+ * CsvReader
+ *
+ * The file is read in large buffers with read(2), and records are split with memchr, so a
+ * field costs a couple of pointer bumps rather than a stream extraction. Fields come back as
+ * string_views into the buffer and are only good until the next call to next(). Quoted fields
+ * (with "" for a quote) are unquoted in place; they may not span lines. A trailing CR is dropped.
+ */
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @class CsvReader - the records of a CSV file, in order.
+ */
+class CsvReader {
+public:
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    /**
+     * @param path         file to read
+     * @param buffer_size  initial buffer size; grown if a record doesn't fit
+     */
+    explicit CsvReader(const std::string &path, size_t buffer_size = BUFFER_SIZE);
+
+    virtual ~CsvReader();
+
+    CsvReader(const CsvReader &other) = delete;
+
+    CsvReader &operator=(const CsvReader &other) = delete;
+
+    /**
+     * Split the next record into fields. Blank lines are skipped.
+     * @param fields  set to the fields (good until the next call)
+     * @returns       false at the end of the file
+     */
+    virtual bool next(std::vector<std::string_view> &fields);
+
+    // bytes of the file read so far
+    size_t get_bytes() const { return bytes; }
+
+    // line number of the record next() last returned
+    size_t get_line() const { return line; }
+
+protected:
+    std::string path;
+    int fd;
+    std::vector<char> buffer;
+    size_t start;   // first unconsumed byte in buffer
+    size_t end;     // end of the data in buffer
+    size_t bytes;
+    size_t line;
+    bool eof;
+
+    bool fill();
+
+    void split(char *record, char *record_end, std::vector<std::string_view> &fields);
+};
@@ -0,0 +1,283 @@
+/**
+ * @file db_env.cpp - implementation of EnvConfig and DbEnv
+ */
+#include "db_env.h"
+#include "heap_storage.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+
+/*
+ * **************************
+ * EnvConfig implementation
+ * **************************
+ */
+const std::vector<EnvConfig::Durability> EnvConfig::DURABILITY_PROFILES = {
+        {"durable",    0,                           "sync data and meta page on every commit"},
+        {"nometasync", MDB_NOMETASYNC,              "defer the meta page sync; a crash may lose the last commit"},
+        {"nosync",     MDB_NOSYNC,                  "leave flushing to the OS (and the sync thread)"},
+        {"writemap",   MDB_WRITEMAP,                "write through a writable map, synced on every commit"},
+        {"async",      MDB_WRITEMAP | MDB_MAPASYNC, "writable map flushed asynchronously"},
+};
+
+EnvConfig::EnvConfig()
+        : map_size(1UL * 1024UL * 1024UL * 1024UL), // 1Gb
+          max_map_size(0), max_dbs(128), durability("durable"), sync_interval_ms(1000),
+          work_mem(64UL * 1024UL * 1024UL), statement_cache(256), bloom_filters("_columns.table_name"),
+          bloom_bits(10), stale_reader_ms(10000) {}
+
+void EnvConfig::set(const std::string &name, const std::string &value) {
+    if (name == "durability") {
+        for (auto const &profile: DURABILITY_PROFILES) {
+            if (profile.name == value) {
+                this->durability = value;
+                return;
+            }
+        }
+        throw std::invalid_argument("unknown durability profile '" + value + "'");
+    }
+    if (name == "bloom-filters") {
+        std::string rest = value;
+        while (!rest.empty()) {
+            std::string column = rest.substr(0, rest.find(','));
+            rest.erase(0, std::min(rest.size(), column.size() + 1));
+            size_t dot = column.find('.');
+            if (dot == 0 || dot == std::string::npos || dot + 1 == column.size())
+                throw std::invalid_argument("bad column '" + column + "' for option 'bloom-filters' (want table.column)");
+        }
+        this->bloom_filters = value;
+        return;
+    }
+
+    bool is_size = name == "map-size" || name == "max-map-size" || name == "work-mem";
+    if (!is_size && name != "max-dbs" && name != "sync-interval" && name != "statement-cache" &&
+        name != "bloom-bits" && name != "stale-reader")
+        throw std::invalid_argument("unknown option '" + name + "'");
+    size_t n;
+    try {
+        // stoul would wrap "-1" (even " -1") around to a huge value rather than fail
+        if (value.empty() || !isdigit((unsigned char) value[0]))
+            throw std::invalid_argument(value);
+        n = is_size ? parse_size(value) : std::stoul(value);
+    } catch (std::logic_error &e) {
+        throw std::invalid_argument("bad value '" + value + "' for option '" + name + "'");
+    }
+
+    if (name == "map-size")
+        this->map_size = n;
+    else if (name == "max-map-size")
+        this->max_map_size = n;
+    else if (name == "work-mem")
+        this->work_mem = n;
+    else if (name == "max-dbs")
+        this->max_dbs = n;
+    else if (name == "statement-cache")
+        this->statement_cache = n;
+    else if (name == "bloom-bits")
+        this->bloom_bits = n;
+    else if (name == "stale-reader")
+        this->stale_reader_ms = n;
+    else
+        this->sync_interval_ms = n;
+}
+
+void EnvConfig::load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::invalid_argument("cannot read config file '" + path + "'");
+    std::string line;
+    int line_num = 0;
+    auto trim = [](std::string s) {
+        size_t start = s.find_first_not_of(" \t\r");
+        size_t end = s.find_last_not_of(" \t\r");
+        return start == std::string::npos ? std::string() : s.substr(start, end - start + 1);
+    };
+    while (std::getline(in, line)) {
+        line_num++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            throw std::invalid_argument(path + ":" + std::to_string(line_num) + ": expected name = value");
+        this->set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+    }
+}
+
+void EnvConfig::parse_args(std::vector<std::string> &args) {
+    std::vector<std::string> rest;
+    std::vector<std::pair<std::string, std::string>> options;
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string &arg = args[i];
+        if (arg.rfind("--", 0) != 0) {
+            rest.push_back(arg);
+            continue;
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value;
+        if (eq != std::string::npos)
+            value = arg.substr(eq + 1);
+        else if (i + 1 < args.size())
+            value = args[++i];
+        else
+            throw std::invalid_argument("option --" + name + " needs a value");
+        if (name == "config")
+            this->load(value);
+        else
+            options.push_back({name, value});
+    }
+    for (auto const &option: options)
+        this->set(option.first, option.second);
+    args = rest;
+}
+
+bool EnvConfig::has_bloom_filter(const std::string &table_name, const std::string &column_name) const {
+    std::string list = "," + this->bloom_filters + ",";
+    return list.find("," + table_name + "." + column_name + ",") != std::string::npos;
+}
+
+unsigned int EnvConfig::get_env_flags() const {
+    for (auto const &profile: DURABILITY_PROFILES)
+        if (profile.name == this->durability)
+            return profile.flags;
+    return 0;
+}
+
+bool EnvConfig::defers_sync() const {
+    return (this->get_env_flags() & (MDB_NOSYNC | MDB_NOMETASYNC | MDB_MAPASYNC)) != 0;
+}
+
+// "64M" -> 67108864
+size_t EnvConfig::parse_size(const std::string &value) {
+    size_t pos = 0;
+    unsigned long long n = std::stoull(value, &pos);
+    std::string suffix = value.substr(pos);
+    if (suffix.size() == 2 && toupper(suffix[1]) == 'B')
+        suffix = suffix.substr(0, 1);
+    if (suffix.empty() || suffix == "B" || suffix == "b")
+        return n;
+    switch (toupper(suffix[0])) {
+        case 'K': return n << 10;
+        case 'M': return n << 20;
+        case 'G': return n << 30;
+        case 'T': return n << 40;
+        default:  throw std::invalid_argument("bad size '" + value + "'");
+    }
+}
+
+
+/*
+ * **************************
+ * DbEnv implementation
+ * **************************
+ */
+EnvConfig DbEnv::config;
+std::shared_mutex DbEnv::resize_mutex;
+std::atomic<unsigned int> DbEnv::growths(0);
+std::thread DbEnv::sync_thread;
+std::mutex DbEnv::sync_mutex;
+std::condition_variable DbEnv::sync_wakeup;
+bool DbEnv::sync_stopping = false;
+
+void DbEnv::open(const char *home, const EnvConfig &config) {
+    MDB_env *env;
+    int status = mdb_env_create(&env);
+    if (!status)
+        status = mdb_env_set_mapsize(env, config.map_size);
+    if (!status)
+        status = mdb_env_set_maxdbs(env, config.max_dbs);
+    // MDB_NOTLS: reader slots belong to transactions, not threads, so that a statement's read
+    // snapshot and the separate transactions it reads spilled rows in can be open on one thread
+    if (!status)
+        status = mdb_env_open(env, home, config.get_env_flags() | MDB_NOTLS, 0664); // unlike in BDB, we can't pass in DB_CREATE
+    if (status) {
+        mdb_env_close(env);
+        throw DbException(status, std::generic_category(), mdb_strerror(status));
+    }
+
+    DbEnv::config = config;
+    DbEnv::growths = 0;
+    _MDB_ENV = env;
+    clear_stale_readers();
+
+    if (config.defers_sync() && config.sync_interval_ms > 0) {
+        sync_stopping = false;
+        sync_thread = std::thread(DbEnv::sync_loop);
+    }
+}
+
+void DbEnv::close() {
+    if (_MDB_ENV == nullptr)
+        return;
+    if (sync_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            sync_stopping = true;
+        }
+        sync_wakeup.notify_all();
+        sync_thread.join();
+    }
+    mdb_env_sync(_MDB_ENV, 1);
+    mdb_env_close(_MDB_ENV);
+    _MDB_ENV = nullptr;
+}
+
+bool DbEnv::grow() {
+    std::unique_lock<std::shared_mutex> lock(resize_mutex);
+    MDB_envinfo info;
+    mdb_env_info(_MDB_ENV, &info);
+    size_t limit = config.max_map_size;
+    if (limit != 0 && info.me_mapsize >= limit)
+        return false;
+    size_t new_size = info.me_mapsize * 2;
+    if (limit != 0)
+        new_size = std::min(new_size, limit);
+    if (mdb_env_set_mapsize(_MDB_ENV, new_size))
+        return false;
+    growths++;
+    Stats::count(COUNTER_MAP_GROWTHS);
+    return true;
+}
+
+bool DbEnv::is_map_full(const DbException &e) {
+    return e.code().value() == MDB_MAP_FULL;
+}
+
+int DbEnv::clear_stale_readers() {
+    int dead = 0;
+    int status = mdb_reader_check(_MDB_ENV, &dead);
+    if (status)
+        throw DbException(status, std::generic_category(), mdb_strerror(status));
+    Stats::count(COUNTER_STALE_READERS_CLEARED, dead);
+    return dead;
+}
+
+void DbEnv::write_transaction(const std::function<void()> &body) {
+    while (true) {
+        try {
+            BTTransaction txn;
+            body();
+            txn.commit();
+            return;
+        } catch (DbException &e) {
+            // txn has been rolled back by now, so the map can be resized
+            if (!is_map_full(e) || BTTransaction::current() != nullptr || !grow())
+                throw;
+        }
+    }
+}
+
+// protected
+// Cap the window of commits that a crash can lose when commits don't sync
+void DbEnv::sync_loop() {
+    std::unique_lock<std::mutex> lock(sync_mutex);
+    while (!sync_stopping) {
+        sync_wakeup.wait_for(lock, std::chrono::milliseconds(config.sync_interval_ms));
+        if (!sync_stopping)
+            mdb_env_sync(_MDB_ENV, 1);
+    }
+}
@@ -0,0 +1,176 @@
+/**
+ * @file db_env.h - LMDB environment configuration and lifetime.
+ * EnvConfig
+ * DbEnv
+ *
+ * Opening the environment with a fixed map size and table count means the database
+ * stops accepting writes once either runs out. DbEnv grows the map on MDB_MAP_FULL and
+ * keeps the durability settings (and the background sync they may need) in one place.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class EnvConfig - settings used to open the LMDB environment.
+ *
+ *      Options can be given as "name=value" pairs, either on the command line as
+ *      --name=value or one per line in a config file ('#' starts a comment):
+ *          map-size       initial map size (suffixes K, M, G, T)
+ *          max-map-size   upper limit for automatic growth, 0 for none
+ *          max-dbs        maximum number of named databases (tables)
+ *          durability     durable | nometasync | nosync | writemap | async
+ *          sync-interval  milliseconds between background mdb_env_sync calls when the
+ *                         durability profile defers syncing, 0 to disable
+ *          work-mem       memory a query operator (e.g. a hash join) may hold before it
+ *                         spills to a temporary database (suffixes K, M, G, T)
+ *          statement-cache  parsed statements (and their plans) kept for reuse, 0 for none
+ *          bloom-filters  TEXT columns, as comma-separated table.column, whose values each
+ *                         block's zone map keeps a Bloom filter of, for equality lookups
+ *          bloom-bits     Bloom filter bits per row: 10 gives about 1% false positives,
+ *                         each 5 more roughly a tenth of that; 0 for no filters
+ *          stale-reader   milliseconds after which SHOW READERS calls an open read
+ *                         snapshot stale (it keeps pages freed since from being reused)
+ */
+class EnvConfig {
+public:
+    /**
+     * A named set of environment flags trading durability for commit speed.
+     */
+    struct Durability {
+        std::string name;
+        unsigned int flags;
+        std::string description;
+    };
+
+    static const std::vector<Durability> DURABILITY_PROFILES;
+
+    size_t map_size;
+    size_t max_map_size;
+    unsigned int max_dbs;
+    std::string durability;
+    unsigned int sync_interval_ms;
+    size_t work_mem;
+    unsigned int statement_cache;
+    std::string bloom_filters;
+    unsigned int bloom_bits;
+    unsigned int stale_reader_ms;
+
+    EnvConfig();
+
+    virtual ~EnvConfig() {}
+
+    /**
+     * Set one option by name.
+     * @param name   option name, e.g. "map-size"
+     * @param value  option value
+     * @throws std::invalid_argument for unknown options or bad values
+     */
+    virtual void set(const std::string &name, const std::string &value);
+
+    /**
+     * Read options from a file of "name = value" lines.
+     * @throws std::invalid_argument if the file can't be read or has bad lines
+     */
+    virtual void load(const std::string &path);
+
+    /**
+     * Apply command line options of the form --name=value (or --name value).
+     * --config=FILE loads a config file first so later options override it.
+     * @param args  arguments; the options consumed are removed
+     */
+    virtual void parse_args(std::vector<std::string> &args);
+
+    // mdb_env_open flags for the selected durability profile 
+    virtual unsigned int get_env_flags() const;
+
+    // true when commits don't fsync everything and a background sync is worthwhile
+    virtual bool defers_sync() const;
+
+    // whether bloom-filters names table_name.column_name
+    virtual bool has_bloom_filter(const std::string &table_name, const std::string &column_name) const;
+
+    static size_t parse_size(const std::string &value);
+};
+
+
+/**
+ * @class DbEnv - owner of the process-wide LMDB environment (_MDB_ENV).
+ *
+ *      Every top-level transaction holds the resize lock shared; grow() takes it
+ *      exclusively, because LMDB only allows the map to be resized while no transaction
+ *      in the process is active.
+ */
+class DbEnv {
+public:
+    DbEnv() = delete;
+
+    /**
+     * Create and open the environment, clear reader slots left by dead processes, and
+     * start the background sync if needed.
+     * @param home    environment directory
+     * @param config  environment settings
+     * @throws DbException if LMDB refuses the settings or the directory
+     */
+    static void open(const char *home, const EnvConfig &config = EnvConfig());
+
+    /**
+     * Stop the background sync, flush, and close the environment.
+     */
+    static void close();
+
+    static bool is_open() { return _MDB_ENV != nullptr; }
+
+    static const EnvConfig &get_config() { return config; }
+
+    /**
+     * Double the map size (capped by max-map-size).
+     * Must not be called while this thread has a transaction open.
+     * @returns  false if the map is already at its limit
+     */
+    static bool grow();
+
+    static bool is_map_full(const DbException &e);
+
+    /**
+     * Free the reader slots of processes that died with a read transaction open, whose
+     * snapshots would otherwise keep old pages from being reused.
+     * @returns  the number of slots cleared
+     */
+    static int clear_stale_readers();
+
+    /**
+     * Run body in one write transaction (a BTTransaction) and commit it. If the map
+     * fills up, the transaction is rolled back, the map grown and body run again, so
+     * body must be safe to repeat.
+     */
+    static void write_transaction(const std::function<void()> &body);
+
+    // held shared by every top-level transaction, exclusively while resizing
+    static void lock_shared() { resize_mutex.lock_shared(); }
+
+    static void unlock_shared() { resize_mutex.unlock_shared(); }
+
+    // number of times the map has been grown since open
+    static unsigned int get_growths() { return growths; }
+
+protected:
+    static EnvConfig config;
+    static std::shared_mutex resize_mutex;
+    static std::atomic<unsigned int> growths;
+
+    static std::thread sync_thread;
+    static std::mutex sync_mutex;
+    static std::condition_variable sync_wakeup;
+    static bool sync_stopping;
+
+    static void sync_loop();
+};
@@ -1,8 +1,157 @@
 #include "heap_storage.h"
+#include <algorithm>
+#include <charconv>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
 #include "storage_engine.h"
+#include "db_env.h"
+#include "stats.h"
 
 MDB_env *_MDB_ENV = nullptr;
 
+//// BTTransaction
+thread_local BTTransaction *BTTransaction::active = nullptr;
+
+// Begin a transaction, or join the one already active on this thread
+BTTransaction::BTTransaction(uint flags, Scope scope)
+    : txn(nullptr), outer(active), scope(scope), owned(true), read_only(flags & MDB_RDONLY), holds_lock(false) {
+  MDB_txn *parent = nullptr;
+  if (this->outer != nullptr) {
+    if (this->scope == JOIN && this->outer->read_only && !this->read_only)
+      this->scope = SEPARATE;
+    if (this->scope == JOIN) {
+      this->txn = this->outer->txn;
+      this->owned = false;
+      this->read_only = this->outer->read_only;
+      active = this;
+      return;
+    }
+    if (this->scope == NESTED) {
+      if (this->outer->read_only)
+        throw DbException(EINVAL, std::generic_category(), "cannot nest inside a read-only transaction");
+      parent = this->outer->txn;
+    }
+  }
+  StatTimer timer(STAT_TXN_BEGIN);
+  if (this->outer == nullptr) {
+    DbEnv::lock_shared(); // no resizing the map under a live transaction
+    this->holds_lock = true;
+  }
+  int status = mdb_txn_begin(_MDB_ENV, parent, flags, &this->txn);
+  if (status) {
+    if (this->holds_lock)
+      DbEnv::unlock_shared();
+    this->holds_lock = false;
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  active = this;
+}
+
+BTTransaction::~BTTransaction() {
+  if (this->txn != nullptr)
+    this->abort();
+}
+
+// Commit the transaction; a joined transaction is committed by its owner
+void BTTransaction::commit() {
+  if (this->txn == nullptr)
+    return;
+  int status = 0;
+  if (this->owned) {
+    StatTimer timer(STAT_TXN_COMMIT);
+    status = mdb_txn_commit(this->txn);
+    if (status)
+      timer.fail();
+  }
+  if (status) {
+    Stats::count(COUNTER_TXN_ABORTS);
+    this->rollback();
+  } else if (this->owned && this->scope == NESTED) {
+    // a committed child's changes still go away if the parent aborts
+    for (auto &undo : this->undo_log)
+      this->outer->on_abort(undo);
+  }
+  this->undo_log.clear();
+  this->end();
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+}
+
+void BTTransaction::abort() {
+  if (this->txn == nullptr)
+    return;
+  if (this->owned) {
+    mdb_txn_abort(this->txn);
+    Stats::count(COUNTER_TXN_ABORTS);
+  }
+  this->rollback();
+  this->end();
+}
+
+void BTTransaction::on_abort(std::function<void()> undo) {
+  if (!this->owned)
+    this->outer->on_abort(undo);
+  else
+    this->undo_log.push_back(undo);
+}
+
+// protected
+void BTTransaction::end() {
+  if (this->holds_lock)
+    DbEnv::unlock_shared();
+  this->holds_lock = false;
+  this->txn = nullptr;
+  if (active == this)
+    active = this->outer;
+}
+
+void BTTransaction::rollback() {
+  for (auto undo = this->undo_log.rbegin(); undo != this->undo_log.rend(); undo++)
+    (*undo)();
+  this->undo_log.clear();
+}
+
+//// ReadSnapshot
+std::mutex ReadSnapshot::registry_mutex;
+std::map<const ReadSnapshot *, ReadSnapshot::Info> ReadSnapshot::registry;
+
+ReadSnapshot::ReadSnapshot(const std::string &label) : BTTransaction(MDB_RDONLY) {
+  if (!this->owned)
+    return;  // part of the transaction already active, which is what is being read from
+  std::ostringstream thread;
+  thread << std::this_thread::get_id();
+  Info info{label, thread.str(), mdb_txn_id(this->txn), std::chrono::steady_clock::now()};
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry[this] = info;
+}
+
+// a read-only transaction has nothing to undo, so ending it is a commit (not counted as an abort)
+ReadSnapshot::~ReadSnapshot() {
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(this);
+  }
+  try {
+    this->commit();
+  } catch (DbException &e) {
+    // the base destructor aborts it instead
+  }
+}
+
+std::vector<ReadSnapshot::Info> ReadSnapshot::list() {
+  std::vector<Info> snapshots;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto const &entry : registry)
+      snapshots.push_back(entry.second);
+  }
+  std::sort(snapshots.begin(), snapshots.end(),
+            [](const Info &a, const Info &b) { return a.started < b.started; });
+  return snapshots;
+}
+
 //// SlottedPage
 // public
 
@@ -24,7 +173,7 @@ SlottedPage::SlottedPage(const SlottedPage &other)
 	end_free = other.end_free;
 }
 
-RecordID SlottedPage::add(const MDB_val *data) {
+RecordID SlottedPage::add(const MDB_val *data, RecordKind kind) {
   if (!has_room(data->mv_size))
     throw DbBlockNoRoomError("not enough room for new record");
   u_int16_t id = ++this->num_records;
@@ -32,7 +181,8 @@ RecordID SlottedPage::add(const MDB_val *data) {
   this->end_free -= size;
   u_int16_t loc = this->end_free + 1;
   put_header(); // update global header
-  put_header(id, size, loc);
+  put_n(4 * id, size | kind); // the header may hold old bytes, kind bits and all
+  put_n(4 * id + 2, loc);
   memcpy(this->address(loc), data->mv_data, size);
   return id;
 }
@@ -48,6 +198,17 @@ MDB_val *SlottedPage::get(RecordID record_id) {
   return new MDB_val(size, this->address(loc));
 }
 
+bool SlottedPage::get(RecordID record_id, MDB_val &data) {
+  u_int16_t size;
+  u_int16_t loc;
+  this->get_header(size, loc, record_id);
+  if (loc == 0)
+    return false;
+  data.mv_size = size;
+  data.mv_data = this->address(loc);
+  return true;
+}
+
 // Replace the data at record_id with new MDB_val
 void SlottedPage::put(RecordID record_id, const MDB_val &data) {
   u_int16_t size;
@@ -56,9 +217,8 @@ void SlottedPage::put(RecordID record_id, const MDB_val &data) {
   u_int16_t new_size = data.mv_size;
   if (new_size > size) {
     int extra = new_size - size;
-    if (!this->has_room(extra)) {
-      throw "Not enough room in block";
-    }
+    if (!this->has_room(extra))
+      throw DbBlockNoRoomError("not enough room to grow record");
     // OLD: this->slide(loc + new_size, loc + size);
     this->slide(loc, loc - extra);
     // OLD: memmove(this->address(loc - extra), data.get_data(), new_size);
@@ -81,6 +241,12 @@ void SlottedPage::del(RecordID record_id) {
   this->put_header(record_id, 0, 0);
 }
 
+void SlottedPage::del(const RecordIDs &record_ids) {
+  for (RecordID record_id : record_ids)
+    this->put_header(record_id, 0, 0);
+  this->compact();
+}
+
 // Get existing record_ids in SlottedPage, make sure to deallocate
 RecordIDs *SlottedPage::ids(void) {
   RecordIDs *record_ids = new RecordIDs();
@@ -95,10 +261,89 @@ RecordIDs *SlottedPage::ids(void) {
   return record_ids;
 }
 
+u_int16_t SlottedPage::used_bytes(void) {
+  u_int16_t headers = 4 * (this->num_records + 1);
+  return headers + (DbBlock::BLOCK_SZ - 1 - this->end_free);
+}
+
+u_int16_t SlottedPage::tombstones(void) {
+  u_int16_t count = 0;
+  for (RecordID id = 1; id <= this->num_records; id++) {
+    u_int16_t size;
+    u_int16_t loc;
+    this->get_header(size, loc, id);
+    if (loc == 0)
+      count++;
+  }
+  return count;
+}
+
+u_int16_t SlottedPage::live_records(void) {
+  return this->num_records - this->tombstones() - this->forwards();
+}
+
+u_int16_t SlottedPage::forwards(void) {
+  u_int16_t count = 0;
+  for (RecordID id = 1; id <= this->num_records; id++)
+    count += this->get_kind(id) == FORWARD;
+  return count;
+}
+
+SlottedPage::RecordKind SlottedPage::get_kind(RecordID record_id) {
+  u_int16_t size, loc;
+  this->get_header(size, loc, record_id);
+  if (loc == 0)
+    return ROW;
+  return (RecordKind)(this->get_n(4 * record_id) & (MOVED | FORWARD));
+}
+
+void SlottedPage::set_kind(RecordID record_id, RecordKind kind) {
+  u_int16_t size, loc;
+  this->get_header(size, loc, record_id);
+  this->put_n(4 * record_id, size | kind);
+}
+
+bool SlottedPage::get_row(RecordID record_id, MDB_val &data, Handle &handle) {
+  if (!this->get(record_id, data))
+    return false;
+  switch (this->get_kind(record_id)) {
+  case FORWARD:
+    return false;
+  case MOVED:
+    handle = get_handle(data.mv_data);
+    data.mv_data = (char *)data.mv_data + HANDLE_SZ;
+    data.mv_size -= HANDLE_SZ;
+    return true;
+  default:
+    handle = Handle(this->block_id, record_id);
+    return true;
+  }
+}
+
+Handle SlottedPage::get_forward(RecordID record_id) {
+  MDB_val data;
+  if (!this->get(record_id, data) || this->get_kind(record_id) != FORWARD)
+    throw DbRelationError("record " + std::to_string(record_id) + " is not a forwarding stub");
+  return get_handle(data.mv_data);
+}
+
+void SlottedPage::put_handle(char *bytes, Handle handle) {
+  memcpy(bytes, &handle.first, sizeof(BlockID));
+  memcpy(bytes + sizeof(BlockID), &handle.second, sizeof(RecordID));
+}
+
+Handle SlottedPage::get_handle(const void *bytes) {
+  Handle handle;
+  memcpy(&handle.first, bytes, sizeof(BlockID));
+  memcpy(&handle.second, (const char *)bytes + sizeof(BlockID), sizeof(RecordID));
+  return handle;
+}
+
 // protected
 // Check if SlottedPage has room
 bool SlottedPage::has_room(u_int16_t size) {
-  u_int16_t available = this->end_free - (this->num_records + 2) * 4;
+  // signed: once the headers reach end_free this would wrap around as a u_int16_t
+  int available = this->end_free - (this->num_records + 2) * 4;
   return size <= available;
 };
 
@@ -128,6 +373,28 @@ void SlottedPage::slide(u_int16_t start, u_int16_t end) {
     put_header();
 }
 
+void SlottedPage::compact(void) {
+  std::vector<std::pair<u_int16_t, RecordID>> live; // (offset, id), the last-lying first
+  for (RecordID id = 1; id <= this->num_records; id++) {
+    u_int16_t size, loc;
+    this->get_header(size, loc, id);
+    if (loc != 0)
+      live.push_back({loc, id});
+  }
+  std::sort(live.rbegin(), live.rend());
+  u_int16_t end = DbBlock::BLOCK_SZ; // just past where the next record goes
+  for (auto const &[loc, id] : live) {
+    u_int16_t size, ignored;
+    this->get_header(size, ignored, id);
+    end -= size;
+    if (end != loc)
+      memmove(this->address(end), this->address(loc), size);
+    this->put_header(id, size, end);
+  }
+  this->end_free = end - 1;
+  this->put_header();
+}
+
 // Get 2-byte integer at given offset in block.
 u_int16_t SlottedPage::get_n(u_int16_t offset) {
   return *(u_int16_t *)this->address(offset);
@@ -143,12 +410,14 @@ void *SlottedPage::address(u_int16_t offset) {
   return (void *)((char *)this->block.mv_data + offset);
 }
 
-// Store the size and offset for given id. For id of zero, store the block
-// header.
+// Store the size and offset for given id, keeping a live record's kind. For id of zero,
+// store the block header.
 void SlottedPage::put_header(RecordID id, u_int16_t size, u_int16_t loc) {
   if (id == 0) { // called the put_header() version and using the default params
     size = this->num_records;
     loc = this->end_free;
+  } else if (loc != 0) {
+    size |= get_n(4 * id) & (MOVED | FORWARD);
   }
   put_n(4 * id, size);
   put_n(4 * id + 2, loc);
@@ -159,6 +428,8 @@ void SlottedPage::get_header(u_int16_t &size, u_int16_t &loc, RecordID id) {
   // headers are 4 bytes in size
   size = get_n(4 * id);
   loc = get_n(4 * id + 2);
+  if (id != 0)
+    size &= ~(MOVED | FORWARD);
 };
 
 //// BTFile
@@ -166,16 +437,26 @@ void SlottedPage::get_header(u_int16_t &size, u_int16_t &loc, RecordID id) {
 
 // Create a new block
 void BTFile::create(void) {
-  this->db_open(MDB_CREATE);
+  this->db_open(MDB_CREATE | MDB_INTEGERKEY); // block ids sort as numbers
   SlottedPage *block = this->get_new();
   this->put(block);
   delete block;
 };
 
-// Drop this current file, remove the db file
+// Drop this current file: its database and every block in it
 void BTFile::drop(void) {
-  this->close();
-  std::remove(this->dbfilename.c_str());
+  this->open();
+  MDB_txn *txn = this->begin();
+  int status = mdb_drop(txn, this->dbi, 1);
+  if (status) {
+    this->abort(txn);
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  status = this->end(txn);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  this->closed = true;
+  this->last = 0;
 };
 
 // Open current file
@@ -184,68 +465,267 @@ void BTFile::open(void) { this->db_open(); }; // Create the named databse if it
 // Close current file
 void BTFile::close(void) {
 
-  MDB_txn *txn = nullptr;
-  mdb_txn_begin(_MDB_ENV, nullptr, 0, &txn);
+  MDB_txn *txn = this->begin();
   mdb_dbi_close(_MDB_ENV, this->dbi);
-  mdb_txn_commit(txn);
+  this->end(txn);
 
   this->closed = true;
 };
 
 // Allocate a new block and give it a block_id, make sure to deallocate
 SlottedPage *BTFile::get_new(void) {
+  StatTimer timer(STAT_FILE_GET_NEW);
   char block[DbBlock::BLOCK_SZ];
   memset(block, 0, sizeof(block));
   MDB_val data(sizeof(block), block);
   int block_id = ++this->last;
   MDB_val key(sizeof(block_id), &block_id);
-  SlottedPage *page = new SlottedPage(data, this->last, true);
+  SlottedPage fresh(data, this->last, true);
 
-  MDB_txn *txn = nullptr;
-  mdb_txn_begin(_MDB_ENV, nullptr, 0, &txn);
-  mdb_put(txn, this->dbi, &key, &data, 0);
-  mdb_get(txn, this->dbi, &key, &data);
-  mdb_txn_commit(txn);
+  int status;
+  do {
+    MDB_txn *txn = this->begin();
+    status = mdb_put(txn, this->dbi, &key, &data, 0);
+    if (status)
+      this->abort(txn);
+    else
+      status = this->end(txn);
+  } while (this->retry(status));
+  if (status) {
+    this->last--;
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  if (BTTransaction::current() != nullptr) {
+    u_int32_t previous = this->last - 1;
+    BTTransaction::current()->on_abort([this, previous]() { this->last = previous; });
+  }
 
-  return page;
+  return new SlottedPage(fresh); // the caller's page must outlive this stack buffer
 };
 
+// Whether a page can be handed out where LMDB keeps it: only while a read-only transaction
+// (a ReadSnapshot) holds it. Anywhere else the transaction that found it may end, and a writer
+// reuse its memory, before the caller is done with it.
+static bool snapshot_holds_pages() {
+  BTTransaction *active = BTTransaction::current();
+  return active != nullptr && active->is_read_only();
+}
+
 // Get an existing block from the file, make sure to deallocate
 SlottedPage *BTFile::get(BlockID block_id) {
-  char block[DbBlock::BLOCK_SZ];
-  memset(block, 0, sizeof(block));
-  MDB_val data(sizeof(block), block);
+  StatTimer timer(STAT_FILE_GET);
+  MDB_val data;
   MDB_val key(sizeof(BlockID), &block_id);
 
-  MDB_txn *txn = nullptr;
-  mdb_txn_begin(_MDB_ENV, nullptr, 0, &txn);
-  mdb_get(txn, this->dbi, &key, &data);
-  mdb_txn_commit(txn);
+  MDB_txn *txn = this->begin(MDB_RDONLY);
+  int status = mdb_get(txn, this->dbi, &key, &data);
+  SlottedPage *block = nullptr;
+  if (status == 0) {
+    SlottedPage stored(data, block_id);
+    block = snapshot_holds_pages() ? new SlottedPage(data, block_id) : new SlottedPage(stored);
+  }
+  this->end(txn);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status)); // e.g. a stale handle
+  Stats::count(COUNTER_BLOCKS_READ);
+  return block;
+};
+
+// The active write transaction, if a page reserved in it stays put until it ends: only under
+// MDB_WRITEMAP, where the reservation is the map itself. Otherwise it is a dirty page on the
+// heap, good only until the next put, which may spill it (and callers hold several pages
+// while writing others, the row count and zone maps).
+static BTTransaction *in_place_transaction() {
+  BTTransaction *active = BTTransaction::current();
+  unsigned int flags = 0;
+  mdb_env_get_flags(_MDB_ENV, &flags);
+  if (active == nullptr || active->is_read_only() || !(flags & MDB_WRITEMAP))
+    return nullptr;
+  return active;
+}
 
+// Get an existing block to modify where LMDB will store it, make sure to deallocate
+SlottedPage *BTFile::get_for_write(BlockID block_id) {
+  BTTransaction *active = in_place_transaction();
+  if (active == nullptr) {
+    SlottedPage *block = this->get(block_id);
+    if (!snapshot_holds_pages())
+      return block; // already a copy of its own
+    SlottedPage *copy = new SlottedPage(*block); // we can't modify the block directly
+    delete block;
+    return copy;
+  }
+  StatTimer timer(STAT_FILE_GET);
+  MDB_val key(sizeof(BlockID), &block_id);
+  MDB_val stored, data(DbBlock::BLOCK_SZ, nullptr);
+  int status = mdb_get(active->get_txn(), this->dbi, &key, &stored);
+  if (status == 0)
+    status = mdb_put(active->get_txn(), this->dbi, &key, &data, MDB_RESERVE);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  // the old version of a block last written by an earlier transaction is still in the map (a
+  // page freed by this one isn't reused before it commits); one already reserved by this
+  // transaction is reserved again in place, so it's the same buffer
+  memmove(data.mv_data, stored.mv_data, DbBlock::BLOCK_SZ);
+  Stats::count(COUNTER_BLOCKS_READ);
   return new SlottedPage(data, block_id);
-};
+}
+
+// Allocate a new block in the buffer LMDB reserves for it, make sure to deallocate
+SlottedPage *BTFile::get_new_for_write(void) {
+  BTTransaction *active = in_place_transaction();
+  if (active == nullptr)
+    return this->get_new();
+  StatTimer timer(STAT_FILE_GET_NEW);
+  BlockID block_id = this->last + 1;
+  MDB_val key(sizeof(block_id), &block_id);
+  MDB_val data(DbBlock::BLOCK_SZ, nullptr);
+  int status = mdb_put(active->get_txn(), this->dbi, &key, &data, MDB_RESERVE);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  memset(data.mv_data, 0, DbBlock::BLOCK_SZ); // reserved space isn't cleared
+  u_int32_t previous = this->last++;
+  active->on_abort([this, previous]() { this->last = previous; });
+  return new SlottedPage(data, block_id, true);
+}
 
 // Replace an existing block in the file
 void BTFile::put(DbBlock *block) {
+  StatTimer timer(STAT_FILE_PUT);
   BlockID block_id(block->get_block_id());
   MDB_val key(sizeof(BlockID), &block_id);
   MDB_val data(DbBlock::BLOCK_SZ, block->get_data());
 
-  MDB_txn *txn = nullptr;
-  mdb_txn_begin(_MDB_ENV, nullptr, 0, &txn);
-  mdb_put(txn, this->dbi, &key, &data, 0); // Maybe use MDB_append here?
-  mdb_txn_commit(txn);
+  int status;
+  do {
+    MDB_txn *txn = this->begin();
+    MDB_val stored;
+    if (in_place_transaction() != nullptr && mdb_get(txn, this->dbi, &key, &stored) == 0
+        && stored.mv_data == data.mv_data) {
+      Stats::count(COUNTER_PAGES_IN_PLACE); // changed where it is stored: already written
+      status = this->end(txn);
+      continue;
+    }
+    status = mdb_put(txn, this->dbi, &key, &data, 0); // Maybe use MDB_append here?
+    if (status)
+      this->abort(txn);
+    else
+      status = this->end(txn);
+  } while (this->retry(status));
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
 };
 
+void BTFile::append(DbBlock *block) {
+  StatTimer timer(STAT_FILE_PUT);
+  BlockID block_id(block->get_block_id());
+  MDB_val key(sizeof(BlockID), &block_id);
+  MDB_val data(DbBlock::BLOCK_SZ, block->get_data());
+
+  int status;
+  do {
+    MDB_txn *txn = this->begin();
+    // in a file from before block ids sorted as numbers, each 256th one sorts before the ids
+    // already there
+    MDB_cursor *cursor;
+    MDB_val last_key, last_data;
+    unsigned int flags = 0;
+    status = mdb_cursor_open(txn, this->dbi, &cursor);
+    if (status == 0) {
+      status = mdb_cursor_get(cursor, &last_key, &last_data, MDB_LAST);
+      if (status == MDB_NOTFOUND || (status == 0 && mdb_cmp(txn, this->dbi, &key, &last_key) > 0))
+        flags = MDB_APPEND;
+      mdb_cursor_close(cursor);
+      status = 0;
+    }
+    if (status == 0)
+      status = mdb_put(txn, this->dbi, &key, &data, flags);
+    if (status)
+      this->abort(txn);
+    else
+      status = this->end(txn);
+  } while (this->retry(status));
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  u_int32_t previous = this->last;
+  this->last = block_id;
+  if (BTTransaction::current() != nullptr)
+    BTTransaction::current()->on_abort([this, previous]() { this->last = previous; });
+}
+
 // Get existing block_ids in the file, make sure to deallocate
 BlockIDs *BTFile::block_ids() {
+  this->open();
   BlockIDs *block_ids = new BlockIDs;
-  for (u_int32_t i = 1; i <= this->last; i++) {
-    block_ids->push_back(i);
-  }
+  BTTransaction txn(MDB_RDONLY);
+  this->walk(txn.get_txn(), 0, [block_ids](BlockID block_id, MDB_val &) {
+    block_ids->push_back(block_id);
+    return true;
+  });
+  txn.commit();
   return block_ids;
 };
 
+// Get the blocks that follow after (0 for the first), in key order, make sure to deallocate;
+// each is a copy of its own unless a read snapshot holds it
+bool BTFile::get_blocks(BlockID after, size_t count, std::vector<SlottedPage *> &blocks) {
+  StatTimer timer(STAT_FILE_GET);
+  this->open();
+  blocks.clear();
+  bool in_place = snapshot_holds_pages(); // an outer one: txn itself ends with this call
+  BTTransaction txn(MDB_RDONLY);
+  this->walk(txn.get_txn(), after, [&blocks, count, in_place](BlockID block_id, MDB_val &data) {
+    SlottedPage stored(data, block_id);
+    blocks.push_back(in_place ? new SlottedPage(data, block_id) : new SlottedPage(stored));
+    return blocks.size() < count;
+  });
+  txn.commit();
+  Stats::count(COUNTER_BLOCKS_READ, blocks.size());
+  return !blocks.empty();
+}
+
+void BTFile::get_stats(BTFileStats &stats) {
+  this->open();
+  BTTransaction txn(MDB_RDONLY);
+  int status = mdb_stat(txn.get_txn(), this->dbi, &stats.db);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+
+  stats.blocks = 0;
+  stats.records = stats.tombstones = stats.forwards = stats.used_bytes = 0;
+  stats.min_fill = stats.max_fill = 0.0;
+  this->walk(txn.get_txn(), 0, [&stats](BlockID block_id, MDB_val &data) {
+    SlottedPage page(data, block_id);
+    RecordIDs *record_ids = page.ids();
+    u_int16_t used = page.used_bytes();
+    double fill = (double)used / DbBlock::BLOCK_SZ;
+    stats.min_fill = stats.blocks == 0 ? fill : std::min(stats.min_fill, fill);
+    stats.max_fill = std::max(stats.max_fill, fill);
+    stats.blocks++;
+    u_int16_t forwards = page.forwards();
+    stats.records += record_ids->size() - forwards;
+    stats.tombstones += page.tombstones();
+    stats.forwards += forwards;
+    stats.used_bytes += used;
+    delete record_ids;
+    return true;
+  });
+  txn.commit();
+}
+
+u_int64_t BTFile::count_records() {
+  this->open();
+  BTTransaction txn(MDB_RDONLY);
+  u_int64_t records = 0;
+  this->walk(txn.get_txn(), 0, [&records](BlockID block_id, MDB_val &data) {
+    SlottedPage page(data, block_id); // reads the headers in place
+    records += page.live_records();
+    return true;
+  });
+  txn.commit();
+  return records;
+}
+
 // protected
 void BTFile::db_open(uint flags) {
   if (!this->closed)
@@ -255,45 +735,226 @@ void BTFile::db_open(uint flags) {
   mdb_env_get_path(_MDB_ENV, &path);
   dbfilename = path + name + ".mdb";
 
-  // make TXN
-  MDB_txn *txn = nullptr;
-  mdb_txn_begin(_MDB_ENV, nullptr, 0, &txn);
+  // make TXN (only creating needs a write one, so a file can be opened under a read snapshot)
+  MDB_txn *txn = this->begin(flags & MDB_CREATE ? 0 : MDB_RDONLY);
 
   // open dbi
   int status = mdb_dbi_open(txn, dbfilename.c_str(), flags, &dbi);
 
   if (status) {
-		if (status == MDB_NOTFOUND) {
-			mdb_txn_abort(txn);
+		this->abort(txn);
+		if (status == MDB_NOTFOUND)
 			throw DbException(status, std::generic_category(), "FILE DOES NOT EXIST");
-		}
+		throw DbException(status, std::generic_category(), mdb_strerror(status));
 	}
 
-  // get stats
-  MDB_stat stats;
-  mdb_stat(txn, dbi, &stats);
-  last = stats.ms_entries;
+  // the highest block id is the last key, unless the file is from before block ids sorted
+  // as numbers: then every key is looked at
+  unsigned int db_flags = 0;
+  mdb_dbi_flags(txn, dbi, &db_flags);
+  MDB_cursor *cursor;
+  status = mdb_cursor_open(txn, dbi, &cursor);
+  if (status == 0) {
+    MDB_val key, data;
+    last = 0;
+    status = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+    while (status == 0) {
+      last = std::max(last, *(BlockID *)key.mv_data);
+      status = db_flags & MDB_INTEGERKEY ? MDB_NOTFOUND : mdb_cursor_get(cursor, &key, &data, MDB_PREV);
+    }
+    mdb_cursor_close(cursor);
+  }
+  if (status != MDB_NOTFOUND) {
+    this->abort(txn);
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
 
   // clean up
-  mdb_txn_commit(txn);
+  status = this->end(txn);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
   this->closed = false;
+  // a handle opened in a transaction that is rolled back is gone with it
+  if (BTTransaction::current() != nullptr)
+    BTTransaction::current()->on_abort([this]() { this->closed = true; });
 };
 
+// Begin a transaction for a single file operation, or use the active BTTransaction
+MDB_txn *BTFile::begin(uint flags) {
+  BTTransaction *active = BTTransaction::current();
+  if (active != nullptr) {
+    if (active->is_read_only() && !(flags & MDB_RDONLY))
+      throw DbException(EACCES, std::generic_category(), "write inside a read-only transaction");
+    return active->get_txn();
+  }
+  StatTimer timer(STAT_TXN_BEGIN);
+  DbEnv::lock_shared();
+  MDB_txn *txn = nullptr;
+  int status = mdb_txn_begin(_MDB_ENV, nullptr, flags, &txn);
+  if (status) {
+    DbEnv::unlock_shared();
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  return txn;
+}
+
+// Commit a transaction from begin(); an active BTTransaction is left to its owner
+int BTFile::end(MDB_txn *txn) {
+  if (BTTransaction::current() != nullptr)
+    return 0;
+  StatTimer timer(STAT_TXN_COMMIT);
+  int status = mdb_txn_commit(txn);
+  DbEnv::unlock_shared();
+  if (status) {
+    timer.fail();
+    Stats::count(COUNTER_TXN_ABORTS);
+  }
+  return status;
+}
+
+void BTFile::abort(MDB_txn *txn) {
+  if (BTTransaction::current() != nullptr)
+    return;
+  mdb_txn_abort(txn);
+  DbEnv::unlock_shared();
+  Stats::count(COUNTER_TXN_ABORTS);
+}
+
+// Whether a failed write can be retried: only our own transaction, and only if the map could grow
+bool BTFile::retry(int status) {
+  return status == MDB_MAP_FULL && BTTransaction::current() == nullptr && DbEnv::grow();
+}
+
+// One cursor down the leaves: the blocks after block after (0 for all of them), until visit
+// says to stop. Resuming from a key rather than from the next id works in either key order.
+void BTFile::walk(MDB_txn *txn, BlockID after, const std::function<bool(BlockID, MDB_val &)> &visit) {
+  MDB_cursor *cursor;
+  int status = mdb_cursor_open(txn, this->dbi, &cursor);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  MDB_val key(sizeof(after), &after), data;
+  status = mdb_cursor_get(cursor, &key, &data, after == 0 ? MDB_FIRST : MDB_SET_RANGE);
+  if (status == 0 && after != 0 && *(BlockID *)key.mv_data == after)
+    status = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+  try {
+    while (status == 0 && visit(*(BlockID *)key.mv_data, data))
+      status = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+  } catch (...) {
+    mdb_cursor_close(cursor);
+    throw;
+  }
+  mdb_cursor_close(cursor);
+  if (status && status != MDB_NOTFOUND)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+}
+
 //// BTTable
+
+// The _row_counts database: table name -> number of rows (a u_int64_t). Opening a
+// database already open in the environment just looks its handle up.
+static std::mutex side_db_mutex;
+
+// Open a database kept beside the tables (_row_counts, _zone_maps) in txn, creating it if
+// asked; false if it doesn't exist yet
+static bool open_side_db(MDB_txn *txn, const char *name, bool create, MDB_dbi &dbi) {
+  std::lock_guard<std::mutex> lock(side_db_mutex); // LMDB wants handles opened one at a time
+  int status = mdb_dbi_open(txn, name, create ? MDB_CREATE : 0, &dbi);
+  if (status == MDB_NOTFOUND)
+    return false;
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  return true;
+}
+
+static bool open_row_counts(MDB_txn *txn, bool create, MDB_dbi &dbi) {
+  return open_side_db(txn, "_row_counts", create, dbi);
+}
+
+static bool open_zone_maps(MDB_txn *txn, bool create, MDB_dbi &dbi) {
+  return open_side_db(txn, "_zone_maps", create, dbi);
+}
+
+// table name, a 0 byte, then the block id big-endian, so a table's zone maps are together and in block order
+static std::string zone_key(const Identifier &table_name, BlockID block_id) {
+  std::string key = table_name;
+  key += '\0';
+  for (int shift = 24; shift >= 0; shift -= 8)
+    key += (char)(block_id >> shift);
+  return key;
+}
+
+// zone map flag: the block has no live records
+static const u_char ZONE_EMPTY = 1;
+
+// 64-bit FNV-1a, then MurmurHash3's finalizer to spread it over all the bits; it's stored
+// (as bit positions in Bloom filters), so it mustn't change
+static u_int64_t bloom_hash(const char *bytes, size_t size) {
+  u_int64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++)
+    h = (h ^ (u_char)bytes[i]) * 1099511628211ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// the k bits of a value in a filter of bits bits, from two halves of its hash (Kirsch-Mitzenmacher)
+template <typename F> static void bloom_bits(u_int64_t hash, uint k, size_t bits, F f) {
+  u_int32_t h1 = (u_int32_t)hash, h2 = (u_int32_t)(hash >> 32) | 1;
+  for (uint i = 0; i < k; i++)
+    f((h1 + (u_int64_t)i * h2) % bits);
+}
+
 // public
 BTTable::BTTable(Identifier table_name, ColumnNames column_names,
                      ColumnAttributes column_attributes)
-    : DbRelation(table_name, column_names, column_attributes), file(table_name){
+    : DbRelation(table_name, column_names, column_attributes), file(table_name), bloom_bits_per_row(0) {
+  const EnvConfig &config = DbEnv::get_config();
+  ColumnNames chosen;
+  for (auto const &column_name : this->column_names)
+    if (config.has_bloom_filter(this->table_name, column_name))
+      chosen.push_back(column_name);
+  this->set_bloom_filters(chosen, config.bloom_bits);
+}
 
-                                                               };
+void BTTable::set_bloom_filters(const ColumnNames &column_names, uint bits_per_row) {
+  this->bloom_columns.clear();
+  this->bloom_bits_per_row = bits_per_row;
+  for (auto const &column_name : column_names) {
+    auto it = std::find(this->column_names.begin(), this->column_names.end(), column_name);
+    if (it == this->column_names.end())
+      throw DbRelationError("unknown column " + column_name);
+    size_t col_num = it - this->column_names.begin();
+    if (this->column_attributes[col_num].get_data_type() != ColumnAttribute::TEXT)
+      throw DbRelationError("Bloom filters are only kept on TEXT columns, not " + column_name);
+    this->bloom_columns.push_back(col_num);
+  }
+  std::sort(this->bloom_columns.begin(), this->bloom_columns.end()); // in column order, as put_block meets them
+  if (bits_per_row == 0)
+    this->bloom_columns.clear();
+}
 
-void BTTable::create() { this->file.create(); }
+bool BTTable::has_bloom_filter(const Identifier &column_name) const {
+  for (size_t col_num : this->bloom_columns)
+    if (this->column_names[col_num] == column_name)
+      return true;
+  return false;
+}
+
+void BTTable::create() {
+  BTTransaction txn;
+  this->file.create();
+  this->put_row_count(0);
+  txn.commit();
+}
 
 void BTTable::create_if_not_exists() { 
 	try {
 		this->file.open(); 
 	} catch (DbException &e) {
-		this->file.create();
+		this->create(); // subclasses seed their rows in create()
 	}
 }
 
@@ -301,62 +962,262 @@ void BTTable::open() { this->file.open(); }
 
 void BTTable::close() { this->file.close(); }
 
-void BTTable::drop() { this->file.drop(); }
+void BTTable::drop() {
+  BTTransaction txn;
+  MDB_dbi dbi;
+  MDB_val key(this->table_name.size(), this->table_name.data());
+  if (open_row_counts(txn.get_txn(), false, dbi)) {
+    int status = mdb_del(txn.get_txn(), dbi, &key, nullptr);
+    if (status && status != MDB_NOTFOUND)
+      throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  if (open_zone_maps(txn.get_txn(), false, dbi)) {
+    std::string prefix = zone_key(this->table_name, 0).substr(0, this->table_name.size() + 1);
+    MDB_cursor *cursor;
+    int status = mdb_cursor_open(txn.get_txn(), dbi, &cursor);
+    if (status)
+      throw DbException(status, std::generic_category(), mdb_strerror(status));
+    MDB_val zone, data;
+    while (true) { // the first of the table's zone maps left, each time
+      zone = MDB_val(prefix.size(), prefix.data());
+      status = mdb_cursor_get(cursor, &zone, &data, MDB_SET_RANGE);
+      if (status || zone.mv_size <= prefix.size() || memcmp(zone.mv_data, prefix.data(), prefix.size()) != 0)
+        break;
+      status = mdb_cursor_del(cursor, 0);
+      if (status)
+        break;
+    }
+    mdb_cursor_close(cursor);
+    if (status && status != MDB_NOTFOUND)
+      throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  this->file.drop();
+  txn.commit();
+}
 
 Handle BTTable::insert(const ValueDict *row) {
+  StatTimer timer(STAT_TABLE_INSERT);
+  this->open();
+  ValueDict *full_row = validate(row);
+  Handle handle;
+  try {
+    DbEnv::write_transaction([&]() { // the row and the row count go in together
+      u_int64_t rows = this->count_rows();
+      handle = this->append(full_row);
+      this->put_row_count(rows + 1);
+    });
+  } catch (...) {
+    delete full_row;
+    throw;
+  }
+  delete full_row;
+  return handle;
+}
+
+Handles *BTTable::insert(const ValueDicts *rows) {
+  StatTimer timer(STAT_TABLE_INSERT);
   this->open();
-  return this->append(validate(row));
+  Handles *handles = new Handles();
+  handles->reserve(rows->size());
+  char bytes[DbBlock::BLOCK_SZ];
+  try {
+    DbEnv::write_transaction([&]() { // the rows and the row count go in together
+      handles->clear(); // repeated from scratch if the map has to grow part way through
+      u_int64_t count = this->count_rows();
+      SlottedPage *page = nullptr;
+      try {
+        page = this->file.get_for_write(this->file.get_last_block_id());
+        for (auto const &row : *rows) {
+          MDB_val data(marshal(row, bytes), bytes);
+          RecordID record_id;
+          try {
+            record_id = page->add(&data);
+          } catch (const DbBlockNoRoomError &e) {
+            this->put_block(page);
+            delete page;
+            page = nullptr;
+            page = this->file.get_new_for_write();
+            record_id = page->add(&data);
+          }
+          handles->push_back(Handle(page->get_block_id(), record_id));
+        }
+        this->put_block(page);
+        this->put_row_count(count + handles->size());
+      } catch (...) {
+        delete page;
+        throw;
+      }
+      delete page;
+    });
+  } catch (...) {
+    delete handles;
+    throw;
+  }
+  return handles;
 }
 
-// not required for Milestone 2
-void BTTable::update(const Handle handle, const ValueDict *new_values){};
+void BTTable::update(const Handle handle, const ValueDict *new_values) {
+  Handles handles = {handle};
+  this->update(&handles, new_values);
+}
 
-void BTTable::del(const Handle handle){
-	BlockID block_id = handle.first;
-	RecordID record_id = handle.second;
-	SlottedPage *block = this->file.get(block_id);
-	SlottedPage block_copy(*block);
+void BTTable::update(const Handles *handles, const ValueDict *new_values) {
+  StatTimer timer(STAT_TABLE_UPDATE);
+  this->open();
+  for (auto const &[column_name, value] : *new_values) {
+    auto it = std::find(this->column_names.begin(), this->column_names.end(), column_name);
+    if (it == this->column_names.end())
+      throw DbRelationError("unknown column " + column_name);
+    if (value.data_type != this->column_attributes[it - this->column_names.begin()].get_data_type())
+      throw DbRelationError("wrong type of value for column " + column_name);
+  }
+  std::map<BlockID, RecordIDs> home_blocks;
+  for (auto const &handle : *handles)
+    home_blocks[handle.first].push_back(handle.second);
+  for (auto const &[block_id, record_ids] : home_blocks) {
+    DbEnv::write_transaction([&]() {
+      std::map<BlockID, SlottedPage *> pages;
+      try {
+        for (RecordID record_id : record_ids)
+          this->update_row(Handle(block_id, record_id), new_values, pages);
+        for (auto const &[page_id, page] : pages)
+          this->put_block(page);
+      } catch (...) {
+        for (auto const &[page_id, page] : pages)
+          delete page;
+        throw;
+      }
+      for (auto const &[page_id, page] : pages)
+        delete page;
+    });
+  }
+}
 
-	block_copy.del(record_id);
-	this->file.put(&block_copy);
-	// delete block?
-};
+void BTTable::del(const Handle handle) {
+  Handles handles = {handle};
+  this->del(&handles);
+}
+
+void BTTable::del(const Handles *handles) {
+  StatTimer timer(STAT_TABLE_DELETE);
+  this->open();
+  std::map<BlockID, std::set<RecordID>> home_blocks;
+  for (auto const &handle : *handles)
+    home_blocks[handle.first].insert(handle.second);
+  DbEnv::write_transaction([&]() { // the rows and the row count go in together
+    u_int64_t rows = this->count_rows(), deleted = 0;
+    std::map<BlockID, RecordIDs> doomed; // records to go, by block: rows, stubs and the rows they point to
+    std::map<BlockID, SlottedPage *> pages;
+    auto page = [this, &pages](BlockID block_id) {
+      SlottedPage *&block = pages[block_id];
+      if (block == nullptr)
+        block = this->file.get_for_write(block_id);
+      return block;
+    };
+    try {
+      for (auto const &[block_id, record_ids] : home_blocks) {
+        SlottedPage *home = page(block_id);
+        MDB_val data;
+        for (RecordID record_id : record_ids) {
+          if (!home->get(record_id, data))
+            continue; // already deleted
+          if (home->get_kind(record_id) == SlottedPage::FORWARD) {
+            Handle moved = home->get_forward(record_id);
+            doomed[moved.first].push_back(moved.second);
+          }
+          doomed[block_id].push_back(record_id);
+          deleted++;
+        }
+      }
+      for (auto const &[block_id, record_ids] : doomed) {
+        SlottedPage *block = page(block_id);
+        block->del(record_ids);
+        this->put_block(block);
+      }
+      this->put_row_count(rows - std::min(rows, deleted));
+    } catch (...) {
+      for (auto const &[block_id, block] : pages)
+        delete block;
+      throw;
+    }
+    for (auto const &[block_id, block] : pages)
+      delete block;
+  });
+}
 
 // Select all, return existing handles in this table
 Handles *BTTable::select() {
+  StatTimer timer(STAT_TABLE_SELECT);
   Handles *handles = new Handles();
-  BlockIDs *block_ids = file.block_ids();
-  for (auto const &block_id : *block_ids) {
-    SlottedPage *block = file.get(block_id);
-    RecordIDs *record_ids = block->ids();
-    for (auto const &record_id : *record_ids)
-      handles->push_back(Handle(block_id, record_id));
-    delete record_ids;
-    delete block;
+  std::vector<SlottedPage *> blocks;
+  BlockID after = 0;
+  while (file.get_blocks(after, BTTableCursor::BLOCK_WINDOW, blocks)) {
+    for (SlottedPage *block : blocks) {
+      RecordIDs *record_ids = block->ids();
+      MDB_val data;
+      Handle handle;
+      for (auto const &record_id : *record_ids)
+        if (block->get_row(record_id, data, handle)) // a moved row by its own handle, where it now is
+          handles->push_back(handle);
+      delete record_ids;
+      after = block->get_block_id();
+      delete block;
+    }
   }
-  delete block_ids;
+  Stats::count(COUNTER_ROWS_SELECTED, handles->size());
   return handles;
 };
 
-// not required for Milestone 2
+// Select the rows equal to where in each of its columns, passing over blocks by their zone
+// maps (and Bloom filters)
 Handles *BTTable::select(const ValueDict *where) {
+  StatTimer timer(STAT_TABLE_SELECT);
   Handles *handles = new Handles();
-  BlockIDs *block_ids = file.block_ids();
-  for (auto const &block_id : *block_ids) {
-    SlottedPage *block = file.get(block_id);
-    RecordIDs *record_ids = block->ids();
-    for (auto const &record_id : *record_ids) {
-		Handle handle(block_id, record_id);
-	    if (selected(handle, where))
-      		handles->push_back(Handle(block_id, record_id));
-	}
-    delete record_ids;
-    delete block;
+  ScanBounds bounds;
+  if (where != nullptr) {
+    for (auto const &[column_name, value] : *where) {
+      if (value.data_type == ColumnAttribute::INT)
+        bounds.restrict(column_name, value.n, value.n);
+      else if (value.data_type == ColumnAttribute::TEXT)
+        bounds.restrict(column_name, value.s);
+    }
+  }
+  BTTableCursor zones(*this, bounds);
+  std::vector<SlottedPage *> blocks;
+  BlockID after = 0;
+  while (file.get_blocks(after, BTTableCursor::BLOCK_WINDOW, blocks)) {
+    for (SlottedPage *block : blocks) {
+      after = block->get_block_id();
+      if (zones.skip(after)) {
+        Stats::count(COUNTER_BLOCKS_SKIPPED);
+        delete block;
+        continue;
+      }
+      RecordIDs *record_ids = block->ids();
+      MDB_val data;
+      Handle handle;
+      for (auto const &record_id : *record_ids) {
+        if (block->get_row(record_id, data, handle) && selected(handle, where))
+          handles->push_back(handle);
+      }
+      delete record_ids;
+      delete block;
+    }
   }
-  delete block_ids;
+  Stats::count(COUNTER_ROWS_SELECTED, handles->size());
   return handles;
 }
 
+DbCursor *BTTable::cursor() {
+  this->open();
+  return new BTTableCursor(*this);
+}
+
+DbCursor *BTTable::cursor(const ScanBounds &bounds) {
+  this->open();
+  return new BTTableCursor(*this, bounds);
+}
+
 // Display the row with the associated handle
 ValueDict *BTTable::project(Handle handle) {
   return this->project(handle, &this->column_names);
@@ -364,19 +1225,52 @@ ValueDict *BTTable::project(Handle handle) {
 
 // Display the row with the associated handle and its column names
 ValueDict *BTTable::project(Handle handle, const ColumnNames *column_names) {
+  StatTimer timer(STAT_TABLE_PROJECT);
   BlockID block_id = handle.first;
   RecordID record_id = handle.second;
   SlottedPage *page = this->file.get(block_id);
-  ValueDict *rows = unmarshal(page->get(record_id));
+  if (page->get_kind(record_id) == SlottedPage::FORWARD) {
+    Handle moved = page->get_forward(record_id);
+    delete page;
+    page = this->file.get(moved.first);
+    record_id = moved.second;
+  }
+  MDB_val data;
+  if (!page->get_row(record_id, data, handle)) {
+    delete page;
+    throw DbRelationError("no row at block " + std::to_string(block_id) + " record " + std::to_string(record_id));
+  }
+  ValueDict *rows = unmarshal(&data);
+  delete page;
   ValueDict *p_rows = new ValueDict();
   for (const auto &column_name : *column_names) {
     if (rows->find(column_name) != rows->end()) {
       (*p_rows)[column_name] = (*rows)[column_name];
     }
   }
+  delete rows;
   return p_rows;
 };
 
+void BTTable::get_stats(BTFileStats &stats) {
+  this->file.get_stats(stats);
+}
+
+u_int64_t BTTable::count_rows() {
+  this->open();
+  BTTransaction txn(MDB_RDONLY);
+  MDB_dbi dbi;
+  u_int64_t rows;
+  MDB_val key(this->table_name.size(), this->table_name.data());
+  MDB_val data;
+  if (open_row_counts(txn.get_txn(), false, dbi) && mdb_get(txn.get_txn(), dbi, &key, &data) == 0)
+    memcpy(&rows, data.mv_data, sizeof(rows));
+  else
+    rows = this->file.count_records(); // a table from before row counts were kept
+  txn.commit();
+  return rows;
+}
+
 // protected
 // Check if row can be inserted, throw exception if unable to
 ValueDict *BTTable::validate(const ValueDict *row) {
@@ -392,26 +1286,238 @@ ValueDict *BTTable::validate(const ValueDict *row) {
   return full_row;
 };
 
+void BTTable::put_row_count(u_int64_t rows) {
+  BTTransaction txn;
+  MDB_dbi dbi;
+  open_row_counts(txn.get_txn(), true, dbi);
+  MDB_val key(this->table_name.size(), this->table_name.data());
+  MDB_val data(sizeof(rows), &rows);
+  int status = mdb_put(txn.get_txn(), dbi, &key, &data, 0);
+  if (status)
+    throw DbException(status, std::generic_category(), mdb_strerror(status));
+  txn.commit();
+}
+
+void BTTable::put_block(SlottedPage *page, bool is_new) {
+  BTTransaction txn;
+  if (is_new)
+    this->file.append(page);
+  else
+    this->file.put(page);
+  size_t ints = std::count_if(this->column_attributes.begin(), this->column_attributes.end(),
+                              [](const ColumnAttribute &ca) { return ca.get_data_type() == ColumnAttribute::INT; });
+  if (ints > 0 || !this->bloom_columns.empty()) {
+    // flags, then min and max of each INT column
+    std::vector<int32_t> bounds(2 * ints);
+    for (size_t i = 0; i < ints; i++) {
+      bounds[2 * i] = INT32_MAX;
+      bounds[2 * i + 1] = INT32_MIN;
+    }
+    RecordIDs *record_ids = page->ids();
+    size_t rows = page->live_records(); // forwarding stubs aside
+    u_char flags = rows == 0 ? ZONE_EMPTY : 0;
+
+    // then for each Bloom filter column: column number (u16), k (u8), size in bytes (u16), the bits
+    uint hashes = std::clamp((uint)(this->bloom_bits_per_row * 0.69 + 0.5), 1U, 16U);
+    size_t bloom_size = std::clamp((rows * this->bloom_bits_per_row + 7) / 8, (size_t)8, (size_t)UINT16_MAX);
+    std::vector<std::string> blooms(this->bloom_columns.size(), std::string(bloom_size, '\0'));
+
+    MDB_val data;
+    Handle handle;
+    for (auto const &record_id : *record_ids) {
+      if (!page->get_row(record_id, data, handle))
+        continue;
+      const char *bytes = (const char *)data.mv_data;
+      uint offset = 0;
+      size_t i = 0, bloom = 0;
+      for (size_t col_num = 0; col_num < this->column_attributes.size(); col_num++) {
+        if (this->column_attributes[col_num].get_data_type() == ColumnAttribute::INT) {
+          int32_t n;
+          memcpy(&n, bytes + offset, sizeof(int32_t));
+          offset += sizeof(int32_t);
+          bounds[2 * i] = std::min(bounds[2 * i], n);
+          bounds[2 * i + 1] = std::max(bounds[2 * i + 1], n);
+          i++;
+        } else {
+          u_int16_t size;
+          memcpy(&size, bytes + offset, sizeof(u_int16_t));
+          offset += sizeof(u_int16_t);
+          if (bloom < this->bloom_columns.size() && this->bloom_columns[bloom] == col_num) {
+            std::string &bits = blooms[bloom++];
+            bloom_bits(bloom_hash(bytes + offset, size), hashes, bloom_size * 8,
+                       [&bits](size_t bit) { bits[bit / 8] |= (char)(1 << bit % 8); });
+          }
+          offset += size;
+        }
+      }
+    }
+    delete record_ids;
+    std::string zone(1, (char)flags);
+    zone.append((const char *)bounds.data(), bounds.size() * sizeof(int32_t));
+    for (size_t bloom = 0; bloom < blooms.size(); bloom++) {
+      u_int16_t col_num = this->bloom_columns[bloom], size = bloom_size;
+      zone.append((const char *)&col_num, sizeof(col_num));
+      zone += (char)hashes;
+      zone.append((const char *)&size, sizeof(size));
+      zone += blooms[bloom];
+    }
+
+    MDB_dbi dbi;
+    open_zone_maps(txn.get_txn(), true, dbi);
+    std::string key = zone_key(this->table_name, page->get_block_id());
+    MDB_val k(key.size(), key.data()), v(zone.size(), zone.data());
+    int status = mdb_put(txn.get_txn(), dbi, &k, &v, 0);
+    if (status)
+      throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  txn.commit();
+}
+
+bool BTTable::zone_excludes(const MDB_val &zone, const ScanBounds &bounds) {
+  const char *bytes = (const char *)zone.mv_data;
+  if (bytes[0] & ZONE_EMPTY)
+    return true;
+  size_t ints = 0;
+  for (auto const &ca : this->column_attributes)
+    if (ca.get_data_type() == ColumnAttribute::INT)
+      ints++;
+  for (auto const &[column_name, range] : bounds.int_ranges) {
+    if (range.first > range.second)
+      return true;
+    size_t i = 0;
+    for (size_t col_num = 0; col_num < this->column_names.size(); col_num++) {
+      if (this->column_attributes[col_num].get_data_type() != ColumnAttribute::INT)
+        continue;
+      if (this->column_names[col_num] == column_name) {
+        int32_t min, max;
+        memcpy(&min, bytes + 1 + 2 * i * sizeof(int32_t), sizeof(int32_t));
+        memcpy(&max, bytes + 1 + (2 * i + 1) * sizeof(int32_t), sizeof(int32_t));
+        if (max < range.first || min > range.second)
+          return true;
+        break;
+      }
+      i++;
+    }
+  }
+  if (bounds.text_values.empty())
+    return false;
+
+  // the Bloom filters the block was written with (not necessarily the table's now)
+  const char *bloom = bytes + 1 + 2 * ints * sizeof(int32_t), *end = bytes + zone.mv_size;
+  while (bloom < end) {
+    u_int16_t col_num, size;
+    memcpy(&col_num, bloom, sizeof(col_num));
+    uint k = (u_char)bloom[sizeof(col_num)];
+    memcpy(&size, bloom + sizeof(col_num) + 1, sizeof(size));
+    const char *bits = bloom + sizeof(col_num) + 1 + sizeof(size);
+    bloom = bits + size;
+    if (col_num >= this->column_names.size())
+      break;
+    auto value = bounds.text_values.find(this->column_names[col_num]);
+    if (value == bounds.text_values.end())
+      continue;
+    Stats::count(COUNTER_BLOOM_PROBES);
+    bool maybe = true;
+    bloom_bits(bloom_hash(value->second.data(), value->second.size()), k, (size_t)size * 8,
+               [&maybe, bits](size_t bit) { maybe = maybe && (bits[bit / 8] >> bit % 8 & 1); });
+    if (!maybe) {
+      Stats::count(COUNTER_BLOOM_SKIPS);
+      return true;
+    }
+  }
+  return false;
+}
+
 // Add a new row to the file
 Handle BTTable::append(const ValueDict *row) {
   RecordID record_id;
   BlockID block_id = this->file.get_last_block_id();
   MDB_val *data = marshal(row); // row we want to insert
-  SlottedPage *page = this->file.get(block_id); // we can't modify the block directly
-  SlottedPage page_copy(*page);
+  SlottedPage *page = this->file.get_for_write(block_id);
 
   try {
-    record_id = page_copy.add(data);
+    record_id = page->add(data);
   } catch (const DbBlockNoRoomError &e) {
-	throw DbException(404, std::generic_category(), "BLOCK OVER FILL NOT IMPLEMENTED!");
-    // page_copy = this->file.get_new(); 
-    // record_id = page_copy.add(data);
+    delete page;
+    page = this->file.get_new_for_write();
+    block_id = page->get_block_id();
+    record_id = page->add(data);
   }
 
-  this->file.put(&page_copy);
+  this->put_block(page);
+  delete page;
+  delete[] (char *) data->mv_data;
+  delete data;
   return {block_id, record_id};
 };
 
+// Rewrite the row in place if it still fits; if not, move it (with its home handle) to the
+// last block, or a new one, and point its home's stub there
+void BTTable::update_row(Handle handle, const ValueDict *new_values, std::map<BlockID, SlottedPage *> &pages) {
+  auto page = [this, &pages](BlockID block_id) {
+    SlottedPage *&block = pages[block_id];
+    if (block == nullptr)
+      block = this->file.get_for_write(block_id);
+    return block;
+  };
+  SlottedPage *home = page(handle.first);
+  Handle at = handle; // where the row is
+  if (home->get_kind(handle.second) == SlottedPage::FORWARD)
+    at = home->get_forward(handle.second);
+  SlottedPage *current = page(at.first);
+  MDB_val data;
+  Handle known;
+  if (!current->get_row(at.second, data, known))
+    return; // deleted
+
+  // the row, after its home handle in case it has to (or already did) move
+  char bytes[SlottedPage::HANDLE_SZ + DbBlock::BLOCK_SZ];
+  ValueDict *row = this->unmarshal(&data);
+  for (auto const &[column_name, value] : *new_values)
+    (*row)[column_name] = value;
+  uint size;
+  try {
+    size = this->marshal(row, bytes + SlottedPage::HANDLE_SZ);
+  } catch (...) {
+    delete row;
+    throw;
+  }
+  delete row;
+  SlottedPage::put_handle(bytes, handle);
+  MDB_val moved_row(SlottedPage::HANDLE_SZ + size, bytes);
+  bool moved = at != handle;
+  try {
+    if (moved)
+      current->put(at.second, moved_row);
+    else
+      current->put(at.second, MDB_val(size, bytes + SlottedPage::HANDLE_SZ));
+    return;
+  } catch (const DbBlockNoRoomError &e) {
+    // outgrown its block
+  }
+
+  SlottedPage *target = page(this->file.get_last_block_id());
+  RecordID record_id;
+  try {
+    record_id = target->add(&moved_row, SlottedPage::MOVED);
+  } catch (const DbBlockNoRoomError &e) {
+    target = this->file.get_new_for_write();
+    pages[target->get_block_id()] = target;
+    record_id = target->add(&moved_row, SlottedPage::MOVED);
+  }
+  char stub[SlottedPage::HANDLE_SZ];
+  SlottedPage::put_handle(stub, Handle(target->get_block_id(), record_id));
+  if (moved)
+    current->del(at.second);
+  try {
+    home->put(handle.second, MDB_val(sizeof(stub), stub)); // the same size as a stub already there
+  } catch (const DbBlockNoRoomError &e) {
+    throw DbRelationError("no room in block " + std::to_string(handle.first) + " for a forwarding stub");
+  }
+  home->set_kind(handle.second, SlottedPage::FORWARD);
+  Stats::count(COUNTER_ROWS_MOVED);
+}
+
 bool BTTable::selected(Handle handle, const ValueDict *where) {
 	if (where == nullptr)
 		return true;
@@ -425,17 +1531,38 @@ MDB_val *BTTable::marshal(const ValueDict *row) {
   char *bytes =
       new char[DbBlock::BLOCK_SZ]; // more than we need (we insist that one row
                                    // fits into DbBlock::BLOCK_SZ)
+  uint offset;
+  try {
+    offset = marshal(row, bytes);
+  } catch (...) {
+    delete[] bytes;
+    throw;
+  }
+  char *right_size_bytes = new char[offset];
+  memcpy(right_size_bytes, bytes, offset);
+  delete[] bytes;
+  MDB_val *data = new MDB_val(offset, right_size_bytes);
+  return data;
+}
+
+uint BTTable::marshal(const ValueDict *row, char *bytes) {
   uint offset = 0;
   uint col_num = 0;
   for (auto const &column_name : this->column_names) {
     ColumnAttribute ca = this->column_attributes[col_num++];
     ValueDict::const_iterator column = row->find(column_name);
-    Value value = column->second;
+    if (column == row->end())
+      throw DbRelationError("don't know how to handle NULLs, defaults, etc. yet");
+    const Value &value = column->second;
     if (ca.get_data_type() == ColumnAttribute::DataType::INT) {
+      if (offset + sizeof(int32_t) > DbBlock::BLOCK_SZ)
+        throw DbRelationError("row too big to marshal");
       *(int32_t *)(bytes + offset) = value.n;
       offset += sizeof(int32_t);
     } else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT) {
       uint size = value.s.length();
+      if (offset + sizeof(u_int16_t) + size > DbBlock::BLOCK_SZ)
+        throw DbRelationError("row too big to marshal");
       *(u_int16_t *)(bytes + offset) = size;
       offset += sizeof(u_int16_t);
       memcpy(bytes + offset, value.s.c_str(), size); // assume ascii for now
@@ -444,14 +1571,59 @@ MDB_val *BTTable::marshal(const ValueDict *row) {
       throw DbRelationError("Only know how to marshal INT and TEXT");
     }
   }
-  char *right_size_bytes = new char[offset];
-  memcpy(right_size_bytes, bytes, offset);
-  delete[] bytes;
-  MDB_val *data = new MDB_val(offset, right_size_bytes);
-  return data;
+  return offset;
+}
+
+uint BTTable::marshal(const std::vector<std::string_view> &fields, char *bytes) {
+  if (fields.size() != this->column_names.size())
+    throw DbRelationError(std::to_string(fields.size()) + " values for " + std::to_string(this->column_names.size())
+                          + " columns");
+  uint offset = 0;
+  for (uint col_num = 0; col_num < fields.size(); col_num++) {
+    std::string_view field = fields[col_num];
+    if (this->column_attributes[col_num].get_data_type() == ColumnAttribute::DataType::INT) {
+      int32_t n;
+      auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), n);
+      if (error != std::errc() || end != field.data() + field.size())
+        throw DbRelationError("bad INT '" + std::string(field) + "' for column " + this->column_names[col_num]);
+      if (offset + sizeof(int32_t) > DbBlock::BLOCK_SZ)
+        throw DbRelationError("row too big to marshal");
+      memcpy(bytes + offset, &n, sizeof(int32_t));
+      offset += sizeof(int32_t);
+    } else {
+      u_int16_t size = field.size();
+      if (field.size() > UINT16_MAX || offset + sizeof(u_int16_t) + size > DbBlock::BLOCK_SZ)
+        throw DbRelationError("row too big to marshal");
+      memcpy(bytes + offset, &size, sizeof(u_int16_t));
+      offset += sizeof(u_int16_t);
+      memcpy(bytes + offset, field.data(), size);
+      offset += size;
+    }
+  }
+  return offset;
+}
+
+void BTTable::unmarshal(const MDB_val &data, ColumnBatch &batch) {
+  Stats::count(COUNTER_BYTES_UNMARSHALLED, data.mv_size);
+  uint offset = 0;
+  const char *bytes = (const char *)data.mv_data;
+  for (uint col_num = 0; col_num < this->column_names.size(); col_num++) {
+    if (this->column_attributes[col_num].get_data_type() == ColumnAttribute::DataType::INT) {
+      memcpy(&batch.ints[col_num][batch.size], bytes + offset, sizeof(int32_t));
+      offset += sizeof(int32_t);
+    } else {
+      u_int16_t size;
+      memcpy(&size, bytes + offset, sizeof(u_int16_t));
+      offset += sizeof(u_int16_t);
+      batch.texts[col_num][batch.size].assign(bytes + offset, size);
+      offset += size;
+    }
+  }
+  batch.size++;
 }
 
 ValueDict *BTTable::unmarshal(MDB_val *data) {
+  Stats::count(COUNTER_BYTES_UNMARSHALLED, data->mv_size);
   ValueDict *row = new ValueDict();
   uint offset = 0;
   uint col_num = 0;
@@ -459,14 +1631,14 @@ ValueDict *BTTable::unmarshal(MDB_val *data) {
   for (auto const &column_name : this->column_names) {
     ColumnAttribute ca = this->column_attributes[col_num++];
     if (ca.get_data_type() == ColumnAttribute::DataType::INT) {
-      (*row)[column_name].n = *(int32_t *)(bytes + offset);
+      (*row)[column_name] = Value(*(int32_t *)(bytes + offset));
       offset += sizeof(int32_t);
     } else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT) {
       u_int16_t size;
       memcpy(&size, bytes + offset, sizeof(u_int16_t));
       offset += sizeof(u_int16_t);
       std::string text(bytes + offset, size);
-      (*row)[column_name].s = text;
+      (*row)[column_name] = Value(text);
       offset += size;
     } else {
       throw DbRelationError("Only know how to unmarshal INT and TEXT");
@@ -474,3 +1646,178 @@ ValueDict *BTTable::unmarshal(MDB_val *data) {
   }
   return row;
 };
+
+//// BTTableCursor
+
+BTTableCursor::BTTableCursor(BTTable &table, const ScanBounds &bounds)
+    : table(table), bounds(bounds), block_id(0), last(table.file.get_last_block_id()), next_block(0),
+      page(nullptr), record_ids(nullptr), position(0), zone_maps(-1), zone_dbi(0), window_start(0) {}
+
+BTTableCursor::~BTTableCursor() {
+  for (size_t i = this->next_block; i < this->blocks.size(); i++)
+    delete this->blocks[i];
+  delete this->record_ids;
+  delete this->page;
+}
+
+// make sure there is a record to read, moving on to the next page if need be
+bool BTTableCursor::advance() {
+  while (this->record_ids == nullptr || this->position == this->record_ids->size()) {
+    delete this->record_ids;
+    delete this->page;
+    this->record_ids = nullptr;
+    this->page = nullptr;
+    if (this->next_block == this->blocks.size()) {
+      this->next_block = 0;
+      if (!this->table.file.get_blocks(this->block_id, BLOCK_WINDOW, this->blocks))
+        return false;
+    }
+    SlottedPage *block = this->blocks[this->next_block++];
+    this->block_id = block->get_block_id();
+    if (this->block_id > this->last) { // added since the scan began
+      delete block;
+      continue;
+    }
+    if (this->skip(this->block_id)) {
+      delete block;
+      Stats::count(COUNTER_BLOCKS_SKIPPED);
+      continue;
+    }
+    this->page = block;
+    this->record_ids = this->page->ids();
+    this->position = 0;
+    Stats::count(COUNTER_ROWS_SELECTED, this->record_ids->size());
+  }
+  return true;
+}
+
+bool BTTableCursor::skip(BlockID block_id) {
+  if (this->bounds.empty() || this->zone_maps == 0)
+    return false;
+  if (block_id < this->window_start || block_id >= this->window_start + this->excluded.size())
+    this->read_zones(block_id);
+  return this->excluded[block_id - this->window_start];
+}
+
+void BTTableCursor::read_zones(BlockID block_id) {
+  this->window_start = block_id;
+  this->excluded.assign(ZONE_WINDOW, false); // a block without a zone map is read
+  BTTransaction txn(MDB_RDONLY);
+  if (this->zone_maps < 0)
+    this->zone_maps = open_zone_maps(txn.get_txn(), false, this->zone_dbi) ? 1 : 0;
+  if (this->zone_maps == 1) {
+    MDB_cursor *cursor;
+    int status = mdb_cursor_open(txn.get_txn(), this->zone_dbi, &cursor);
+    if (status)
+      throw DbException(status, std::generic_category(), mdb_strerror(status));
+    std::string start = zone_key(this->table.table_name, block_id);
+    size_t prefix = this->table.table_name.size() + 1;
+    MDB_val key(start.size(), start.data()), zone;
+    status = mdb_cursor_get(cursor, &key, &zone, MDB_SET_RANGE);
+    while (status == 0 && key.mv_size == start.size() && memcmp(key.mv_data, start.data(), prefix) == 0) {
+      const u_char *id = (const u_char *)key.mv_data + prefix;
+      BlockID zone_block = (BlockID)id[0] << 24 | (BlockID)id[1] << 16 | (BlockID)id[2] << 8 | id[3];
+      if (zone_block >= block_id + ZONE_WINDOW)
+        break;
+      this->excluded[zone_block - block_id] = this->table.zone_excludes(zone, this->bounds);
+      status = mdb_cursor_get(cursor, &key, &zone, MDB_NEXT);
+    }
+    mdb_cursor_close(cursor);
+    if (status && status != MDB_NOTFOUND)
+      throw DbException(status, std::generic_category(), mdb_strerror(status));
+  }
+  txn.commit();
+}
+
+// the next row, passing over forwarding stubs (a moved row is met where it now is)
+bool BTTableCursor::next(Handle &handle, ValueDict *&row) {
+  MDB_val data;
+  do {
+    if (!this->advance())
+      return false;
+  } while (!this->page->get_row((*this->record_ids)[this->position++], data, handle));
+  row = this->table.unmarshal(&data);
+  return true;
+}
+
+bool BTTableCursor::next_batch(ColumnBatch &batch) {
+  if (batch.column_names != this->table.column_names)
+    batch.reset(this->table.column_names, this->table.column_attributes);
+  batch.clear();
+  MDB_val data;
+  Handle handle;
+  while (!batch.full() && this->advance()) {
+    if (this->page->get_row((*this->record_ids)[this->position++], data, handle))
+      this->table.unmarshal(data, batch);
+  }
+  batch.select_all();
+  return batch.size > 0;
+}
+
+//// BTTableLoader
+
+BTTableLoader::BTTableLoader(BTTable &table)
+    : table(table), page(nullptr), rows(0), written(0), page_rows(0), full_rows(0), table_rows(0) {
+  this->table.open();
+  this->table_rows = this->table.count_rows();
+  SlottedPage *last = this->table.file.get(this->table.file.get_last_block_id());
+  this->page = new SlottedPage(*last); // we can't modify the block directly
+  delete last;
+}
+
+BTTableLoader::~BTTableLoader() {
+  for (SlottedPage *full_page : this->full)
+    delete full_page;
+  delete this->page;
+}
+
+void BTTableLoader::add(const std::vector<std::string_view> &fields) {
+  MDB_val data(this->table.marshal(fields, this->bytes), this->bytes);
+  try {
+    this->page->add(&data);
+  } catch (const DbBlockNoRoomError &e) {
+    BlockID block_id = this->page->get_block_id() + 1;
+    this->full.push_back(this->page);
+    this->full_rows += this->page_rows;
+    this->page = nullptr;
+    this->page_rows = 0;
+    if (this->full.size() == PAGES_PER_TXN)
+      this->write(false);
+    char block[DbBlock::BLOCK_SZ];
+    memset(block, 0, sizeof(block));
+    MDB_val fresh_data(sizeof(block), block);
+    SlottedPage fresh(fresh_data, block_id, true);
+    this->page = new SlottedPage(fresh); // its own copy of the block
+    this->page->add(&data);
+  }
+  this->page_rows++;
+  this->rows++;
+}
+
+void BTTableLoader::finish() {
+  this->write(true);
+}
+
+// write the full pages, and with all, the one being filled too
+void BTTableLoader::write(bool all) {
+  std::vector<SlottedPage *> pages(this->full);
+  u_int64_t new_rows = this->full_rows;
+  if (all && this->page != nullptr) {
+    pages.push_back(this->page);
+    new_rows += this->page_rows;
+  }
+  BTFile &file = this->table.file;
+  DbEnv::write_transaction([&]() {
+    for (SlottedPage *written : pages)
+      this->table.put_block(written, written->get_block_id() > file.get_last_block_id());
+    this->table.put_row_count(this->table_rows + new_rows);
+  });
+  this->table_rows += new_rows;
+  this->written += new_rows;
+  for (SlottedPage *full_page : this->full)
+    delete full_page;
+  this->full.clear();
+  this->full_rows = 0;
+  if (all)
+    this->page_rows = 0; // written, though still being filled
+}
@@ -9,7 +9,12 @@
  */
 #pragma once
 
+#include <chrono>
 #include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string_view>
 #include <lmdb++.h>
 #include "storage_engine.h"
 
@@ -26,6 +31,10 @@
             Bytes 0x04 - 0x05: size of record 1
             Bytes 0x06 - 0x07: offset to record 1
             etc.
+
+        The top two bits of a record's size give its kind (see RecordKind): a row that
+        outgrows its block moves to another, leaving a forwarding stub behind so that its
+        handle stays good.
  *
  */
 class SlottedPage : public DbBlock {
@@ -42,16 +51,67 @@ public:
 
     SlottedPage &operator=(SlottedPage &temp) = delete;
 
-    virtual RecordID add(const MDB_val *data);
+    enum RecordKind : u_int16_t {
+        ROW = 0,           // a row, known by its own handle
+        MOVED = 0x4000,    // a row moved here from its home: the home handle, then the row
+        FORWARD = 0x8000   // a forwarding stub at a moved row's home: the handle it moved to
+    };
+
+    // bytes of a handle in a stub or a moved row
+    static const u_int16_t HANDLE_SZ = sizeof(BlockID) + sizeof(RecordID);
+
+    virtual RecordID add(const MDB_val *data) { return add(data, ROW); }
+
+    virtual RecordID add(const MDB_val *data, RecordKind kind);
 
     virtual MDB_val *get(RecordID record_id);
 
+    // the record's bytes where they lie in the block, without allocating; false if deleted
+    virtual bool get(RecordID record_id, MDB_val &data);
+
+    /**
+     * Replace a record's bytes, keeping its kind.
+     * @throws DbBlockNoRoomError if it has grown by more than the block has room for
+     */
     virtual void put(RecordID record_id, const MDB_val &data);
 
     virtual void del(RecordID record_id);
 
+    // delete several records, then close up the gaps they leave in one pass
+    virtual void del(const RecordIDs &record_ids);
+
+    virtual RecordKind get_kind(RecordID record_id);
+
+    virtual void set_kind(RecordID record_id, RecordKind kind);
+
+    /**
+     * A row's bytes where they lie in the block (past a moved row's home handle), and the
+     * handle it is known by.
+     * @returns  false for a deleted record or a forwarding stub (the row is read where it went)
+     */
+    virtual bool get_row(RecordID record_id, MDB_val &data, Handle &handle);
+
+    // the handle a forwarding stub points to
+    virtual Handle get_forward(RecordID record_id);
+
+    static void put_handle(char *bytes, Handle handle);
+
+    static Handle get_handle(const void *bytes);
+
     virtual RecordIDs *ids(void);
 
+    // bytes in use by the block header, record headers and live records
+    virtual u_int16_t used_bytes(void);
+
+    // record ids whose records have been deleted (headers that are still taking up room)
+    virtual u_int16_t tombstones(void);
+
+    // rows not deleted (forwarding stubs aside), counted from the record headers alone
+    virtual u_int16_t live_records(void);
+
+    // forwarding stubs
+    virtual u_int16_t forwards(void);
+
 protected:
     u_int16_t num_records;
     u_int16_t end_free;
@@ -64,6 +124,9 @@ protected:
 
     virtual void slide(u_int16_t start, u_int16_t end);
 
+    // move the live records up against the end of the block, in the order they lie
+    virtual void compact(void);
+
     virtual u_int16_t get_n(u_int16_t offset);
 
     virtual void put_n(u_int16_t offset, u_int16_t n);
@@ -71,6 +134,118 @@ protected:
     virtual void *address(u_int16_t offset);
 };
 
+/**
+ * @class BTTransaction - scoped LMDB transaction shared by every BTFile call on this thread.
+ *
+ *      While a BTTransaction is alive, BTFile operations on the same thread run inside it
+ *      instead of beginning and committing their own transaction, so several page reads and
+ *      writes can be made atomic. A second BTTransaction joins the active one, unless its
+ *      scope says otherwise (see Scope). Uncommitted transactions abort when the scope ends.
+ */
+class BTTransaction {
+public:
+    // how a transaction begun while another is active on this thread relates to it
+    enum Scope {
+        JOIN,     // run inside it (a write can't join a read-only one, so it is SEPARATE instead)
+        NESTED,   // a child transaction, committed into or aborted out of it
+        SEPARATE  // a top-level transaction of its own, seeing everything committed since
+    };
+
+    BTTransaction(uint flags = 0, Scope scope = JOIN);
+
+    virtual ~BTTransaction();
+
+    BTTransaction(const BTTransaction &other) = delete;
+
+    BTTransaction(BTTransaction &&temp) = delete;
+
+    BTTransaction &operator=(const BTTransaction &other) = delete;
+
+    BTTransaction &operator=(BTTransaction &&temp) = delete;
+
+    virtual void commit();
+
+    virtual void abort();
+
+    virtual MDB_txn *get_txn() { return txn; }
+
+    virtual bool is_read_only() { return read_only; }
+
+    /**
+     * Register a callback that undoes in-memory state tied to this transaction
+     * (e.g. a file's last block id) if it is rolled back. Callbacks run newest first.
+     */
+    virtual void on_abort(std::function<void()> undo);
+
+    /**
+     * The innermost transaction active on this thread, or nullptr.
+     */
+    static BTTransaction *current() { return active; }
+
+protected:
+    MDB_txn *txn;
+    BTTransaction *outer;
+    Scope scope;
+    bool owned;
+    bool read_only;
+    bool holds_lock;  // a shared hold on DbEnv's resize lock, taken by the outermost transaction
+    std::vector<std::function<void()>> undo_log;
+
+    virtual void end();
+
+    virtual void rollback();
+
+    static thread_local BTTransaction *active;
+};
+
+/**
+ * @class ReadSnapshot - a read-only BTTransaction held for a whole statement, so that every
+ *      page it fetches comes from one consistent state of the database and none of them pays
+ *      to begin a transaction of its own. Writers carry on meanwhile (LMDB readers and
+ *      writers don't wait for each other), but the pages their commits free can't be reused
+ *      while a snapshot older than them is open, so a long-lived one makes the file grow.
+ *      Open snapshots are listed process-wide with their age and how many commits behind
+ *      they are, for SHOW READERS to point out the stale ones. A snapshot begun inside
+ *      another transaction joins it.
+ *
+ *      While a snapshot is open the map can't be resized: a write beneath it (a spill, say)
+ *      that fills the map fails instead of growing it.
+ */
+class ReadSnapshot : public BTTransaction {
+public:
+    struct Info {
+        std::string label;   // what the snapshot is for, e.g. the plan it runs
+        std::string thread;
+        size_t txn_id;       // the last commit the snapshot sees
+        std::chrono::steady_clock::time_point started;
+    };
+
+    explicit ReadSnapshot(const std::string &label);
+
+    virtual ~ReadSnapshot();
+
+    // the snapshots open in this process, oldest first
+    static std::vector<Info> list();
+
+protected:
+    static std::mutex registry_mutex;
+    static std::map<const ReadSnapshot *, Info> registry;
+};
+
+/**
+ * Physical layout of a BTFile: the LMDB B+tree holding it and the pages in it.
+ */
+struct BTFileStats {
+    MDB_stat db;             // mdb_stat of the file's database
+    u_int32_t blocks;
+    u_int64_t records;       // live rows
+    u_int64_t tombstones;    // deleted records' headers
+    u_int64_t forwards;      // forwarding stubs left by rows that moved to another block
+    u_int64_t used_bytes;    // over all blocks
+    double min_fill;         // fraction of a block in use, for the emptiest and fullest blocks
+    double max_fill;
+};
+
 class BTFile : public DbFile {
 public:
     BTFile(std::string name) : DbFile(name), dbfilename(""), last(0), closed(true), dbi(0) {}
@@ -97,12 +272,53 @@ public:
 
     virtual SlottedPage *get(BlockID block_id);
 
+    /**
+     * Get an existing block to change. Under MDB_WRITEMAP, inside a write transaction, it is
+     * changed where it is stored, in the map (reserved with MDB_RESERVE) rather than in a
+     * copy on the heap, so put() has nothing left to write, and it is good until the
+     * transaction ends. Otherwise it is a heap copy, as get() and the copy constructor give.
+     */
+    virtual SlottedPage *get_for_write(BlockID block_id);
+
+    // get_new(), likewise built in the buffer LMDB reserves for it
+    virtual SlottedPage *get_new_for_write(void);
+
+    // Write a block back, unless it was changed where it is stored (see get_for_write)
     virtual void put(DbBlock *block);
 
+    /**
+     * Write a block that isn't in the file yet, numbered get_last_block_id() + 1, as a
+     * B+tree append (MDB_APPEND) when its key sorts after every key already there.
+     */
+    virtual void append(DbBlock *block);
+
+    // the ids of the blocks in the file, walked with one cursor in one read-only transaction
     virtual BlockIDs *block_ids();
 
+    /**
+     * Get up to count blocks in key order (ascending ids) after block after, 0 for the first,
+     * with one cursor in one read-only transaction rather than a lookup each.
+     * @param blocks  returned by reference, make sure to deallocate
+     * @returns       false if there are no more
+     */
+    virtual bool get_blocks(BlockID after, size_t count, std::vector<SlottedPage *> &blocks);
+
+    // the highest block id in the file (the last key), which the next new block follows
     virtual u_int32_t get_last_block_id() { return last; }
 
+    /**
+     * Measure the file, reading every block in one read-only transaction (so writers
+     * carry on meanwhile and the numbers are from one consistent snapshot).
+     * @param stats  returned by reference
+     */
+    virtual void get_stats(BTFileStats &stats);
+
+    /**
+     * Live records in the file, counted from the block and record headers in one
+     * read-only transaction, without copying any block or decoding any record.
+     */
+    virtual u_int64_t count_records();
+
 protected:
     std::string dbfilename;
     u_int32_t last;
@@ -110,9 +326,129 @@ protected:
     MDB_dbi dbi;
 
     virtual void db_open(uint flags = 0);
+
+    virtual MDB_txn *begin(uint flags = 0);
+
+    virtual int end(MDB_txn *txn);
+
+    virtual void abort(MDB_txn *txn);
+
+    virtual bool retry(int status);
+
+    virtual void walk(MDB_txn *txn, BlockID after, const std::function<bool(BlockID, MDB_val &)> &visit);
+};
+
+class BTTable;
+
+/**
+ * @class BTTableCursor - reads a BTTable a block at a time, so a scan holds one page in
+ *      memory however big the table is, and each page is fetched once, BLOCK_WINDOW of
+ *      them to a cursor walk. Given bounds, it passes over the blocks whose zone maps show
+ *      they hold no row within them.
+ */
+class BTTableCursor : public DbCursor {
+public:
+    // zone maps read per read transaction
+    static const size_t ZONE_WINDOW = 256;
+
+    // blocks fetched per read transaction, with one cursor
+    static const size_t BLOCK_WINDOW = 256;
+
+    explicit BTTableCursor(BTTable &table, const ScanBounds &bounds = ScanBounds());
+
+    ~BTTableCursor() override;
+
+    BTTableCursor(const BTTableCursor &other) = delete;
+
+    BTTableCursor &operator=(const BTTableCursor &other) = delete;
+
+    bool next(Handle &handle, ValueDict *&row) override;
+
+    // decodes records straight from the page into the batch's columns
+    bool next_batch(ColumnBatch &batch) override;
+
+protected:
+    BTTable &table;
+    ScanBounds bounds;
+    BlockID block_id;
+    BlockID last;
+    std::vector<SlottedPage *> blocks;  // the window of blocks being read
+    size_t next_block;                  // in blocks
+    SlottedPage *page;
+    RecordIDs *record_ids;
+    size_t position;
+    int zone_maps;  // 1 if the table has zone maps open in zone_dbi, 0 if not, -1 before looking
+    MDB_dbi zone_dbi;
+    BlockID window_start;        // first block of window
+    std::vector<bool> excluded;  // for each block of the window, whether its zone map rules it out
+
+    bool advance();
+
+    // true if block_id's zone map shows it can't hold a row within bounds
+    bool skip(BlockID block_id);
+
+    // read the zone maps of ZONE_WINDOW blocks from block_id on, in one read transaction
+    void read_zones(BlockID block_id);
+
+    friend class BTTable;
+};
+
+/**
+ * @class BTTableLoader - appends rows to a BTTable in bulk, straight from text (e.g. the
+ *      fields of a CSV line).
+ *
+ *      Rows are marshalled into pages held in memory, starting with a copy of the table's
+ *      last page; full pages are written PAGES_PER_TXN at a time in one write transaction,
+ *      along with the table's row count, and new pages go in as B+tree appends where their
+ *      keys allow it. Nothing else should write the table while it is being loaded.
+ */
+class BTTableLoader {
+public:
+    // full pages written per transaction
+    static const size_t PAGES_PER_TXN = 256;
+
+    explicit BTTableLoader(BTTable &table);
+
+    // rows not yet written by finish() are dropped
+    virtual ~BTTableLoader();
+
+    BTTableLoader(const BTTableLoader &other) = delete;
+
+    BTTableLoader &operator=(const BTTableLoader &other) = delete;
+
+    /**
+     * Add a row.
+     * @param fields  the text of each column's value, in the table's column order
+     * @throws DbRelationError if the fields don't make a row of the table
+     */
+    virtual void add(const std::vector<std::string_view> &fields);
+
+    // write out every row added so far
+    virtual void finish();
+
+    // rows added
+    u_int64_t get_rows() const { return rows; }
+
+    // rows written (and committed, unless an enclosing transaction is still open)
+    u_int64_t get_written() const { return written; }
+
+protected:
+    BTTable &table;
+    char bytes[DbBlock::BLOCK_SZ];
+    SlottedPage *page;                // being filled
+    std::vector<SlottedPage *> full;  // filled, not yet written
+    u_int64_t rows;
+    u_int64_t written;
+    u_int64_t page_rows;              // rows added to page
+    u_int64_t full_rows;              // rows added to the full pages
+    u_int64_t table_rows;             // the table's rows, as of the last write
+
+    virtual void write(bool all);
 };
 
 class BTTable : public DbRelation {
+    friend class BTTableCursor;
+    friend class BTTableLoader;
 public:
     BTTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes);
 
@@ -138,31 +474,128 @@ public:
 
     virtual Handle insert(const ValueDict *row);
 
+    /**
+     * Insert rows in one transaction, marshalling each into the same buffer and filling
+     * pages in memory, so each page is written once however many rows land on it.
+     */
+    virtual Handles *insert(const ValueDicts *rows);
+
+    /**
+     * Change a row's values: in place if it still fits its block, otherwise by moving it
+     * to the table's last block (or a new one) and leaving a forwarding stub in its place,
+     * so that its handle stays good. A row that moves again is pointed to from the same
+     * stub, so reaching any row takes at most one hop.
+     * @throws DbRelationError for an unknown column or a value of the wrong type
+     */
     virtual void update(const Handle handle, const ValueDict *new_values);
 
+    /**
+     * Update rows a home block at a time: each block's rows in one transaction, in which
+     * every block they touch is read and written once.
+     */
+    virtual void update(const Handles *handles, const ValueDict *new_values);
+
+    // delete a row (and, for one that has moved, its forwarding stub)
     virtual void del(const Handle handle);
 
+    /**
+     * Delete rows in one transaction, each block's at once: every block is read, closed up
+     * once and written once, however many of its rows go.
+     */
+    virtual void del(const Handles *handles);
+
     virtual Handles *select();
 
     virtual Handles *select(const ValueDict *where);
 
+    virtual DbCursor *cursor();
+
+    // a cursor that skips blocks outside the bounds by their zone maps
+    virtual DbCursor *cursor(const ScanBounds &bounds);
+
     virtual ValueDict *project(Handle handle);
 
     virtual ValueDict *project(Handle handle, const ColumnNames *column_names);
 
 	using DbRelation::project;
 
+    virtual void get_stats(BTFileStats &stats);
+
+    /**
+     * Number of rows. A running count is kept for each table in the _row_counts database
+     * and changed in the same transaction as every insert and delete, so it is read
+     * without touching the table; a table without one is counted from its page headers.
+     */
+    virtual u_int64_t count_rows();
+
+    // row count for the planner
+    virtual u_int64_t estimate_rows() { return count_rows(); }
+
+    /**
+     * Choose the TEXT columns whose values each block's zone map keeps a Bloom filter of
+     * (by default those named by the bloom-filters option), for equality lookups to skip
+     * blocks by. Blocks get the filters as they are next written.
+     * @param bits_per_row  filter size; 0 for no filters
+     * @throws DbRelationError for an unknown or non-TEXT column
+     */
+    virtual void set_bloom_filters(const ColumnNames &column_names, uint bits_per_row);
+
+    // whether blocks get a Bloom filter of a column
+    virtual bool has_bloom_filter(const Identifier &column_name) const;
+
 protected:
     BTFile file;
+    std::vector<size_t> bloom_columns;  // column numbers, in order
+    uint bloom_bits_per_row;
 
     virtual ValueDict *validate(const ValueDict *row);
 
     virtual Handle append(const ValueDict *row);
 
+    /**
+     * Update one row among pages, the block copies being changed (by block id), to which
+     * blocks read or added are added.
+     */
+    virtual void update_row(Handle handle, const ValueDict *new_values, std::map<BlockID, SlottedPage *> &pages);
+
+    // set the running row count, in the active (or a new) write transaction
+    virtual void put_row_count(u_int64_t rows);
+
+    /**
+     * Write a block and its zone map, in the active (or a new) write transaction. The zone
+     * map, in the _zone_maps database under the table name and block id, has an empty flag,
+     * the min and max of each INT column over the block's live records, and a Bloom filter
+     * of the values of each Bloom filter column, for scans to skip the block by (a table
+     * with neither INT nor Bloom filter columns has none).
+     * @param is_new  true for a block numbered past the file's last one (see BTFile::append)
+     */
+    virtual void put_block(SlottedPage *page, bool is_new = false);
+
+    // whether a block's zone map (as put_block wrote it) shows it can't hold a row within
+    // bounds, counting the Bloom filter probes and the blocks they rule out
+    virtual bool zone_excludes(const MDB_val &zone, const ScanBounds &bounds);
+
     virtual MDB_val *marshal(const ValueDict *row);
 
+    /**
+     * Marshal a row into a caller's buffer.
+     * @param bytes  at least DbBlock::BLOCK_SZ bytes
+     * @returns      the number of bytes used
+     */
+    virtual uint marshal(const ValueDict *row, char *bytes);
+
+    /**
+     * Marshal a row given as the text of each column's value, in column order.
+     * @param bytes  at least DbBlock::BLOCK_SZ bytes
+     * @returns      the number of bytes used
+     */
+    virtual uint marshal(const std::vector<std::string_view> &fields, char *bytes);
+
     virtual ValueDict *unmarshal(MDB_val *data);
 
+    // decode a record onto the end of a batch that has this table's columns
+    virtual void unmarshal(const MDB_val &data, ColumnBatch &batch);
+
 	virtual bool selected(Handle handle, const ValueDict *where);
 };
 
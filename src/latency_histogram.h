@@ -0,0 +1,125 @@
+/**
+ * @file latency_histogram.h - fixed-size log-linear latency histogram.
+ * LatencyHistogram
+ *
+ * Keeping every sample to compute percentiles costs memory in proportion to the run
+ * length. Like HdrHistogram, this keeps counts in buckets whose width grows with the
+ * value (16 sub-buckets per power of two, so any recorded value is within ~3%), which
+ * makes recording O(1), the footprint constant, and histograms cheap to merge.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @class LatencyHistogram - counts of nanosecond latencies in log-linear buckets.
+ *
+ *      Only one thread may record into (or reset, or merge into) a histogram at a time,
+ *      typically the thread that owns it, but any thread may read or merge from it while
+ *      that happens: fields are relaxed atomics written with plain loads and stores, so
+ *      recording costs the same as it would with ordinary integers.
+ */
+class LatencyHistogram {
+public:
+    static const unsigned int SUB_BITS = 5;
+    static const unsigned int SUB_COUNT = 1U << SUB_BITS;
+    static const unsigned int BUCKETS = (64 - SUB_BITS + 1) * (SUB_COUNT / 2) + SUB_COUNT / 2;
+
+    LatencyHistogram() { reset(); }
+
+    LatencyHistogram(const LatencyHistogram &other) = delete;
+
+    LatencyHistogram &operator=(const LatencyHistogram &other) = delete;
+
+    void record(u_int64_t ns) {
+        add(counts[index_of(ns)], 1);
+        add(total, 1);
+        add(sum, ns);
+        if (ns < min_ns.load(std::memory_order_relaxed))
+            min_ns.store(ns, std::memory_order_relaxed);
+        if (ns > max_ns.load(std::memory_order_relaxed))
+            max_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (unsigned int i = 0; i < BUCKETS; i++)
+            add(counts[i], other.counts[i].load(std::memory_order_relaxed));
+        add(total, other.total.load(std::memory_order_relaxed));
+        add(sum, other.sum.load(std::memory_order_relaxed));
+        min_ns.store(std::min(min_ns.load(std::memory_order_relaxed), other.min_ns.load(std::memory_order_relaxed)),
+                     std::memory_order_relaxed);
+        max_ns.store(std::max(max_ns.load(std::memory_order_relaxed), other.max_ns.load(std::memory_order_relaxed)),
+                     std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto &count: counts)
+            count.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max_ns.store(0, std::memory_order_relaxed);
+        min_ns.store(UINT64_MAX, std::memory_order_relaxed);
+    }
+
+    u_int64_t count() const { return total.load(std::memory_order_relaxed); }
+
+    u_int64_t min() const { return count() ? min_ns.load(std::memory_order_relaxed) : 0; }
+
+    u_int64_t max() const { return max_ns.load(std::memory_order_relaxed); }
+
+    double mean() const { return count() ? (double) sum.load(std::memory_order_relaxed) / count() : 0.0; }
+
+    /**
+     * Latency at or below which the given fraction of samples fall.
+     * @param fraction  e.g. 0.99 for p99
+     * @returns         the middle of the bucket holding that sample (the exact maximum
+     *                  for the last sample), in ns
+     */
+    u_int64_t percentile(double fraction) const {
+        u_int64_t n = count();
+        if (n == 0)
+            return 0;
+        u_int64_t rank = (u_int64_t) (fraction * n + 0.5);
+        rank = std::clamp<u_int64_t>(rank, 1, n);
+        if (rank == n)
+            return max();
+        u_int64_t seen = 0;
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::clamp(middle_of(i), min(), max());
+        }
+        return max();
+    }
+
+protected:
+    std::array<std::atomic<u_int64_t>, BUCKETS> counts;
+    std::atomic<u_int64_t> total;
+    std::atomic<u_int64_t> sum;
+    std::atomic<u_int64_t> min_ns;
+    std::atomic<u_int64_t> max_ns;
+
+    // single writer, so no read-modify-write instruction is needed
+    static void add(std::atomic<u_int64_t> &field, u_int64_t n) {
+        field.store(field.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // values below SUB_COUNT get a bucket each; above, keep the top SUB_BITS bits
+    static unsigned int index_of(u_int64_t ns) {
+        if (ns < SUB_COUNT)
+            return (unsigned int) ns;
+        unsigned int shift = 63 - __builtin_clzll(ns) - (SUB_BITS - 1);
+        return (shift + 1) * (SUB_COUNT / 2) + (unsigned int) ((ns >> shift) - SUB_COUNT / 2);
+    }
+
+    static u_int64_t middle_of(unsigned int index) {
+        if (index < SUB_COUNT)
+            return index;
+        unsigned int shift = index / (SUB_COUNT / 2) - 1;
+        u_int64_t low = (u_int64_t) (index % (SUB_COUNT / 2) + SUB_COUNT / 2) << shift;
+        return low + ((1ULL << shift) >> 1);
+    }
+};
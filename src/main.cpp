@@ -5,13 +5,50 @@
 
 int main(int argc, char *argv[]) {
 
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " dbenvpath" << std::endl;
+  EnvConfig config;
+  std::vector<std::string> args(argv + 1, argv + argc);
+  // --load=TABLE:FILE loads the CSV file into the table, and then exits instead of running the shell
+  std::vector<std::pair<std::string, std::string>> loads;
+  for (auto arg = args.begin(); arg != args.end();) {
+    if (arg->rfind("--load=", 0) == 0) {
+      std::string load = arg->substr(7);
+      size_t colon = load.find(':');
+      if (colon == std::string::npos || colon == 0 || colon + 1 == load.size()) {
+        std::cerr << argv[0] << ": --load needs TABLE:FILE, not '" << load << "'" << std::endl;
+        return EXIT_FAILURE;
+      }
+      loads.emplace_back(load.substr(0, colon), load.substr(colon + 1));
+      arg = args.erase(arg);
+    } else {
+      arg++;
+    }
+  }
+  try {
+    config.parse_args(args);
+  } catch (std::invalid_argument &e) {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (args.size() != 1) {
+    std::cerr << "Usage: " << argv[0] << " [--config=FILE] [--map-size=SIZE] [--max-map-size=SIZE]"
+              << " [--max-dbs=N] [--durability=PROFILE] [--sync-interval=MS] [--work-mem=SIZE]"
+              << " [--statement-cache=N] [--bloom-filters=TABLE.COLUMN,...] [--bloom-bits=N]"
+              << " [--stale-reader=MS] [--load=TABLE:FILE ...] dbenvpath" << std::endl;
+    std::cerr << "Durability profiles:" << std::endl;
+    for (auto const &profile : EnvConfig::DURABILITY_PROFILES)
+      std::cerr << "  " << profile.name << " - " << profile.description << std::endl;
     return EXIT_FAILURE;
   }
 
   SQLShell shell;
-  shell.init(argv[1]);
+  shell.init(args[0].c_str(), config);
+  if (!loads.empty()) {
+    for (auto const &[table_name, path] : loads)
+      if (!shell.load(table_name, path))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+  }
   shell.run();
 
   return EXIT_SUCCESS;
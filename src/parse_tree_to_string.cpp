@@ -78,6 +78,24 @@ string parse_tree_to_string::operator_expression(const Expr *expr) {
         case OperatorType::kOpOr:
             ret += "OR";
             break;
+        case OperatorType::kOpEquals:
+            ret += "=";
+            break;
+        case OperatorType::kOpNotEquals:
+            ret += "<>";
+            break;
+        case OperatorType::kOpLess:
+            ret += "<";
+            break;
+        case OperatorType::kOpLessEq:
+            ret += "<=";
+            break;
+        case OperatorType::kOpGreater:
+            ret += ">";
+            break;
+        case OperatorType::kOpGreaterEq:
+            ret += ">=";
+            break;
         default:
             ret += "???";
             break;
@@ -96,9 +114,11 @@ string parse_tree_to_string::expression(const Expr *expr) {
         case ExprType::kExprColumnRef:
             if (expr->table != NULL)
                 ret += string(expr->table) + ".";
-        case ExprType::kExprLiteralString:
             ret += expr->name;
             break;
+        case ExprType::kExprLiteralString:
+            ret += string("'") + expr->name + "'";
+            break;
         case ExprType::kExprLiteralFloat:
             ret += to_string(expr->fval);
             break;
@@ -106,7 +126,12 @@ string parse_tree_to_string::expression(const Expr *expr) {
             ret += to_string(expr->ival);
             break;
         case ExprType::kExprFunctionRef:
-            ret += string(expr->name) + "?" + expr->expr->name;
+            ret += string(expr->name) + "(";
+            if (expr->distinct)
+                ret += "DISTINCT ";
+            for (size_t i = 0; expr->exprList != NULL && i < expr->exprList->size(); i++)
+                ret += (i ? ", " : "") + expression((*expr->exprList)[i]);
+            ret += ")";
             break;
         case ExprType::kExprOperator:
             ret += operator_expression(expr);
@@ -196,11 +221,60 @@ string parse_tree_to_string::select(const SelectStatement *stmt) {
     ret += " FROM " + table_ref(stmt->fromTable);
     if (stmt->whereClause != NULL)
         ret += " WHERE " + expression(stmt->whereClause);
+    if (stmt->groupBy != NULL) {
+        ret += " GROUP BY ";
+        for (size_t i = 0; i < stmt->groupBy->columns->size(); i++)
+            ret += (i ? ", " : "") + expression((*stmt->groupBy->columns)[i]);
+        if (stmt->groupBy->having != NULL)
+            ret += " HAVING " + expression(stmt->groupBy->having);
+    }
+    if (stmt->order != NULL) {
+        ret += " ORDER BY ";
+        doComma = false;
+        for (OrderDescription *order : *stmt->order) {
+            if (doComma)
+                ret += ", ";
+            ret += expression(order->expr);
+            if (order->type == kOrderDesc)
+                ret += " DESC";
+            doComma = true;
+        }
+    }
+    if (stmt->limit != NULL) {
+        if (stmt->limit->limit != NULL)
+            ret += " LIMIT " + expression(stmt->limit->limit);
+        if (stmt->limit->offset != NULL)
+            ret += " OFFSET " + expression(stmt->limit->offset);
+    }
     return ret;
 }
 
 string parse_tree_to_string::insert(const InsertStatement *stmt) {
-    return "INSERT ...";
+    string ret("INSERT INTO ");
+    ret += stmt->tableName;
+    if (stmt->columns != NULL) {
+        ret += " (";
+        bool doComma = false;
+        for (char *column : *stmt->columns) {
+            if (doComma)
+                ret += ", ";
+            ret += column;
+            doComma = true;
+        }
+        ret += ")";
+    }
+    if (stmt->type == InsertType::kInsertSelect)
+        return ret + " " + select(stmt->select);
+    ret += " VALUES (";
+    bool doComma = false;
+    for (Expr *expr : *stmt->values) {
+        if (doComma)
+            ret += ", ";
+        ret += expression(expr);
+        doComma = true;
+    }
+    ret += ")";
+    return ret;
 }
 
 string parse_tree_to_string::create(const CreateStatement *stmt) {
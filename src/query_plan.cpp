@@ -0,0 +1,1304 @@
+/**
+ * @file query_plan.cpp - implementation of the plan operators
+ */
+#include "query_plan.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "heap_storage.h"
+#include "simd_filter.h"
+#include "spill_file.h"
+#include "stats.h"
+
+// fractions of rows the planner assumes pass each kind of comparison
+static const double EQUALITY_SELECTIVITY = 0.1;
+static const double RANGE_SELECTIVITY = 1.0 / 3.0;
+
+// a running total that a RESET STATS meanwhile may have set back to zero
+static u_int64_t since(u_int64_t now, u_int64_t then) {
+    return now >= then ? now - then : now;
+}
+
+ProfileScope::ProfileScope(OperatorProfile &profile)
+        : profile(profile), blocks(Stats::local_count(COUNTER_BLOCKS_READ)),
+          transactions(Stats::local_count(STAT_TXN_BEGIN)),
+          bytes(Stats::local_count(COUNTER_BYTES_UNMARSHALLED)), start(std::chrono::steady_clock::now()) {}
+
+ProfileScope::~ProfileScope() {
+    auto elapsed = std::chrono::steady_clock::now() - this->start;
+    profile.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    profile.blocks += since(Stats::local_count(COUNTER_BLOCKS_READ), this->blocks);
+    profile.transactions += since(Stats::local_count(STAT_TXN_BEGIN), this->transactions);
+    profile.bytes += since(Stats::local_count(COUNTER_BYTES_UNMARSHALLED), this->bytes);
+}
+
+//// Condition
+
+// <0, 0, >0 as a sorts before, with or after b (which must have the same type)
+static int compare(const Value &a, const Value &b) {
+    if (a.data_type == ColumnAttribute::INT)
+        return a.n < b.n ? -1 : a.n > b.n;
+    return a.s.compare(b.s);
+}
+
+bool Condition::matches(const ValueDict &row) const {
+    switch (this->op) {
+        case AND:
+            return this->left->matches(row) && this->right->matches(row);
+        case OR:
+            return this->left->matches(row) || this->right->matches(row);
+        case NOT:
+            return !this->left->matches(row);
+        default:
+            break;
+    }
+    auto found = row.find(this->column);
+    const Value &value = get_value();
+    if (found == row.end() || found->second.data_type != value.data_type)
+        return false;
+    int order = compare(found->second, value);
+    switch (this->op) {
+        case EQ:    return order == 0;
+        case NE:    return order != 0;
+        case LT:    return order < 0;
+        case LE:    return order <= 0;
+        case GT:    return order > 0;
+        case GE:    return order >= 0;
+        default:    return false;
+    }
+}
+
+static_assert((int) Condition::EQ == COMPARE_EQ && (int) Condition::GE == COMPARE_GE,
+              "comparisons are passed straight to compare_int32");
+
+void Condition::matches(const ColumnBatch &batch, u_int64_t *bitmap) const {
+    const size_t words = (batch.size + 63) / 64;
+    switch (this->op) {
+        case AND:
+        case OR: {
+            u_int64_t right[ColumnBatch::CAPACITY / 64];
+            this->left->matches(batch, bitmap);
+            this->right->matches(batch, right);
+            for (size_t i = 0; i < words; i++)
+                bitmap[i] = this->op == AND ? bitmap[i] & right[i] : bitmap[i] | right[i];
+            return;
+        }
+        case NOT:
+            this->left->matches(batch, bitmap);
+            for (size_t i = 0; i < words; i++)
+                bitmap[i] = ~bitmap[i];  // bits past the end are ignored
+            return;
+        default:
+            break;
+    }
+    const Value &value = get_value();
+    int column = batch.column_index(this->column);
+    if (column >= 0 && batch.column_attributes[column].get_data_type() != value.data_type)
+        column = -1;
+    if (column < 0) {
+        memset(bitmap, 0, words * sizeof(u_int64_t));
+        return;
+    }
+    if (value.data_type == ColumnAttribute::INT) {
+        compare_int32(batch.ints[column].data(), batch.size, (CompareOp) this->op, value.n, bitmap);
+        return;
+    }
+    memset(bitmap, 0, words * sizeof(u_int64_t));
+    const std::vector<std::string> &texts = batch.texts[column];
+    for (size_t i = 0; i < batch.size; i++) {
+        int order = texts[i].compare(value.s);
+        bool match;
+        switch (this->op) {
+            case EQ:    match = order == 0; break;
+            case NE:    match = order != 0; break;
+            case LT:    match = order < 0;  break;
+            case LE:    match = order <= 0; break;
+            case GT:    match = order > 0;  break;
+            default:    match = order >= 0; break;
+        }
+        bitmap[i / 64] |= (u_int64_t) match << (i % 64);
+    }
+}
+
+bool Condition::has_int_comparison() const {
+    switch (this->op) {
+        case AND:
+        case OR:    return this->left->has_int_comparison() || this->right->has_int_comparison();
+        case NOT:   return this->left->has_int_comparison();
+        default:    return get_value().data_type == ColumnAttribute::INT;
+    }
+}
+
+void Condition::bounds(ScanBounds &bounds) const {
+    if (this->op == AND) {
+        this->left->bounds(bounds);
+        this->right->bounds(bounds);
+        return;
+    }
+    const Value &value = get_value();
+    if (this->op == EQ && value.data_type == ColumnAttribute::TEXT)
+        bounds.restrict(this->column, value.s);
+    if (this->op > GE || value.data_type != ColumnAttribute::INT)
+        return;  // OR and NOT could match anywhere
+    int64_t n = value.n, lo = INT32_MIN, hi = INT32_MAX;
+    switch (this->op) {
+        case EQ:    lo = hi = n;    break;
+        case LT:    hi = n - 1;     break;
+        case LE:    hi = n;         break;
+        case GT:    lo = n + 1;     break;
+        case GE:    lo = n;         break;
+        default:    return;  // NE
+    }
+    if (lo > hi)
+        bounds.restrict(this->column, 1, 0);  // < INT32_MIN or > INT32_MAX: nothing
+    else
+        bounds.restrict(this->column, (int32_t) lo, (int32_t) hi);
+}
+
+double Condition::selectivity() const {
+    switch (this->op) {
+        case EQ:    return EQUALITY_SELECTIVITY;
+        case NE:    return 1.0 - EQUALITY_SELECTIVITY;
+        case AND:   return this->left->selectivity() * this->right->selectivity();
+        case OR: {
+            double left = this->left->selectivity(), right = this->right->selectivity();
+            return left + right - left * right;
+        }
+        case NOT:   return 1.0 - this->left->selectivity();
+        default:    return RANGE_SELECTIVITY;
+    }
+}
+
+double Condition::selectivity(const ColumnStatisticsMap &statistics) const {
+    switch (this->op) {
+        case AND:   return this->left->selectivity(statistics) * this->right->selectivity(statistics);
+        case OR: {
+            double left = this->left->selectivity(statistics), right = this->right->selectivity(statistics);
+            return left + right - left * right;
+        }
+        case NOT:   return 1.0 - this->left->selectivity(statistics);
+        default:    break;
+    }
+    auto found = statistics.find(this->column);
+    if (found == statistics.end())
+        return this->selectivity();
+    const ColumnStatistics &column = found->second;
+    const Value &value = get_value();
+    if (this->op == EQ || this->op == NE) {
+        double equal = column.equality_fraction();
+        if (value.data_type == ColumnAttribute::INT && !column.histogram.empty()
+            && (value.n < column.histogram.front() || value.n > column.histogram.back()))
+            equal = 0.0;
+        return this->op == EQ ? equal : 1.0 - equal;
+    }
+    // for INT values, n < x is n < x - 0.5 and so on, so the histogram is read between values
+    double below = value.data_type == ColumnAttribute::INT ? column.fraction_below(value.n - 0.5) : -1.0;
+    double below_or_equal = value.data_type == ColumnAttribute::INT ? column.fraction_below(value.n + 0.5) : -1.0;
+    if (below < 0.0)
+        return this->selectivity();
+    switch (this->op) {
+        case LT:    return below;
+        case LE:    return below_or_equal;
+        case GT:    return 1.0 - below_or_equal;
+        default:    return 1.0 - below;  // GE
+    }
+}
+
+bool Condition::has_parameter() const {
+    if (this->op >= AND)
+        return this->left->has_parameter() || (this->right != nullptr && this->right->has_parameter());
+    return this->parameter != nullptr;
+}
+
+std::string Condition::to_string() const {
+    static const char *OPERATORS[] = {"=", "<>", "<", "<=", ">", ">="};
+    switch (this->op) {
+        case AND:
+        case OR: {
+            // parenthesize an OR under an AND, so it reads as it evaluates
+            std::string left = this->left->to_string(), right = this->right->to_string();
+            if (this->op == AND && this->left->op == OR)
+                left = "(" + left + ")";
+            if (this->op == AND && this->right->op == OR)
+                right = "(" + right + ")";
+            return left + (this->op == AND ? " AND " : " OR ") + right;
+        }
+        case NOT:
+            return "NOT (" + this->left->to_string() + ")";
+        default: {
+            std::string value = this->parameter != nullptr ? "?"
+                                : this->value.data_type == ColumnAttribute::TEXT ? "'" + this->value.s + "'"
+                                : std::to_string(this->value.n);
+            return this->column + " " + OPERATORS[this->op] + " " + value;
+        }
+    }
+}
+
+//// PlanNode
+
+void PlanNode::open() {
+    if (!this->profiling)
+        return do_open();
+    ProfileScope scope(this->profile);
+    do_open();
+}
+
+ValueDict *PlanNode::next() {
+    ValueDict *row;
+    if (!this->profiling) {
+        row = do_next();
+    } else {
+        ProfileScope scope(this->profile);
+        row = do_next();
+    }
+    if (row != nullptr)
+        this->profile.rows++;
+    return row;
+}
+
+bool PlanNode::next_batch(ColumnBatch &batch) {
+    bool more;
+    if (!this->profiling) {
+        more = do_next_batch(batch);
+    } else {
+        ProfileScope scope(this->profile);
+        more = do_next_batch(batch);
+    }
+    if (more)
+        this->profile.rows += batch.selected;
+    return more;
+}
+
+bool PlanNode::do_next_batch(ColumnBatch &batch) {
+    batch.reset({}, {});
+    while (!batch.full()) {
+        ValueDict *row = do_next();
+        if (row == nullptr)
+            break;
+        batch.append(*row);
+        delete row;
+    }
+    batch.select_all();
+    return batch.size > 0;
+}
+
+void PlanNode::close() {
+    if (!this->profiling)
+        return do_close();
+    ProfileScope scope(this->profile);
+    do_close();
+}
+
+void PlanNode::set_profiling(bool on) {
+    this->profiling = on;
+    for (PlanNode *input: get_inputs())
+        input->set_profiling(on);
+}
+
+const ColumnStatisticsMap &PlanNode::column_statistics() {
+    static const ColumnStatisticsMap none;
+    return this->input != nullptr ? this->input->column_statistics() : none;
+}
+
+std::vector<PlanNode *> PlanNode::get_inputs() const {
+    if (this->input == nullptr)
+        return {};
+    return {this->input};
+}
+
+//// TableScan
+
+TableScan::TableScan(DbRelation &table, const Identifier &table_name, const Identifier &qualifier)
+        : PlanNode("Seq Scan on " + table_name), table(table), qualifier(qualifier), cursor(nullptr),
+          bounds_condition(nullptr), analyzed_blocks(0), analyzed_rows(0) {
+    if (!qualifier.empty() && qualifier != table_name)
+        this->description += " " + qualifier;
+}
+
+void TableScan::set_statistics(const TableStatistics *statistics) {
+    this->statistics.clear();
+    this->analyzed_blocks = this->analyzed_rows = 0;
+    if (statistics == nullptr)
+        return;
+    for (auto const &[column_name, column]: statistics->columns)
+        this->statistics[this->qualifier.empty() ? column_name : this->qualifier + "." + column_name] = column;
+    this->analyzed_blocks = statistics->blocks;
+    this->analyzed_rows = statistics->rows;
+}
+
+void TableScan::set_bounds(const Condition *condition) {
+    this->bounds_condition = condition;
+    if (this->description.rfind("Seq Scan", 0) == 0)
+        this->description.replace(0, 8, "Zone Map Scan");
+}
+
+// reading a block's zone map, as a fraction of the cost of fetching and decoding the block
+static const double ZONE_MAP_COST = 0.05;
+
+// the Bloom filter false positive rate assumed (that of the default bloom-bits)
+static const double BLOOM_FALSE_POSITIVES = 0.01;
+
+void TableScan::choose_scan(const Condition *condition) {
+    if (this->analyzed_blocks == 0 || condition->has_parameter())
+        return this->set_bounds(condition);
+    ScanBounds bounds;
+    condition->bounds(bounds);
+    double blocks = (double) this->analyzed_blocks, read = 1.0;  // fraction of blocks a Zone Map Scan reads
+    for (auto const &[column_name, range]: bounds.int_ranges) {
+        auto found = this->statistics.find(column_name);
+        if (found == this->statistics.end() || found->second.histogram.empty())
+            continue;
+        const ColumnStatistics &column = found->second;
+        double within = range.first > range.second ? 0.0 : column.fraction_below(range.second + 0.5)
+                                                            - column.fraction_below(range.first - 0.5);
+        // the matching rows are in that share of the blocks if stored in order, anywhere if not
+        double ordered = column.correlation * column.correlation;
+        read = std::min(read, ordered * within + (1.0 - ordered));
+    }
+    BTTable *bt_table = dynamic_cast<BTTable *>(&this->table);
+    for (auto const &[column_name, text]: bounds.text_values) {
+        auto found = this->statistics.find(column_name);
+        if (found == this->statistics.end() || bt_table == nullptr || !bt_table->has_bloom_filter(column_name))
+            continue;
+        double matching = (double) this->analyzed_rows * found->second.equality_fraction();
+        read = std::min(read, std::min(1.0, matching / blocks + BLOOM_FALSE_POSITIVES));
+    }
+    if (blocks * (ZONE_MAP_COST + read) < blocks)
+        this->set_bounds(condition);
+}
+
+double TableScan::estimate() {
+    BTTable *bt_table = dynamic_cast<BTTable *>(&this->table);
+    return bt_table != nullptr ? (double) bt_table->estimate_rows() : 1000.0;
+}
+
+bool TableScan::has_row_count() {
+    return dynamic_cast<BTTable *>(&this->table) != nullptr;
+}
+
+u_int64_t TableScan::count_rows() {
+    return dynamic_cast<BTTable &>(this->table).count_rows();
+}
+
+void TableScan::do_open() {
+    delete this->cursor;
+    this->cursor = nullptr;
+    if (this->bounds_condition == nullptr) {
+        this->cursor = this->table.cursor();
+        return;
+    }
+    ScanBounds bounds;
+    this->bounds_condition->bounds(bounds);
+    this->cursor = this->table.cursor(bounds);
+}
+
+ValueDict *TableScan::do_next() {
+    Handle handle;
+    ValueDict *row;
+    if (this->cursor == nullptr || !this->cursor->next(handle, row))
+        return nullptr;
+    if (this->qualifier.empty())
+        return row;
+    ValueDict *qualified = new ValueDict();
+    for (auto &[column_name, value]: *row)
+        qualified->emplace_hint(qualified->end(), this->qualifier + "." + column_name, std::move(value));
+    delete row;
+    return qualified;
+}
+
+bool TableScan::do_next_batch(ColumnBatch &batch) {
+    if (this->cursor == nullptr)
+        return false;
+    if (!this->qualifier.empty())
+        return PlanNode::do_next_batch(batch);
+    return this->cursor->next_batch(batch);
+}
+
+void TableScan::do_close() {
+    delete this->cursor;
+    this->cursor = nullptr;
+}
+
+//// Filter
+
+Filter::Filter(PlanNode *input, Condition *condition)
+        : PlanNode("Filter (" + condition->to_string() + ")", input), condition(condition) {}
+
+ValueDict *Filter::do_next() {
+    while (ValueDict *row = this->input->next()) {
+        if (this->condition->matches(*row))
+            return row;
+        delete row;
+    }
+    return nullptr;
+}
+
+//// VectorFilter
+
+VectorFilter::VectorFilter(PlanNode *input, Condition *condition) : Filter(input, condition), position(0) {
+    this->description = "Vectorized " + this->description;
+}
+
+void VectorFilter::do_open() {
+    this->batch.clear();
+    this->position = 0;
+    Filter::do_open();
+}
+
+ValueDict *VectorFilter::do_next() {
+    while (this->position == this->batch.selected) {
+        if (!this->input->next_batch(this->batch))
+            return nullptr;
+        filter(this->batch);
+        this->position = 0;
+    }
+    return this->batch.row(this->position++);
+}
+
+bool VectorFilter::do_next_batch(ColumnBatch &batch) {
+    while (this->input->next_batch(batch)) {
+        filter(batch);
+        if (batch.selected > 0)
+            return true;
+    }
+    return false;
+}
+
+void VectorFilter::filter(ColumnBatch &batch) {
+    u_int64_t bitmap[ColumnBatch::CAPACITY / 64];
+    this->condition->matches(batch, bitmap);
+    if (batch.selected < batch.size) {
+        // keep only rows the input had selected
+        u_int64_t selected[ColumnBatch::CAPACITY / 64] = {};
+        for (size_t i = 0; i < batch.selected; i++)
+            selected[batch.selection[i] / 64] |= 1ULL << (batch.selection[i] % 64);
+        for (size_t i = 0; i < (batch.size + 63) / 64; i++)
+            bitmap[i] &= selected[i];
+    }
+    batch.selected = bitmap_to_selection(bitmap, batch.size, batch.selection);
+}
+
+//// HashJoin
+
+static std::string join_description(const ColumnNames &left_keys, const ColumnNames &right_keys) {
+    std::string description = "Hash Join (";
+    for (size_t i = 0; i < left_keys.size(); i++)
+        description += (i ? " AND " : "") + left_keys[i] + " = " + right_keys[i];
+    return description + ")";
+}
+
+// bytes a row takes in memory, roughly: map nodes plus the strings
+static size_t row_size(const ValueDict &row) {
+    size_t size = sizeof(ValueDict);
+    for (auto const &[column_name, value]: row)
+        size += 64 + column_name.capacity() + value.s.capacity();
+    return size;
+}
+
+static u_int64_t mix(u_int64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+HashJoin::HashJoin(PlanNode *left, PlanNode *right, const ColumnNames &left_keys, const ColumnNames &right_keys,
+                   size_t memory_budget)
+        : PlanNode(join_description(left_keys, right_keys), left), build(right), build_keys(right_keys),
+          probe_keys(left_keys), memory_budget(memory_budget), row_bytes(0), probe_row(nullptr), probe_hash(0),
+          slot(0), probing(false), spill(nullptr), spill_reader(nullptr), partition(0), spilled_partitions(0) {
+    if (left->estimate() < right->estimate()) {
+        std::swap(this->input, this->build);
+        std::swap(this->build_keys, this->probe_keys);
+    }
+    this->base_description = this->description;
+}
+
+HashJoin::~HashJoin() {
+    clear_rows();
+    delete this->probe_row;
+    delete this->spill_reader;
+    delete this->spill;
+    delete this->build;
+}
+
+// with statistics on the first keys, each value of the side with more of them matches a
+// value of the other; without, assume each probe row matches one build row
+double HashJoin::estimate() {
+    double probe = this->input->estimate(), build = this->build->estimate();
+    auto probe_key = this->input->column_statistics().find(this->probe_keys[0]);
+    auto build_key = this->build->column_statistics().find(this->build_keys[0]);
+    if (probe_key == this->input->column_statistics().end() || build_key == this->build->column_statistics().end())
+        return std::max(probe, build);
+    double distinct = std::max({std::min((double) probe_key->second.distinct, probe),
+                                std::min((double) build_key->second.distinct, build), 1.0});
+    return probe * build / distinct;
+}
+
+const ColumnStatisticsMap &HashJoin::column_statistics() {
+    this->statistics = this->input->column_statistics();
+    for (auto const &[column_name, column]: this->build->column_statistics())
+        this->statistics[column_name] = column;
+    return this->statistics;
+}
+
+bool HashJoin::hash_keys(const ValueDict &row, const ColumnNames &keys, u_int64_t &hash) {
+    hash = 0;
+    for (auto const &key: keys) {
+        auto found = row.find(key);
+        if (found == row.end())
+            return false;
+        const Value &value = found->second;
+        u_int64_t h = value.data_type == ColumnAttribute::TEXT ? std::hash<std::string>()(value.s)
+                                                               : (u_int64_t) (u_int32_t) value.n;
+        hash = mix(hash * 31 + h + value.data_type);
+    }
+    return true;
+}
+
+void HashJoin::do_open() {
+    do_close();
+    this->description = this->base_description;
+    this->spilled_partitions = 0;
+
+    // build: into memory, or into partitions once it doesn't fit
+    this->build->open();
+    while (ValueDict *row = this->build->next()) {
+        u_int64_t hash;
+        if (!hash_keys(*row, this->build_keys, hash)) {
+            delete row;
+            continue;
+        }
+        if (this->spill != nullptr) {
+            spill_row(0, hash, *row);
+            delete row;
+            continue;
+        }
+        this->rows.push_back(row);
+        this->row_bytes += row_size(*row);
+        if (this->row_bytes > this->memory_budget) {
+            this->spill = new SpillFile();
+            for (ValueDict *held: this->rows) {
+                hash_keys(*held, this->build_keys, hash);
+                spill_row(0, hash, *held);
+            }
+            clear_rows();
+        }
+    }
+    this->build->close();
+
+    this->input->open();
+    if (this->spill == nullptr) {
+        this->probing = true;
+        index_rows();
+        return;
+    }
+
+    // probe: partitioned the same way, then joined a partition at a time
+    u_int64_t hash;
+    while (ValueDict *row = this->input->next()) {
+        if (hash_keys(*row, this->probe_keys, hash))
+            spill_row(1, hash, *row);
+        delete row;
+    }
+    this->input->close();
+    this->spill->flush();
+    this->spilled_partitions = PARTITIONS;
+    this->description += " (spilled to " + std::to_string(PARTITIONS) + " partitions)";
+    this->partition = 0;
+    next_partition();
+}
+
+// open addressing at no more than half full, so probes for a missing key stay short
+void HashJoin::index_rows() {
+    size_t capacity = 16;
+    while (capacity < 2 * this->rows.size())
+        capacity *= 2;
+    this->slots.assign(capacity, Slot{0, 0});
+    for (size_t i = 0; i < this->rows.size(); i++) {
+        u_int64_t hash;
+        hash_keys(*this->rows[i], this->build_keys, hash);
+        size_t s = hash & (capacity - 1);
+        while (this->slots[s].row != 0)
+            s = (s + 1) & (capacity - 1);
+        this->slots[s] = Slot{hash, (u_int32_t) i + 1};
+    }
+}
+
+void HashJoin::clear_rows() {
+    for (ValueDict *row: this->rows)
+        delete row;
+    this->rows.clear();
+    this->row_bytes = 0;
+    this->slots.clear();
+}
+
+// key: side, partition, then a sequence number keeping rows in the order they came
+void HashJoin::spill_row(u_int8_t side, u_int64_t hash, const ValueDict &row) {
+    std::string key(1, (char) side);
+    SpillFile::append_key(key, (u_int32_t) (hash >> 32) % PARTITIONS);
+    SpillFile::append_key(key, (u_int32_t) this->spill->size());
+    this->spill->put(key, row);
+}
+
+bool HashJoin::next_partition() {
+    clear_rows();
+    delete this->spill_reader;
+    this->spill_reader = nullptr;
+    for (; this->partition < PARTITIONS; this->partition++) {
+        std::string from(1, '\0'), to(1, '\0');
+        SpillFile::append_key(from, this->partition);
+        SpillFile::append_key(to, this->partition + 1);
+        SpillReader build_rows(*this->spill, from, to);
+        while (ValueDict *row = build_rows.next()) {
+            this->rows.push_back(row);
+            this->row_bytes += row_size(*row);
+        }
+        if (this->rows.empty())
+            continue;  // no probe row in the partition can match
+        index_rows();
+        from[0] = to[0] = 1;
+        this->spill_reader = new SpillReader(*this->spill, from, to);
+        this->partition++;
+        return true;
+    }
+    return false;
+}
+
+ValueDict *HashJoin::next_probe_row(u_int64_t &hash) {
+    if (this->spill == nullptr) {
+        while (ValueDict *row = this->input->next()) {
+            if (hash_keys(*row, this->probe_keys, hash))
+                return row;
+            delete row;
+        }
+        return nullptr;
+    }
+    while (this->spill_reader != nullptr) {
+        if (ValueDict *row = this->spill_reader->next()) {
+            hash_keys(*row, this->probe_keys, hash);
+            return row;
+        }
+        if (!next_partition())
+            break;
+    }
+    return nullptr;
+}
+
+ValueDict *HashJoin::do_next() {
+    while (true) {
+        if (this->probe_row == nullptr) {
+            this->probe_row = next_probe_row(this->probe_hash);
+            if (this->probe_row == nullptr)
+                return nullptr;
+            this->slot = this->probe_hash & (this->slots.size() - 1);
+        }
+        // every build row with the same hash is in the run of full slots from here
+        for (; this->slots[this->slot].row != 0; this->slot = (this->slot + 1) & (this->slots.size() - 1)) {
+            const Slot &candidate = this->slots[this->slot];
+            if (candidate.hash != this->probe_hash)
+                continue;
+            const ValueDict &build_row = *this->rows[candidate.row - 1];
+            bool equal = true;
+            for (size_t i = 0; i < this->build_keys.size() && equal; i++)
+                equal = build_row.at(this->build_keys[i]) == this->probe_row->at(this->probe_keys[i]);
+            if (!equal)
+                continue;
+            this->slot = (this->slot + 1) & (this->slots.size() - 1);
+            ValueDict *joined = new ValueDict(*this->probe_row);
+            joined->insert(build_row.begin(), build_row.end());
+            return joined;
+        }
+        delete this->probe_row;
+        this->probe_row = nullptr;
+    }
+}
+
+void HashJoin::do_close() {
+    clear_rows();
+    delete this->probe_row;
+    this->probe_row = nullptr;
+    delete this->spill_reader;
+    this->spill_reader = nullptr;
+    if (this->probing)
+        this->input->close();
+    this->probing = false;
+    delete this->spill;
+    this->spill = nullptr;
+}
+
+//// LoserTree
+
+void LoserTree::reset(size_t k) {
+    this->keys.assign(k, std::string());
+    this->finished.assign(k, false);
+    this->losers.assign(k, 0);
+    this->top = 0;
+}
+
+bool LoserTree::beats(size_t a, size_t b) const {
+    if (this->finished[a] || this->finished[b])
+        return !this->finished[a];
+    const std::string &x = this->keys[a], &y = this->keys[b];
+    int order = memcmp(x.data(), y.data(), std::min(x.size(), y.size()));
+    return order < 0 || (order == 0 && x.size() < y.size());
+}
+
+// the winner of the subtree at node, leaving the losers of its matches behind
+size_t LoserTree::play(size_t node) {
+    size_t k = this->keys.size();
+    if (node >= k)
+        return node - k;
+    size_t left = play(2 * node), right = play(2 * node + 1);
+    bool left_wins = beats(left, right);
+    this->losers[node] = left_wins ? right : left;
+    return left_wins ? left : right;
+}
+
+void LoserTree::build() {
+    this->top = this->keys.empty() ? 0 : play(1);
+}
+
+void LoserTree::replay() {
+    size_t k = this->keys.size(), winner = this->top;
+    for (size_t node = (winner + k) / 2; node >= 1; node /= 2)
+        if (beats(this->losers[node], winner))
+            std::swap(this->losers[node], winner);
+    this->top = winner;
+}
+
+//// Sort
+
+static std::string sort_description(const std::string &name, const ColumnNames &columns,
+                                    const std::vector<bool> &descending) {
+    std::string description = name + " (";
+    for (size_t i = 0; i < columns.size(); i++)
+        description += (i ? ", " : "") + columns[i] + (descending[i] ? " DESC" : "");
+    return description + ")";
+}
+
+Sort::Sort(PlanNode *input, const ColumnNames &columns, const std::vector<bool> &descending,
+           size_t memory_budget)
+        : PlanNode(sort_description("Sort", columns, descending), input), columns(columns),
+          descending(descending), memory_budget(memory_budget), position(0), sequence(0), spill(nullptr),
+          spilled_runs(0) {
+    this->base_description = this->description;
+}
+
+Sort::~Sort() {
+    do_close();
+}
+
+void Sort::normalize(const Value &value, bool descending, std::string &key) {
+    size_t start = key.size();
+    if (value.data_type == ColumnAttribute::TEXT) {
+        for (char c: value.s) {
+            key += c;
+            if (c == '\0')
+                key += '\1';
+        }
+        key.append(2, '\0');
+    } else {
+        SpillFile::append_key(key, (u_int32_t) value.n ^ 0x80000000U);
+    }
+    if (descending)
+        for (size_t i = start; i < key.size(); i++)
+            key[i] = (char) ~key[i];
+}
+
+std::string Sort::make_key(const ValueDict &row) {
+    std::string key;
+    for (size_t i = 0; i < this->columns.size(); i++) {
+        auto found = row.find(this->columns[i]);
+        normalize(found != row.end() ? found->second : Value(), this->descending[i], key);
+    }
+    SpillFile::append_key(key, this->sequence++);
+    return key;
+}
+
+bool Sort::key_less(const Entry &a, const Entry &b) {
+    const std::string &x = a.first, &y = b.first;
+    int order = memcmp(x.data(), y.data(), std::min(x.size(), y.size()));
+    return order < 0 || (order == 0 && x.size() < y.size());
+}
+
+void Sort::do_open() {
+    do_close();
+    this->description = this->base_description;
+    this->sequence = this->spilled_runs = 0;
+    size_t bytes = 0;
+    this->input->open();
+    while (ValueDict *row = this->input->next()) {
+        this->entries.emplace_back(make_key(*row), row);
+        bytes += row_size(*row) + sizeof(Entry) + this->entries.back().first.capacity();
+        if (bytes > this->memory_budget) {
+            spill_run();
+            bytes = 0;
+        }
+    }
+    this->input->close();
+    if (this->spill == nullptr) {
+        std::sort(this->entries.begin(), this->entries.end(), key_less);
+        return;
+    }
+
+    spill_run();
+    this->spill->flush();
+    this->description += " (spilled " + std::to_string(this->spilled_runs) + " runs)";
+    this->tree.reset(this->spilled_runs);
+    this->heads.assign(this->spilled_runs, nullptr);
+    for (u_int32_t run = 0; run < this->spilled_runs; run++) {
+        std::string from, to;
+        SpillFile::append_key(from, run);
+        SpillFile::append_key(to, run + 1);
+        this->runs.push_back(new SpillReader(*this->spill, from, to));
+        advance_run(run);
+    }
+    this->tree.build();
+}
+
+// a run's keys are the run number then the row's normalized key, so runs are ranges of keys
+void Sort::spill_run() {
+    if (this->entries.empty())
+        return;
+    if (this->spill == nullptr)
+        this->spill = new SpillFile();
+    std::sort(this->entries.begin(), this->entries.end(), key_less);
+    std::string run;
+    SpillFile::append_key(run, this->spilled_runs++);
+    for (auto const &[key, row]: this->entries)
+        this->spill->put(run + key, *row);
+    clear_entries();
+}
+
+void Sort::advance_run(size_t i) {
+    delete this->heads[i];
+    this->heads[i] = this->runs[i]->next();
+    if (this->heads[i] == nullptr)
+        this->tree.finish(i);
+    else
+        this->tree.key(i) = this->runs[i]->get_key().substr(sizeof(u_int32_t));
+}
+
+ValueDict *Sort::do_next() {
+    if (this->spill == nullptr) {
+        if (this->position == this->entries.size())
+            return nullptr;
+        ValueDict *row = this->entries[this->position].second;
+        this->entries[this->position++].second = nullptr;
+        return row;
+    }
+    if (this->tree.empty())
+        return nullptr;
+    size_t run = this->tree.winner();
+    ValueDict *row = this->heads[run];
+    this->heads[run] = nullptr;
+    advance_run(run);
+    this->tree.replay();
+    return row;
+}
+
+void Sort::clear_entries() {
+    for (auto const &entry: this->entries)
+        delete entry.second;
+    this->entries.clear();
+    this->position = 0;
+}
+
+void Sort::do_close() {
+    clear_entries();
+    for (ValueDict *row: this->heads)
+        delete row;
+    this->heads.clear();
+    for (SpillReader *run: this->runs)
+        delete run;
+    this->runs.clear();
+    delete this->spill;
+    this->spill = nullptr;
+}
+
+//// TopN
+
+TopN::TopN(PlanNode *input, const ColumnNames &columns, const std::vector<bool> &descending, u_int64_t count)
+        : Sort(input, columns, descending, 0), count(count) {
+    this->description = this->base_description = sort_description("Top-" + std::to_string(count) + " Sort",
+                                                                  columns, descending);
+}
+
+void TopN::do_open() {
+    do_close();
+    this->sequence = 0;
+    this->input->open();
+    // the top of the heap is the greatest of the rows kept, the first to go for a lesser one
+    while (ValueDict *row = this->input->next()) {
+        Entry entry(make_key(*row), row);
+        if (this->entries.size() < this->count) {
+            this->entries.push_back(entry);
+            std::push_heap(this->entries.begin(), this->entries.end(), key_less);
+        } else if (this->count > 0 && key_less(entry, this->entries.front())) {
+            std::pop_heap(this->entries.begin(), this->entries.end(), key_less);
+            delete this->entries.back().second;
+            this->entries.back() = entry;
+            std::push_heap(this->entries.begin(), this->entries.end(), key_less);
+        } else {
+            delete row;
+        }
+    }
+    this->input->close();
+    std::sort_heap(this->entries.begin(), this->entries.end(), key_less);
+}
+
+//// HashAggregate
+
+static const char *FUNCTION_NAMES[] = {"count", "sum", "min", "max", "avg"};
+
+static std::string aggregate_description(const ColumnNames &group_by,
+                                         const std::vector<HashAggregate::Aggregate> &aggregates) {
+    std::string description = "Hash Aggregate (";
+    for (size_t i = 0; i < aggregates.size(); i++) {
+        const HashAggregate::Aggregate &aggregate = aggregates[i];
+        description += (i ? ", " : "") + std::string(FUNCTION_NAMES[aggregate.function]) + "("
+                       + (aggregate.column.empty() ? "*" : aggregate.column) + ")";
+    }
+    for (size_t i = 0; i < group_by.size(); i++)
+        description += (i ? ", " : " by ") + group_by[i];
+    return description + ")";
+}
+
+HashAggregate::HashAggregate(PlanNode *input, const ColumnNames &group_by, const std::vector<Aggregate> &aggregates,
+                             size_t memory_budget)
+        : PlanNode(aggregate_description(group_by, aggregates), input), group_by(group_by), aggregates(aggregates),
+          memory_budget(memory_budget), count_only(group_by.empty()), counted(nullptr), group_bytes(0), position(0),
+          spill(nullptr), partition(0), spilled_rows(0) {
+    for (auto const &aggregate: aggregates)
+        if (aggregate.function != Aggregate::COUNT || !aggregate.column.empty())
+            this->count_only = false;
+    if (this->count_only) {
+        TableScan *scan = dynamic_cast<TableScan *>(input);
+        if (scan != nullptr && scan->has_row_count())
+            this->counted = scan;
+        this->description += this->counted != nullptr ? " from row count" : " by batch";
+    }
+    this->base_description = this->description;
+}
+
+HashAggregate::~HashAggregate() {
+    delete this->spill;
+}
+
+// as many groups as combinations of the group columns' distinct values, up to one a row;
+// with no statistics on them, assume ten rows to a group
+double HashAggregate::estimate() {
+    if (this->group_by.empty())
+        return 1.0;
+    double rows = this->input->estimate(), groups = 1.0;
+    const ColumnStatisticsMap &statistics = this->input->column_statistics();
+    for (auto const &column_name: this->group_by) {
+        auto found = statistics.find(column_name);
+        if (found == statistics.end())
+            return std::max(1.0, rows / 10.0);
+        groups *= (double) found->second.distinct;
+    }
+    return std::max(1.0, std::min(groups, rows));
+}
+
+ColumnAttribute::DataType HashAggregate::output_type(const Aggregate &aggregate) {
+    switch (aggregate.function) {
+        case Aggregate::MIN:
+        case Aggregate::MAX:    return aggregate.data_type;
+        case Aggregate::AVG:    return ColumnAttribute::TEXT;  // no fractions in an INT
+        default:                return ColumnAttribute::INT;
+    }
+}
+
+void HashAggregate::do_open() {
+    do_close();
+    this->description = this->base_description;
+    this->spilled_rows = 0;
+    if (this->counted != nullptr) {
+        ValueDict none;
+        find_group("", 0, none, false);
+        int64_t count = (int64_t) this->counted->count_rows();
+        for (size_t i = 0; i < this->aggregates.size(); i++)
+            this->states[2 * i + 1] = count;
+        return;
+    }
+    this->input->open();
+    if (this->count_only) {
+        ColumnBatch batch;
+        int64_t count = 0;
+        while (this->input->next_batch(batch))
+            count += batch.selected;
+        ValueDict none;
+        find_group("", 0, none, false);
+        for (size_t i = 0; i < this->aggregates.size(); i++)
+            this->states[2 * i + 1] = count;
+    } else {
+        consume(this->input);
+    }
+    this->input->close();
+    if (this->group_by.empty() && this->keys.empty()) {
+        ValueDict none;
+        find_group("", 0, none, false);  // aggregates over no rows
+    }
+    if (this->spill != nullptr) {
+        this->spill->flush();
+        this->spilled_rows = this->spill->size();
+        this->description += " (spilled " + std::to_string(this->spilled_rows) + " rows to "
+                             + std::to_string(PARTITIONS) + " partitions)";
+    }
+}
+
+void HashAggregate::consume(PlanNode *input) {
+    while (ValueDict *row = input->next()) {
+        consume(*row, true);
+        delete row;
+    }
+}
+
+void HashAggregate::consume(const ValueDict &row, bool may_spill) {
+    std::string key;
+    for (auto const &column: this->group_by) {
+        auto found = row.find(column);
+        Sort::normalize(found != row.end() ? found->second : Value(), false, key);
+    }
+    u_int64_t hash = mix(std::hash<std::string>()(key));
+    int64_t group = find_group(key, hash, row, may_spill);
+    if (group >= 0) {
+        update(group, row);
+        return;
+    }
+
+    // no room for its group: spill just the columns it's aggregated on
+    if (this->spill == nullptr)
+        this->spill = new SpillFile();
+    ValueDict needed;
+    for (auto const &column: this->group_by)
+        needed[column] = row.at(column);
+    for (auto const &aggregate: this->aggregates)
+        if (!aggregate.column.empty())
+            needed[aggregate.column] = row.at(aggregate.column);
+    std::string spill_key;
+    SpillFile::append_key(spill_key, (u_int32_t) (hash >> 32) % PARTITIONS);
+    SpillFile::append_key(spill_key, (u_int32_t) this->spill->size());
+    this->spill->put(spill_key, needed);
+}
+
+int64_t HashAggregate::find_group(const std::string &key, u_int64_t hash, const ValueDict &row, bool may_spill) {
+    size_t mask = this->slots.size() - 1;
+    size_t s = hash & mask;
+    if (!this->slots.empty()) {
+        for (; this->slots[s].group != 0; s = (s + 1) & mask) {
+            const Slot &slot = this->slots[s];
+            if (slot.hash == hash && this->keys[slot.group - 1] == key)
+                return slot.group - 1;
+        }
+    }
+    if (may_spill && (this->spill != nullptr || this->group_bytes > this->memory_budget))
+        return -1;
+
+    // a new group, in a table kept no more than half full
+    size_t group = this->keys.size();
+    if (2 * (group + 1) > this->slots.size()) {
+        std::vector<Slot> old;
+        old.swap(this->slots);
+        this->slots.assign(std::max((size_t) 16, 2 * old.size()), Slot{0, 0});
+        mask = this->slots.size() - 1;
+        for (const Slot &slot: old) {
+            if (slot.group == 0)
+                continue;
+            size_t t = slot.hash & mask;
+            while (this->slots[t].group != 0)
+                t = (t + 1) & mask;
+            this->slots[t] = slot;
+        }
+        for (s = hash & mask; this->slots[s].group != 0; s = (s + 1) & mask)
+            ;
+    }
+    this->slots[s] = Slot{hash, (u_int32_t) group + 1};
+    this->keys.push_back(key);
+    for (auto const &column: this->group_by)
+        this->group_values.push_back(row.at(column));
+    this->states.resize(this->states.size() + 2 * this->aggregates.size(), 0);
+    this->group_bytes += key.capacity() + 2 * sizeof(Slot) + 16 * this->aggregates.size()
+                         + this->group_by.size() * sizeof(Value) + sizeof(std::string);
+    for (size_t i = 0; i < this->aggregates.size(); i++) {
+        const Aggregate &aggregate = this->aggregates[i];
+        if ((aggregate.function == Aggregate::MIN || aggregate.function == Aggregate::MAX)
+            && aggregate.data_type == ColumnAttribute::TEXT) {
+            this->states[2 * (group * this->aggregates.size() + i)] = this->texts.size();
+            this->texts.emplace_back();
+        }
+    }
+    return group;
+}
+
+void HashAggregate::update(size_t group, const ValueDict &row) {
+    int64_t *state = &this->states[2 * group * this->aggregates.size()];
+    for (auto const &aggregate: this->aggregates) {
+        int64_t &value = state[0], &count = state[1];
+        state += 2;
+        if (aggregate.column.empty()) {
+            count++;
+            continue;
+        }
+        auto found = row.find(aggregate.column);
+        if (found == row.end())
+            continue;
+        const Value &input = found->second;
+        switch (aggregate.function) {
+            case Aggregate::COUNT:
+                break;
+            case Aggregate::SUM:
+            case Aggregate::AVG:
+                value += input.n;
+                break;
+            case Aggregate::MIN:
+            case Aggregate::MAX: {
+                bool less = aggregate.function == Aggregate::MIN;
+                if (aggregate.data_type == ColumnAttribute::TEXT) {
+                    std::string &text = this->texts[value];
+                    if (count == 0 || (input.s < text) == less) {
+                        this->group_bytes += input.s.size() > text.size() ? input.s.size() - text.size() : 0;
+                        text = input.s;
+                    }
+                } else if (count == 0 || (input.n < value) == less) {
+                    value = input.n;
+                }
+                break;
+            }
+        }
+        count++;
+    }
+}
+
+ValueDict *HashAggregate::do_next() {
+    while (this->position == this->keys.size()) {
+        if (this->spill == nullptr || this->partition == PARTITIONS)
+            return nullptr;
+        // the next partition's groups, all of them in memory
+        clear_groups();
+        std::string from, to;
+        SpillFile::append_key(from, this->partition);
+        SpillFile::append_key(to, ++this->partition);
+        SpillReader rows(*this->spill, from, to);
+        while (ValueDict *row = rows.next()) {
+            consume(*row, false);
+            delete row;
+        }
+    }
+
+    size_t group = this->position++;
+    ValueDict *row = new ValueDict();
+    for (size_t i = 0; i < this->group_by.size(); i++)
+        (*row)[this->group_by[i]] = this->group_values[group * this->group_by.size() + i];
+    const int64_t *state = &this->states[2 * group * this->aggregates.size()];
+    for (auto const &aggregate: this->aggregates) {
+        int64_t value = state[0], count = state[1];
+        state += 2;
+        if (aggregate.function == Aggregate::COUNT) {
+            value = count;
+        } else if (count == 0) {
+            continue;  // NULL: nothing to aggregate
+        } else if (aggregate.function == Aggregate::AVG) {
+            char average[32];
+            snprintf(average, sizeof(average), "%.6f", (double) value / (double) count);
+            std::string text(average);
+            text.erase(text.find_last_not_of('0') + 1);
+            if (text.back() == '.')
+                text.pop_back();
+            (*row)[aggregate.name] = Value(text);
+            continue;
+        } else if (aggregate.data_type == ColumnAttribute::TEXT) {
+            (*row)[aggregate.name] = Value(this->texts[value]);
+            continue;
+        }
+        if (value < INT32_MIN || value > INT32_MAX) {
+            delete row;
+            throw DbRelationError(aggregate.name + " is out of range for INT");
+        }
+        (*row)[aggregate.name] = Value((int32_t) value);
+    }
+    return row;
+}
+
+void HashAggregate::clear_groups() {
+    this->keys.clear();
+    this->group_values.clear();
+    this->states.clear();
+    this->texts.clear();
+    this->slots.clear();
+    this->group_bytes = 0;
+    this->position = 0;
+}
+
+void HashAggregate::do_close() {
+    clear_groups();
+    delete this->spill;
+    this->spill = nullptr;
+    this->partition = 0;
+}
+
+//// Project
+
+static std::string project_description(const ColumnNames &column_names) {
+    std::string description = "Project (";
+    for (size_t i = 0; i < column_names.size(); i++)
+        description += (i ? ", " : "") + column_names[i];
+    return description + ")";
+}
+
+Project::Project(PlanNode *input, const ColumnNames &column_names)
+        : PlanNode(project_description(column_names), input), column_names(column_names) {}
+
+ValueDict *Project::do_next() {
+    ValueDict *row = this->input->next();
+    if (row == nullptr)
+        return nullptr;
+    ValueDict *projected = new ValueDict();
+    for (auto const &column_name: this->column_names) {
+        auto found = row->find(column_name);
+        if (found != row->end())
+            (*projected)[column_name] = std::move(found->second);
+    }
+    delete row;
+    return projected;
+}
+
+//// Limit
+
+static std::string limit_description(u_int64_t count, u_int64_t offset) {
+    std::string description = "Limit (" + std::to_string(count);
+    if (offset > 0)
+        description += " offset " + std::to_string(offset);
+    return description + ")";
+}
+
+Limit::Limit(PlanNode *input, u_int64_t count, u_int64_t offset)
+        : PlanNode(limit_description(count, offset), input), count(count), offset(offset), skipped(0),
+          returned(0) {}
+
+double Limit::estimate() {
+    double rows = this->input->estimate() - (double) this->offset;
+    return rows < 0.0 ? 0.0 : std::min(rows, (double) this->count);
+}
+
+void Limit::do_open() {
+    this->skipped = this->returned = 0;
+    PlanNode::do_open();
+}
+
+ValueDict *Limit::do_next() {
+    for (; this->skipped < this->offset; this->skipped++) {
+        ValueDict *row = this->input->next();
+        if (row == nullptr)
+            return nullptr;
+        delete row;
+    }
+    if (this->returned == this->count)
+        return nullptr;
+    ValueDict *row = this->input->next();
+    if (row != nullptr)
+        this->returned++;
+    return row;
+}
@@ -0,0 +1,677 @@
+/**
+ * @file query_plan.h - physical query plans: iterator operators and their run-time profiles.
+ * OperatorProfile
+ * ProfileScope
+ * Condition
+ * PlanNode
+ * TableScan
+ * Filter
+ * VectorFilter
+ * HashJoin
+ * LoserTree
+ * Sort
+ * TopN
+ * HashAggregate
+ * Project
+ * Limit
+ *
+ * A plan is a tree of operators with the open/next/close (Volcano) interface: each next()
+ * pulls rows from the operator's input only as it needs them, so rows stream out of the
+ * plan while the scan is still going, and a query holds a page and a few rows in memory
+ * however big the table is. Between the scan and a filter on INT columns, rows instead go
+ * a ColumnBatch at a time (next_batch()), so the filter can test a whole column with SIMD
+ * comparisons rather than one Value at a time. A scan under a filter skips the blocks whose
+ * zone maps (per-block min and max of each INT column, and Bloom filters of chosen TEXT
+ * columns) rule out the filter's ranges and values. A HashJoin has two inputs and holds one of
+ * them in memory, up to the work-mem budget, past which it spills to a SpillFile; a Sort
+ * likewise writes sorted runs to a SpillFile and merges them, and a HashAggregate spills
+ * the rows of groups it has no room for.
+ *
+ * EXPLAIN prints the tree with the planner's row estimates; EXPLAIN ANALYZE runs it with
+ * profiling on and shows what every operator actually did: rows out, blocks fetched, LMDB
+ * transactions begun, bytes unmarshalled and time taken, each including the work of its
+ * input.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+#include "table_statistics.h"
+
+class SpillFile;
+class SpillReader;
+
+/**
+ * What an operator did, as measured by ProfileScope.
+ */
+struct OperatorProfile {
+    u_int64_t rows = 0;
+    u_int64_t blocks = 0;        // pages fetched from their files
+    u_int64_t transactions = 0;  // LMDB transactions begun
+    u_int64_t bytes = 0;         // bytes unmarshalled
+    u_int64_t ns = 0;
+};
+
+/**
+ * @class ProfileScope - adds the work this thread does while the scope is open to a profile.
+ */
+class ProfileScope {
+public:
+    explicit ProfileScope(OperatorProfile &profile);
+
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope &other) = delete;
+
+    ProfileScope &operator=(const ProfileScope &other) = delete;
+
+protected:
+    OperatorProfile &profile;
+    u_int64_t blocks;
+    u_int64_t transactions;
+    u_int64_t bytes;
+    std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * @class Condition - a WHERE clause, compiled for testing rows.
+ *
+ *      Either a comparison of a column with a value, or AND/OR/NOT of other conditions.
+ *      The value may be a parameter: a slot outside the condition (a prepared statement's
+ *      ? parameter) read each time the condition is tested, so a plan can be built once and
+ *      run with different values.
+ */
+class Condition {
+public:
+    enum Op {
+        EQ, NE, LT, LE, GT, GE, AND, OR, NOT
+    };
+
+    // column <op> value, for the comparison ops
+    Condition(Op op, const Identifier &column, const Value &value)
+            : op(op), column(column), value(value), parameter(nullptr), left(nullptr), right(nullptr) {}
+
+    /**
+     * column <op> parameter, for the comparison ops
+     * @param parameter  the slot (outliving the condition) holding the value, whose type
+     *                   must already be the one the value will have
+     */
+    Condition(Op op, const Identifier &column, const Value *parameter)
+            : op(op), column(column), parameter(parameter), left(nullptr), right(nullptr) {}
+
+    // left AND/OR right, or NOT left
+    Condition(Op op, Condition *left, Condition *right = nullptr)
+            : op(op), parameter(nullptr), left(left), right(right) {}
+
+    virtual ~Condition() {
+        delete left;
+        delete right;
+    }
+
+    Condition(const Condition &other) = delete;
+
+    Condition &operator=(const Condition &other) = delete;
+
+    bool matches(const ValueDict &row) const;
+
+    /**
+     * Test every row of a batch (ignoring its selection).
+     * @param bitmap  returned by reference: bit i set if row i matches; one word per 64 rows
+     */
+    void matches(const ColumnBatch &batch, u_int64_t *bitmap) const;
+
+    // true if some comparison is on an INT value, which a VectorFilter does best
+    bool has_int_comparison() const;
+
+    /**
+     * Narrow bounds to the INT ranges and TEXT values every matching row has, from the
+     * comparisons ANDed together at the top of the condition (with the parameters' current
+     * values).
+     */
+    void bounds(ScanBounds &bounds) const;
+
+    // fraction of rows the planner expects to match, by fixed guesses
+    double selectivity() const;
+
+    // fraction of rows the planner expects to match, from the statistics of the columns
+    // that have them (see ANALYZE) and fixed guesses for the rest
+    double selectivity(const ColumnStatisticsMap &statistics) const;
+
+    // true if some comparison is with a parameter, whose value is only known when run
+    bool has_parameter() const;
+
+    std::string to_string() const;
+
+protected:
+    Op op;
+    Identifier column;
+    Value value;
+    const Value *parameter;  // where the value is, if it is a parameter
+    Condition *left;
+    Condition *right;
+
+    const Value &get_value() const { return parameter != nullptr ? *parameter : value; }
+};
+
+/**
+ * @class PlanNode - abstract base class for the operators in a plan.
+ *
+ *      open() before the first next(), close() after the last. Without profiling, the
+ *      public methods just count rows and pass through to the do_*() methods.
+ */
+class PlanNode {
+public:
+    /**
+     * @param description  how EXPLAIN shows the operator
+     * @param input        the operator feeding this one, if any (owned by this node)
+     */
+    explicit PlanNode(std::string description, PlanNode *input = nullptr)
+            : description(description), input(input), profiling(false) {}
+
+    virtual ~PlanNode() { delete input; }
+
+    PlanNode(const PlanNode &other) = delete;
+
+    PlanNode &operator=(const PlanNode &other) = delete;
+
+    void open();
+
+    /**
+     * Pull the next row out of the operator.
+     * @returns  the row (freed by caller), or nullptr once there are no more
+     */
+    ValueDict *next();
+
+    void close();
+
+    /**
+     * Pull the next rows out of the operator as a batch, instead of next().
+     * @param batch  filled with the rows; the selected ones are the operator's output
+     * @returns      false once there are no more
+     */
+    bool next_batch(ColumnBatch &batch);
+
+    // measure every call from now on, in this operator and its inputs
+    void set_profiling(bool on);
+
+    // number of rows the planner expects next() to return
+    virtual double estimate() = 0;
+
+    // statistics of the columns of the rows next() returns, for those that have them (the
+    // default: the input's)
+    virtual const ColumnStatisticsMap &column_statistics();
+
+    const std::string &get_description() const { return description; }
+
+    PlanNode *get_input() const { return input; }
+
+    // every operator feeding this one, in the order EXPLAIN shows them
+    virtual std::vector<PlanNode *> get_inputs() const;
+
+    const OperatorProfile &get_profile() const { return profile; }
+
+protected:
+    std::string description;
+    PlanNode *input;
+    OperatorProfile profile;
+    bool profiling;
+
+    virtual void do_open() {
+        if (input != nullptr)
+            input->open();
+    }
+
+    virtual ValueDict *do_next() = 0;
+
+    // the default batches up rows from do_next()
+    virtual bool do_next_batch(ColumnBatch &batch);
+
+    virtual void do_close() {
+        if (input != nullptr)
+            input->close();
+    }
+};
+
+/**
+ * @class TableScan - every row of a table, in storage order, through a DbCursor.
+ *
+ *      With a qualifier (as in a join), each column comes out as "qualifier.column", so
+ *      rows from several tables can be merged without their column names colliding.
+ */
+class TableScan : public PlanNode {
+public:
+    /**
+     * @param table       the table to scan
+     * @param table_name  its name, for the description
+     * @param qualifier   prefix for the column names, or empty for none
+     */
+    TableScan(DbRelation &table, const Identifier &table_name, const Identifier &qualifier = "");
+
+    ~TableScan() override { delete cursor; }
+
+    double estimate() override;
+
+    // whether count_rows() can answer without reading the table's rows
+    bool has_row_count();
+
+    // the table's row count, kept by the table (see BTTable::count_rows)
+    u_int64_t count_rows();
+
+    // the table's statistics, or nullptr if it has none
+    void set_statistics(const TableStatistics *statistics);
+
+    const ColumnStatisticsMap &column_statistics() override { return statistics; }
+
+    /**
+     * Only rows matching a condition are wanted (they are still tested above the scan), so
+     * the table may skip blocks by their zone maps: a Zone Map Scan.
+     * @param condition  tested by the operator above (outliving the scan); its bounds are
+     *                   taken on each open(), for a prepared plan's parameters
+     */
+    void set_bounds(const Condition *condition);
+
+    /**
+     * Choose between a Seq Scan and a Zone Map Scan (set_bounds()) for rows matching a
+     * condition. A Zone Map Scan reads every block's zone map, and the blocks it can't rule
+     * out; with statistics, it is chosen if the blocks it expects to read (from the
+     * condition's selectivity on each column and how well the column's values follow
+     * storage order) make it cheaper. Without statistics, or with parameters, it always is:
+     * a zone map costs little next to a block.
+     */
+    void choose_scan(const Condition *condition);
+
+protected:
+    DbRelation &table;
+    Identifier qualifier;
+    DbCursor *cursor;
+    const Condition *bounds_condition;
+    ColumnStatisticsMap statistics;  // by the names of the columns as they come out
+    u_int64_t analyzed_blocks;       // blocks when analyzed, 0 for no statistics
+    u_int64_t analyzed_rows;
+
+    void do_open() override;
+
+    ValueDict *do_next() override;
+
+    bool do_next_batch(ColumnBatch &batch) override;
+
+    void do_close() override;
+};
+
+/**
+ * @class Filter - the input rows that satisfy a condition.
+ */
+class Filter : public PlanNode {
+public:
+    // condition is owned by the filter
+    Filter(PlanNode *input, Condition *condition);
+
+    ~Filter() override { delete condition; }
+
+    double estimate() override { return input->estimate() * condition->selectivity(input->column_statistics()); }
+
+protected:
+    Condition *condition;
+
+    ValueDict *do_next() override;
+};
+
+/**
+ * @class VectorFilter - a Filter that takes its input a batch at a time and tests each
+ *      comparison on a whole column at once, narrowing the batch's selection vector.
+ */
+class VectorFilter : public Filter {
+public:
+    VectorFilter(PlanNode *input, Condition *condition);
+
+protected:
+    ColumnBatch batch;
+    size_t position;  // next row of batch's selection for do_next()
+
+    void do_open() override;
+
+    ValueDict *do_next() override;
+
+    bool do_next_batch(ColumnBatch &batch) override;
+
+    // narrow the batch's selection to the rows that match
+    void filter(ColumnBatch &batch);
+};
+
+/**
+ * @class HashJoin - inner equi-join: every pair of a left and a right row whose key
+ *      columns are equal, merged into one row.
+ *
+ *      The input the planner expects to be smaller is the build side: it is read whole into
+ *      an open-addressing hash table (slots of hash and row number, probed linearly), then
+ *      the other, probe side streams past it. If the build side outgrows memory_budget
+ *      bytes, both sides are partitioned by key hash into a SpillFile instead, and joined a
+ *      partition at a time, each with its own hash table.
+ */
+class HashJoin : public PlanNode {
+public:
+    // partitions made when the build side spills
+    static constexpr u_int32_t PARTITIONS = 32;
+
+    /**
+     * @param left, right    the inputs (owned by the join)
+     * @param left_keys      key columns of left rows
+     * @param right_keys     the columns of right rows they must equal, in the same order
+     * @param memory_budget  bytes of build rows to hold before spilling
+     */
+    HashJoin(PlanNode *left, PlanNode *right, const ColumnNames &left_keys, const ColumnNames &right_keys,
+             size_t memory_budget);
+
+    ~HashJoin() override;
+
+    double estimate() override;
+
+    // both inputs' column statistics
+    const ColumnStatisticsMap &column_statistics() override;
+
+    std::vector<PlanNode *> get_inputs() const override { return {input, build}; }
+
+    // partitions the last run spilled to, 0 if the build side fit in memory
+    u_int32_t get_spilled_partitions() const { return spilled_partitions; }
+
+protected:
+    // a slot of the hash table; row is 1 + the row's index in rows, 0 for an empty slot
+    struct Slot {
+        u_int64_t hash;
+        u_int32_t row;
+    };
+
+    PlanNode *build;       // the input held in memory; input is the probe side
+    ColumnNames build_keys;
+    ColumnNames probe_keys;
+    size_t memory_budget;
+    std::string base_description;
+    ColumnStatisticsMap statistics;
+    ValueDicts rows;       // build rows in the table
+    size_t row_bytes;      // their approximate size
+    std::vector<Slot> slots;
+    ValueDict *probe_row;  // the probe row being matched, and where its search is up to
+    u_int64_t probe_hash;
+    size_t slot;
+    bool probing;          // the probe input is open, streaming rows (not spilled)
+    SpillFile *spill;
+    SpillReader *spill_reader;  // probe rows of the current partition
+    u_int32_t partition;
+    u_int32_t spilled_partitions;
+
+    void do_open() override;
+
+    ValueDict *do_next() override;
+
+    void do_close() override;
+
+    // hash of the key columns, or false if row lacks one
+    static bool hash_keys(const ValueDict &row, const ColumnNames &keys, u_int64_t &hash);
+
+    void index_rows();
+
+    void clear_rows();
+
+    // write a row to its partition: side 0 for build rows, 1 for probe rows
+    void spill_row(u_int8_t side, u_int64_t hash, const ValueDict &row);
+
+    // move on to the next partition's rows, returning false if there are no more
+    bool next_partition();
+
+    // the next probe row, and its hash, from the input or the current partition
+    ValueDict *next_probe_row(u_int64_t &hash);
+};
+
+/**
+ * @class LoserTree - picks the least of k keys again and again, as in a k-way merge.
+ *
+ *      Each internal node of the tournament holds the loser of the match played there, so
+ *      after the winner's key is replaced only the matches on its path to the root are
+ *      replayed: log2(k) comparisons per key instead of k. Keys are compared with memcmp.
+ */
+class LoserTree {
+public:
+    // start over with k entries, none of them finished
+    void reset(size_t k);
+
+    // entry i's key, to set before build() or, for the winner, before replay()
+    std::string &key(size_t i) { return keys[i]; }
+
+    // entry i has no more keys
+    void finish(size_t i) { finished[i] = true; }
+
+    // play every match; call once all the keys are set
+    void build();
+
+    // replay the winner's matches after its key changed or it finished
+    void replay();
+
+    // the entry with the least key
+    size_t winner() const { return top; }
+
+    // true once every entry has finished
+    bool empty() const { return keys.empty() || finished[top]; }
+
+protected:
+    std::vector<std::string> keys;
+    std::vector<bool> finished;
+    std::vector<size_t> losers;  // losers[n] for internal node n (1 to k - 1); leaf k + i is entry i
+    size_t top = 0;
+
+    // true if entry a wins over entry b
+    bool beats(size_t a, size_t b) const;
+
+    size_t play(size_t node);
+};
+
+/**
+ * @class Sort - the input rows in ORDER BY order (ties in input order).
+ *
+ *      Each row gets a normalized key, its sort columns encoded so that comparing two keys
+ *      with memcmp orders them like the values, then a sequence number. Rows are sorted in
+ *      memory while they fit in memory_budget bytes; beyond that each memory-full is sorted
+ *      and written out as a run to a SpillFile, and the runs are merged with a LoserTree.
+ */
+class Sort : public PlanNode {
+public:
+    /**
+     * @param columns        the columns to sort on, most significant first
+     * @param descending     for each column, true to sort it from largest to smallest
+     * @param memory_budget  bytes of rows to hold before spilling a run
+     */
+    Sort(PlanNode *input, const ColumnNames &columns, const std::vector<bool> &descending,
+         size_t memory_budget);
+
+    ~Sort() override;
+
+    double estimate() override { return input->estimate(); }
+
+    // runs the last open() wrote, 0 if the rows fit in memory
+    u_int32_t get_spilled_runs() const { return spilled_runs; }
+
+    /**
+     * Append value's normalized key to key: INTs as big-endian with the sign bit flipped,
+     * TEXT with 0 bytes escaped and ending in two 0 bytes, every byte inverted if descending.
+     */
+    static void normalize(const Value &value, bool descending, std::string &key);
+
+protected:
+    typedef std::pair<std::string, ValueDict *> Entry;  // normalized key and row
+
+    ColumnNames columns;
+    std::vector<bool> descending;
+    size_t memory_budget;
+    std::string base_description;
+    std::vector<Entry> entries;  // rows in memory, sorted before they are returned
+    size_t position;
+    u_int32_t sequence;
+    SpillFile *spill;
+    std::vector<SpillReader *> runs;
+    std::vector<ValueDict *> heads;  // each run's next row, whose key is in the tree
+    LoserTree tree;
+    u_int32_t spilled_runs;
+
+    void do_open() override;
+
+    ValueDict *do_next() override;
+
+    void do_close() override;
+
+    // the row's normalized key, with the next sequence number
+    std::string make_key(const ValueDict &row);
+
+    void clear_entries();
+
+    void spill_run();
+
+    // the next row of run i into the tree
+    void advance_run(size_t i);
+
+    static bool key_less(const Entry &a, const Entry &b);
+};
+
+/**
+ * @class TopN - the first count rows in ORDER BY order, for ORDER BY ... LIMIT: keeps the
+ *      count least rows so far in a max-heap, so it never holds more than count rows and
+ *      never spills.
+ */
+class TopN : public Sort {
+public:
+    TopN(PlanNode *input, const ColumnNames &columns, const std::vector<bool> &descending, u_int64_t count);
+
+    double estimate() override { return std::min(input->estimate(), (double) count); }
+
+protected:
+    u_int64_t count;
+
+    void do_open() override;
+};
+
+/**
+ * @class HashAggregate - GROUP BY: one row per group of input rows with equal group
+ *      columns, holding the group columns and the aggregates over the group's rows.
+ *
+ *      Groups are found through an open-addressing hash table on their normalized keys
+ *      (see Sort::normalize). Every aggregate keeps two int64 slots per group, all in one
+ *      flat array: a value (a sum, least or greatest INT, or index of a TEXT) and a count.
+ *      Once the groups outgrow memory_budget bytes no new groups are made; rows of groups
+ *      not already held are partitioned by key hash into a SpillFile and aggregated a
+ *      partition at a time after the groups in memory are returned. Without GROUP BY there
+ *      is exactly one group, even over no rows. COUNT(*) alone counts the input's batches
+ *      without making its rows, or, straight over a table scan, takes the table's row count
+ *      without reading the table at all.
+ */
+class HashAggregate : public PlanNode {
+public:
+    struct Aggregate {
+        enum Function {
+            COUNT, SUM, MIN, MAX, AVG
+        };
+        Function function;
+        Identifier column;                  // empty for COUNT(*)
+        ColumnAttribute::DataType data_type;  // the column's
+        Identifier name;                    // output column
+    };
+
+    // partitions made when the groups spill
+    static constexpr u_int32_t PARTITIONS = 32;
+
+    /**
+     * @param group_by       the group columns, none for a single group
+     * @param aggregates     what to compute for each group
+     * @param memory_budget  bytes of groups to hold before spilling
+     */
+    HashAggregate(PlanNode *input, const ColumnNames &group_by, const std::vector<Aggregate> &aggregates,
+                  size_t memory_budget);
+
+    ~HashAggregate() override;
+
+    double estimate() override;
+
+    // the type of an aggregate's output column
+    static ColumnAttribute::DataType output_type(const Aggregate &aggregate);
+
+    // input rows the last open() spilled
+    u_int64_t get_spilled_rows() const { return spilled_rows; }
+
+protected:
+    // a slot of the hash table; group is 1 + the group's number, 0 for an empty slot
+    struct Slot {
+        u_int64_t hash;
+        u_int32_t group;
+    };
+
+    ColumnNames group_by;
+    std::vector<Aggregate> aggregates;
+    size_t memory_budget;
+    bool count_only;                  // just COUNT(*)s, with no groups
+    TableScan *counted;               // input whose row count answers them, if any
+    std::string base_description;
+    std::vector<std::string> keys;    // normalized group key of each group
+    std::vector<Value> group_values;  // the group columns of each group, group_by.size() per group
+    std::vector<int64_t> states;      // 2 slots per aggregate per group
+    std::vector<std::string> texts;   // TEXT values of MIN and MAX
+    std::vector<Slot> slots;
+    size_t group_bytes;               // approximate size of the groups
+    size_t position;                  // next group to return
+    SpillFile *spill;
+    u_int32_t partition;              // next partition to aggregate
+    u_int64_t spilled_rows;
+
+    void do_open() override;
+
+    ValueDict *do_next() override;
+
+    void do_close() override;
+
+    // aggregate rows from input, spilling those of new groups if spill is set
+    void consume(PlanNode *input);
+
+    void consume(const ValueDict &row, bool may_spill);
+
+    // the number of the group with this key, made if need be, or -1 if there's no room
+    int64_t find_group(const std::string &key, u_int64_t hash, const ValueDict &row, bool may_spill);
+
+    void update(size_t group, const ValueDict &row);
+
+    void clear_groups();
+};
+
+/**
+ * @class Project - narrow each input row to the given columns.
+ */
+class Project : public PlanNode {
+public:
+    Project(PlanNode *input, const ColumnNames &column_names);
+
+    double estimate() override { return input->estimate(); }
+
+protected:
+    ColumnNames column_names;
+
+    ValueDict *do_next() override;
+};
+
+/**
+ * @class Limit - at most count input rows after skipping offset of them; stops pulling from
+ *      its input as soon as it has them.
+ */
+class Limit : public PlanNode {
+public:
+    Limit(PlanNode *input, u_int64_t count, u_int64_t offset = 0);
+
+    double estimate() override;
+
+protected:
+    u_int64_t count;
+    u_int64_t offset;
+    u_int64_t skipped;
+    u_int64_t returned;
+
+    void do_open() override;
+
+    ValueDict *do_next() override;
+};
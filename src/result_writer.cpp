@@ -0,0 +1,207 @@
+/**
+ * @file result_writer.cpp - implementation of the result writers
+ */
+#include "result_writer.h"
+
+#include <charconv>
+#include <stdexcept>
+
+//// ResultWriter
+
+const std::vector<std::string> ResultWriter::FORMATS = {"text", "csv", "binary"};
+
+std::unique_ptr<ResultWriter> ResultWriter::create(const std::string &format, std::ostream &out, bool header) {
+    if (format == "text")
+        return std::make_unique<TextWriter>(out);
+    if (format == "csv")
+        return std::make_unique<CsvWriter>(out, header);
+    if (format == "binary")
+        return std::make_unique<BinaryWriter>(out);
+    throw std::invalid_argument("unknown format '" + format + "'");
+}
+
+ResultWriter::~ResultWriter() {
+    try {
+        flush();
+    } catch (std::exception &e) {
+        // nothing to be done; the stream has its error state set
+    }
+}
+
+void ResultWriter::row(const ValueDict &row) {
+    begin_row();
+    for (size_t i = 0; i < column_names.size(); i++) {
+        auto found = row.find(column_names[i]);
+        if (found == row.end())
+            put_null(i);  // e.g. the MIN of no rows
+        else if (found->second.data_type == ColumnAttribute::INT)
+            put_int(i, found->second.n);
+        else
+            put_text(i, found->second.s);
+    }
+    end_row();
+    row_done();
+}
+
+void ResultWriter::batch(const ColumnBatch &batch) {
+    std::vector<int> columns;
+    for (auto const &column_name: column_names)
+        columns.push_back(batch.column_index(column_name));
+    for (size_t s = 0; s < batch.selected; s++) {
+        size_t r = batch.selection[s];
+        begin_row();
+        for (size_t i = 0; i < columns.size(); i++) {
+            int c = columns[i];
+            if (c < 0)
+                put_null(i);
+            else if (batch.column_attributes[c].get_data_type() == ColumnAttribute::INT)
+                put_int(i, batch.ints[c][r]);
+            else
+                put_text(i, batch.texts[c][r]);
+        }
+        end_row();
+        row_done();
+    }
+}
+
+void ResultWriter::flush() {
+    if (buffer.empty())
+        return;
+    out.write(buffer.data(), (std::streamsize) buffer.size());
+    written += buffer.size();
+    buffer.clear();
+}
+
+void ResultWriter::put_digits(int32_t n) {
+    char digits[16];
+    char *end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    buffer.append(digits, end - digits);
+}
+
+//// TextWriter
+
+void TextWriter::begin(const ColumnNames &column_names) {
+    this->column_names = column_names;
+    for (auto const &column_name: column_names) {
+        buffer += column_name;
+        buffer += ' ';
+    }
+    buffer += "\n+";
+    for (size_t i = 0; i < column_names.size(); i++)
+        buffer += "----------+";
+    buffer += '\n';
+}
+
+void TextWriter::put_null(size_t) {
+    buffer += "NULL ";
+}
+
+void TextWriter::put_int(size_t, int32_t n) {
+    put_digits(n);
+    buffer += ' ';
+}
+
+void TextWriter::put_text(size_t, const std::string &s) {
+    buffer += '"';
+    buffer += s;
+    buffer += "\" ";
+}
+
+void TextWriter::end_row() {
+    buffer += '\n';
+}
+
+void TextWriter::end(const std::string &message) {
+    buffer += message;
+    buffer += '\n';
+    flush();
+}
+
+//// CsvWriter
+
+// a field that CsvReader would split or unquote needs quotes, and so does an empty TEXT (to tell it from NULL)
+static void put_csv_field(std::string &buffer, const std::string &s) {
+    if (!s.empty() && s.find_first_of(",\"\r\n") == std::string::npos) {
+        buffer += s;
+        return;
+    }
+    buffer += '"';
+    for (char c: s) {
+        if (c == '"')
+            buffer += '"';
+        buffer += c;
+    }
+    buffer += '"';
+}
+
+void CsvWriter::begin(const ColumnNames &column_names) {
+    this->column_names = column_names;
+    if (!header)
+        return;
+    for (size_t i = 0; i < column_names.size(); i++) {
+        if (i > 0)
+            buffer += ',';
+        put_csv_field(buffer, column_names[i]);
+    }
+    buffer += '\n';
+}
+
+void CsvWriter::put_null(size_t column) {
+    if (column > 0)
+        buffer += ',';
+}
+
+void CsvWriter::put_int(size_t column, int32_t n) {
+    if (column > 0)
+        buffer += ',';
+    put_digits(n);
+}
+
+void CsvWriter::put_text(size_t column, const std::string &s) {
+    if (column > 0)
+        buffer += ',';
+    put_csv_field(buffer, s);
+}
+
+void CsvWriter::end_row() {
+    buffer += '\n';
+}
+
+void CsvWriter::end(const std::string &) {
+    flush();
+}
+
+//// BinaryWriter
+
+void BinaryWriter::begin(const ColumnNames &column_names) {
+    this->column_names = column_names;
+    buffer += MAGIC;
+    u_int16_t count = column_names.size();
+    buffer.append((const char *) &count, sizeof(count));
+    for (auto const &column_name: column_names) {
+        u_int16_t size = column_name.size();
+        buffer.append((const char *) &size, sizeof(size));
+        buffer += column_name;
+    }
+}
+
+void BinaryWriter::put_null(size_t) {
+    buffer += '\0';
+}
+
+void BinaryWriter::put_int(size_t, int32_t n) {
+    buffer += '\1';
+    buffer.append((const char *) &n, sizeof(n));
+}
+
+void BinaryWriter::put_text(size_t, const std::string &s) {
+    u_int32_t size = s.size();
+    buffer += '\2';
+    buffer.append((const char *) &size, sizeof(size));
+    buffer += s;
+}
+
+void BinaryWriter::end(const std::string &) {
+    buffer += '\0';
+    flush();
+}
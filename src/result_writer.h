@@ -0,0 +1,167 @@
+/**
+ * @file result_writer.h - formatting query results for the client or a file.
+ * ResultWriter
+ * TextWriter
+ * CsvWriter
+ * BinaryWriter
+ *
+ * A writer is handed the column names, then the rows as they come out of the plan, one at a
+ * time or a ColumnBatch at a time, then the closing message, so a result is never held in
+ * memory to be printed. Values are formatted straight into a buffer (numbers with to_chars)
+ * that goes to the stream a large block at a time, so a big result costs one stream write per
+ * BUFFER_SIZE bytes rather than a few per value. A format is the handful of put_* hooks.
+ */
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class ResultWriter - abstract buffered writer of a result in some format.
+ */
+class ResultWriter {
+public:
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    // names accepted by create()
+    static const std::vector<std::string> FORMATS;
+
+    /**
+     * @param format  "text", "csv" or "binary"
+     * @param out     stream to write to (outliving the writer)
+     * @param header  whether a CSV result starts with a line of column names
+     * @throws std::invalid_argument for an unknown format
+     */
+    static std::unique_ptr<ResultWriter> create(const std::string &format, std::ostream &out, bool header = true);
+
+    explicit ResultWriter(std::ostream &out) : out(out), rows(0), written(0) { buffer.reserve(BUFFER_SIZE + 4096); }
+
+    // flushes whatever is still buffered
+    virtual ~ResultWriter();
+
+    ResultWriter(const ResultWriter &other) = delete;
+
+    ResultWriter &operator=(const ResultWriter &other) = delete;
+
+    virtual void begin(const ColumnNames &column_names) = 0;
+
+    // a column missing from the row is written as NULL
+    virtual void row(const ValueDict &row);
+
+    // the batch's selected rows
+    virtual void batch(const ColumnBatch &batch);
+
+    virtual void end(const std::string &message) = 0;
+
+    // hand the buffered bytes to the stream
+    virtual void flush();
+
+    u_int64_t get_rows() const { return rows; }
+
+    // bytes written so far, buffered or not
+    u_int64_t get_bytes() const { return written + buffer.size(); }
+
+protected:
+    std::ostream &out;
+    std::string buffer;
+    ColumnNames column_names;
+    u_int64_t rows;
+    u_int64_t written;  // bytes handed to the stream
+
+    virtual void begin_row() {}
+
+    virtual void put_null(size_t column) = 0;
+
+    virtual void put_int(size_t column, int32_t n) = 0;
+
+    virtual void put_text(size_t column, const std::string &s) = 0;
+
+    virtual void end_row() = 0;
+
+    void put_digits(int32_t n);
+
+    // flush if the row just written filled the buffer
+    void row_done() {
+        rows++;
+        if (buffer.size() >= BUFFER_SIZE)
+            flush();
+    }
+};
+
+/**
+ * @class TextWriter - the shell's format: space-separated values, TEXT in double quotes.
+ */
+class TextWriter : public ResultWriter {
+public:
+    explicit TextWriter(std::ostream &out) : ResultWriter(out) {}
+
+    void begin(const ColumnNames &column_names) override;
+
+    void end(const std::string &message) override;
+
+protected:
+    void put_null(size_t column) override;
+
+    void put_int(size_t column, int32_t n) override;
+
+    void put_text(size_t column, const std::string &s) override;
+
+    void end_row() override;
+};
+
+/**
+ * @class CsvWriter - RFC 4180 CSV, as CsvReader reads it: a field is quoted (with "" for a
+ *      quote) only when it holds a comma, quote or line break, or is an empty TEXT; NULL is
+ *      an empty unquoted field. The message is not written.
+ */
+class CsvWriter : public ResultWriter {
+public:
+    explicit CsvWriter(std::ostream &out, bool header = true) : ResultWriter(out), header(header) {}
+
+    void begin(const ColumnNames &column_names) override;
+
+    void end(const std::string &message) override;
+
+protected:
+    bool header;
+
+    void put_null(size_t column) override;
+
+    void put_int(size_t column, int32_t n) override;
+
+    void put_text(size_t column, const std::string &s) override;
+
+    void end_row() override;
+};
+
+/**
+ * @class BinaryWriter - a compact row format for programs: the magic "LLR1", a u16 column
+ *      count and each name (u16 length, bytes), then for each row a 1 byte, and for each
+ *      column a type byte (0 NULL, 1 INT, 2 TEXT) followed by a 4-byte INT or a u32 length
+ *      and the bytes, in native byte order; a 0 byte ends the rows. The message is not written.
+ */
+class BinaryWriter : public ResultWriter {
+public:
+    static constexpr std::string_view MAGIC = "LLR1";
+
+    explicit BinaryWriter(std::ostream &out) : ResultWriter(out) {}
+
+    void begin(const ColumnNames &column_names) override;
+
+    void end(const std::string &message) override;
+
+protected:
+    void begin_row() override { buffer += '\1'; }
+
+    void put_null(size_t column) override;
+
+    void put_int(size_t column, int32_t n) override;
+
+    void put_text(size_t column, const std::string &s) override;
+
+    void end_row() override {}
+};
@@ -4,6 +4,7 @@
  * @see "Seattle University, CPSC5300, Winter Quarter 2024"
  */
 #include "schema_tables.h"
+#include "db_env.h"
 #include "parse_tree_to_string.h"
 
 
@@ -14,6 +15,9 @@ void initialize_schema_tables() {
     Columns columns;
     columns.create_if_not_exists();
     columns.close();
+    Statistics statistics;
+    statistics.create_if_not_exists();
+    statistics.close();
 }
 
 // Not terribly useful since the parser weeds most of these out
@@ -44,7 +48,9 @@ bool is_acceptable_data_type(std::string dt) {
  */
 const Identifier Tables::TABLE_NAME = "_tables";
 Columns *Tables::columns_table = nullptr;
+Statistics *Tables::statistics_table = nullptr;
 std::map<Identifier, DbRelation *> Tables::table_cache;
+std::atomic<u_int64_t> Tables::version(0);
 
 // get the column name for _tables column
 ColumnNames &Tables::COLUMN_NAMES() {
@@ -70,6 +76,9 @@ Tables::Tables() : BTTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
     if (Tables::columns_table == nullptr)
         columns_table = new Columns();
     Tables::table_cache[columns_table->TABLE_NAME] = columns_table;
+    if (Tables::statistics_table == nullptr)
+        statistics_table = new Statistics();
+    Tables::table_cache[statistics_table->TABLE_NAME] = statistics_table;
 }
 
 // Create the file and also, manually add schema tables.
@@ -94,6 +103,7 @@ Handle Tables::insert(const ValueDict *row) {
     {
         throw DbRelationError(row->at("table_name").s + " already exists");
     }
+    Tables::version++;
     return BTTable::insert(row);
 }
 
@@ -111,6 +121,7 @@ void Tables::del(Handle handle) {
         delete table;
     }
 
+    Tables::version++;
     BTTable::del(handle);
 }
 
@@ -230,5 +241,131 @@ Handle Columns::insert(const ValueDict *row) {
         throw DbRelationError("duplicate column " + row->at("table_name").s + "." + row->at("column_name").s);
     }
 
+    Tables::version++;
     return BTTable::insert(row);
 }
+
+
+/*
+ * *******************************
+ * Statistics class implementation
+ * *******************************
+ */
+const Identifier Statistics::TABLE_NAME = "_statistics";
+
+// get the column names for the _statistics table
+ColumnNames &Statistics::COLUMN_NAMES() {
+    static ColumnNames cn = {"table_name", "column_name", "rows", "blocks", "distinct_values", "correlation",
+                             "histogram"};
+    return cn;
+}
+
+// get the column attributes for the _statistics table
+ColumnAttributes &Statistics::COLUMN_ATTRIBUTES() {
+    static ColumnAttributes cas = {ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::TEXT),
+                                   ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT),
+                                   ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT),
+                                   ColumnAttribute(ColumnAttribute::TEXT)};
+    return cas;
+}
+
+Statistics::Statistics() : BTTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
+}
+
+// Create the file and enter it in _tables and _columns (which may be older than it), without
+// going through a Tables, which would take the place of the one the rest of the process uses.
+void Statistics::create() {
+    BTTransaction txn;
+    BTTable::create();
+    BTTable tables(Tables::TABLE_NAME, Tables::COLUMN_NAMES(), Tables::COLUMN_ATTRIBUTES());
+    ValueDict row;
+    row["table_name"] = Value(TABLE_NAME);
+    Handles *handles = tables.select(&row);
+    if (handles->empty())
+        tables.insert(&row);
+    delete handles;
+    Columns columns;
+    for (size_t i = 0; i < COLUMN_NAMES().size(); i++) {
+        row["column_name"] = Value(COLUMN_NAMES()[i]);
+        row["data_type"] = Value(COLUMN_ATTRIBUTES()[i].get_data_type() == ColumnAttribute::INT ? "INT" : "TEXT");
+        try {
+            columns.insert(&row);
+        } catch (DbRelationError &e) {
+            // already there
+        }
+    }
+    txn.commit();
+    Tables::version++;
+}
+
+const TableStatistics &Statistics::analyze(const Identifier &table_name, DbRelation &table) {
+    std::unique_ptr<TableStatistics> statistics;
+    {
+        ReadSnapshot snapshot("ANALYZE " + table_name);
+        statistics = std::make_unique<TableStatistics>(TableStatistics::collect(table));
+    }
+    this->create_if_not_exists();
+    DbEnv::write_transaction([&]() {
+        this->delete_rows(table_name);
+        for (auto const &[column_name, column]: statistics->columns) {
+            char correlation[16];
+            snprintf(correlation, sizeof(correlation), "%.3f", column.correlation);
+            ValueDict row = {{"table_name", Value(table_name)}, {"column_name", Value(column_name)},
+                             {"rows", Value((int32_t) statistics->rows)},
+                             {"blocks", Value((int32_t) statistics->blocks)},
+                             {"distinct_values", Value((int32_t) column.distinct)},
+                             {"correlation", Value(std::string(correlation))},
+                             {"histogram", Value(column.histogram_text())}};
+            BTTable::insert(&row);
+        }
+    });
+    Tables::version++;  // plans made without these may now be made differently
+    return *(this->cache[table_name] = std::move(statistics));
+}
+
+const TableStatistics *Statistics::get(const Identifier &table_name) {
+    auto cached = this->cache.find(table_name);
+    if (cached != this->cache.end())
+        return cached->second.get();
+    std::unique_ptr<TableStatistics> statistics;
+    try {
+        this->open();
+    } catch (DbException &e) {
+        return nullptr;  // nothing analyzed yet
+    }
+    ValueDict where = {{"table_name", Value(table_name)}};
+    Handles *handles = this->select(&where);
+    for (auto const &handle: *handles) {
+        ValueDict *row = this->project(handle);
+        if (statistics == nullptr)
+            statistics = std::make_unique<TableStatistics>();
+        statistics->rows = (u_int32_t) row->at("rows").n;
+        statistics->blocks = (u_int32_t) row->at("blocks").n;
+        ColumnStatistics &column = statistics->columns[row->at("column_name").s];
+        column.distinct = (u_int32_t) row->at("distinct_values").n;
+        column.correlation = std::stod(row->at("correlation").s);
+        column.set_histogram(row->at("histogram").s);
+        delete row;
+    }
+    delete handles;
+    return (this->cache[table_name] = std::move(statistics)).get();
+}
+
+void Statistics::remove(const Identifier &table_name) {
+    try {
+        this->open();
+    } catch (DbException &e) {
+        return;
+    }
+    DbEnv::write_transaction([&]() { this->delete_rows(table_name); });
+    this->cache.erase(table_name);
+    Tables::version++;
+}
+
+void Statistics::delete_rows(const Identifier &table_name) {
+    ValueDict where = {{"table_name", Value(table_name)}};
+    Handles *handles = this->select(&where);
+    for (auto const &handle: *handles)
+        this->del(handle);
+    delete handles;
+}
@@ -2,12 +2,16 @@
  * @file schema_tables.h - schema table classes:
  * 		Columns
  * 		Tables
+ * 		Statistics
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Winter Quarter 2024"
  */
 #pragma once
+#include <atomic>
 #include <iostream>
+#include <memory>
 #include "heap_storage.h"
+#include "table_statistics.h"
 
 /**
  * Initialize access to the schema tables.
@@ -19,6 +23,8 @@ void initialize_schema_tables();
 
 class Columns; // forward declare
 
+class Statistics;
+
 /**
  * @class Tables - The singleton table that stores the metadata for all other tables.
  * For now, we are not indexing anything, so a query requires sequential scan
@@ -60,6 +66,15 @@ public:
      */
     virtual DbRelation &get_table(Identifier table_name);
 
+    // the _statistics table
+    virtual Statistics &get_statistics() { return *statistics_table; }
+
+    /**
+     * Count of changes to _tables and _columns in this process, so anything worked out
+     * from the catalog (a cached plan, say) can tell when it is out of date.
+     */
+    static u_int64_t get_version() { return version; }
+
 protected:
     // hard-coded columns for _tables table
     static ColumnNames &COLUMN_NAMES();
@@ -69,6 +84,14 @@ protected:
     // keep a reference to the columns table (for get_columns method)
     static Columns *columns_table;
 
+    static Statistics *statistics_table;
+
+    static std::atomic<u_int64_t> version;
+
+    friend class Columns;  // bumps version
+
+    friend class Statistics;  // bumps version
+
 private:
     // keep a cache of all the tables we've instantiated so far
     static std::map<Identifier, DbRelation *> table_cache;
@@ -103,3 +126,55 @@ protected:
 };
 
 
+/**
+ * @class Statistics - The singleton table that stores what ANALYZE found out about each
+ * table: a row per column, with the table's row and block counts, the column's number of
+ * distinct values and, for an INT column, its correlation with storage order and its
+ * histogram. It is created (and entered in _tables and _columns) when first needed, so
+ * databases made before it get one too.
+ */
+class Statistics : public BTTable {
+public:
+    /**
+     * Name of the statistics table ("_statistics")
+     */
+    static const Identifier TABLE_NAME;
+
+    // ctor/dtor
+    Statistics();
+
+    virtual ~Statistics() {}
+
+    // HeapTable overrides
+    virtual void create();
+
+    /**
+     * Collect the statistics of a table and replace any it had.
+     * @param table_name  the table's name
+     * @param table       the table
+     * @returns           what was collected
+     */
+    virtual const TableStatistics &analyze(const Identifier &table_name, DbRelation &table);
+
+    /**
+     * The statistics of a table.
+     * @param table_name  the table's name
+     * @returns           its statistics, or nullptr if it hasn't been analyzed
+     */
+    virtual const TableStatistics *get(const Identifier &table_name);
+
+    // forget a table's statistics (when it is dropped)
+    virtual void remove(const Identifier &table_name);
+
+protected:
+    // hard-coded columns for the _statistics table
+    static ColumnNames &COLUMN_NAMES();
+
+    static ColumnAttributes &COLUMN_ATTRIBUTES();
+
+    // statistics read so far, by table; nullptr for a table that has none
+    std::map<Identifier, std::unique_ptr<TableStatistics>> cache;
+
+    // delete a table's rows
+    virtual void delete_rows(const Identifier &table_name);
+};
@@ -0,0 +1,156 @@
+/**
+ * @file simd_filter.cpp - implementation of the comparison kernels
+ */
+#include "simd_filter.h"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void (*CompareKernel)(const int32_t *values, size_t n, int32_t constant, u_int64_t *bitmap);
+
+template<CompareOp OP>
+static inline bool compare(int32_t value, int32_t constant) {
+    switch (OP) {
+        case COMPARE_EQ:    return value == constant;
+        case COMPARE_NE:    return value != constant;
+        case COMPARE_LT:    return value < constant;
+        case COMPARE_LE:    return value <= constant;
+        case COMPARE_GT:    return value > constant;
+        case COMPARE_GE:    return value >= constant;
+    }
+    return false;
+}
+
+// values from start on, a bit at a time (bitmap already zeroed)
+template<CompareOp OP>
+static void compare_scalar(const int32_t *values, size_t start, size_t n, int32_t constant, u_int64_t *bitmap) {
+    for (size_t i = start; i < n; i++)
+        bitmap[i / 64] |= (u_int64_t) compare<OP>(values[i], constant) << (i % 64);
+}
+
+template<CompareOp OP>
+static void kernel_scalar(const int32_t *values, size_t n, int32_t constant, u_int64_t *bitmap) {
+    memset(bitmap, 0, (n + 63) / 64 * sizeof(u_int64_t));
+    compare_scalar<OP>(values, 0, n, constant, bitmap);
+}
+
+#if defined(__x86_64__)
+
+// x86 only has == and >, so the rest are those with the operands swapped and/or the result flipped
+template<CompareOp OP>
+static constexpr bool inverted() { return OP == COMPARE_NE || OP == COMPARE_LE || OP == COMPARE_GE; }
+
+template<CompareOp OP>
+static void kernel_sse2(const int32_t *values, size_t n, int32_t constant, u_int64_t *bitmap) {
+    memset(bitmap, 0, (n + 63) / 64 * sizeof(u_int64_t));
+    const __m128i c = _mm_set1_epi32(constant);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (values + i));
+        __m128i mask;
+        if (OP == COMPARE_EQ || OP == COMPARE_NE)
+            mask = _mm_cmpeq_epi32(v, c);
+        else if (OP == COMPARE_GT || OP == COMPARE_LE)
+            mask = _mm_cmpgt_epi32(v, c);
+        else
+            mask = _mm_cmpgt_epi32(c, v);
+        u_int64_t bits = (u_int64_t) _mm_movemask_ps(_mm_castsi128_ps(mask));
+        if (inverted<OP>())
+            bits ^= 0xF;
+        bitmap[i / 64] |= bits << (i % 64);
+    }
+    compare_scalar<OP>(values, i, n, constant, bitmap);
+}
+
+template<CompareOp OP>
+__attribute__((target("avx2")))
+static void kernel_avx2(const int32_t *values, size_t n, int32_t constant, u_int64_t *bitmap) {
+    memset(bitmap, 0, (n + 63) / 64 * sizeof(u_int64_t));
+    const __m256i c = _mm256_set1_epi32(constant);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (values + i));
+        __m256i mask;
+        if (OP == COMPARE_EQ || OP == COMPARE_NE)
+            mask = _mm256_cmpeq_epi32(v, c);
+        else if (OP == COMPARE_GT || OP == COMPARE_LE)
+            mask = _mm256_cmpgt_epi32(v, c);
+        else
+            mask = _mm256_cmpgt_epi32(c, v);
+        u_int64_t bits = (u_int64_t) _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+        if (inverted<OP>())
+            bits ^= 0xFF;
+        bitmap[i / 64] |= bits << (i % 64);
+    }
+    compare_scalar<OP>(values, i, n, constant, bitmap);
+}
+
+#endif
+
+// kernels by level, then op
+#define KERNELS(kernel) { kernel<COMPARE_EQ>, kernel<COMPARE_NE>, kernel<COMPARE_LT>, \
+                          kernel<COMPARE_LE>, kernel<COMPARE_GT>, kernel<COMPARE_GE> }
+
+static const CompareKernel KERNEL_TABLE[][6] = {
+        KERNELS(kernel_scalar),
+#if defined(__x86_64__)
+        KERNELS(kernel_sse2),
+        KERNELS(kernel_avx2),
+#endif
+};
+
+SimdLevel simd_supported() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    return SIMD_SSE2;  // part of x86-64
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+static std::atomic<int> current_level(-1);
+
+SimdLevel simd_level() {
+    int level = current_level.load(std::memory_order_relaxed);
+    if (level < 0) {
+        level = simd_supported();
+        current_level.store(level, std::memory_order_relaxed);
+    }
+    return (SimdLevel) level;
+}
+
+bool set_simd_level(SimdLevel level) {
+    if (level > simd_supported())
+        return false;
+    current_level.store(level, std::memory_order_relaxed);
+    return true;
+}
+
+const char *simd_level_name(SimdLevel level) {
+    static const char *NAMES[] = {"scalar", "sse2", "avx2"};
+    return NAMES[level];
+}
+
+void compare_int32(const int32_t *values, size_t n, CompareOp op, int32_t constant, u_int64_t *bitmap) {
+    KERNEL_TABLE[simd_level()][op](values, n, constant, bitmap);
+}
+
+size_t bitmap_to_selection(const u_int64_t *bitmap, size_t n, u_int16_t *selection) {
+    size_t count = 0;
+    for (size_t word = 0; word < (n + 63) / 64; word++) {
+        u_int64_t bits = bitmap[word];
+        if (n - word * 64 < 64)
+            bits &= (1ULL << (n - word * 64)) - 1;
+        while (bits != 0) {
+            selection[count++] = (u_int16_t) (word * 64 + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+    return count;
+}
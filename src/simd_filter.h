@@ -0,0 +1,57 @@
+/**
+ * @file simd_filter.h - comparison kernels for vectorized filters.
+ * compare_int32
+ * bitmap_to_selection
+ *
+ * A filter over a ColumnBatch compares a whole INT column with a constant at once, giving
+ * a bitmap of the rows that pass (one bit per row, 64 rows per word), combines bitmaps
+ * for AND/OR/NOT, and turns the result into a selection vector. The comparison has AVX2
+ * and SSE2 versions besides the scalar one; the best the CPU supports is picked the first
+ * time it is used.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+/**
+ * Comparisons, in the same order as Condition's.
+ */
+enum CompareOp {
+    COMPARE_EQ, COMPARE_NE, COMPARE_LT, COMPARE_LE, COMPARE_GT, COMPARE_GE
+};
+
+/**
+ * Instruction sets the kernels can use.
+ */
+enum SimdLevel {
+    SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2
+};
+
+/**
+ * Set bit i of bitmap if values[i] <op> constant, for every i < n.
+ * @param bitmap  (n + 63) / 64 words, all of them overwritten
+ */
+void compare_int32(const int32_t *values, size_t n, CompareOp op, int32_t constant, u_int64_t *bitmap);
+
+/**
+ * The positions of the set bits among the first n, in order.
+ * @param selection  room for n positions
+ * @returns          how many there are
+ */
+size_t bitmap_to_selection(const u_int64_t *bitmap, size_t n, u_int16_t *selection);
+
+// the best level this CPU supports
+SimdLevel simd_supported();
+
+// the level compare_int32 is using
+SimdLevel simd_level();
+
+/**
+ * Make compare_int32 use the given level, e.g. to compare them.
+ * @returns  false (and no change) if the CPU doesn't support it
+ */
+bool set_simd_level(SimdLevel level);
+
+const char *simd_level_name(SimdLevel level);
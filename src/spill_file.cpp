@@ -0,0 +1,160 @@
+/**
+ * @file spill_file.cpp - implementation of SpillFile and SpillReader
+ */
+#include "spill_file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <unistd.h>
+#include "db_env.h"
+#include "heap_storage.h"
+#include "stats.h"
+
+static void check(int status) {
+    if (status)
+        throw DbException(status, std::generic_category(), mdb_strerror(status));
+}
+
+//// SpillFile
+
+SpillFile::SpillFile() : dbi(0), pending_bytes(0), entries(0) {
+    static std::atomic<u_int64_t> files(0);
+    this->name = "_spill_" + std::to_string(getpid()) + "_" + std::to_string(files++);
+    DbEnv::write_transaction([this]() {
+        check(mdb_dbi_open(BTTransaction::current()->get_txn(), this->name.c_str(), MDB_CREATE, &this->dbi));
+    });
+}
+
+SpillFile::~SpillFile() {
+    try {
+        DbEnv::write_transaction([this]() { check(mdb_drop(BTTransaction::current()->get_txn(), this->dbi, 1)); });
+    } catch (DbException &e) {
+        // nothing to be done; the database is left behind until it is dropped by hand
+    }
+}
+
+void SpillFile::put(const std::string &key, const ValueDict &row) {
+    std::string bytes;
+    encode(row, bytes);
+    this->pending_bytes += key.size() + bytes.size();
+    this->pending.emplace_back(key, std::move(bytes));
+    this->entries++;
+    if (this->pending_bytes >= FLUSH_BYTES)
+        this->flush();
+}
+
+void SpillFile::flush() {
+    if (this->pending.empty())
+        return;
+    std::sort(this->pending.begin(), this->pending.end());
+    std::string last_key;
+    DbEnv::write_transaction([this, &last_key]() {
+        last_key = this->last_key;
+        for (auto &[key, bytes]: this->pending) {
+            MDB_val k(key.size(), key.data()), data(bytes.size(), bytes.data());
+            // in key order past everything already written (a sorted run, say) is an append
+            unsigned int flags = last_key.empty() || key > last_key ? MDB_APPEND : 0;
+            check(mdb_put(BTTransaction::current()->get_txn(), this->dbi, &k, &data, flags));
+            last_key = std::max(last_key, key);
+        }
+    });
+    this->last_key = last_key;
+    Stats::count(COUNTER_ROWS_SPILLED, this->pending.size());
+    this->pending.clear();
+    this->pending_bytes = 0;
+}
+
+// each column as: name length (1 byte), name, type (1 byte), then 4 bytes of INT, or a
+// 4-byte length and the bytes of TEXT
+void SpillFile::encode(const ValueDict &row, std::string &bytes) {
+    bytes.clear();
+    for (auto const &[column_name, value]: row) {
+        bytes += (char) column_name.size();
+        bytes += column_name;
+        bytes += (char) value.data_type;
+        if (value.data_type == ColumnAttribute::TEXT) {
+            u_int32_t size = value.s.size();
+            bytes.append((const char *) &size, sizeof(size));
+            bytes += value.s;
+        } else {
+            bytes.append((const char *) &value.n, sizeof(value.n));
+        }
+    }
+}
+
+ValueDict *SpillFile::decode(const void *bytes, size_t size) {
+    const char *p = (const char *) bytes, *end = p + size;
+    ValueDict *row = new ValueDict();
+    while (p < end) {
+        size_t name_size = (u_char) *p++;
+        Identifier column_name(p, name_size);
+        p += name_size;
+        ColumnAttribute::DataType data_type = (ColumnAttribute::DataType) *p++;
+        Value &value = (*row)[column_name];
+        if (data_type == ColumnAttribute::TEXT) {
+            u_int32_t text_size;
+            memcpy(&text_size, p, sizeof(text_size));
+            p += sizeof(text_size);
+            value = Value(std::string(p, text_size));
+            p += text_size;
+        } else {
+            memcpy(&value.n, p, sizeof(value.n));
+            value.data_type = data_type;
+            p += sizeof(value.n);
+        }
+    }
+    return row;
+}
+
+void SpillFile::append_key(std::string &key, u_int32_t n) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        key += (char) (n >> shift);
+}
+
+//// SpillReader
+
+SpillReader::SpillReader(SpillFile &file, const std::string &from, const std::string &to)
+        : file(file), to(to), position(0), resume(from), done(false) {}
+
+ValueDict *SpillReader::next() {
+    if (this->position == this->chunk.size()) {
+        if (this->done)
+            return nullptr;
+        this->fetch();
+        if (this->chunk.empty())
+            return nullptr;
+    }
+    auto &[key, bytes] = this->chunk[this->position++];
+    this->key = key;
+    return SpillFile::decode(bytes.data(), bytes.size());
+}
+
+// the next CHUNK entries of the range, in one read transaction of its own: the statement's
+// snapshot (see ReadSnapshot) began before the rows were spilled
+void SpillReader::fetch() {
+    this->chunk.clear();
+    this->position = 0;
+    BTTransaction txn(MDB_RDONLY, BTTransaction::SEPARATE);
+    MDB_cursor *cursor;
+    check(mdb_cursor_open(txn.get_txn(), this->file.get_dbi(), &cursor));
+    MDB_val key(this->resume.size(), this->resume.data()), data;
+    int status = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    this->done = true;
+    while (status == 0) {
+        std::string found((const char *) key.mv_data, key.mv_size);
+        if (!this->to.empty() && found >= this->to)
+            break;
+        if (this->chunk.size() == CHUNK) {
+            this->resume = found;
+            this->done = false;
+            break;
+        }
+        this->chunk.emplace_back(found, std::string((const char *) data.mv_data, data.mv_size));
+        status = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    mdb_cursor_close(cursor);
+    if (status != 0 && status != MDB_NOTFOUND)
+        check(status);
+    txn.commit();
+}
@@ -0,0 +1,103 @@
+/**
+ * @file spill_file.h - temporary LMDB databases for operators that outgrow memory.
+ * SpillFile
+ * SpillReader
+ *
+ * An operator over its memory budget (work-mem) writes rows out to a SpillFile, a named
+ * database of its own in the environment, and reads them back in key order later. Rows
+ * are keyed by the operator (so it can group them, e.g. by partition) and stored in a
+ * compact self-describing encoding. Writes are buffered and go in one transaction per
+ * buffer-full; reads take a chunk of entries per read transaction, so neither holds a
+ * transaction open while the rest of the plan runs. The database is dropped when the
+ * SpillFile is destroyed.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class SpillFile - a temporary database of (key, encoded row) entries.
+ */
+class SpillFile {
+public:
+    // bytes of entries buffered before they are written out
+    static const size_t FLUSH_BYTES = 1024 * 1024;
+
+    SpillFile();
+
+    virtual ~SpillFile();
+
+    SpillFile(const SpillFile &other) = delete;
+
+    SpillFile &operator=(const SpillFile &other) = delete;
+
+    /**
+     * Add an entry (buffered until flush()). Keys must be unique.
+     */
+    virtual void put(const std::string &key, const ValueDict &row);
+
+    // write out the buffered entries; readers only see flushed entries
+    virtual void flush();
+
+    // number of entries put so far
+    u_int64_t size() const { return entries; }
+
+    const std::string &get_name() const { return name; }
+
+    MDB_dbi get_dbi() const { return dbi; }
+
+    static void encode(const ValueDict &row, std::string &bytes);
+
+    // @returns  the row (freed by caller)
+    static ValueDict *decode(const void *bytes, size_t size);
+
+    // big-endian, so the bytes sort like the number
+    static void append_key(std::string &key, u_int32_t n);
+
+protected:
+    std::string name;
+    MDB_dbi dbi;
+    std::vector<std::pair<std::string, std::string>> pending;
+    size_t pending_bytes;
+    std::string last_key;  // greatest key written so far
+    u_int64_t entries;
+};
+
+/**
+ * @class SpillReader - the entries of a SpillFile with keys in [from, to), in key order.
+ */
+class SpillReader {
+public:
+    // entries fetched per read transaction
+    static const size_t CHUNK = 256;
+
+    /**
+     * @param file  the file (flushed, and outliving the reader)
+     * @param from  first key, inclusive
+     * @param to    last key, exclusive; empty for the end of the file
+     */
+    SpillReader(SpillFile &file, const std::string &from, const std::string &to = "");
+
+    virtual ~SpillReader() {}
+
+    /**
+     * @returns  the next row (freed by caller), or nullptr at the end of the range
+     */
+    virtual ValueDict *next();
+
+    // key of the row next() last returned
+    const std::string &get_key() const { return key; }
+
+protected:
+    SpillFile &file;
+    std::string to;
+    std::string key;
+    std::vector<std::pair<std::string, std::string>> chunk;
+    size_t position;
+    std::string resume;  // key to continue from, or empty when the range is used up
+    bool done;
+
+    void fetch();
+};
@@ -4,62 +4,392 @@
  * @see "Seattle University, CPSC5300, Winter Quarter 2024"
  */
 #include "sql_exec.h"
+#include "csv_reader.h"
+#include "db_env.h"
+#include "parse_tree_to_string.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <sstream>
+#include <unordered_map>
 
 using namespace std;
 using namespace hsql;
 
 // define static data
 Tables *SQLExec::tables = nullptr;
+map<Identifier, shared_ptr<PreparedStatement>> SQLExec::prepared_statements;
+
+// the statement cache: most recently used first, and by normalized text
+typedef list<pair<string, shared_ptr<PreparedStatement>>> StatementList;
+static StatementList cached_statements;
+static unordered_map<string, StatementList::iterator> cache_index;
+
+// the prepared statement being planned or run on this thread, whose ? parameters are in use
+static thread_local PreparedStatement *bound_statement = nullptr;
+
+struct ParameterScope {
+    PreparedStatement *outer;
+
+    explicit ParameterScope(PreparedStatement *statement) : outer(bound_statement) { bound_statement = statement; }
+
+    ~ParameterScope() { bound_statement = outer; }
+};
+
+/**
+ * An INT literal from the AST, negated if it is under a unary minus.
+ * @returns  false if expr isn't an INT literal
+ * @throws   SQLExecError if it doesn't fit in an INT
+ */
+static bool int_literal(const Expr *expr, int32_t &n) {
+    bool negative = expr->type == kExprOperator && expr->opType == kOpUnaryMinus;
+    if (negative)
+        expr = expr->expr;
+    if (expr->type != kExprLiteralInt)
+        return false;
+    int64_t value = negative ? -expr->ival : expr->ival;
+    if (value < INT32_MIN || value > INT32_MAX)
+        throw SQLExecError("integer " + to_string(value) + " out of range for INT");
+    n = (int32_t) value;
+    return true;
+}
+
+// a literal from the AST as a Value, checked against the type of the column it goes with
+static Value literal_value(const Expr *expr, ColumnAttribute::DataType data_type, const Identifier &column_name) {
+    int32_t n;
+    if (data_type == ColumnAttribute::INT && int_literal(expr, n))
+        return Value(n);
+    if (expr->type == kExprLiteralString && data_type == ColumnAttribute::TEXT)
+        return Value(string(expr->name));
+    throw SQLExecError("wrong type of value for column " + column_name);
+}
 
 // make query result be printable
 ostream &operator<<(ostream &out, const QueryResult &qres) {
-    if (qres.column_names != nullptr) {
-        for (auto const &column_name: *qres.column_names)
-            out << column_name << " ";
-        out << endl << "+";
-        for (unsigned int i = 0; i < qres.column_names->size(); i++)
-            out << "----------+";
-        out << endl;
-        for (auto const &row: *qres.rows) {
-            for (auto const &column_name: *qres.column_names) {
-                Value value = row->at(column_name);
-                switch (value.data_type) {
-                    case ColumnAttribute::INT:  out << value.n;                 break;
-                    case ColumnAttribute::TEXT: out << "\"" << value.s << "\""; break;
-                    default:                    out << "???";
-                }
-                out << " ";
+    TextWriter writer(out);
+    qres.write(writer);
+    return out;
+}
+
+void QueryResult::write(ResultWriter &writer) const {
+    if (column_names == nullptr) {
+        writer.end(message);
+        return;
+    }
+    writer.begin(*column_names);
+    if (plan != nullptr) {
+        writer.end(stream_rows([&writer](const ValueDict *row) { writer.row(*row); }));
+        return;
+    }
+    for (auto const &row: *rows)
+        writer.row(*row);
+    writer.end(message);
+}
+
+string QueryResult::stream_rows(const function<void(const ValueDict *)> &consume) const {
+    size_t count = 0;
+    try {
+        ReadSnapshot snapshot(plan->get_description());  // every page the plan reads from one state
+        plan->open();
+        while (ValueDict *row = plan->next()) {
+            try {
+                consume(row);
+            } catch (...) {
+                delete row;
+                throw;
             }
-            out << endl;
+            delete row;
+            count++;
         }
+        plan->close();
+    } catch (DbRelationError &e) {
+        throw SQLExecError(string("DbRelationError: ") + e.what());
+    } catch (DbException &e) {
+        throw SQLExecError(string("DbException: ") + e.what());
     }
-    out << qres.message << "\n";
-    return out;
+    return "successfully returned " + to_string(count) + " rows";
 }
 
 QueryResult::~QueryResult() {
+    if (prepared != nullptr)
+        prepared->results--;
+    else
+        delete plan;
     delete column_names;
     delete column_attributes;
     delete rows;
 }
 
+PreparedStatement::PreparedStatement(SQLParserResult *parse)
+        : parse(parse), parameters(parse->parameters().size()), parameter_types(parameters.size(), -1), plan(nullptr),
+          catalog_version(0), results(0) {}
 
-QueryResult *SQLExec::execute(const SQLStatement *statement) {
-    // FIXED: initialize _tables table, if not yet present
+PreparedStatement::~PreparedStatement() {
+    delete plan;
+    delete parse;
+}
+
+void PreparedStatement::bind(const vector<Expr *> *values) {
+    size_t count = values == nullptr ? 0 : values->size();
+    if (count != this->parameters.size())
+        throw SQLExecError("statement takes " + to_string(this->parameters.size()) + " parameters, not "
+                           + to_string(count));
+    vector<Value> bound(count);
+    for (size_t i = 0; i < count; i++) {
+        const Expr *expr = (*values)[i];
+        int32_t n;
+        if (int_literal(expr, n))
+            bound[i] = Value(n);
+        else if (expr->type == kExprLiteralString)
+            bound[i] = Value(string(expr->name));
+        else
+            throw SQLExecError("parameter " + to_string(i + 1) + " must be an INT or TEXT literal");
+        if (this->parameter_types[i] >= 0 && bound[i].data_type != this->parameter_types[i])
+            throw SQLExecError("wrong type of value for parameter " + to_string(i + 1));
+    }
+    for (size_t i = 0; i < count; i++)
+        this->parameters[i] = bound[i];  // in place: plans point at the slots
+}
+
+const Value *PreparedStatement::use_parameter(size_t i, ColumnAttribute::DataType data_type) {
+    if (i >= this->parameters.size())
+        throw SQLExecError("no parameter " + to_string(i + 1));
+    this->parameter_types[i] = data_type;
+    if (this->parameters[i].data_type != data_type)
+        this->parameters[i] = data_type == ColumnAttribute::TEXT ? Value(string()) : Value(0);
+    return &this->parameters[i];
+}
+
+
+// the STAT_EXECUTE_* timer for a statement type
+static StatId statement_stat(StatementType type) {
+    switch (type) {
+        case kStmtSelect:   return STAT_EXECUTE_SELECT;
+        case kStmtInsert:   return STAT_EXECUTE_INSERT;
+        case kStmtUpdate:   return STAT_EXECUTE_UPDATE;
+        case kStmtDelete:   return STAT_EXECUTE_DELETE;
+        case kStmtCreate:   return STAT_EXECUTE_CREATE;
+        case kStmtDrop:     return STAT_EXECUTE_DROP;
+        case kStmtShow:     return STAT_EXECUTE_SHOW;
+        default:            return STAT_EXECUTE_OTHER;
+    }
+}
+
+// split an extension statement into words, dropping a trailing semicolon
+static vector<string> statement_words(const string &query) {
+    vector<string> words;
+    istringstream in(query.substr(0, query.find_last_not_of(" \t;") + 1));
+    string word;
+    while (in >> word)
+        words.push_back(word);
+    return words;
+}
+
+// case-insensitive keyword match
+static bool is_keyword(const string &word, const char *keyword) {
+    if (word.size() != strlen(keyword))
+        return false;
+    for (size_t i = 0; i < word.size(); i++)
+        if (toupper(word[i]) != keyword[i])
+            return false;
+    return true;
+}
+
+// the text of query following its first n words
+static string after_words(const string &query, size_t n) {
+    size_t position = 0;
+    for (size_t i = 0; i < n; i++) {
+        position = query.find_first_not_of(" \t\n", position);
+        position = query.find_first_of(" \t\n", position);
+        if (position == string::npos)
+            return "";
+    }
+    return query.substr(position);
+}
+
+/**
+ * Turn a multi-row INSERT ... VALUES (...), (...) into one statement whose VALUES holds
+ * every row's values in turn, since the parser only takes one row per VALUES, so that the
+ * whole statement is parsed once. Only commas and white space may come between the rows,
+ * and nothing but a semicolon after them.
+ * @param row_sizes  returned by reference: the number of values in each row
+ * @returns          the statement, or nothing if query isn't a multi-row INSERT
+ */
+static string merge_insert_rows(const string &query, vector<size_t> &row_sizes) {
+    row_sizes.clear();
+    size_t values = string::npos;
+    char quote = 0;
+    for (size_t i = 0; i + 6 <= query.size() && values == string::npos; i++) {
+        if (quote) {
+            if (query[i] == quote)
+                quote = 0;
+        } else if (query[i] == '\'' || query[i] == '"') {
+            quote = query[i];
+        } else if ((i == 0 || isspace(query[i - 1]) || query[i - 1] == ')')
+                   && is_keyword(query.substr(i, 6), "VALUES")) {
+            values = i + 6;
+        }
+    }
+    if (values == string::npos)
+        return "";
+
+    string merged;
+    int depth = 0;
+    bool separated = true, ended = false;  // a comma since the last row; a semicolon after them
+    size_t start = 0, commas = 0;
+    for (size_t i = values; i < query.size(); i++) {
+        char c = query[i];
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+        } else if (depth > 0) {
+            if (c == '\'' || c == '"') {
+                quote = c;
+            } else if (c == '(') {
+                depth++;
+            } else if (c == ',' && depth == 1) {
+                commas++;
+            } else if (c == ')' && --depth == 0) {
+                merged += (merged.empty() ? "" : ", ") + query.substr(start + 1, i - start - 1);
+                row_sizes.push_back(commas + 1);
+            }
+        } else if (isspace(c)) {
+            continue;
+        } else if (c == '(' && separated && !ended) {
+            depth = 1;
+            start = i;
+            commas = 0;
+            separated = false;
+        } else if (c == ',' && !separated && !ended) {
+            separated = true;
+        } else if (c == ';' && !separated && !ended) {
+            ended = true;
+        } else {
+            throw SQLExecError("invalid SQL: unexpected '" + string(1, c) + "' after row "
+                               + to_string(row_sizes.size()) + " of INSERT");
+        }
+    }
+    if (row_sizes.size() < 2)
+        return "";
+    if (depth > 0 || separated)
+        throw SQLExecError("invalid SQL: INSERT ends in the middle of its rows");
+    return query.substr(0, values) + " (" + merged + ")";
+}
+
+// initialize _tables table, if not yet present
+void SQLExec::open_tables() {
     if (!tables) {
         tables = new Tables();
         tables->open();
     }
+}
+
+QueryResult *SQLExec::execute(const SQLStatement *statement) {
+    open_tables();
+    StatTimer timer(statement_stat(statement->type()));
     try {
         switch (statement->type()) {
+            case kStmtSelect:   return select((const SelectStatement *) statement);
+            case kStmtInsert:   return insert((const InsertStatement *) statement);
+            case kStmtUpdate:   return update((const UpdateStatement *) statement);
+            case kStmtDelete:   return del((const DeleteStatement *) statement);
             case kStmtCreate:   return create((const CreateStatement *) statement);
             case kStmtDrop:     return drop((const DropStatement *) statement);
             case kStmtShow:     return show((const ShowStatement *) statement);
+            case kStmtImport:   return copy_from((const ImportStatement *) statement);
+            case kStmtExport:   return copy_to((const ExportStatement *) statement);
+            case kStmtPrepare:  return prepare((const PrepareStatement *) statement);
+            case kStmtExecute:  return execute_prepared((const ExecuteStatement *) statement);
             default:            return new QueryResult("not implemented");
         }
     } catch (DbRelationError &e) {
         throw SQLExecError(string("DbRelationError: ") + e.what());
+    } catch (DbException &e) {
+        throw SQLExecError(string("DbException: ") + e.what());
+    }
+}
+
+QueryResult *SQLExec::execute_extension(const string &query) {
+    vector<string> words = statement_words(query);
+    if (words.size() >= 2 && words.size() <= 3 && is_keyword(words[0], "SHOW") && is_keyword(words[1], "STORAGE")) {
+        StatTimer timer(STAT_EXECUTE_SHOW);
+        open_tables();
+        try {
+            return show_storage(words.size() == 3 ? words[2] : "");
+        } catch (DbRelationError &e) {
+            throw SQLExecError(string("DbRelationError: ") + e.what());
+        } catch (DbException &e) {
+            throw SQLExecError(string("DbException: ") + e.what());
+        }
+    }
+    if (words.size() <= 2 && !words.empty() && is_keyword(words[0], "ANALYZE")) {
+        StatTimer timer(STAT_EXECUTE_OTHER);
+        open_tables();
+        try {
+            return analyze(words.size() == 2 ? words[1] : "");
+        } catch (DbRelationError &e) {
+            throw SQLExecError(string("DbRelationError: ") + e.what());
+        } catch (DbException &e) {
+            throw SQLExecError(string("DbException: ") + e.what());
+        }
     }
+    if (words.size() >= 2 && is_keyword(words[0], "EXPLAIN")) {
+        StatTimer timer(STAT_EXECUTE_OTHER);
+        bool analyze = is_keyword(words[1], "ANALYZE");
+        string sql = after_words(query, analyze ? 2 : 1);
+        SQLParserResult parse;
+        if (!SQLParser::parseSQLString(sql, &parse) || parse.size() != 1)
+            throw SQLExecError("invalid SQL: " + sql);
+        open_tables();
+        try {
+            return explain(parse.getStatement(0), analyze);
+        } catch (DbRelationError &e) {
+            throw SQLExecError(string("DbRelationError: ") + e.what());
+        }
+    }
+    if (!words.empty() && is_keyword(words[0], "INSERT")) {
+        vector<size_t> row_sizes;
+        string sql = merge_insert_rows(query, row_sizes);
+        if (sql.empty())
+            return nullptr;
+        StatTimer timer(STAT_EXECUTE_INSERT);
+        SQLParserResult parse;
+        if (!SQLParser::parseSQLString(sql, &parse) || parse.size() != 1 || !parse.getStatement(0)->isType(kStmtInsert))
+            throw SQLExecError("invalid SQL: " + query);
+        open_tables();
+        try {
+            return insert((const InsertStatement *) parse.getStatement(0), row_sizes);
+        } catch (DbRelationError &e) {
+            throw SQLExecError(string("DbRelationError: ") + e.what());
+        } catch (DbException &e) {
+            throw SQLExecError(string("DbException: ") + e.what());
+        }
+    }
+    if (words.size() >= 2 && words.size() <= 3 && is_keyword(words[0], "DEALLOCATE")
+        && (words.size() == 2 || is_keyword(words[1], "PREPARE")))
+        return deallocate(words.back());
+    if (words.size() == 2 && is_keyword(words[0], "SHOW") && is_keyword(words[1], "READERS")) {
+        StatTimer timer(STAT_EXECUTE_SHOW);
+        try {
+            return show_readers();
+        } catch (DbException &e) {
+            throw SQLExecError(string("DbException: ") + e.what());
+        }
+    }
+    if (words.size() == 2 && is_keyword(words[1], "STATS")) {
+        if (is_keyword(words[0], "SHOW")) {
+            StatTimer timer(STAT_EXECUTE_SHOW);
+            return show_stats();
+        }
+        if (is_keyword(words[0], "RESET"))
+            return reset_stats();
+    }
+    return nullptr;
 }
 
 void
@@ -125,10 +455,196 @@ QueryResult *SQLExec::create(const CreateStatement *statement) {
     return new QueryResult("created " + table_name);
 }
 
+// INSERT INTO ... VALUES ...: validated once for all rows, written in one transaction
+QueryResult *SQLExec::insert(const InsertStatement *statement, vector<size_t> row_sizes) {
+    if (statement->type != kInsertValues)
+        throw SQLExecError("only INSERT ... VALUES is supported");
+    Identifier table_name = statement->tableName;
+    ColumnNames table_columns;
+    ColumnAttributes table_attributes;
+    tables->get_columns(table_name, table_columns, table_attributes);
+    if (table_columns.empty())
+        throw SQLExecError("no such table " + table_name);
+
+    // which table column each value goes to, and its type
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    if (statement->columns == nullptr) {
+        column_names = table_columns;
+        column_attributes = table_attributes;
+    } else {
+        for (auto const &name: *statement->columns) {
+            auto found = find(table_columns.begin(), table_columns.end(), name);
+            if (found == table_columns.end())
+                throw SQLExecError(string("unknown column ") + name);
+            if (find(column_names.begin(), column_names.end(), name) != column_names.end())
+                throw SQLExecError(string("column ") + name + " given twice");
+            column_names.push_back(name);
+            column_attributes.push_back(table_attributes[found - table_columns.begin()]);
+        }
+        if (column_names.size() != table_columns.size())
+            throw SQLExecError("INSERT must give a value for every column");
+    }
+
+    if (row_sizes.empty())
+        row_sizes.push_back(statement->values->size());
+    ValueDicts rows;
+    rows.reserve(row_sizes.size());
+    try {
+        size_t next = 0;  // the row's first value in the statement's
+        for (size_t row_size: row_sizes) {
+            if (row_size != column_names.size())
+                throw SQLExecError("INSERT has " + to_string(row_size) + " values for "
+                                   + to_string(column_names.size()) + " columns");
+            if (next + row_size > statement->values->size())
+                throw SQLExecError("invalid SQL: INSERT rows don't add up to its values");
+            ValueDict *row = new ValueDict();
+            rows.push_back(row);
+            for (size_t i = 0; i < column_names.size(); i++) {
+                const Expr *expr = (*statement->values)[next + i];
+                if (expr->type == kExprParameter) {
+                    if (bound_statement == nullptr)
+                        throw SQLExecError("? parameters are only for PREPARE");
+                    const Value &value = bound_statement->get_parameter(expr->ival);
+                    if (value.data_type != column_attributes[i].get_data_type())
+                        throw SQLExecError("wrong type of value for column " + column_names[i]);
+                    (*row)[column_names[i]] = value;
+                } else {
+                    (*row)[column_names[i]] = literal_value(expr, column_attributes[i].get_data_type(),
+                                                            column_names[i]);
+                }
+            }
+            next += row_size;
+        }
+        if (next != statement->values->size())
+            throw SQLExecError("invalid SQL: INSERT rows don't add up to its values");
+
+        DbRelation &table = tables->get_table(table_name);
+        DbEnv::write_transaction([&]() {
+            delete table.insert(&rows);
+        });
+    } catch (...) {
+        for (auto const &row: rows)
+            delete row;
+        throw;
+    }
+    for (auto const &row: rows)
+        delete row;
+
+    return new QueryResult("successfully inserted " + to_string(rows.size()) + (rows.size() == 1 ? " row" : " rows")
+                           + " into " + table_name);
+}
+
+// COPY ... FROM
+QueryResult *SQLExec::copy_from(const ImportStatement *statement) {
+    if (statement->type != kImportCSV && statement->type != kImportAuto)
+        throw SQLExecError("only CSV files can be loaded");
+    return load(statement->tableName, statement->filePath);
+}
+
+QueryResult *SQLExec::load(const Identifier &table_name, const string &path) {
+    open_tables();
+    if (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME)
+        throw SQLExecError("cannot load a schema table");
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    tables->get_columns(table_name, column_names, column_attributes);
+    if (column_names.empty())
+        throw SQLExecError("no such table " + table_name);
+
+    auto start = chrono::steady_clock::now();
+    unique_ptr<CsvReader> opened;
+    try {
+        opened = make_unique<CsvReader>(path);
+    } catch (invalid_argument &e) {
+        throw SQLExecError(e.what());
+    }
+    CsvReader &reader = *opened;
+    BTTableLoader loader(dynamic_cast<BTTable &>(tables->get_table(table_name)));
+    vector<string_view> fields;
+    try {
+        while (reader.next(fields))
+            loader.add(fields);
+        loader.finish();
+    } catch (exception &e) {
+        throw SQLExecError("line " + to_string(reader.get_line()) + " of " + path + ": " + e.what()
+                           + " (" + to_string(loader.get_written()) + " rows loaded)");
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double mb = reader.get_bytes() / (1024.0 * 1024.0);
+    char rates[128];
+    snprintf(rates, sizeof(rates), "%.1f MB in %.3f s: %.1f MB/s, %.0f rows/s", mb, seconds,
+             seconds > 0 ? mb / seconds : 0.0, seconds > 0 ? loader.get_rows() / seconds : 0.0);
+    return new QueryResult("successfully loaded " + to_string(loader.get_rows())
+                           + (loader.get_rows() == 1 ? " row" : " rows") + " into " + table_name + " (" + rates + ")");
+}
+
+// COPY ... TO
+QueryResult *SQLExec::copy_to(const ExportStatement *statement) {
+    string format;
+    switch (statement->type) {
+        case kImportCSV:
+        case kImportAuto:   format = "csv";     break;
+        case kImportBinary: format = "binary";  break;
+        default:            throw SQLExecError("only CSV and BINARY files can be written");
+    }
+    ColumnNames *column_names = new ColumnNames();
+    ColumnAttributes *column_attributes = new ColumnAttributes();
+    PlanNode *root;
+    string source;
+    try {
+        if (statement->select != nullptr) {
+            root = plan(statement->select, column_names, column_attributes);
+            source = "query";
+        } else {
+            source = statement->tableName;
+            tables->get_columns(source, *column_names, *column_attributes);
+            if (column_names->empty())
+                throw SQLExecError("no such table " + source);
+            root = new TableScan(tables->get_table(source), source);
+        }
+    } catch (...) {
+        delete column_names;
+        delete column_attributes;
+        throw;
+    }
+    QueryResult result(column_names, column_attributes, root);
+
+    auto start = chrono::steady_clock::now();
+    ofstream out(statement->filePath, ios::binary | ios::trunc);
+    if (!out)
+        throw SQLExecError(string("cannot write file '") + statement->filePath + "'");
+    unique_ptr<ResultWriter> writer = ResultWriter::create(format, out, false);
+    if (statement->select == nullptr) {
+        // a whole table goes a batch at a time, without a ValueDict per row
+        writer->begin(*column_names);
+        ColumnBatch batch;
+        ReadSnapshot snapshot("COPY " + source + " TO");
+        root->open();
+        while (root->next_batch(batch))
+            writer->batch(batch);
+        root->close();
+        writer->end("");
+    } else {
+        result.write(*writer);
+    }
+    out.close();
+    if (!out)
+        throw SQLExecError(string("error writing file '") + statement->filePath + "'");
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double mb = writer->get_bytes() / (1024.0 * 1024.0);
+    char rates[128];
+    snprintf(rates, sizeof(rates), "%.1f MB in %.3f s: %.1f MB/s, %.0f rows/s", mb, seconds,
+             seconds > 0 ? mb / seconds : 0.0, seconds > 0 ? writer->get_rows() / seconds : 0.0);
+    return new QueryResult("successfully wrote " + to_string(writer->get_rows())
+                           + (writer->get_rows() == 1 ? " row" : " rows") + " of " + source + " to "
+                           + statement->filePath + " (" + rates + ")");
+}
+
 // DROP ...
 QueryResult *SQLExec::drop(const DropStatement *statement) {
     string table_name = statement->name;
-    if (table_name == "_tables" || table_name == "_columns") {
+    if (table_name == "_tables" || table_name == "_columns" || table_name == Statistics::TABLE_NAME) {
         throw SQLExecError("SQLExecError: Cannot drop a schema table");
     }
 
@@ -154,6 +670,8 @@ QueryResult *SQLExec::drop(const DropStatement *statement) {
     }
     delete handles;
 
+    tables->get_statistics().remove(table_name);
+
     // drop the table
     DbRelation &table = tables->get_table(table_name);
     table.drop();
@@ -178,7 +696,9 @@ QueryResult *SQLExec::show_tables() {
     Handles *handles = tables->select();
     for (Handle &handle : *handles) {
         ValueDict *row = tables->project(handle);
-        if ((*row)["table_name"].s == "_tables" || (*row)["table_name"].s == "_columns") {
+        if ((*row)["table_name"].s == "_tables" || (*row)["table_name"].s == "_columns"
+            || (*row)["table_name"].s == Statistics::TABLE_NAME) {
+            delete row;
             continue;
         }
         rows->push_back(row);
@@ -213,3 +733,906 @@ QueryResult *SQLExec::show_columns(const ShowStatement *statement) {
 
     return new QueryResult(names, attribs, rows, message);
 }
+
+// SHOW STATS: latency percentiles per operation and event counts, over all threads since the last reset
+QueryResult *SQLExec::show_stats() {
+    ColumnNames *names = new ColumnNames({"operation", "count", "errors", "mean_us", "p50_us", "p99_us",
+                                          "p999_us", "max_us"});
+    ColumnAttributes *attribs = new ColumnAttributes({ColumnAttribute(ColumnAttribute::TEXT)});
+    attribs->resize(3, ColumnAttribute(ColumnAttribute::INT));
+    attribs->resize(names->size(), ColumnAttribute(ColumnAttribute::TEXT));
+
+    Stats::Snapshot *snapshot = new Stats::Snapshot();
+    Stats::collect(*snapshot);
+
+    auto microseconds = [](double ns) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.3f", ns / 1000.0);
+        return Value(string(text));
+    };
+    ValueDicts *rows = new ValueDicts();
+    for (int id = 0; id < STAT_COUNT; id++) {
+        const LatencyHistogram &latency = snapshot->latency[id];
+        if (latency.count() == 0)
+            continue;
+        ValueDict *row = new ValueDict();
+        (*row)["operation"] = Value(Stats::name((StatId) id));
+        (*row)["count"] = Value((int32_t) latency.count());
+        (*row)["errors"] = Value((int32_t) snapshot->errors[id]);
+        (*row)["mean_us"] = microseconds(latency.mean());
+        (*row)["p50_us"] = microseconds(latency.percentile(0.50));
+        (*row)["p99_us"] = microseconds(latency.percentile(0.99));
+        (*row)["p999_us"] = microseconds(latency.percentile(0.999));
+        (*row)["max_us"] = microseconds(latency.max());
+        rows->push_back(row);
+    }
+    for (int id = 0; id < COUNTER_COUNT; id++) {
+        ValueDict *row = new ValueDict();
+        (*row)["operation"] = Value(Stats::name((CounterId) id));
+        (*row)["count"] = Value((int32_t) snapshot->counters[id]);
+        (*row)["errors"] = Value(0);
+        for (auto const &column_name : {"mean_us", "p50_us", "p99_us", "p999_us", "max_us"})
+            (*row)[column_name] = Value(string());
+        rows->push_back(row);
+    }
+    delete snapshot;
+
+    string message = "successfully returned " + std::to_string(rows->size()) + " rows";
+    return new QueryResult(names, attribs, rows, message);
+}
+
+// RESET STATS
+QueryResult *SQLExec::reset_stats() {
+    Stats::reset();
+    return new QueryResult("statistics reset");
+}
+
+// SHOW STORAGE [table]: LMDB environment numbers, then B+tree and page statistics per table
+vector<Identifier> SQLExec::table_names(const Identifier &table_name) {
+    vector<Identifier> table_names;
+    if (!table_name.empty()) {
+        ValueDict where = {{"table_name", Value(table_name)}};
+        Handles *handles = tables->select(&where);
+        bool exists = !handles->empty();
+        delete handles;
+        if (!exists)
+            throw SQLExecError("no such table " + table_name);
+        table_names.push_back(table_name);
+    } else {
+        Handles *handles = tables->select();
+        for (auto const &handle : *handles) {
+            ValueDict *row = tables->project(handle);
+            table_names.push_back(row->at("table_name").s);
+            delete row;
+        }
+        delete handles;
+    }
+    return table_names;
+}
+
+QueryResult *SQLExec::show_storage(const Identifier &table_name) {
+    vector<Identifier> table_names = SQLExec::table_names(table_name);
+
+    ColumnNames *names = new ColumnNames({"table_name", "depth", "branch_pages", "leaf_pages", "overflow_pages",
+                                          "entries", "blocks", "records", "tombstones", "forwards", "fill_pct",
+                                          "min_fill_pct", "max_fill_pct"});
+    ColumnAttributes *attribs = new ColumnAttributes({ColumnAttribute(ColumnAttribute::TEXT)});
+    attribs->resize(10, ColumnAttribute(ColumnAttribute::INT));
+    attribs->resize(names->size(), ColumnAttribute(ColumnAttribute::TEXT));
+    auto percent = [](double fraction) {
+        char text[16];
+        snprintf(text, sizeof(text), "%.1f", fraction * 100.0);
+        return Value(string(text));
+    };
+    auto add_btree = [](ValueDict &row, const MDB_stat &stat) {
+        row["depth"] = Value((int32_t) stat.ms_depth);
+        row["branch_pages"] = Value((int32_t) stat.ms_branch_pages);
+        row["leaf_pages"] = Value((int32_t) stat.ms_leaf_pages);
+        row["overflow_pages"] = Value((int32_t) stat.ms_overflow_pages);
+        row["entries"] = Value((int32_t) stat.ms_entries);
+    };
+
+    // all of it from one snapshot, without holding up writers
+    ReadSnapshot snapshot("SHOW STORAGE");
+    ValueDicts *rows = new ValueDicts();
+    for (auto const &name : table_names) {
+        BTTable *table = dynamic_cast<BTTable *>(&tables->get_table(name));
+        if (table == nullptr)
+            continue;
+        BTFileStats stats;
+        table->get_stats(stats);
+        ValueDict *row = new ValueDict();
+        (*row)["table_name"] = Value(name);
+        add_btree(*row, stats.db);
+        (*row)["blocks"] = Value((int32_t) stats.blocks);
+        (*row)["records"] = Value((int32_t) stats.records);
+        (*row)["tombstones"] = Value((int32_t) stats.tombstones);
+        (*row)["forwards"] = Value((int32_t) stats.forwards);
+        (*row)["fill_pct"] = percent(stats.blocks ? (double) stats.used_bytes / stats.blocks / DbBlock::BLOCK_SZ : 0.0);
+        (*row)["min_fill_pct"] = percent(stats.min_fill);
+        (*row)["max_fill_pct"] = percent(stats.max_fill);
+        rows->push_back(row);
+    }
+
+    // the environment as a whole: the main database, holding the table names
+    MDB_stat env_stat;
+    MDB_envinfo env_info;
+    mdb_env_stat(_MDB_ENV, &env_stat);
+    mdb_env_info(_MDB_ENV, &env_info);
+    snapshot.commit();
+    ValueDict *row = new ValueDict();
+    (*row)["table_name"] = Value("(environment)");
+    add_btree(*row, env_stat);
+    for (auto const &column_name : {"blocks", "records", "tombstones", "forwards"})
+        (*row)[column_name] = Value(0);
+    for (auto const &column_name : {"fill_pct", "min_fill_pct", "max_fill_pct"})
+        (*row)[column_name] = Value(string());
+    rows->push_back(row);
+
+    double map_used = (double) (env_info.me_last_pgno + 1) * env_stat.ms_psize / env_info.me_mapsize;
+    ostringstream message;
+    message << "map size " << env_info.me_mapsize << " bytes (" << percent(map_used).s << "% used), page size "
+            << env_stat.ms_psize << ", last page " << env_info.me_last_pgno << ", last txn "
+            << env_info.me_last_txnid << ", readers " << env_info.me_numreaders << " of " << env_info.me_maxreaders
+            << endl << "successfully returned " << rows->size() << " rows";
+    return new QueryResult(names, attribs, rows, message.str());
+}
+
+// SHOW READERS: each open snapshot's statement, age and how many commits it is behind; an
+// old one keeps every page freed since it began from being reused, so the file grows
+QueryResult *SQLExec::show_readers() {
+    int cleared = DbEnv::clear_stale_readers();
+    MDB_envinfo env_info;
+    mdb_env_info(_MDB_ENV, &env_info);
+    auto now = chrono::steady_clock::now();
+    auto stale_after = chrono::milliseconds(DbEnv::get_config().stale_reader_ms);
+
+    ColumnNames *names = new ColumnNames({"thread", "statement", "age_ms", "txn_id", "commits_behind", "stale"});
+    ColumnAttributes *attribs = new ColumnAttributes({ColumnAttribute(ColumnAttribute::TEXT),
+                                                      ColumnAttribute(ColumnAttribute::TEXT)});
+    attribs->resize(5, ColumnAttribute(ColumnAttribute::INT));
+    attribs->resize(names->size(), ColumnAttribute(ColumnAttribute::TEXT));
+    ValueDicts *rows = new ValueDicts();
+    size_t stale = 0;
+    for (auto const &snapshot : ReadSnapshot::list()) {
+        auto age = now - snapshot.started;
+        bool is_stale = age >= stale_after;
+        stale += is_stale;
+        ValueDict *row = new ValueDict();
+        (*row)["thread"] = Value(snapshot.thread);
+        (*row)["statement"] = Value(snapshot.label);
+        (*row)["age_ms"] = Value((int32_t) chrono::duration_cast<chrono::milliseconds>(age).count());
+        (*row)["txn_id"] = Value((int32_t) snapshot.txn_id);
+        (*row)["commits_behind"] = Value((int32_t) (env_info.me_last_txnid - snapshot.txn_id));
+        (*row)["stale"] = Value(string(is_stale ? "yes" : "no"));
+        rows->push_back(row);
+    }
+
+    ostringstream message;
+    message << stale << " stale (open over " << DbEnv::get_config().stale_reader_ms << " ms), LMDB reader slots "
+            << env_info.me_numreaders << " of " << env_info.me_maxreaders << " in use, " << cleared
+            << " left by dead processes cleared, last txn " << env_info.me_last_txnid << endl
+            << "successfully returned " << rows->size() << " rows";
+    return new QueryResult(names, attribs, rows, message.str());
+}
+
+/**
+ * A statement that has no operators of its own (CREATE, SHOW, ...), as one plan node that
+ * executes it when opened and hands out its result rows.
+ */
+class StatementNode : public PlanNode {
+public:
+    explicit StatementNode(const SQLStatement *statement)
+            : PlanNode(statement_name(statement->type())), statement(statement), result(nullptr), position(0) {}
+
+    ~StatementNode() override { delete result; }
+
+    double estimate() override { return 0.0; }
+
+protected:
+    const SQLStatement *statement;
+    QueryResult *result;
+    size_t position;
+
+    void do_open() override {
+        delete result;
+        result = SQLExec::execute(statement);
+        position = 0;
+    }
+
+    ValueDict *do_next() override {
+        if (result == nullptr || result->get_rows() == nullptr || position == result->get_rows()->size())
+            return nullptr;
+        return new ValueDict(*(*result->get_rows())[position++]);
+    }
+
+    void do_close() override {
+        delete result;
+        result = nullptr;
+    }
+
+    static string statement_name(StatementType type) {
+        switch (type) {
+            case kStmtInsert:   return "Insert";
+            case kStmtUpdate:   return "Update";
+            case kStmtDelete:   return "Delete";
+            case kStmtCreate:   return "Create";
+            case kStmtDrop:     return "Drop";
+            case kStmtShow:     return "Show";
+            default:            return "Statement";
+        }
+    }
+};
+
+/**
+ * A column a statement can refer to: the table (or alias) it's from, its name, and the
+ * name it has in the rows the plan passes around.
+ */
+struct ScopeColumn {
+    Identifier table;
+    Identifier column;
+    Identifier key;
+    ColumnAttribute attribute;
+};
+typedef vector<ScopeColumn> Scope;
+
+// the column a column reference means, which must be exactly one of scope's
+static const ScopeColumn &resolve(const Expr *column_ref, const Scope &scope) {
+    const ScopeColumn *found = nullptr;
+    for (auto const &column: scope) {
+        if (column.column != column_ref->name || (column_ref->table != nullptr && column.table != column_ref->table))
+            continue;
+        if (found != nullptr)
+            throw SQLExecError(string("ambiguous column ") + column_ref->name);
+        found = &column;
+    }
+    if (found == nullptr)
+        throw SQLExecError(string("unknown column ") + (column_ref->table != nullptr ? string(column_ref->table) + "." : "")
+                           + column_ref->name);
+    return *found;
+}
+
+// the name of an aggregate's output column, e.g. count(*) or sum(t.a)
+static string aggregate_name(const Expr *expr) {
+    string name(expr->name);
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    string argument;
+    if (expr->exprList != nullptr && expr->exprList->size() == 1) {
+        const Expr *column = (*expr->exprList)[0];
+        if (column->type == kExprStar)
+            argument = "*";
+        else if (column->type == kExprColumnRef)
+            argument = (column->table != nullptr ? string(column->table) + "." : "") + column->name;
+    }
+    return name + "(" + argument + ")";
+}
+
+/**
+ * Compile a WHERE clause: comparisons of a column with a literal, under AND, OR and NOT.
+ * In a HAVING clause, an aggregate can stand for a column.
+ * @returns  the condition (freed by caller)
+ */
+static Condition *condition(const Expr *expr, const Scope &scope) {
+    if (expr->type != kExprOperator)
+        throw SQLExecError("WHERE needs a comparison");
+    switch (expr->opType) {
+        case kOpAnd:
+        case kOpOr: {
+            Condition *left = condition(expr->expr, scope);
+            try {
+                return new Condition(expr->opType == kOpAnd ? Condition::AND : Condition::OR, left,
+                                     condition(expr->expr2, scope));
+            } catch (...) {
+                delete left;
+                throw;
+            }
+        }
+        case kOpNot:
+            return new Condition(Condition::NOT, condition(expr->expr, scope));
+        default:
+            break;
+    }
+
+    Condition::Op op;
+    switch (expr->opType) {
+        case kOpEquals:     op = Condition::EQ; break;
+        case kOpNotEquals:  op = Condition::NE; break;
+        case kOpLess:       op = Condition::LT; break;
+        case kOpLessEq:     op = Condition::LE; break;
+        case kOpGreater:    op = Condition::GT; break;
+        case kOpGreaterEq:  op = Condition::GE; break;
+        default:            throw SQLExecError("unsupported operator in WHERE");
+    }
+    const Expr *column = expr->expr, *literal = expr->expr2;
+    auto is_column = [](const Expr *e) { return e->type == kExprColumnRef || e->type == kExprFunctionRef; };
+    if (!is_column(column)) {
+        // 3 < a is a > 3
+        static const Condition::Op FLIPPED[] = {Condition::EQ, Condition::NE, Condition::GT, Condition::GE,
+                                                Condition::LT, Condition::LE};
+        std::swap(column, literal);
+        op = FLIPPED[op];
+    }
+    if (!is_column(column) || is_column(literal))
+        throw SQLExecError("WHERE can only compare a column with a value");
+    auto compare = [&](const Identifier &key, ColumnAttribute::DataType data_type, const Identifier &name) {
+        if (literal->type != kExprParameter)
+            return new Condition(op, key, literal_value(literal, data_type, name));
+        if (bound_statement == nullptr)
+            throw SQLExecError("? parameters are only for PREPARE");
+        return new Condition(op, key, bound_statement->use_parameter(literal->ival, data_type));
+    };
+    if (column->type == kExprFunctionRef) {
+        string name = aggregate_name(column);
+        for (auto const &found: scope)
+            if (found.table.empty() && found.key == name)
+                return compare(name, found.attribute.get_data_type(), name);
+        throw SQLExecError("aggregates can only be compared in HAVING");
+    }
+    const ScopeColumn &found = resolve(column, scope);
+    return compare(found.key, found.attribute.get_data_type(), found.column);
+}
+
+/**
+ * The key columns of a join's ON clause: column = column comparisons, under AND, each
+ * between a column of the left input and one of the right.
+ */
+static void join_keys(const Expr *expr, const Scope &left, const Scope &right, ColumnNames &left_keys,
+                      ColumnNames &right_keys) {
+    if (expr == nullptr)
+        throw SQLExecError("a join needs an ON clause");
+    if (expr->type == kExprOperator && expr->opType == kOpAnd) {
+        join_keys(expr->expr, left, right, left_keys, right_keys);
+        join_keys(expr->expr2, left, right, left_keys, right_keys);
+        return;
+    }
+    if (expr->type != kExprOperator || expr->opType != kOpEquals || expr->expr->type != kExprColumnRef
+        || expr->expr2->type != kExprColumnRef)
+        throw SQLExecError("only joins on column = column are supported");
+    const Expr *a = expr->expr, *b = expr->expr2;
+    auto in = [](const Expr *column_ref, const Scope &scope) {
+        for (auto const &column: scope)
+            if (column.column == column_ref->name && (column_ref->table == nullptr || column.table == column_ref->table))
+                return true;
+        return false;
+    };
+    if (!in(a, left))
+        std::swap(a, b);
+    const ScopeColumn &left_column = resolve(a, left), &right_column = resolve(b, right);
+    if (left_column.attribute.get_data_type() != right_column.attribute.get_data_type())
+        throw SQLExecError("cannot join " + left_column.key + " with " + right_column.key + " of another type");
+    left_keys.push_back(left_column.key);
+    right_keys.push_back(right_column.key);
+}
+
+/**
+ * Plan the FROM clause, adding the columns it brings into scope.
+ * @param qualify  true in a join, where rows carry "table.column" names
+ */
+static PlanNode *plan_from(const TableRef *table_ref, bool qualify, Tables &tables, Scope &scope) {
+    if (table_ref->type == kTableName) {
+        Identifier table_name = table_ref->name, alias = table_ref->getName();
+        ColumnNames columns;
+        ColumnAttributes attributes;
+        tables.get_columns(table_name, columns, attributes);
+        if (columns.empty())
+            throw SQLExecError("no such table " + table_name);
+        for (auto const &[existing, column, key, attribute]: scope)
+            if (existing == alias)
+                throw SQLExecError("table " + alias + " appears twice; give one an alias");
+        for (size_t i = 0; i < columns.size(); i++)
+            scope.push_back({alias, columns[i], qualify ? alias + "." + columns[i] : columns[i], attributes[i]});
+        TableScan *scan = new TableScan(tables.get_table(table_name), table_name, qualify ? alias : "");
+        scan->set_statistics(tables.get_statistics().get(table_name));
+        return scan;
+    }
+    if (table_ref->type != kTableJoin)
+        throw SQLExecError("only SELECT from a table or a join of tables is supported");
+    const JoinDefinition *join = table_ref->join;
+    if (join->type != kJoinInner)
+        throw SQLExecError("only inner joins are supported");
+    Scope left_scope, right_scope;
+    PlanNode *left = plan_from(join->left, true, tables, left_scope);
+    PlanNode *right = nullptr;
+    try {
+        right = plan_from(join->right, true, tables, right_scope);
+        for (auto const &column: left_scope)
+            for (auto const &other: right_scope)
+                if (column.table == other.table)
+                    throw SQLExecError("table " + column.table + " appears twice; give one an alias");
+        ColumnNames left_keys, right_keys;
+        join_keys(join->condition, left_scope, right_scope, left_keys, right_keys);
+        scope.insert(scope.end(), left_scope.begin(), left_scope.end());
+        scope.insert(scope.end(), right_scope.begin(), right_scope.end());
+        return new HashJoin(left, right, left_keys, right_keys, DbEnv::get_config().work_mem);
+    } catch (...) {
+        delete left;
+        delete right;
+        throw;
+    }
+}
+
+// an aggregate call: COUNT(*), or COUNT, SUM, MIN, MAX or AVG of a column
+static HashAggregate::Aggregate aggregate(const Expr *expr, const Scope &scope) {
+    static const vector<pair<string, HashAggregate::Aggregate::Function>> FUNCTIONS = {
+            {"count", HashAggregate::Aggregate::COUNT}, {"sum", HashAggregate::Aggregate::SUM},
+            {"min", HashAggregate::Aggregate::MIN}, {"max", HashAggregate::Aggregate::MAX},
+            {"avg", HashAggregate::Aggregate::AVG}};
+    string name = aggregate_name(expr);
+    string function = name.substr(0, name.find('('));
+    auto found = find_if(FUNCTIONS.begin(), FUNCTIONS.end(), [&](auto const &f) { return f.first == function; });
+    if (found == FUNCTIONS.end())
+        throw SQLExecError("unknown function " + string(expr->name));
+    if (expr->distinct)
+        throw SQLExecError("DISTINCT aggregates are not supported");
+    if (expr->exprList == nullptr || expr->exprList->size() != 1)
+        throw SQLExecError(function + " takes one column");
+    const Expr *argument = (*expr->exprList)[0];
+    HashAggregate::Aggregate aggregate{found->second, "", ColumnAttribute::INT, name};
+    if (argument->type == kExprStar && aggregate.function == HashAggregate::Aggregate::COUNT)
+        return aggregate;
+    if (argument->type != kExprColumnRef)
+        throw SQLExecError(function + " takes one column");
+    const ScopeColumn &column = resolve(argument, scope);
+    aggregate.column = column.key;
+    aggregate.data_type = column.attribute.get_data_type();
+    if ((aggregate.function == HashAggregate::Aggregate::SUM || aggregate.function == HashAggregate::Aggregate::AVG)
+        && aggregate.data_type != ColumnAttribute::INT)
+        throw SQLExecError(function + " needs an INT column");
+    return aggregate;
+}
+
+/**
+ * Plan GROUP BY and the aggregates in the select list and ORDER BY.
+ * @param scope  the columns in scope for the input; returned as those for the output,
+ *               the group columns and then the aggregates
+ */
+static PlanNode *plan_aggregate(const SelectStatement *statement, PlanNode *input, Scope &scope) {
+    Scope output;
+    ColumnNames group_by;
+    if (statement->groupBy != nullptr) {
+        for (auto const &expr: *statement->groupBy->columns) {
+            if (expr->type != kExprColumnRef)
+                throw SQLExecError("GROUP BY takes columns");
+            const ScopeColumn &column = resolve(expr, scope);
+            group_by.push_back(column.key);
+            output.push_back(column);
+        }
+    }
+    vector<HashAggregate::Aggregate> aggregates;
+    vector<const Expr *> calls(statement->selectList->begin(), statement->selectList->end());
+    if (statement->order != nullptr)
+        for (auto const &order: *statement->order)
+            calls.push_back(order->expr);
+    if (statement->groupBy != nullptr && statement->groupBy->having != nullptr)
+        calls.push_back(statement->groupBy->having);
+    for (size_t i = 0; i < calls.size(); i++) {
+        const Expr *expr = calls[i];
+        if (expr->type == kExprOperator) {
+            for (const Expr *operand: {expr->expr, expr->expr2})
+                if (operand != nullptr)
+                    calls.push_back(operand);
+            continue;
+        }
+        if (expr->type != kExprFunctionRef)
+            continue;
+        HashAggregate::Aggregate call = aggregate(expr, scope);
+        if (any_of(aggregates.begin(), aggregates.end(), [&](auto const &a) { return a.name == call.name; }))
+            continue;
+        aggregates.push_back(call);
+        output.push_back({"", call.name, call.name, ColumnAttribute(HashAggregate::output_type(call))});
+    }
+    scope = output;
+    Condition *having = nullptr;
+    if (statement->groupBy != nullptr && statement->groupBy->having != nullptr)
+        having = condition(statement->groupBy->having, scope);
+    PlanNode *plan = new HashAggregate(input, group_by, aggregates, DbEnv::get_config().work_mem);
+    return having != nullptr ? new Filter(plan, having) : plan;
+}
+
+// a column of the output of an aggregation: a group column or an aggregate
+static const ScopeColumn &aggregate_output(const Expr *expr, const Scope &scope) {
+    if (expr->type == kExprColumnRef) {
+        try {
+            return resolve(expr, scope);
+        } catch (SQLExecError &e) {
+            throw SQLExecError(string("column ") + expr->name + " must be in GROUP BY or in an aggregate");
+        }
+    }
+    string name = aggregate_name(expr);
+    for (auto const &column: scope)
+        if (column.table.empty() && column.key == name)
+            return column;
+    throw SQLExecError("unsupported expression " + name);
+}
+
+PlanNode *SQLExec::plan(const SelectStatement *statement, ColumnNames *column_names,
+                        ColumnAttributes *column_attributes) {
+    if (statement->fromTable == nullptr)
+        throw SQLExecError("SELECT needs a FROM clause");
+    bool aggregating = statement->groupBy != nullptr;
+    for (auto const &expr: *statement->selectList)
+        aggregating = aggregating || expr->type == kExprFunctionRef;
+    Scope scope;
+    PlanNode *plan = plan_from(statement->fromTable, false, *tables, scope);
+    try {
+        u_int64_t limit = UINT64_MAX, offset = 0;
+        if (statement->limit != nullptr) {
+            for (auto const &[expr, number]: {pair{statement->limit->limit, &limit},
+                                              pair{statement->limit->offset, &offset}}) {
+                if (expr == nullptr)
+                    continue;
+                if (expr->type != kExprLiteralInt || expr->ival < 0)
+                    throw SQLExecError("LIMIT and OFFSET take a count");
+                *number = expr->ival;
+            }
+        }
+
+        if (statement->whereClause != nullptr) {
+            Condition *where = condition(statement->whereClause, scope);
+            // batches come straight off the pages, and zone maps apply, only for an unqualified scan
+            if (statement->fromTable->type == kTableName)
+                ((TableScan *) plan)->choose_scan(where);
+            if (where->has_int_comparison() && statement->fromTable->type == kTableName)
+                plan = new VectorFilter(plan, where);
+            else
+                plan = new Filter(plan, where);
+        }
+        if (aggregating)
+            plan = plan_aggregate(statement, plan, scope);
+        if (statement->order != nullptr) {
+            ColumnNames order_columns;
+            vector<bool> descending;
+            for (auto const &order: *statement->order) {
+                if (aggregating)
+                    order_columns.push_back(aggregate_output(order->expr, scope).key);
+                else if (order->expr->type == kExprColumnRef)
+                    order_columns.push_back(resolve(order->expr, scope).key);
+                else
+                    throw SQLExecError("ORDER BY takes columns");
+                descending.push_back(order->type == kOrderDesc);
+            }
+            // with a LIMIT, only the first rows need sorting
+            if (limit != UINT64_MAX)
+                plan = new TopN(plan, order_columns, descending, limit + offset);
+            else
+                plan = new Sort(plan, order_columns, descending, DbEnv::get_config().work_mem);
+        }
+
+        ColumnNames names;
+        ColumnAttributes attributes;
+        for (auto const &expr: *statement->selectList) {
+            if (expr->type == kExprStar && !aggregating) {
+                for (auto const &column: scope) {
+                    if (expr->table != nullptr && column.table != expr->table)
+                        continue;
+                    names.push_back(column.key);
+                    attributes.push_back(column.attribute);
+                }
+            } else if (aggregating && (expr->type == kExprColumnRef || expr->type == kExprFunctionRef)) {
+                const ScopeColumn &column = aggregate_output(expr, scope);
+                names.push_back(column.key);
+                attributes.push_back(column.attribute);
+            } else if (expr->type == kExprColumnRef) {
+                const ScopeColumn &column = resolve(expr, scope);
+                names.push_back(column.key);
+                attributes.push_back(column.attribute);
+            } else {
+                throw SQLExecError(aggregating ? "only GROUP BY columns and aggregates can be selected"
+                                               : "only columns and aggregates can be selected");
+            }
+        }
+        plan = new Project(plan, names);
+        if (limit != UINT64_MAX || offset > 0)
+            plan = new Limit(plan, limit, offset);
+        if (column_names != nullptr)
+            *column_names = names;
+        if (column_attributes != nullptr)
+            *column_attributes = attributes;
+    } catch (...) {
+        delete plan;
+        throw;
+    }
+    return plan;
+}
+
+// the columns of a table that DML can change, which mustn't be a schema table
+static void dml_table(Tables &tables, const Identifier &table_name, ColumnNames &column_names,
+                      ColumnAttributes &column_attributes) {
+    if (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME || table_name == Statistics::TABLE_NAME)
+        throw SQLExecError("cannot change a schema table");
+    tables.get_columns(table_name, column_names, column_attributes);
+    if (column_names.empty())
+        throw SQLExecError("no such table " + table_name);
+}
+
+// every row of a table that a WHERE clause (if any) picks, all found before any is changed,
+// so none is met twice; blocks are passed over by their zone maps
+static Handles where_rows(DbRelation &table, const Identifier &table_name, const ColumnNames &column_names,
+                          const ColumnAttributes &column_attributes, const Expr *where_clause) {
+    Scope scope;
+    for (size_t i = 0; i < column_names.size(); i++)
+        scope.push_back({table_name, column_names[i], column_names[i], column_attributes[i]});
+    unique_ptr<Condition> where(where_clause != nullptr ? condition(where_clause, scope) : nullptr);
+    ScanBounds bounds;
+    if (where != nullptr)
+        where->bounds(bounds);
+    Handles handles;
+    DbCursor *cursor = table.cursor(bounds);
+    try {
+        Handle handle;
+        ValueDict *row;
+        while (cursor->next(handle, row)) {
+            if (where == nullptr || where->matches(*row))
+                handles.push_back(handle);
+            delete row;
+        }
+    } catch (...) {
+        delete cursor;
+        throw;
+    }
+    delete cursor;
+    return handles;
+}
+
+// UPDATE ...: literal values only, under the same WHERE clauses as a SELECT
+QueryResult *SQLExec::update(const UpdateStatement *statement) {
+    if (statement->table->type != kTableName)
+        throw SQLExecError("UPDATE takes a table name");
+    Identifier table_name = statement->table->name;
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    dml_table(*tables, table_name, column_names, column_attributes);
+
+    ValueDict new_values;
+    for (auto const &clause: *statement->updates) {
+        auto found = find(column_names.begin(), column_names.end(), clause->column);
+        if (found == column_names.end())
+            throw SQLExecError(string("unknown column ") + clause->column);
+        if (new_values.count(clause->column))
+            throw SQLExecError(string("column ") + clause->column + " given twice");
+        new_values[clause->column] = literal_value(clause->value,
+                                                   column_attributes[found - column_names.begin()].get_data_type(),
+                                                   clause->column);
+    }
+    DbRelation &table = tables->get_table(table_name);
+    Handles handles;
+    DbEnv::write_transaction([&]() { // no other writer can change which rows match in between
+        handles = where_rows(table, table_name, column_names, column_attributes, statement->where);
+        table.update(&handles, &new_values);
+    });
+    return new QueryResult("successfully updated " + to_string(handles.size()) + (handles.size() == 1 ? " row" : " rows")
+                           + " in " + table_name);
+}
+
+// DELETE FROM ... [WHERE ...]: the rows found, then deleted a block at a time, all in one transaction
+QueryResult *SQLExec::del(const DeleteStatement *statement) {
+    Identifier table_name = statement->tableName;
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    dml_table(*tables, table_name, column_names, column_attributes);
+    DbRelation &table = tables->get_table(table_name);
+    Handles handles;
+    DbEnv::write_transaction([&]() { // no other writer can change which rows match in between
+        handles = where_rows(table, table_name, column_names, column_attributes, statement->expr);
+        table.del(&handles);
+    });
+    return new QueryResult("successfully deleted " + to_string(handles.size()) + (handles.size() == 1 ? " row" : " rows")
+                           + " from " + table_name);
+}
+
+QueryResult *SQLExec::select(const SelectStatement *statement) {
+    ColumnNames *names = new ColumnNames();
+    ColumnAttributes *attribs = new ColumnAttributes();
+    PlanNode *root;
+    try {
+        root = plan(statement, names, attribs);
+    } catch (...) {
+        delete names;
+        delete attribs;
+        throw;
+    }
+    return new QueryResult(names, attribs, root);
+}
+
+// PREPARE name FROM 'statement', planning a SELECT now so mistakes show up here
+QueryResult *SQLExec::prepare(const PrepareStatement *statement) {
+    SQLParserResult *parse = new SQLParserResult();
+    if (!SQLParser::parseSQLString(statement->query, parse) || parse->size() != 1) {
+        delete parse;
+        throw SQLExecError(string("invalid SQL: ") + statement->query);
+    }
+    StatementType type = parse->getStatement(0)->type();
+    if (type != kStmtSelect && type != kStmtInsert) {
+        delete parse;
+        throw SQLExecError("only SELECT and INSERT can be prepared");
+    }
+    shared_ptr<PreparedStatement> prepared = make_shared<PreparedStatement>(parse);
+    plan(*prepared);
+    prepared_statements[statement->name] = prepared;
+    return new QueryResult(string("prepared ") + statement->name);
+}
+
+// EXECUTE name(values) or EXECUTE name USING values
+QueryResult *SQLExec::execute_prepared(const ExecuteStatement *statement) {
+    auto found = prepared_statements.find(statement->name);
+    if (found == prepared_statements.end())
+        throw SQLExecError(string("no prepared statement ") + statement->name);
+    shared_ptr<PreparedStatement> prepared = found->second;
+    // its plan reads the parameters, so they can't change under rows still being read
+    if (prepared->results > 0)
+        throw SQLExecError(string("rows of ") + statement->name + " from an earlier EXECUTE are still being read");
+    plan(*prepared);  // so the parameters' types are known
+    prepared->bind(statement->parameters);
+    return run(prepared);
+}
+
+QueryResult *SQLExec::deallocate(const Identifier &name) {
+    if (prepared_statements.erase(name) == 0)
+        throw SQLExecError("no prepared statement " + name);
+    return new QueryResult("deallocated " + name);
+}
+
+QueryResult *SQLExec::run(shared_ptr<PreparedStatement> prepared) {
+    const SQLStatement *statement = prepared->get_statement();
+    if (statement->isType(kStmtInsert)) {
+        ParameterScope scope(prepared.get());
+        return insert((const InsertStatement *) statement);
+    }
+    if (prepared->results > 0)
+        return select((const SelectStatement *) statement);  // has no parameters (see execute_prepared)
+    plan(*prepared);
+    return new QueryResult(prepared);
+}
+
+void SQLExec::plan(PreparedStatement &prepared) {
+    const SQLStatement *statement = prepared.get_statement();
+    u_int64_t version = Tables::get_version();
+    if (!statement->isType(kStmtSelect) || (prepared.plan != nullptr && prepared.catalog_version == version))
+        return;
+    delete prepared.plan;
+    prepared.plan = nullptr;
+    prepared.column_names.clear();
+    prepared.column_attributes.clear();
+    ParameterScope scope(&prepared);
+    prepared.plan = plan((const SelectStatement *) statement, &prepared.column_names, &prepared.column_attributes);
+    prepared.catalog_version = version;
+}
+
+// a statement's text with runs of white space outside quotes made one space, for the cache
+static string normalize(const string &query) {
+    string text;
+    char quote = 0;
+    for (char c: query) {
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (isspace(c)) {
+            if (!text.empty() && text.back() != ' ')
+                text += ' ';
+            continue;
+        }
+        text += c;
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == ';'))
+        text.pop_back();
+    return text;
+}
+
+QueryResult *SQLExec::execute_cached(const string &query) {
+    size_t capacity = DbEnv::get_config().statement_cache;
+    vector<string> words = statement_words(query);
+    if (capacity == 0 || words.empty() || !(is_keyword(words[0], "SELECT") || is_keyword(words[0], "INSERT")))
+        return nullptr;
+    string text = normalize(query);
+    shared_ptr<PreparedStatement> prepared;
+    auto found = cache_index.find(text);
+    if (found != cache_index.end()) {
+        Stats::count(COUNTER_STATEMENT_CACHE_HITS);
+        cached_statements.splice(cached_statements.begin(), cached_statements, found->second);
+        prepared = found->second->second;
+    } else {
+        SQLParserResult *parse = new SQLParserResult();
+        if (!SQLParser::parseSQLString(query, parse) || parse->size() != 1 || !parse->parameters().empty()
+            || !(parse->getStatement(0)->isType(kStmtSelect) || parse->getStatement(0)->isType(kStmtInsert))) {
+            delete parse;
+            return nullptr;
+        }
+        Stats::count(COUNTER_STATEMENT_CACHE_MISSES);
+        prepared = make_shared<PreparedStatement>(parse);
+        cached_statements.emplace_front(text, prepared);
+        cache_index[text] = cached_statements.begin();
+        while (cached_statements.size() > capacity) {
+            cache_index.erase(cached_statements.back().first);
+            cached_statements.pop_back();
+        }
+    }
+
+    open_tables();
+    StatTimer timer(statement_stat(prepared->get_statement()->type()));
+    try {
+        return run(prepared);
+    } catch (DbRelationError &e) {
+        throw SQLExecError(string("DbRelationError: ") + e.what());
+    } catch (DbException &e) {
+        throw SQLExecError(string("DbException: ") + e.what());
+    }
+}
+
+void SQLExec::clear_statements() {
+    cache_index.clear();
+    cached_statements.clear();
+    prepared_statements.clear();
+}
+
+// ANALYZE [table]: the statistics of a table, or of every table but the schema tables
+QueryResult *SQLExec::analyze(const Identifier &table_name) {
+    string message;
+    for (auto const &name : table_names(table_name)) {
+        if (table_name.empty() && (name == Tables::TABLE_NAME || name == Columns::TABLE_NAME
+                                   || name == Statistics::TABLE_NAME))
+            continue;
+        const TableStatistics &statistics = tables->get_statistics().analyze(name, tables->get_table(name));
+        message += (message.empty() ? "analyzed " : ", ") + name + " (" + std::to_string(statistics.rows)
+                   + " rows in " + std::to_string(statistics.blocks) + " blocks)";
+    }
+    return new QueryResult(message.empty() ? "no tables to analyze" : message);
+}
+
+// EXPLAIN [ANALYZE]: one row per operator, inputs indented beneath the operator they feed
+QueryResult *SQLExec::explain(const SQLStatement *statement, bool analyze) {
+    PlanNode *root = statement->isType(kStmtSelect) ? plan((const SelectStatement *) statement)
+                                                    : new StatementNode(statement);
+    if (analyze) {
+        root->set_profiling(true);
+        try {
+            // a query reads from one snapshot; any other statement runs as it would unexplained
+            unique_ptr<ReadSnapshot> snapshot;
+            if (statement->isType(kStmtSelect))
+                snapshot = make_unique<ReadSnapshot>(root->get_description());
+            root->open();
+            while (ValueDict *row = root->next())
+                delete row;
+            root->close();
+        } catch (...) {
+            delete root;
+            throw;
+        }
+    }
+
+    ColumnNames *names = new ColumnNames({"operator", "est_rows"});
+    if (analyze)
+        names->insert(names->end(), {"rows", "blocks", "txns", "bytes", "time_ms"});
+    ColumnAttributes *attribs = new ColumnAttributes({ColumnAttribute(ColumnAttribute::TEXT)});
+    attribs->resize(names->size() - (analyze ? 1 : 0), ColumnAttribute(ColumnAttribute::INT));
+    attribs->resize(names->size(), ColumnAttribute(ColumnAttribute::TEXT));
+
+    ValueDicts *rows = new ValueDicts();
+    vector<pair<PlanNode *, string>> stack = {{root, ""}};  // operators still to show, and their indents
+    while (!stack.empty()) {
+        auto [node, indent] = stack.back();
+        stack.pop_back();
+        vector<PlanNode *> inputs = node->get_inputs();
+        for (auto input = inputs.rbegin(); input != inputs.rend(); input++)
+            stack.push_back({*input, indent.empty() ? "-> " : "   " + indent});
+        ValueDict *row = new ValueDict();
+        (*row)["operator"] = Value(indent + node->get_description());
+        (*row)["est_rows"] = Value((int32_t) (node->estimate() + 0.5));
+        if (analyze) {
+            const OperatorProfile &profile = node->get_profile();
+            char time_ms[32];
+            snprintf(time_ms, sizeof(time_ms), "%.3f", profile.ns / 1e6);
+            (*row)["rows"] = Value((int32_t) profile.rows);
+            (*row)["blocks"] = Value((int32_t) profile.blocks);
+            (*row)["txns"] = Value((int32_t) profile.transactions);
+            (*row)["bytes"] = Value((int32_t) profile.bytes);
+            (*row)["time_ms"] = Value(string(time_ms));
+        }
+        rows->push_back(row);
+    }
+    delete root;
+
+    string message = string(analyze ? "EXPLAIN ANALYZE " : "EXPLAIN ") + parse_tree_to_string::statement(statement);
+    return new QueryResult(names, attribs, rows, message);
+}
@@ -6,9 +6,13 @@
 #pragma once
 
 #include <exception>
+#include <functional>
+#include <memory>
 #include <string>
 #include <hsql/SQLParser.h>
 #include "schema_tables.h"
+#include "query_plan.h"
+#include "result_writer.h"
 
 /**
  * @class SQLExecError - exception for SQLExec methods
@@ -19,18 +23,91 @@ public:
 };
 
 
+/**
+ * @class PreparedStatement - a parsed SELECT or INSERT kept to be run again, by EXECUTE or
+ *      from the statement cache, without being parsed again.
+ *
+ *      A SELECT keeps its plan too, built on its first run and reopened on later ones, and
+ *      built again once the catalog has changed (see Tables::get_version). The plan's
+ *      conditions read the statement's ? parameters from slots here, so binding new values
+ *      doesn't need a new plan.
+ */
+class PreparedStatement {
+public:
+    // @param parse  one statement, with any ? parameters (owned by the prepared statement)
+    explicit PreparedStatement(hsql::SQLParserResult *parse);
+
+    virtual ~PreparedStatement();
+
+    PreparedStatement(const PreparedStatement &other) = delete;
+
+    PreparedStatement &operator=(const PreparedStatement &other) = delete;
+
+    const hsql::SQLStatement *get_statement() const { return parse->getStatement(0); }
+
+    size_t parameter_count() const { return parameters.size(); }
+
+    /**
+     * Set the values of the ? parameters.
+     * @param values  a literal for each parameter, in order
+     * @throws SQLExecError if the number of values or the type of one is wrong
+     */
+    virtual void bind(const std::vector<hsql::Expr *> *values);
+
+    /**
+     * The slot of a ? parameter compared with a column, for a plan to read.
+     * @param data_type  the column's type, which the value must have
+     */
+    virtual const Value *use_parameter(size_t i, ColumnAttribute::DataType data_type);
+
+    // the value a ? parameter was last bound to
+    const Value &get_parameter(size_t i) const { return parameters.at(i); }
+
+protected:
+    hsql::SQLParserResult *parse;
+    std::vector<Value> parameters;
+    std::vector<int> parameter_types;  // a DataType for each parameter a plan compares, or -1
+    PlanNode *plan;
+    ColumnNames column_names;          // of the plan's rows
+    ColumnAttributes column_attributes;
+    u_int64_t catalog_version;         // when the plan was made
+    int results;                       // QueryResults still reading the plan
+
+    friend class SQLExec;
+    friend class QueryResult;
+};
+
+
 /**
  * @class QueryResult - data structure to hold all the returned data for a query execution
+ *
+ *      The rows are either all there (rows) or still to come out of a plan, in which case
+ *      they are produced as they are written (see write()), or passed to stream_rows() one
+ *      at a time. The
+ *      plan is the result's own, or a prepared statement's, which the result keeps alive.
  */
 class QueryResult {
 public:
-    QueryResult() : column_names(nullptr), column_attributes(nullptr), rows(nullptr), message("") {}
+    QueryResult() : column_names(nullptr), column_attributes(nullptr), rows(nullptr), message(""), plan(nullptr) {}
 
     QueryResult(std::string message) : column_names(nullptr), column_attributes(nullptr), rows(nullptr),
-                                       message(message) {}
+                                       message(message), plan(nullptr) {}
 
     QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, ValueDicts *rows, std::string message)
-            : column_names(column_names), column_attributes(column_attributes), rows(rows), message(message) {}
+            : column_names(column_names), column_attributes(column_attributes), rows(rows), message(message),
+              plan(nullptr) {}
+
+    QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, PlanNode *plan)
+            : column_names(column_names), column_attributes(column_attributes), rows(nullptr), message(""),
+              plan(plan) {}
+
+    // the rows of a prepared statement's plan
+    QueryResult(std::shared_ptr<PreparedStatement> prepared)
+            : column_names(new ColumnNames(prepared->column_names)),
+              column_attributes(new ColumnAttributes(prepared->column_attributes)), rows(nullptr), message(""),
+              plan(prepared->plan), prepared(prepared) {
+        prepared->results++;
+    }
 
     virtual ~QueryResult();
 
@@ -42,6 +119,21 @@ public:
 
     const std::string &get_message() const { return message; }
 
+    PlanNode *get_plan() const { return plan; }
+
+    /**
+     * Run the plan, handing each row to consume as soon as it is produced.
+     * @param consume  called with each row (which it must not keep)
+     * @returns        the message to show after the rows
+     */
+    std::string stream_rows(const std::function<void(const ValueDict *)> &consume) const;
+
+    /**
+     * Write the result out, its rows as they are produced.
+     * @param writer  the format to write in
+     */
+    void write(ResultWriter &writer) const;
+
     friend std::ostream &operator<<(std::ostream &stream, const QueryResult &qres);
 
 protected:
@@ -49,6 +141,8 @@ protected:
     ColumnAttributes *column_attributes;
     ValueDicts *rows;
     std::string message;
+    PlanNode *plan;
+    std::shared_ptr<PreparedStatement> prepared;  // owner of plan, if not this result
 };
 
 
@@ -64,21 +158,157 @@ public:
      */
     static QueryResult *execute(const hsql::SQLStatement *statement);
 
+    /**
+     * Execute one of our own statements that the Hyrise parser doesn't know:
+     *      SHOW STATS
+     *      RESET STATS
+     *      SHOW STORAGE [table]
+     *      SHOW READERS
+     *      ANALYZE [table]
+     *      EXPLAIN [ANALYZE] statement
+     *      INSERT INTO table [(columns)] VALUES (...), (...), ...
+     *      DEALLOCATE [PREPARE] name
+     * @param query  the statement text
+     * @returns      the query result (freed by caller), or nullptr if query is not one of these
+     */
+    static QueryResult *execute_extension(const std::string &query);
+
+    /**
+     * Execute a statement given as text through the statement cache, which holds the
+     * most recently run SELECTs and INSERTs (up to EnvConfig::statement_cache of them) by
+     * their text, give or take whitespace. One found there isn't parsed again, and a
+     * SELECT isn't planned again either unless the catalog has changed.
+     * @param query  the statement text
+     * @returns      the query result (freed by caller), or nullptr if query isn't one
+     *               SELECT or INSERT without parameters, or the cache is off
+     */
+    static QueryResult *execute_cached(const std::string &query);
+
+    // forget every cached and prepared statement
+    static void clear_statements();
+
+    /**
+     * Bulk load a CSV file (no header line) into a table, a batch of full pages per write
+     * transaction, so a failed load keeps the batches before it. COPY t FROM 'file' and
+     * lmdb-lab --load come here.
+     * @param table_name  table to load
+     * @param path        CSV file
+     * @returns           the query result, with the load's throughput (freed by caller)
+     */
+    static QueryResult *load(const Identifier &table_name, const std::string &path);
+
 protected:
     // the one place in the system that holds the _tables table
     static Tables *tables;
 
+    // PREPARE'd statements by name
+    static std::map<Identifier, std::shared_ptr<PreparedStatement>> prepared_statements;
+
+    static void open_tables();
+
     // recursive decent into the AST
     static QueryResult *create(const hsql::CreateStatement *statement);
 
     static QueryResult *drop(const hsql::DropStatement *statement);
 
+    static QueryResult *select(const hsql::SelectStatement *statement);
+
+    /**
+     * Insert the rows of an INSERT ... VALUES statement, all in one write transaction.
+     * @param statement  Hyrise AST
+     * @param row_sizes  for a multi-row INSERT, the number of values in each row, taken in
+     *                   turn from the statement's VALUES; empty for one row
+     * @returns          the query result (freed by caller)
+     */
+    static QueryResult *insert(const hsql::InsertStatement *statement, std::vector<size_t> row_sizes = {});
+
+    /**
+     * UPDATE ... SET column = value, ... [WHERE ...]: the rows are found first, then changed
+     * a block at a time (see BTTable::update).
+     * @param statement  Hyrise AST
+     * @returns          the query result (freed by caller)
+     */
+    static QueryResult *update(const hsql::UpdateStatement *statement);
+
+    /**
+     * DELETE FROM table [WHERE ...]: the rows are found first, then deleted a block at a
+     * time, all in one transaction (see BTTable::del).
+     * @param statement  Hyrise AST
+     * @returns          the query result (freed by caller)
+     */
+    static QueryResult *del(const hsql::DeleteStatement *statement);
+
+    // COPY t FROM 'file'
+    static QueryResult *copy_from(const hsql::ImportStatement *statement);
+
+    /**
+     * COPY t TO 'file' [WITH (FORMAT CSV|BINARY)]: write every row of a table (or a query's rows)
+     * to a file as they are read, as CSV without a header line (which COPY FROM reads back) or
+     * in BinaryWriter's format.
+     * @param statement  Hyrise AST
+     * @returns          the query result, with the export's throughput (freed by caller)
+     */
+    static QueryResult *copy_to(const hsql::ExportStatement *statement);
+
     static QueryResult *show(const hsql::ShowStatement *statement);
 
+    static QueryResult *prepare(const hsql::PrepareStatement *statement);
+
+    // EXECUTE: bind the parameters and run the prepared statement
+    static QueryResult *execute_prepared(const hsql::ExecuteStatement *statement);
+
+    static QueryResult *deallocate(const Identifier &name);
+
+    /**
+     * Run a prepared statement with its parameters as bound, planning it if need be. A
+     * SELECT whose plan is still in use by an earlier result gets a plan of its own.
+     * @returns  the query result (freed by caller)
+     */
+    static QueryResult *run(std::shared_ptr<PreparedStatement> prepared);
+
+    // plan a prepared SELECT, unless its plan is still good for the catalog
+    static void plan(PreparedStatement &prepared);
+
     static QueryResult *show_tables();
 
     static QueryResult *show_columns(const hsql::ShowStatement *statement);
 
+    static QueryResult *show_stats();
+
+    static QueryResult *reset_stats();
+
+    static QueryResult *show_storage(const Identifier &table_name);
+
+    // the read snapshots open in this process, flagging those older than stale-reader
+    static QueryResult *show_readers();
+
+    // the one table named (which must exist), or every table if none is
+    static std::vector<Identifier> table_names(const Identifier &table_name);
+
+    /**
+     * Collect statistics for the planner (see Statistics).
+     * @param table_name  the table, or empty for every table but the schema tables
+     */
+    static QueryResult *analyze(const Identifier &table_name);
+
+    /**
+     * Show the plan for a statement, running it too if analyze is set.
+     * @param statement  Hyrise AST of the statement to explain
+     * @param analyze    true to execute the plan and report what each operator did
+     * @returns          one row per operator (freed by caller)
+     */
+    static QueryResult *explain(const hsql::SQLStatement *statement, bool analyze);
+
+    /**
+     * Build the operator tree for a SELECT.
+     * @param statement          Hyrise AST of the query
+     * @param column_names       if given, returned by reference: the columns of the rows it produces
+     * @param column_attributes  if given, returned by reference
+     * @returns                  the plan's top operator (freed by caller)
+     */
+    static PlanNode *plan(const hsql::SelectStatement *statement, ColumnNames *column_names = nullptr,
+                          ColumnAttributes *column_attributes = nullptr);
+
     /**
      * Pull out column name and attributes from AST's column definition clause
      * @param col                AST column definition
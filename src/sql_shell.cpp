@@ -11,7 +11,9 @@
 #include "benchmark.h"
 
 #include <stdio.h>
+#include <strings.h>
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -21,28 +23,29 @@ using namespace hsql;
 
 bool SQLShell::initialized = false;
 
-void SQLShell::init(const char *envHome) {
+SQLShell::~SQLShell() {
+    if (this->initialized) {
+        DbEnv::close();
+        this->initialized = false;
+    }
+}
+
+void SQLShell::init(const char *envHome, const EnvConfig &config) {
     if (this->initialized) {
         cerr << "(database environment already initialized) \n";
         return;
     };
-	
-	MDB_env *env;
-	mdb_env_create(&env);
-	mdb_env_set_mapsize(env, 1UL * 1024UL * 1024UL * 1024UL); // 1Gb
-	mdb_env_set_maxdbs(env, 5);
-	int status = mdb_env_open(env, envHome, 0, 0664); // unlike in BDB, we can't pass in DB_CREATE
-	_MDB_ENV = env;
-
-	if (status) {
-		cerr << "(bad status code: " << status << " )\n";
+
+	try {
+		DbEnv::open(envHome, config);
+	} catch (DbException &e) {
+		cerr << "(bad status code: " << e.code().value() << " " << e.what() << ")\n";
 		exit(1);
 	}
 
-    _MDB_ENV = env;
     initialize_schema_tables();
     this->initialized = true;
-    printf("(running with database environment at %s)\n", envHome);
+    printf("(running with database environment at %s, durability %s)\n", envHome, config.durability.c_str());
 }
 
 void SQLShell::run() {
@@ -54,6 +57,34 @@ void SQLShell::run() {
         if (query == "quit") break;
         if (query == "benchmark") Benchmark::run();
 
+        istringstream words(query);
+        string set, what, name, rest;
+        words >> set >> what >> name >> rest;
+        if (strcasecmp(set.c_str(), "SET") == 0 && strcasecmp(what.c_str(), "FORMAT") == 0 && rest.empty()) {
+            for (auto &c : name)
+                c = (char) tolower(c);
+            if (find(ResultWriter::FORMATS.begin(), ResultWriter::FORMATS.end(), name) == ResultWriter::FORMATS.end())
+                cout << "Error: format must be text, csv or binary" << endl;
+            else
+                format = name;
+            continue;
+        }
+
+        // statements of our own that the parser doesn't know, then those run before
+        try {
+            QueryResult *extension_result = SQLExec::execute_extension(query);
+            if (extension_result == nullptr)
+                extension_result = SQLExec::execute_cached(query);
+            if (extension_result != nullptr) {
+                print(*extension_result);
+                delete extension_result;
+                continue;
+            }
+        } catch (SQLExecError &e) {
+            cout << "Error: " << e.what() << endl;
+            continue;
+        }
+
         SQLParserResult *parser_result = new SQLParserResult();
 		bool is_valid = SQLParser::parseSQLString(query, parser_result);
 
@@ -64,7 +95,7 @@ void SQLShell::run() {
                 try {
                     // Now, execute it using SQLExec
                     QueryResult *query_result = sql_exec->execute(parser_result->getStatement(i));
-                    std::cout << *query_result;
+                    print(*query_result);
                     delete query_result;
                 } catch (SQLExecError &e) {
                     cout << "Error: " << e.what() << endl;
@@ -78,3 +109,24 @@ void SQLShell::run() {
     }
 }
 
+
+void SQLShell::print(const QueryResult &result) {
+    if (format == "text" || result.get_column_names() == nullptr) {
+        cout << result;
+        return;
+    }
+    unique_ptr<ResultWriter> writer = ResultWriter::create(format, cout);
+    result.write(*writer);
+}
+
+bool SQLShell::load(const string &table_name, const string &path) {
+    try {
+        QueryResult *result = SQLExec::load(table_name, path);
+        cout << *result;
+        delete result;
+        return true;
+    } catch (SQLExecError &e) {
+        cout << "Error: " << e.what() << endl;
+        return false;
+    }
+}
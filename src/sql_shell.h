@@ -8,6 +8,8 @@
 #pragma once
 #include <hsql/SQLParser.h>
 #include "heap_storage.h"
+#include "db_env.h"
+#include "sql_exec.h"
 
 /**
  * Initialize database environment, accept user input and execute SQL commands
@@ -16,18 +18,33 @@
  */
 class SQLShell {
    public:
+    virtual ~SQLShell();
+
     /**
      * Initialize the database environment with the given home directory
      * @param envHome  the home directory of the database
+     * @param config   map size, table limit and durability settings
      */
-    virtual void init(const char *envHome);
+    virtual void init(const char *envHome, const EnvConfig &config = EnvConfig());
 
     /**
      *  Run SQL Shell to accept user input and execute SQL commands
      */
     virtual void run();
 
+    /**
+     * Bulk load a CSV file into a table (as COPY table FROM 'path'), printing the result
+     * @returns  false if the load failed
+     */
+    virtual bool load(const std::string &table_name, const std::string &path);
+
    private:
 
     static bool initialized;
+
+    // how rows are printed: one of ResultWriter::FORMATS, set with SET FORMAT name
+    std::string format = "text";
+
+    // print a result in the current format (messages are always printed as text)
+    void print(const QueryResult &result);
 };
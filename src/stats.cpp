@@ -0,0 +1,151 @@
+/**
+ * @file stats.cpp - implementation of Stats
+ */
+#include "stats.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+static const char *STAT_NAMES[STAT_COUNT] = {
+        "txn begin", "txn commit",
+        "BTFile::get", "BTFile::put", "BTFile::get_new",
+        "BTTable::select", "BTTable::insert", "BTTable::project", "BTTable::update",
+        "BTTable::del",
+        "execute SELECT", "execute INSERT", "execute UPDATE", "execute DELETE",
+        "execute CREATE", "execute DROP", "execute SHOW", "execute other",
+};
+
+static const char *COUNTER_NAMES[COUNTER_COUNT] = {
+        "rows selected", "txn aborts", "map growths", "bytes unmarshalled", "rows spilled",
+        "statement cache hits", "statement cache misses", "blocks skipped", "bloom filter probes",
+        "bloom filter skips", "stale readers cleared", "rows moved", "pages written in place",
+        "blocks read",
+};
+
+/**
+ * One thread's statistics. Written only by its thread; read by collect() at any time.
+ */
+struct ThreadStats {
+    LatencyHistogram latency[STAT_COUNT];
+    std::atomic<u_int64_t> errors[STAT_COUNT];
+    std::atomic<u_int64_t> counters[COUNTER_COUNT];
+    std::atomic<u_int64_t> epoch;
+
+    explicit ThreadStats(u_int64_t epoch) : epoch(epoch) { clear(); }
+
+    void clear() {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            latency[i].reset();
+            errors[i].store(0, std::memory_order_relaxed);
+        }
+        for (auto &counter: counters)
+            counter.store(0, std::memory_order_relaxed);
+    }
+
+    void add_to(Stats::Snapshot &snapshot) const {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            snapshot.latency[i].merge(latency[i]);
+            snapshot.errors[i] += errors[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            snapshot.counters[i] += counters[i].load(std::memory_order_relaxed);
+    }
+};
+
+static std::atomic<u_int64_t> current_epoch(0);
+static std::mutex registry_mutex;
+static std::vector<ThreadStats *> registry;       // live threads
+static Stats::Snapshot *retired = nullptr;        // threads that have exited since the last reset
+
+/**
+ * Registers this thread's statistics on first use, and folds them into retired when the
+ * thread exits so they still show up.
+ */
+class ThreadStatsOwner {
+public:
+    ThreadStatsOwner() : stats(new ThreadStats(current_epoch.load())) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(stats);
+    }
+
+    ~ThreadStatsOwner() {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::erase(registry, stats);
+        if (stats->epoch.load() == current_epoch.load()) {
+            if (retired == nullptr)
+                retired = new Stats::Snapshot();
+            stats->add_to(*retired);
+        }
+        delete stats;
+    }
+
+    // this thread's statistics, cleared first if there has been a reset since they were last used
+    ThreadStats &get() {
+        u_int64_t epoch = current_epoch.load(std::memory_order_acquire);
+        if (stats->epoch.load(std::memory_order_relaxed) != epoch) {
+            stats->clear();
+            stats->epoch.store(epoch, std::memory_order_release);
+        }
+        return *stats;
+    }
+
+protected:
+    ThreadStats *stats;
+};
+
+static ThreadStats &local_stats() {
+    static thread_local ThreadStatsOwner owner;
+    return owner.get();
+}
+
+void Stats::record(StatId id, u_int64_t ns, bool failed) {
+    ThreadStats &stats = local_stats();
+    stats.latency[id].record(ns);
+    if (failed)
+        stats.errors[id].store(stats.errors[id].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void Stats::count(CounterId id, u_int64_t n) {
+    ThreadStats &stats = local_stats();
+    stats.counters[id].store(stats.counters[id].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+u_int64_t Stats::local_count(StatId id) {
+    return local_stats().latency[id].count();
+}
+
+u_int64_t Stats::local_count(CounterId id) {
+    return local_stats().counters[id].load(std::memory_order_relaxed);
+}
+
+void Stats::collect(Snapshot &snapshot) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    u_int64_t epoch = current_epoch.load();
+    for (ThreadStats *stats: registry)
+        if (stats->epoch.load(std::memory_order_acquire) == epoch)  // anything older predates a reset
+            stats->add_to(snapshot);
+    if (retired != nullptr) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            snapshot.latency[i].merge(retired->latency[i]);
+            snapshot.errors[i] += retired->errors[i];
+        }
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            snapshot.counters[i] += retired->counters[i];
+    }
+}
+
+void Stats::reset() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    delete retired;
+    retired = nullptr;
+    current_epoch++;
+}
+
+const char *Stats::name(StatId id) {
+    return STAT_NAMES[id];
+}
+
+const char *Stats::name(CounterId id) {
+    return COUNTER_NAMES[id];
+}
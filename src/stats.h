@@ -0,0 +1,136 @@
+/**
+ * @file stats.h - per-thread operation latency histograms and counters.
+ * Stats
+ * StatTimer
+ *
+ * Each thread records into its own set of histograms, so timing an operation costs two
+ * clock reads and a few uncontended stores. Readers (SHOW STATS) merge every thread's
+ * set on demand; RESET STATS starts a new epoch, and each thread clears its own set the
+ * next time it records, so no thread ever writes another thread's counters.
+ */
+#pragma once
+
+#include <chrono>
+#include <exception>
+#include <string>
+#include "latency_histogram.h"
+
+/**
+ * Timed operations.
+ */
+enum StatId {
+    STAT_TXN_BEGIN,
+    STAT_TXN_COMMIT,
+    STAT_FILE_GET,
+    STAT_FILE_PUT,
+    STAT_FILE_GET_NEW,
+    STAT_TABLE_SELECT,
+    STAT_TABLE_INSERT,
+    STAT_TABLE_PROJECT,
+    STAT_TABLE_UPDATE,
+    STAT_TABLE_DELETE,
+    STAT_EXECUTE_SELECT,
+    STAT_EXECUTE_INSERT,
+    STAT_EXECUTE_UPDATE,
+    STAT_EXECUTE_DELETE,
+    STAT_EXECUTE_CREATE,
+    STAT_EXECUTE_DROP,
+    STAT_EXECUTE_SHOW,
+    STAT_EXECUTE_OTHER,
+    STAT_COUNT
+};
+
+/**
+ * Plain event counters.
+ */
+enum CounterId {
+    COUNTER_ROWS_SELECTED,
+    COUNTER_TXN_ABORTS,
+    COUNTER_MAP_GROWTHS,
+    COUNTER_BYTES_UNMARSHALLED,
+    COUNTER_ROWS_SPILLED,
+    COUNTER_STATEMENT_CACHE_HITS,
+    COUNTER_STATEMENT_CACHE_MISSES,
+    COUNTER_BLOCKS_SKIPPED,
+    COUNTER_BLOOM_PROBES,
+    COUNTER_BLOOM_SKIPS,
+    COUNTER_STALE_READERS_CLEARED,
+    COUNTER_ROWS_MOVED,
+    COUNTER_PAGES_IN_PLACE,
+    COUNTER_BLOCKS_READ,
+    COUNTER_COUNT
+};
+
+/**
+ * @class Stats - process-wide access to the per-thread statistics.
+ */
+class Stats {
+public:
+    Stats() = delete;
+
+    /**
+     * Summed over all threads since the last reset.
+     */
+    struct Snapshot {
+        LatencyHistogram latency[STAT_COUNT];
+        u_int64_t errors[STAT_COUNT] = {};
+        u_int64_t counters[COUNTER_COUNT] = {};
+    };
+
+    /**
+     * Record one operation on this thread.
+     * @param id      the operation
+     * @param ns      how long it took
+     * @param failed  true if it ended with an exception
+     */
+    static void record(StatId id, u_int64_t ns, bool failed = false);
+
+    static void count(CounterId id, u_int64_t n = 1);
+
+    // fill snapshot (which should be fresh) with every thread's statistics
+    static void collect(Snapshot &snapshot);
+
+    // this thread's running totals (since the last reset), for measuring one piece of work
+    static u_int64_t local_count(StatId id);
+
+    static u_int64_t local_count(CounterId id);
+
+    // forget everything recorded so far, on all threads
+    static void reset();
+
+    static const char *name(StatId id);
+
+    static const char *name(CounterId id);
+};
+
+/**
+ * @class StatTimer - times the enclosing scope and records it with Stats.
+ *
+ *      Leaving the scope by an exception, or calling fail(), counts as an error for the
+ *      operation.
+ */
+class StatTimer {
+public:
+    explicit StatTimer(StatId id)
+            : id(id), exceptions(std::uncaught_exceptions()), failed(false),
+              start(std::chrono::steady_clock::now()) {}
+
+    ~StatTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - this->start;
+        Stats::record(this->id, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                      this->failed || std::uncaught_exceptions() > this->exceptions);
+    }
+
+    // count the operation as an error even though it returns normally
+    void fail() { this->failed = true; }
+
+    StatTimer(const StatTimer &other) = delete;
+
+    StatTimer &operator=(const StatTimer &other) = delete;
+
+protected:
+    StatId id;
+    int exceptions;
+    bool failed;
+    std::chrono::steady_clock::time_point start;
+};
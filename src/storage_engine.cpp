@@ -5,6 +5,8 @@
  */
 #include "storage_engine.h"
 
+#include <algorithm>
+
 bool Value::operator==(const Value &other) const {
     if (this->data_type != other.data_type)
         return false;
@@ -17,6 +19,138 @@ bool Value::operator!=(const Value &other) const {
     return !(*this == other);
 }
 
+void ColumnBatch::reset(const ColumnNames &names, const ColumnAttributes &attributes) {
+    this->column_names = names;
+    this->column_attributes = attributes;
+    this->ints.assign(names.size(), {});
+    this->texts.assign(names.size(), {});
+    for (size_t i = 0; i < names.size(); i++) {
+        if (this->column_attributes[i].get_data_type() == ColumnAttribute::INT)
+            this->ints[i].resize(CAPACITY);
+        else
+            this->texts[i].resize(CAPACITY);
+    }
+    clear();
+}
+
+void ColumnBatch::append(const ValueDict &row) {
+    if (this->column_names.empty()) {
+        ColumnNames names;
+        ColumnAttributes attributes;
+        for (auto const &column: row) {
+            names.push_back(column.first);
+            attributes.push_back(ColumnAttribute(column.second.data_type));
+        }
+        reset(names, attributes);
+    }
+    for (size_t i = 0; i < this->column_names.size(); i++) {
+        const Value &value = row.at(this->column_names[i]);
+        if (this->column_attributes[i].get_data_type() == ColumnAttribute::INT)
+            this->ints[i][this->size] = value.n;
+        else
+            this->texts[i][this->size] = value.s;
+    }
+    this->size++;
+}
+
+void ColumnBatch::select_all() {
+    for (size_t i = 0; i < this->size; i++)
+        this->selection[i] = (u_int16_t) i;
+    this->selected = this->size;
+}
+
+int ColumnBatch::column_index(const Identifier &column_name) const {
+    for (size_t i = 0; i < this->column_names.size(); i++)
+        if (this->column_names[i] == column_name)
+            return (int) i;
+    return -1;
+}
+
+ValueDict *ColumnBatch::row(size_t i) const {
+    size_t index = this->selection[i];
+    ValueDict *row = new ValueDict();
+    for (size_t column = 0; column < this->column_names.size(); column++) {
+        if (this->column_attributes[column].get_data_type() == ColumnAttribute::INT)
+            (*row)[this->column_names[column]] = Value(this->ints[column][index]);
+        else
+            (*row)[this->column_names[column]] = Value(this->texts[column][index]);
+    }
+    return row;
+}
+
+// the columns are whatever the first row has
+bool DbCursor::next_batch(ColumnBatch &batch) {
+    batch.reset({}, {});
+    Handle handle;
+    ValueDict *row;
+    while (!batch.full() && next(handle, row)) {
+        batch.append(*row);
+        delete row;
+    }
+    batch.select_all();
+    return batch.size > 0;
+}
+
+/**
+ * Cursor over a relation's handles, projecting each row as it gets to it.
+ */
+class HandleCursor : public DbCursor {
+public:
+    explicit HandleCursor(DbRelation &relation) : relation(relation), handles(relation.select()), position(0) {}
+
+    ~HandleCursor() override { delete handles; }
+
+    HandleCursor(const HandleCursor &other) = delete;
+
+    HandleCursor &operator=(const HandleCursor &other) = delete;
+
+    bool next(Handle &handle, ValueDict *&row) override {
+        if (position == handles->size())
+            return false;
+        handle = (*handles)[position++];
+        row = relation.project(handle);
+        return true;
+    }
+
+protected:
+    DbRelation &relation;
+    Handles *handles;
+    size_t position;
+};
+
+void ScanBounds::restrict(const Identifier &column_name, int32_t lo, int32_t hi) {
+    auto [range, added] = this->int_ranges.emplace(column_name, std::pair(lo, hi));
+    if (!added) {
+        range->second.first = std::max(range->second.first, lo);
+        range->second.second = std::min(range->second.second, hi);
+    }
+}
+
+void ScanBounds::restrict(const Identifier &column_name, const std::string &s) {
+    this->text_values.emplace(column_name, s);
+}
+
+DbCursor *DbRelation::cursor() {
+    return new HandleCursor(*this);
+}
+
+Handles *DbRelation::insert(const ValueDicts *rows) {
+    Handles *handles = new Handles();
+    for (auto const &row: *rows)
+        handles->push_back(this->insert(row));
+    return handles;
+}
+
+void DbRelation::update(const Handles *handles, const ValueDict *new_values) {
+    for (auto const &handle: *handles)
+        this->update(handle, new_values);
+}
+
+void DbRelation::del(const Handles *handles) {
+    for (auto const &handle: *handles)
+        this->del(handle);
+}
+
 // Just pulls out the column names from a ValueDict and passes that to the usual form of project().
 ValueDict *DbRelation::project(Handle handle, const ValueDict *where) {
     ColumnNames t;
@@ -38,17 +38,21 @@ public:
     /**
      * ctor/dtor (subclasses should handle the big-5)
      */
-    DbBlock(MDB_val &block, BlockID block_id, bool is_new = false) : block(block), block_id(block_id) {}
+    DbBlock(MDB_val &block, BlockID block_id, bool is_new = false) : block(block), block_id(block_id), owned(false) {}
 
 	DbBlock(const DbBlock &other) {
 		block_id = other.block_id;
-		void *data = malloc(DbBlock::BLOCK_SZ);
+		char *data = new char[DbBlock::BLOCK_SZ];
 		memcpy(data, other.block.mv_data, other.block.mv_size);
 		MDB_val o_block(DbBlock::BLOCK_SZ, data);
 		block = o_block;
+		owned = true;
 	}
 
-    virtual ~DbBlock() {}
+    virtual ~DbBlock() {
+        if (owned)
+            delete[] (char *) block.mv_data;
+    }
 
     virtual void initialize_new() {}
 
@@ -71,6 +75,7 @@ public:
 protected:
     MDB_val block;
     BlockID block_id;
+    bool owned;  // true when block.mv_data is our own copy
 };
 
 // convenience type alias
@@ -118,7 +123,7 @@ public:
 
     virtual ~ColumnAttribute() {}
 
-    virtual DataType get_data_type() { return data_type; }
+    virtual DataType get_data_type() const { return data_type; }
 
     virtual void set_data_type(DataType data_type) { this->data_type = data_type; }
 
@@ -156,6 +161,93 @@ typedef std::vector<Handle> Handles;  // FIXME: will need to turn this into an i
 typedef std::map<Identifier, Value> ValueDict;
 typedef std::vector<ValueDict *> ValueDicts;
 
+/**
+ * @class ColumnBatch - up to CAPACITY rows held column by column, for vectorized operators.
+ *
+ *      INT columns are plain int32_t arrays, so filters can compare many values per
+ *      instruction. The selection vector lists, in order, the rows still in play; filling
+ *      a batch selects every row, and filters narrow it down.
+ */
+class ColumnBatch {
+public:
+    static const size_t CAPACITY = 1024;
+
+    ColumnBatch() : size(0), selected(0) {}
+
+    // start over with no rows and the given columns
+    void reset(const ColumnNames &names, const ColumnAttributes &attributes);
+
+    // drop the rows, keeping the columns
+    void clear() { size = selected = 0; }
+
+    bool full() const { return size == CAPACITY; }
+
+    // add a row (setting the columns from it if there are none yet)
+    void append(const ValueDict &row);
+
+    void select_all();
+
+    // position of a column in column_names, or -1
+    int column_index(const Identifier &column_name) const;
+
+    /**
+     * A selected row.
+     * @param i  index into the selection vector
+     * @returns  the row (freed by caller)
+     */
+    ValueDict *row(size_t i) const;
+
+    ColumnNames column_names;
+    ColumnAttributes column_attributes;
+    std::vector<std::vector<int32_t>> ints;        // by column, for INT columns
+    std::vector<std::vector<std::string>> texts;   // by column, for TEXT columns
+    size_t size;
+    u_int16_t selection[CAPACITY];
+    size_t selected;
+};
+
+/**
+ * @class ScanBounds - what every row a scan wants must satisfy, in terms a block summary can
+ *      answer: a closed range for each of some INT columns, and a value each of some TEXT
+ *      columns must equal. A range with lo > hi matches nothing. A relation may skip blocks
+ *      that can't hold such a row; the rows that do come back still have to be tested.
+ */
+struct ScanBounds {
+    std::map<Identifier, std::pair<int32_t, int32_t>> int_ranges;
+    std::map<Identifier, std::string> text_values;
+
+    bool empty() const { return int_ranges.empty() && text_values.empty(); }
+
+    // narrow a column's range to [lo, hi]
+    void restrict(const Identifier &column_name, int32_t lo, int32_t hi);
+
+    // require a TEXT column to equal s (a second, different value is left to the row test)
+    void restrict(const Identifier &column_name, const std::string &s);
+};
+
+/**
+ * @class DbCursor - walks the rows of a relation one at a time
+ */
+class DbCursor {
+public:
+    virtual ~DbCursor() {}
+
+    /**
+     * Move to the next row.
+     * @param handle  returned by reference
+     * @param row     returned by reference, all of the row's columns (freed by caller)
+     * @returns       false (and nothing returned) once there are no more rows
+     */
+    virtual bool next(Handle &handle, ValueDict *&row) = 0;
+
+    /**
+     * Fill a batch with the next rows, as many as fit (the default collects them from next()).
+     * @param batch  reset to the relation's columns and filled, with every row selected
+     * @returns      false (and an empty batch) once there are no more rows
+     */
+    virtual bool next_batch(ColumnBatch &batch);
+};
+
 /**
  * @class DbRelationError - generic exception class for DbRelation
  */
@@ -185,14 +277,50 @@ public:
 
     virtual Handle insert(const ValueDict *row) = 0;
 
+    /**
+     * Insert several rows at once. Subclasses can do better than the default, which
+     * inserts them one by one.
+     * @param rows  the rows to insert
+     * @returns     their handles, in the same order (freed by caller)
+     */
+    virtual Handles *insert(const ValueDicts *rows);
+
     virtual void update(const Handle handle, const ValueDict *new_values) = 0;
 
+    /**
+     * Give several rows the same new values. Subclasses can do better than the default,
+     * which updates them one by one.
+     * @param handles     the rows
+     * @param new_values  the columns to change, and their values
+     */
+    virtual void update(const Handles *handles, const ValueDict *new_values);
+
     virtual void del(const Handle handle) = 0;
 
+    /**
+     * Delete several rows. Subclasses can do better than the default, which deletes them
+     * one by one.
+     * @param handles  the rows
+     */
+    virtual void del(const Handles *handles);
+
     virtual Handles *select() = 0;
 
     virtual Handles *select(const ValueDict *where) = 0;
 
+    /**
+     * A cursor over every row. The default selects all the handles up front and projects
+     * each as it is reached; subclasses can hold less.
+     * @returns  the cursor (freed by caller)
+     */
+    virtual DbCursor *cursor();
+
+    /**
+     * A cursor over at least the rows within bounds (the default: every row).
+     * @returns  the cursor (freed by caller)
+     */
+    virtual DbCursor *cursor(const ScanBounds &) { return cursor(); }
+
     virtual ValueDict *project(Handle handle) = 0;
 
     virtual ValueDict *project(Handle handle, const ColumnNames *column_names) = 0;
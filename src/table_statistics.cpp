@@ -0,0 +1,160 @@
+/**
+ * @file table_statistics.cpp - implementation of HyperLogLog, ColumnStatistics and TableStatistics
+ */
+#include "table_statistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <set>
+#include <sstream>
+
+// 64-bit FNV-1a, then MurmurHash3's finalizer, so every bit depends on every byte
+static u_int64_t hash_bytes(const char *bytes, size_t size) {
+    u_int64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ (u_char) bytes[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//// HyperLogLog
+
+void HyperLogLog::add(const Value &value) {
+    if (value.data_type == ColumnAttribute::INT)
+        add(hash_bytes((const char *) &value.n, sizeof(value.n)));
+    else
+        add(hash_bytes(value.s.data(), value.s.size()));
+}
+
+// the top PRECISION bits pick a register, which keeps the longest run of leading zeros
+// (plus one) seen in the rest
+void HyperLogLog::add(u_int64_t hash) {
+    size_t index = hash >> (64 - PRECISION);
+    u_int64_t rest = hash << PRECISION;
+    u_char rank = rest == 0 ? 64 - PRECISION + 1 : __builtin_clzll(rest) + 1;
+    this->registers[index] = std::max(this->registers[index], rank);
+}
+
+double HyperLogLog::estimate() const {
+    double m = (double) this->registers.size(), sum = 0.0;
+    size_t zeros = 0;
+    for (u_char rank: this->registers) {
+        sum += std::ldexp(1.0, -rank);
+        zeros += rank == 0;
+    }
+    double estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0)
+        estimate = m * std::log(m / (double) zeros);  // few values: count the empty registers instead
+    return estimate;
+}
+
+//// ColumnStatistics
+
+double ColumnStatistics::fraction_below(double x) const {
+    if (this->histogram.size() < 2)
+        return -1.0;
+    size_t buckets = this->histogram.size() - 1;
+    double below = 0.0;
+    for (size_t i = 0; i < buckets; i++) {
+        double lo = this->histogram[i], hi = this->histogram[i + 1];
+        if (hi < x)
+            below += 1.0;
+        else if (lo < x)
+            below += (x - lo) / (hi - lo);
+    }
+    return below / (double) buckets;
+}
+
+std::string ColumnStatistics::histogram_text() const {
+    std::string text;
+    for (int32_t bound: this->histogram) {
+        if (!text.empty())
+            text += ' ';
+        text += std::to_string(bound);
+    }
+    return text;
+}
+
+void ColumnStatistics::set_histogram(const std::string &text) {
+    this->histogram.clear();
+    std::istringstream in(text);
+    int32_t bound;
+    while (in >> bound)
+        this->histogram.push_back(bound);
+}
+
+//// TableStatistics
+
+TableStatistics TableStatistics::collect(DbRelation &table) {
+    TableStatistics statistics;
+    std::map<Identifier, HyperLogLog> sketches;
+    // a reservoir of rows, each as its position in the table and its INT values
+    std::vector<std::pair<u_int64_t, std::map<Identifier, int32_t>>> sample;
+    std::mt19937_64 random(5300);  // the same sample each time for the same table
+    std::set<BlockID> blocks;
+
+    DbCursor *cursor = table.cursor();
+    Handle handle;
+    ValueDict *row;
+    try {
+        while (cursor->next(handle, row)) {
+            u_int64_t position = statistics.rows++;
+            blocks.insert(handle.first);
+            std::map<Identifier, int32_t> ints;
+            for (auto const &[column_name, value]: *row) {
+                sketches[column_name].add(value);
+                if (value.data_type == ColumnAttribute::INT)
+                    ints[column_name] = value.n;
+            }
+            delete row;
+            if (sample.size() < SAMPLE_ROWS) {
+                sample.push_back({position, std::move(ints)});
+            } else {
+                u_int64_t slot = random() % (position + 1);
+                if (slot < SAMPLE_ROWS)
+                    sample[slot] = {position, std::move(ints)};
+            }
+        }
+    } catch (...) {
+        delete cursor;
+        throw;
+    }
+    delete cursor;
+    statistics.blocks = blocks.size();
+
+    for (auto const &[column_name, sketch]: sketches) {
+        ColumnStatistics &column = statistics.columns[column_name];
+        column.distinct = std::min(statistics.rows, (u_int64_t) std::llround(sketch.estimate()));
+        std::vector<std::pair<int32_t, u_int64_t>> values;  // (value, position) from the sample
+        for (auto const &[position, ints]: sample) {
+            auto found = ints.find(column_name);
+            if (found != ints.end())
+                values.push_back({found->second, position});
+        }
+        if (values.empty())
+            continue;
+
+        // Pearson correlation of value with position
+        double n = (double) values.size(), sum_v = 0, sum_p = 0, sum_vv = 0, sum_pp = 0, sum_vp = 0;
+        for (auto const &[value, position]: values) {
+            double v = value, p = (double) position;
+            sum_v += v;
+            sum_p += p;
+            sum_vv += v * v;
+            sum_pp += p * p;
+            sum_vp += v * p;
+        }
+        double var_v = n * sum_vv - sum_v * sum_v, var_p = n * sum_pp - sum_p * sum_p;
+        column.correlation = var_v > 0 && var_p > 0 ? (n * sum_vp - sum_v * sum_p) / std::sqrt(var_v * var_p) : 1.0;
+
+        std::sort(values.begin(), values.end());
+        for (size_t i = 0; i <= ColumnStatistics::HISTOGRAM_BUCKETS; i++)
+            column.histogram.push_back(values[i * (values.size() - 1) / ColumnStatistics::HISTOGRAM_BUCKETS].first);
+    }
+    return statistics;
+}
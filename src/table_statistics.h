@@ -0,0 +1,90 @@
+/**
+ * @file table_statistics.h - what ANALYZE learns about a table, for the planner.
+ * HyperLogLog
+ * ColumnStatistics
+ * TableStatistics
+ *
+ * ANALYZE reads a table once and keeps, per column, an estimate of the number of distinct
+ * values (a HyperLogLog sketch sees every row) and, for INT columns, an equi-depth
+ * histogram and the correlation of the values with their order in storage (both from a
+ * fixed-size reservoir sample of the rows). The planner turns these into selectivities
+ * and costs in place of its fixed guesses; they are stored in the _statistics schema
+ * table (see Statistics) and only change when ANALYZE is run again.
+ */
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class HyperLogLog - an estimate of the number of distinct values added, within about
+ *      1.6% (for 2^PRECISION registers), in a few KiB however many there are.
+ */
+class HyperLogLog {
+public:
+    static const uint PRECISION = 12;
+
+    HyperLogLog() : registers(1U << PRECISION, 0) {}
+
+    virtual ~HyperLogLog() {}
+
+    void add(const Value &value);
+
+    // add a value by its 64-bit hash
+    void add(u_int64_t hash);
+
+    double estimate() const;
+
+protected:
+    std::vector<u_char> registers;
+};
+
+/**
+ * @class ColumnStatistics - one column's distinct-value estimate and, for an INT column,
+ *      its histogram and physical correlation.
+ */
+struct ColumnStatistics {
+    // equi-depth buckets in a histogram (there are one more bounds)
+    static const size_t HISTOGRAM_BUCKETS = 32;
+
+    u_int64_t distinct = 0;
+    double correlation = 0.0;        // of value with storage order, -1 to 1 (1: stored in ascending order)
+    std::vector<int32_t> histogram;  // bucket bounds, ascending, each bucket holding an equal share of rows
+
+    // fraction of rows equal to any one value
+    double equality_fraction() const { return distinct > 0 ? 1.0 / (double) distinct : 1.0; }
+
+    /**
+     * Fraction of rows with a value below x, interpolating within the histogram's buckets.
+     * @returns  a fraction, or a negative number if there is no histogram
+     */
+    double fraction_below(double x) const;
+
+    // the histogram as text ("b0 b1 ... bn"), and back
+    std::string histogram_text() const;
+
+    void set_histogram(const std::string &text);
+};
+
+typedef std::map<Identifier, ColumnStatistics> ColumnStatisticsMap;
+
+/**
+ * @class TableStatistics - row and block counts and the statistics of each column.
+ */
+struct TableStatistics {
+    // rows sampled for the histograms and correlations
+    static const size_t SAMPLE_ROWS = 30000;
+
+    u_int64_t rows = 0;
+    u_int64_t blocks = 0;  // blocks holding rows
+    ColumnStatisticsMap columns;
+
+    /**
+     * Read every row of a table and work out its statistics.
+     * @param table  the table
+     * @returns      the statistics
+     */
+    static TableStatistics collect(DbRelation &table);
+};
@@ -1,12 +1,28 @@
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <cstdio>
 #include <cstdlib>
 
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
 #include "storage_engine.h"
 #include "heap_storage.h"
+#include "commit_queue.h"
+#include "csv_reader.h"
+#include "db_env.h"
+#include "latency_histogram.h"
+#include "query_plan.h"
+#include "result_writer.h"
+#include "simd_filter.h"
+#include "spill_file.h"
+#include "sql_exec.h"
+#include "stats.h"
 
 // helper util functions
 MDB_val *marshal_text(std::string text);
@@ -211,11 +227,1282 @@ namespace
         ASSERT_EQ(value.n, 12);
         value = (*result)["b"];
         ASSERT_EQ(value.s, "Hello!");
+        // a handle to a block that isn't there fails instead of reading garbage
+        ASSERT_THROW(table.project(Handle(9999, 1)), DbException);
         table.drop();
         // clean up
         delete handles;
         delete result;
     }
+
+	TEST_F(BTFixture, BT_file_stats)
+    {
+        remove_files({"_test_file_stats"});
+        BTFile file("_test_file_stats");
+        file.create();
+
+        SlottedPage *page = file.get(1);
+        MDB_val *d_value = marshal_text("keep");
+        page->add(d_value);
+        RecordID gone = page->add(d_value);
+        page->add(d_value);
+        page->del(gone);
+        ASSERT_EQ(page->tombstones(), 1);
+        ASSERT_EQ(page->used_bytes(), 4 * 4 + 2 * (4 + 2));  // headers incl. the tombstone, live data only
+        file.put(page);
+
+        BTFileStats stats;
+        file.get_stats(stats);
+        ASSERT_EQ(stats.db.ms_entries, 1U);
+        ASSERT_EQ(stats.blocks, 1U);
+        ASSERT_EQ(stats.records, 2U);
+        ASSERT_EQ(stats.tombstones, 1U);
+        ASSERT_EQ(stats.used_bytes, page->used_bytes());
+        ASSERT_DOUBLE_EQ(stats.min_fill, (double) page->used_bytes() / DbBlock::BLOCK_SZ);
+
+        file.drop();
+        delete[] (char *) d_value->mv_data;
+        delete d_value;
+        delete page;
+    }
+
+	TEST_F(BTFixture, BT_table_insert_batch)
+    {
+        remove_files({"_test_insert_batch"});
+        BTTable table("_test_insert_batch", {"a", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+
+        ValueDicts rows;
+        for (int i = 0; i < 500; i++)
+            rows.push_back(new ValueDict({{"a", Value(i)}, {"b", Value(std::string(30, 'x'))}}));
+        Handles *handles = table.insert(&rows);
+        ASSERT_EQ(handles->size(), rows.size());
+        ASSERT_GT(handles->back().first, handles->front().first);  // spilled onto more pages
+        for (size_t i = 0; i < rows.size(); i += 99) {
+            ValueDict *row = table.project((*handles)[i]);
+            ASSERT_EQ(*row, *rows[i]);
+            delete row;
+        }
+
+        // a row that can't be marshalled rolls back the whole batch
+        ValueDict bad = {{"a", Value(1)}};
+        rows.push_back(&bad);
+        ASSERT_THROW(delete table.insert(&rows), DbRelationError);
+        rows.pop_back();
+        Handles *all = table.select();
+        ASSERT_EQ(all->size(), rows.size());
+
+        for (ValueDict *row : rows)
+            delete row;
+        delete all;
+        delete handles;
+        table.drop();
+    }
+
+	TEST_F(BTFixture, BT_table_row_count)
+    {
+        remove_files({"_test_row_count"});
+        BTTable table("_test_row_count", {"a", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ASSERT_EQ(table.count_rows(), 0U);
+
+        ValueDicts rows;
+        for (int i = 0; i < 300; i++)
+            rows.push_back(new ValueDict({{"a", Value(i)}, {"b", Value(std::string(30, 'x'))}}));
+        Handles *handles = table.insert(&rows);
+        ValueDict row = {{"a", Value(-1)}, {"b", Value("one more")}};
+        table.insert(&row);
+        table.del((*handles)[7]);
+        table.del((*handles)[7]);  // already gone
+        table.del((*handles)[250]);
+        ASSERT_EQ(table.count_rows(), 299U);
+
+        // the count goes with the transaction it was changed in
+        {
+            BTTransaction txn;
+            table.insert(&row);
+            ASSERT_EQ(table.count_rows(), 300U);
+        }
+        ASSERT_EQ(table.count_rows(), 299U);
+
+        // from the page headers, the same, without decoding a record
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_EQ(stats.records, 299U);
+        u_int64_t unmarshalled = Stats::local_count(COUNTER_BYTES_UNMARSHALLED);
+        HashAggregate count(new TableScan(table, "_test_row_count"), {},
+                            {{HashAggregate::Aggregate::COUNT, "", ColumnAttribute::INT, "count(*)"}}, SIZE_MAX);
+        ASSERT_EQ(count.get_description(), "Hash Aggregate (count(*)) from row count");
+        count.open();
+        ValueDict *result = count.next();
+        ASSERT_EQ(result->at("count(*)"), Value(299));
+        delete result;
+        count.close();
+        ASSERT_EQ(Stats::local_count(COUNTER_BYTES_UNMARSHALLED), unmarshalled);
+
+        for (ValueDict *r : rows)
+            delete r;
+        delete handles;
+        table.drop();
+    }
+
+	TEST_F(BTFixture, BT_table_loader)
+    {
+        remove_files({"_test_loader"});
+        std::string path = "/tmp/_test_loader_" + std::to_string(getpid()) + ".csv";
+        FILE *csv = fopen(path.c_str(), "w");
+        fputs("1,\"a, \"\"quoted\"\" one\"\r\n\n", csv);
+        for (int i = 2; i <= 4000; i++)
+            fprintf(csv, "%d,%s\n", i, std::string(300 + i % 50, 'x').c_str());
+        fputs("4001,no newline", csv);
+        fclose(csv);
+
+        // a buffer smaller than a record has to grow
+        CsvReader reader(path, 8);
+        std::vector<std::string_view> fields;
+        ASSERT_TRUE(reader.next(fields));
+        ASSERT_EQ(fields, std::vector<std::string_view>({"1", "a, \"quoted\" one"}));
+
+        BTTable table("_test_loader", {"a", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        {
+            BTTableLoader loader(table);
+            loader.add(fields);
+            while (reader.next(fields))
+                loader.add(fields);
+            ASSERT_EQ(reader.get_line(), 4002U);  // the blank line counts
+            ASSERT_THROW(loader.add({"x1", "bad"}), DbRelationError);
+            ASSERT_THROW(loader.add({"1"}), DbRelationError);
+            loader.finish();
+            ASSERT_EQ(loader.get_written(), 4001U);
+        }
+        ASSERT_EQ(table.count_rows(), 4001U);
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_EQ(stats.records, 4001U);
+        ASSERT_GT(stats.blocks, 256U);  // past a block id whose key sorts before the others
+
+        // a second load goes on from the last page
+        {
+            BTTableLoader loader(table);
+            loader.add({"4002", "last"});
+            loader.finish();
+        }
+        ASSERT_EQ(table.count_rows(), 4002U);
+        Handles *handles = table.select();
+        ValueDict *row = table.project(handles->back());
+        ASSERT_EQ(row->at("a"), Value(4002));
+        delete row;
+        row = table.project(handles->front());
+        ASSERT_EQ(row->at("b"), Value("a, \"quoted\" one"));
+        delete row;
+        delete handles;
+        table.drop();
+        remove(path.c_str());
+        ASSERT_THROW(CsvReader("/tmp/_no_such_loader_file.csv"), std::invalid_argument);
+    }
+
+	TEST_F(BTFixture, BT_table_zone_maps)
+    {
+        remove_files({"_test_zones"});
+        BTTable table("_test_zones", {"ts", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 3000; i++)
+            rows.push_back(new ValueDict({{"ts", Value(i)}, {"b", Value(std::string(60, 'z'))}}));
+        Handles *handles = table.insert(&rows);
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_GT(stats.blocks, 10U);
+
+        auto scan = [&](const Condition &where) {
+            ScanBounds bounds;
+            where.bounds(bounds);
+            DbCursor *cursor = table.cursor(bounds);
+            Handle handle;
+            ValueDict *row;
+            int matches = 0;
+            while (cursor->next(handle, row)) {
+                matches += where.matches(*row);
+                delete row;
+            }
+            delete cursor;
+            return matches;
+        };
+        u_int64_t skipped = Stats::local_count(COUNTER_BLOCKS_SKIPPED);
+        Condition range(Condition::AND, new Condition(Condition::GE, "ts", Value(1500)),
+                        new Condition(Condition::LT, "ts", Value(1510)));
+        ASSERT_EQ(scan(range), 10);
+        ASSERT_GE(Stats::local_count(COUNTER_BLOCKS_SKIPPED) - skipped, stats.blocks - 2);
+
+        // an OR says nothing about where rows are; nor does a TEXT comparison
+        skipped = Stats::local_count(COUNTER_BLOCKS_SKIPPED);
+        Condition either(Condition::OR, new Condition(Condition::LT, "ts", Value(2)),
+                         new Condition(Condition::GT, "ts", Value(2997)));
+        ASSERT_EQ(scan(either), 4);
+        ASSERT_EQ(Stats::local_count(COUNTER_BLOCKS_SKIPPED), skipped);
+
+        // a block with every row deleted is skipped, and the rest are still found
+        int deleted = 0;
+        for (Handle handle : *handles)
+            if (handle.first == handles->front().first) {
+                table.del(handle);
+                deleted++;
+            }
+        skipped = Stats::local_count(COUNTER_BLOCKS_SKIPPED);
+        ASSERT_EQ(scan(Condition(Condition::GE, "ts", Value(0))), 3000 - deleted);
+        ASSERT_EQ(Stats::local_count(COUNTER_BLOCKS_SKIPPED) - skipped, 1U);
+        ASSERT_EQ(scan(Condition(Condition::LT, "ts", Value(INT32_MIN))), 0);
+        ValueDict where = {{"ts", Value(2999)}};
+        Handles *found = table.select(&where);
+        ASSERT_EQ(found->size(), 1U);
+        delete found;
+
+        for (ValueDict *r : rows)
+            delete r;
+        delete handles;
+        table.drop();
+
+        // dropped with the table: a new one of the same name is read block by block
+        table.create();
+        ValueDict row = {{"ts", Value(1)}, {"b", Value("b")}};
+        table.insert(&row);
+        ASSERT_EQ(scan(Condition(Condition::EQ, "ts", Value(1))), 1);
+        table.drop();
+    }
+
+	TEST_F(BTFixture, BT_table_update_forwarding)
+    {
+        remove_files({"_test_update"});
+        BTTable table("_test_update", {"id", "note"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 400; i++)
+            rows.push_back(new ValueDict({{"id", Value(i)}, {"note", Value(std::string(20, 'a'))}}));
+        Handles *handles = table.insert(&rows);
+        for (ValueDict *r : rows)
+            delete r;
+        auto scan = [&table]() {
+            Handles found;
+            DbCursor *cursor = table.cursor();
+            Handle handle;
+            ValueDict *row;
+            while (cursor->next(handle, row)) {
+                found.push_back(handle);
+                delete row;
+            }
+            delete cursor;
+            std::sort(found.begin(), found.end());
+            return found;
+        };
+
+        // a row that still fits its block is changed in place
+        u_int64_t moved = Stats::local_count(COUNTER_ROWS_MOVED);
+        ValueDict shorter = {{"note", Value("b")}};
+        table.update((*handles)[1], &shorter);
+        ASSERT_EQ(Stats::local_count(COUNTER_ROWS_MOVED), moved);
+        ValueDict *row = table.project((*handles)[1]);
+        ASSERT_EQ(row->at("note").s, "b");
+        ASSERT_EQ(row->at("id").n, 1);
+        delete row;
+
+        // rows that outgrow their block move, but keep their handles
+        Handles first_block;
+        for (auto const &handle : *handles)
+            if (handle.first == handles->front().first)
+                first_block.push_back(handle);
+        ValueDict longer = {{"note", Value(std::string(300, 'c'))}};
+        table.update(&first_block, &longer);
+        ASSERT_GT(Stats::local_count(COUNTER_ROWS_MOVED) - moved, 0U);
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_GT(stats.forwards, 0U);
+        ASSERT_EQ(stats.records, 400U);
+        for (auto const &handle : first_block) {
+            row = table.project(handle);
+            ASSERT_EQ(row->at("note").s.size(), 300U);
+            delete row;
+        }
+        Handles sorted(*handles);
+        std::sort(sorted.begin(), sorted.end());
+        ASSERT_EQ(scan(), sorted);
+
+        // moving again repoints the same stub; the zone maps find a moved row where it went
+        Handle home = first_block.back();
+        ValueDict longest = {{"note", Value(std::string(1000, 'd'))}};
+        table.update(home, &longest);
+        BTFileStats again;
+        table.get_stats(again);
+        ASSERT_EQ(again.forwards, stats.forwards);
+        ValueDict where = {{"id", Value((int32_t) (first_block.size() - 1))}};
+        Handles *found = table.select(&where);
+        ASSERT_EQ(*found, Handles({home}));
+        delete found;
+
+        // deleting by the home handle takes the stub and the moved row
+        table.del(home);
+        table.get_stats(again);
+        ASSERT_EQ(again.forwards, stats.forwards - 1);
+        ASSERT_EQ(table.count_rows(), 399U);
+        ASSERT_EQ(scan().size(), 399U);
+        ValueDict wrong_type = {{"id", Value("x")}};
+        ASSERT_THROW(table.update((*handles)[0], &wrong_type), DbRelationError);
+        delete handles;
+        table.drop();
+    }
+
+	TEST_F(BTFixture, BT_table_delete_set)
+    {
+        // a page gives up several records with one compaction, the rest intact
+        char block[DbBlock::BLOCK_SZ];
+        memset(block, 0, sizeof(block));
+        MDB_val data(sizeof(block), block);
+        SlottedPage page(data, 1, true);
+        for (int i = 0; i < 10; i++) {
+            std::string text(10 + i, 'a' + i);
+            MDB_val record(text.size(), text.data());
+            page.add(&record);
+        }
+        u_int16_t used = page.used_bytes();
+        page.del(RecordIDs({2, 5, 9}));
+        ASSERT_EQ(page.used_bytes(), used - 11 - 14 - 18);
+        ASSERT_EQ(*std::unique_ptr<RecordIDs>(page.ids()), RecordIDs({1, 3, 4, 6, 7, 8, 10}));
+        for (RecordID id : {1, 3, 4, 6, 7, 8, 10}) {
+            MDB_val record;
+            ASSERT_TRUE(page.get(id, record));
+            ASSERT_EQ(std::string((char *) record.mv_data, record.mv_size), std::string(9 + id, 'a' + id - 1));
+        }
+
+        remove_files({"_test_delete"});
+        BTTable table("_test_delete", {"id", "note"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 600; i++)
+            rows.push_back(new ValueDict({{"id", Value(i)}, {"note", Value(std::string(20, 'n'))}}));
+        Handles *handles = table.insert(&rows);
+        for (ValueDict *r : rows)
+            delete r;
+        ValueDict longer = {{"note", Value(std::string(2000, 'm'))}};
+        table.update((*handles)[0], &longer);  // moved: both halves go
+
+        Handles doomed;
+        for (size_t i = 0; i < handles->size(); i += 3)
+            doomed.push_back((*handles)[i]);
+        doomed.push_back((*handles)[3]);  // twice
+        table.del(&doomed);
+        ASSERT_EQ(table.count_rows(), 400U);
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_EQ(stats.records, 400U);
+        ASSERT_EQ(stats.forwards, 0U);
+        DbCursor *cursor = table.cursor();
+        Handle handle;
+        ValueDict *row;
+        int seen = 0;
+        while (cursor->next(handle, row)) {
+            ASSERT_NE(row->at("id").n % 3, 0);
+            ASSERT_EQ(row->at("note").s, std::string(20, 'n'));
+            delete row;
+            seen++;
+        }
+        delete cursor;
+        ASSERT_EQ(seen, 400);
+        delete handles;
+        table.drop();
+    }
+
+	TEST_F(BTFixture, BT_file_write_in_place)
+    {
+        // without MDB_WRITEMAP a page to write is a copy of its own, in a write transaction or not
+        remove_files({"_test_in_place_file"});
+        BTFile file("_test_in_place_file");
+        file.create();
+        for (bool in_transaction : {false, true}) {
+            BTTransaction txn(in_transaction ? 0 : MDB_RDONLY);
+            SlottedPage *page = file.get_for_write(1);
+            SlottedPage *stored = file.get(1);
+            ASSERT_NE(page->get_data(), stored->get_data());
+            ASSERT_EQ(memcmp(page->get_data(), stored->get_data(), DbBlock::BLOCK_SZ), 0);
+            delete stored;
+            delete page;
+        }
+        file.drop();
+
+        // under it, pages are changed in the map and not written again
+        mdb_env_close(_MDB_ENV);
+        mdb_env_create(&_MDB_ENV);
+        mdb_env_set_mapsize(_MDB_ENV, 1UL * 1024UL * 1024UL * 1024UL);
+        mdb_env_set_maxdbs(_MDB_ENV, 5);
+        ASSERT_EQ(mdb_env_open(_MDB_ENV, envdir.c_str(), MDB_WRITEMAP, 0664), 0);
+        remove_files({"_test_in_place"});
+        BTTable table("_test_in_place", {"id", "note"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 300; i++)
+            rows.push_back(new ValueDict({{"id", Value(i)}, {"note", Value(std::string(40, 'p'))}}));
+        u_int64_t in_place = Stats::local_count(COUNTER_PAGES_IN_PLACE);
+        Handles *handles = table.insert(&rows);
+        for (ValueDict *r : rows)
+            delete r;
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_GT(stats.blocks, 2U);
+        ASSERT_EQ(Stats::local_count(COUNTER_PAGES_IN_PLACE) - in_place, stats.blocks);  // none copied back
+
+        // a page changed in place goes with the transaction that changed it
+        ValueDict note = {{"note", Value(std::string(40, 'q'))}};
+        {
+            BTTransaction txn;
+            table.update((*handles)[0], &note);
+            delete table.project((*handles)[0]);
+        }
+        ValueDict *row = table.project((*handles)[0]);
+        ASSERT_EQ(row->at("note").s, std::string(40, 'p'));
+        delete row;
+        table.update((*handles)[0], &note);
+        row = table.project((*handles)[0]);
+        ASSERT_EQ(row->at("note").s, std::string(40, 'q'));
+        delete row;
+        delete handles;
+        table.drop();
+    }
+
+	TEST_F(BTFixture, BT_file_block_ids)
+    {
+        remove_files({"_test_block_ids"});
+        BTFile file("_test_block_ids");
+        file.create();
+        for (int i = 0; i < 299; i++)
+            delete file.get_new();
+        BlockIDs *block_ids = file.block_ids();
+        ASSERT_EQ(block_ids->size(), 300U);
+        ASSERT_TRUE(std::is_sorted(block_ids->begin(), block_ids->end()));  // as numbers, not bytes
+        delete block_ids;
+
+        // take out a block in the middle and one past 256: a reopened file doesn't go by its
+        // number of blocks for the next id, and a walk passes over the gaps
+        MDB_txn *txn;
+        MDB_dbi dbi;
+        const char *path;
+        mdb_env_get_path(_MDB_ENV, &path);
+        ASSERT_EQ(mdb_txn_begin(_MDB_ENV, nullptr, 0, &txn), 0);
+        ASSERT_EQ(mdb_dbi_open(txn, (std::string(path) + "_test_block_ids.mdb").c_str(), 0, &dbi), 0);
+        for (BlockID block_id : {2U, 257U}) {
+            MDB_val key(sizeof(block_id), &block_id);
+            ASSERT_EQ(mdb_del(txn, dbi, &key, nullptr), 0);
+        }
+        ASSERT_EQ(mdb_txn_commit(txn), 0);
+
+        BTFile reopened("_test_block_ids");
+        reopened.open();
+        ASSERT_EQ(reopened.get_last_block_id(), 300U);
+        std::vector<SlottedPage *> blocks;
+        BlockIDs seen;
+        for (BlockID after = 0; reopened.get_blocks(after, 100, blocks); after = seen.back()) {
+            ASSERT_LE(blocks.size(), 100U);
+            for (SlottedPage *block : blocks) {
+                seen.push_back(block->get_block_id());
+                delete block;
+            }
+        }
+        ASSERT_EQ(seen.size(), 298U);
+        ASSERT_EQ(seen[1], 3U);
+        ASSERT_EQ(seen.back(), 300U);
+        ASSERT_EQ(std::count(seen.begin(), seen.end(), 257U), 0);
+        SlottedPage *page = reopened.get_new();
+        ASSERT_EQ(page->get_block_id(), 301U);
+        delete page;
+        reopened.drop();
+    }
+
+	TEST_F(BTFixture, BT_table_bloom_filters)
+    {
+        remove_files({"_test_blooms"});
+        BTTable table("_test_blooms", {"name", "note"},
+                      {ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::TEXT)});
+        ASSERT_THROW(table.set_bloom_filters({"nope"}, 10), DbRelationError);
+        table.set_bloom_filters({"name"}, 10);
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 3000; i++)
+            rows.push_back(new ValueDict({{"name", Value("name" + std::to_string(i))},
+                                          {"note", Value(std::string(60, 'z'))}}));
+        delete table.insert(&rows);
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_GT(stats.blocks, 10U);
+
+        // each block is probed, and all but the one holding the name (and a false positive
+        // or so) skipped
+        u_int64_t probes = Stats::local_count(COUNTER_BLOOM_PROBES), skips = Stats::local_count(COUNTER_BLOOM_SKIPS);
+        ValueDict where = {{"name", Value("name1234")}};
+        Handles *found = table.select(&where);
+        ASSERT_EQ(found->size(), 1U);
+        delete found;
+        ASSERT_EQ(Stats::local_count(COUNTER_BLOOM_PROBES) - probes, stats.blocks);
+        ASSERT_GE(Stats::local_count(COUNTER_BLOOM_SKIPS) - skips, stats.blocks - 3);
+
+        // a scan with the equality in its bounds; the unfiltered column is read block by block
+        auto scan = [&](const Condition &where) {
+            ScanBounds bounds;
+            where.bounds(bounds);
+            DbCursor *cursor = table.cursor(bounds);
+            Handle handle;
+            ValueDict *row;
+            int matches = 0;
+            while (cursor->next(handle, row)) {
+                matches += where.matches(*row);
+                delete row;
+            }
+            delete cursor;
+            return matches;
+        };
+        u_int64_t skipped = Stats::local_count(COUNTER_BLOCKS_SKIPPED);
+        ASSERT_EQ(scan(Condition(Condition::EQ, "name", Value("name2999"))), 1);
+        ASSERT_GE(Stats::local_count(COUNTER_BLOCKS_SKIPPED) - skipped, stats.blocks - 3);
+        ASSERT_EQ(scan(Condition(Condition::EQ, "name", Value("nobody"))), 0);
+        skipped = Stats::local_count(COUNTER_BLOCKS_SKIPPED);
+        ASSERT_EQ(scan(Condition(Condition::EQ, "note", Value(std::string(60, 'z')))), 3000);
+        ASSERT_EQ(Stats::local_count(COUNTER_BLOCKS_SKIPPED), skipped);
+
+        for (ValueDict *r : rows)
+            delete r;
+        table.drop();
+    }
+
+	TEST_F(BTFixture, table_statistics_choose_scan)
+    {
+        remove_files({"_test_analyze"});
+        BTTable table("_test_analyze", {"ts", "k"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 20000; i++)
+            rows.push_back(new ValueDict({{"ts", Value(i)}, {"k", Value(i * 7919 % 100)}}));
+        delete table.insert(&rows);
+        for (ValueDict *r : rows)
+            delete r;
+
+        TableStatistics statistics = TableStatistics::collect(table);
+        ASSERT_EQ(statistics.rows, 20000U);
+        BTFileStats stats;
+        table.get_stats(stats);
+        ASSERT_EQ(statistics.blocks, stats.blocks);
+        const ColumnStatistics &ts = statistics.columns["ts"], &k = statistics.columns["k"];
+        ASSERT_NEAR((double) ts.distinct, 20000.0, 20000.0 * 0.05);
+        ASSERT_NEAR((double) k.distinct, 100.0, 3.0);
+        ASSERT_GT(ts.correlation, 0.99);
+        ASSERT_LT(std::abs(k.correlation), 0.1);
+        ASSERT_EQ(ts.histogram.size(), ColumnStatistics::HISTOGRAM_BUCKETS + 1);
+        ASSERT_EQ(ts.histogram.front(), 0);
+        ASSERT_EQ(ts.histogram.back(), 19999);
+        ColumnStatistics round_trip;
+        round_trip.set_histogram(ts.histogram_text());
+        ASSERT_EQ(round_trip.histogram, ts.histogram);
+
+        ColumnStatisticsMap &columns = statistics.columns;
+        ASSERT_NEAR(Condition(Condition::LT, "ts", Value(2000)).selectivity(columns), 0.1, 0.01);
+        ASSERT_NEAR(Condition(Condition::GE, "ts", Value(2000)).selectivity(columns), 0.9, 0.01);
+        ASSERT_NEAR(Condition(Condition::EQ, "k", Value(5)).selectivity(columns), 0.01, 0.001);
+        ASSERT_EQ(Condition(Condition::EQ, "ts", Value(-5)).selectivity(columns), 0.0);
+
+        // a narrow range of the column stored in order reads a few blocks by their zone maps;
+        // one of the column stored in no order would read them all anyway
+        Condition narrow(Condition::LT, "ts", Value(100)), scattered(Condition::LT, "k", Value(10));
+        TableScan *by_ts = new TableScan(table, "_test_analyze");
+        TableScan by_k(table, "_test_analyze"), unknown(table, "_test_analyze");
+        by_ts->set_statistics(&statistics);
+        by_k.set_statistics(&statistics);
+        by_ts->choose_scan(&narrow);
+        by_k.choose_scan(&scattered);
+        unknown.choose_scan(&scattered);
+        ASSERT_EQ(by_ts->get_description(), "Zone Map Scan on _test_analyze");
+        ASSERT_EQ(by_k.get_description(), "Seq Scan on _test_analyze");
+        ASSERT_EQ(unknown.get_description(), "Zone Map Scan on _test_analyze");
+        Filter filter(by_ts, new Condition(Condition::LT, "ts", Value(100)));
+        ASSERT_NEAR(filter.estimate(), 100.0, 20.0);
+        table.drop();
+    }
+
+	TEST_F(BTFixture, read_snapshot)
+    {
+        remove_files({"_test_snapshot"});
+        BTTable table("_test_snapshot", {"a"}, {ColumnAttribute(ColumnAttribute::INT)});
+        table.create();
+        auto insert = [&table](int from, int to) {
+            for (int i = from; i < to; i++) {
+                ValueDict row = {{"a", Value(i)}};
+                table.insert(&row);
+            }
+        };
+        auto count = [&table]() {
+            DbCursor *cursor = table.cursor();
+            Handle handle;
+            ValueDict *row;
+            int rows = 0;
+            while (cursor->next(handle, row)) {
+                rows++;
+                delete row;
+            }
+            delete cursor;
+            return rows;
+        };
+        insert(0, 100);
+
+        {
+            ReadSnapshot snapshot("scan _test_snapshot");
+            ASSERT_EQ(ReadSnapshot::list().size(), 1U);
+            ASSERT_EQ(ReadSnapshot::list()[0].label, "scan _test_snapshot");
+
+            // commits made meanwhile by a writer on another thread aren't seen
+            std::thread writer(insert, 100, 150);
+            writer.join();
+            ASSERT_EQ(count(), 100);
+            MDB_envinfo info;
+            mdb_env_info(_MDB_ENV, &info);
+            ASSERT_GT(info.me_last_txnid, ReadSnapshot::list()[0].txn_id);
+
+            // rows spilled under the snapshot are written and read back in transactions of their own
+            SpillFile spill;
+            spill.put("k", ValueDict({{"a", Value(7)}}));
+            spill.flush();
+            SpillReader reader(spill, "");
+            ValueDict *row = reader.next();
+            ASSERT_NE(row, nullptr);
+            ASSERT_EQ(row->at("a").n, 7);
+            delete row;
+        }
+        ASSERT_TRUE(ReadSnapshot::list().empty());
+        ASSERT_EQ(count(), 150);
+        table.drop();
+    }
+
+	TEST_F(BTFixture, query_plan_pipeline)
+    {
+        remove_files({"_test_plan"});
+        BTTable table("_test_plan", {"a", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 300; i++)
+            rows.push_back(new ValueDict({{"a", Value(i % 3)}, {"b", Value(std::to_string(i))}}));
+        delete table.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+
+        // a = 1 AND NOT (b < '2'), skipping 5 and taking 10
+        Condition *condition = new Condition(Condition::AND, new Condition(Condition::EQ, "a", Value(1)),
+                                             new Condition(Condition::NOT,
+                                                           new Condition(Condition::LT, "b", Value("2"))));
+        Limit plan(new Project(new Filter(new TableScan(table, "_test_plan"), condition), {"b"}), 10, 5);
+        ASSERT_EQ(plan.get_description(), "Limit (10 offset 5)");
+        ASSERT_EQ(plan.get_input()->get_input()->get_description(), "Filter (a = 1 AND NOT (b < '2'))");
+        ASSERT_EQ(plan.estimate(), 10.0);
+
+        plan.set_profiling(true);
+        plan.open();
+        std::vector<std::string> values;
+        while (ValueDict *row = plan.next()) {
+            ASSERT_EQ(row->size(), 1U);
+            values.push_back(row->at("b").s);
+            delete row;
+        }
+        plan.close();
+        std::vector<std::string> expected = {"31", "34", "37", "40", "43", "46", "49", "52", "55", "58"};
+        ASSERT_EQ(values, expected);
+
+        // the limit stopped the scan early, a page at a time, with one unmarshal per row read
+        const OperatorProfile &scan = plan.get_input()->get_input()->get_input()->get_profile();
+        ASSERT_LT(scan.rows, 300U);
+        ASSERT_EQ(scan.blocks, 1U);
+        ASSERT_GT(scan.bytes, 0U);
+        ASSERT_EQ(plan.get_profile().rows, 10U);
+        ASSERT_GE(plan.get_profile().ns, scan.ns);
+        table.drop();
+
+        // a whole scan counts every page it reads, across more than one window of them
+        BTTable big("_test_plan_big", {"a", "b"},
+                    {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        big.create();
+        rows.clear();
+        for (int i = 0; i < 6000; i++)
+            rows.push_back(new ValueDict({{"a", Value(i)}, {"b", Value(std::string(200, 'x'))}}));
+        delete big.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+        BTFileStats stats;
+        big.get_stats(stats);
+        ASSERT_GT(stats.blocks, (u_int32_t) BTTableCursor::BLOCK_WINDOW);
+        TableScan all(big, "_test_plan_big");
+        all.set_profiling(true);
+        all.open();
+        size_t count = 0;
+        while (ValueDict *row = all.next()) {
+            count++;
+            delete row;
+        }
+        all.close();
+        ASSERT_EQ(count, 6000U);
+        ASSERT_EQ(all.get_profile().blocks, (u_int64_t) stats.blocks);
+        big.drop();
+    }
+
+	TEST_F(BTFixture, hash_join_spills)
+    {
+        remove_files({"_test_fact", "_test_dim"});
+        BTTable fact("_test_fact", {"id", "dim"},
+                     {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT)});
+        BTTable dim("_test_dim", {"id", "name"},
+                    {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        fact.create();
+        dim.create();
+        ValueDicts rows;
+        for (int i = 0; i < 2000; i++)
+            rows.push_back(new ValueDict({{"id", Value(i)}, {"dim", Value(i % 250)}}));
+        delete fact.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+        rows.clear();
+        for (int i = 0; i < 300; i += 2)  // every other dim, twice over
+            for (int copy = 0; copy < 2; copy++)
+                rows.push_back(new ValueDict({{"id", Value(i)}, {"name", Value("d" + std::to_string(i))}}));
+        delete dim.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+
+        // (fact id, dim name) of every joined row, sorted, in memory and with a 4K budget
+        auto run = [&](size_t budget, u_int32_t &partitions) {
+            HashJoin join(new TableScan(fact, "_test_fact", "f"), new TableScan(dim, "_test_dim", "d"),
+                          {"f.dim"}, {"d.id"}, budget);
+            join.open();
+            std::vector<std::pair<int, std::string>> out;
+            while (ValueDict *row = join.next()) {
+                EXPECT_EQ(row->size(), 4U);
+                EXPECT_EQ(row->at("d.name").s, "d" + std::to_string(row->at("f.dim").n));
+                out.push_back({row->at("f.id").n, row->at("d.name").s});
+                delete row;
+            }
+            join.close();
+            partitions = join.get_spilled_partitions();
+            std::sort(out.begin(), out.end());
+            return out;
+        };
+        u_int32_t partitions;
+        auto in_memory = run(SIZE_MAX, partitions);
+        ASSERT_EQ(partitions, 0U);
+        ASSERT_EQ(in_memory.size(), 2000U);  // the 1000 fact rows with an even dim, matching two dim rows each
+        u_int64_t spilled = Stats::local_count(COUNTER_ROWS_SPILLED);
+        ASSERT_EQ(run(4096, partitions), in_memory);
+        ASSERT_EQ(partitions, HashJoin::PARTITIONS);
+        ASSERT_EQ(Stats::local_count(COUNTER_ROWS_SPILLED) - spilled, 2300U);
+        fact.drop();
+        dim.drop();
+    }
+
+	TEST(prepared_statement, parameters_bind_in_place)
+	{
+		hsql::SQLParserResult *parse = new hsql::SQLParserResult();
+		ASSERT_TRUE(hsql::SQLParser::parseSQLString("SELECT * FROM t WHERE a > ? AND b = ?", parse));
+		PreparedStatement prepared(parse);
+		ASSERT_EQ(prepared.parameter_count(), 2U);
+
+		// a plan's conditions read the slots, so new values need no new plan
+		Condition condition(Condition::AND,
+		                    new Condition(Condition::GT, "a", prepared.use_parameter(0, ColumnAttribute::INT)),
+		                    new Condition(Condition::EQ, "b", prepared.use_parameter(1, ColumnAttribute::TEXT)));
+		ASSERT_EQ(condition.to_string(), "a > ? AND b = ?");
+		ValueDict row = {{"a", Value(5)}, {"b", Value("x")}};
+		hsql::SQLParserResult values;
+		ASSERT_TRUE(hsql::SQLParser::parseSQLString("EXECUTE s(3, 'x')", &values));
+		prepared.bind(((const hsql::ExecuteStatement *) values.getStatement(0))->parameters);
+		ASSERT_TRUE(condition.matches(row));
+		hsql::SQLParserResult others;
+		ASSERT_TRUE(hsql::SQLParser::parseSQLString("EXECUTE s(7, 'x')", &others));
+		prepared.bind(((const hsql::ExecuteStatement *) others.getStatement(0))->parameters);
+		ASSERT_FALSE(condition.matches(row));
+		ASSERT_EQ(prepared.get_parameter(0), Value(7));
+
+		hsql::SQLParserResult wrong;
+		ASSERT_TRUE(hsql::SQLParser::parseSQLString("EXECUTE s('7', 'x')", &wrong));
+		ASSERT_THROW(prepared.bind(((const hsql::ExecuteStatement *) wrong.getStatement(0))->parameters),
+		             SQLExecError);
+		ASSERT_THROW(prepared.bind(nullptr), SQLExecError);
+		ASSERT_EQ(prepared.get_parameter(0), Value(7));  // a failed bind changes nothing
+
+		// a negative INT, and one too big for an INT
+		hsql::SQLParserResult negative;
+		ASSERT_TRUE(hsql::SQLParser::parseSQLString("EXECUTE s(-2147483648, 'x')", &negative));
+		prepared.bind(((const hsql::ExecuteStatement *) negative.getStatement(0))->parameters);
+		ASSERT_EQ(prepared.get_parameter(0), Value(INT32_MIN));
+		hsql::SQLParserResult big;
+		ASSERT_TRUE(hsql::SQLParser::parseSQLString("EXECUTE s(3000000000, 'x')", &big));
+		ASSERT_THROW(prepared.bind(((const hsql::ExecuteStatement *) big.getStatement(0))->parameters),
+		             SQLExecError);
+		ASSERT_EQ(prepared.get_parameter(0), Value(INT32_MIN));
+	}
+
+	TEST(result_writer, formats)
+	{
+		ValueDict row = {{"a", Value(-12)}, {"b", Value("x, \"y\"")}};
+		ValueDict empty = {{"a", Value(3)}, {"b", Value("")}};
+		ValueDict null = {{"b", Value("z")}};
+		auto write = [&](const std::string &format) {
+			std::ostringstream out;
+			std::unique_ptr<ResultWriter> writer = ResultWriter::create(format, out);
+			writer->begin({"a", "b"});
+			for (const ValueDict *r : {&row, &empty, &null})
+				writer->row(*r);
+			writer->end("successfully returned 3 rows");
+			EXPECT_EQ(writer->get_rows(), 3U);
+			return out.str();
+		};
+		ASSERT_EQ(write("text"), "a b \n+----------+----------+\n-12 \"x, \"y\"\" \n3 \"\" \nNULL \"z\" \n"
+		                         "successfully returned 3 rows\n");
+		// an empty TEXT is quoted, NULL is not
+		ASSERT_EQ(write("csv"), "a,b\n-12,\"x, \"\"y\"\"\"\n3,\"\"\n,z\n");
+		std::string binary = write("binary");
+		ASSERT_EQ(binary.substr(0, 4), "LLR1");
+		ASSERT_EQ(binary.size(), 4 + 2 + 2 * 3 + (1 + 5 + 5 + 6) + (1 + 5 + 5) + (1 + 1 + 6) + 1U);
+		ASSERT_EQ(binary.back(), '\0');
+		std::ostringstream out;
+		ASSERT_THROW(ResultWriter::create("xml", out), std::invalid_argument);
+	}
+
+	TEST(query_plan, sort_normalized_keys)
+	{
+		// memcmp order of the keys is the order of the values, either way round
+		std::vector<Value> ints = {Value(INT32_MIN), Value(-70000), Value(-1), Value(0), Value(1), Value(256),
+								   Value(INT32_MAX)};
+		std::vector<Value> texts = {Value(""), Value(std::string("\0", 1)), Value(std::string("\0\0", 2)),
+									Value("a"), Value(std::string("a\0", 2)), Value("ab"), Value("b")};
+		for (auto const &values: {ints, texts}) {
+			for (bool descending: {false, true}) {
+				for (size_t i = 0; i + 1 < values.size(); i++) {
+					std::string a, b;
+					Sort::normalize(values[i], descending, a);
+					Sort::normalize(values[i + 1], descending, b);
+					ASSERT_EQ(a < b, !descending) << i;
+				}
+			}
+		}
+	}
+
+	TEST_F(BTFixture, sort_spills_and_top_n)
+    {
+        remove_files({"_test_sort"});
+        BTTable table("_test_sort", {"a", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        std::vector<std::pair<int, std::string>> expected;
+        for (int i = 0; i < 1500; i++) {
+            int a = (int) ((i * 2654435761U) % 41) - 20;
+            std::string b = "b" + std::to_string(i % 97);
+            rows.push_back(new ValueDict({{"a", Value(a)}, {"b", Value(b)}}));
+            expected.push_back({a, b});
+        }
+        delete table.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+        // ORDER BY a DESC, b
+        std::stable_sort(expected.begin(), expected.end(), [](auto const &x, auto const &y) {
+            return x.first != y.first ? x.first > y.first : x.second < y.second;
+        });
+
+        auto run = [&](Sort &sort) {
+            std::vector<std::pair<int, std::string>> out;
+            sort.open();
+            while (ValueDict *row = sort.next()) {
+                out.push_back({row->at("a").n, row->at("b").s});
+                delete row;
+            }
+            sort.close();
+            return out;
+        };
+        Sort in_memory(new TableScan(table, "_test_sort"), {"a", "b"}, {true, false}, SIZE_MAX);
+        ASSERT_EQ(run(in_memory), expected);
+        ASSERT_EQ(in_memory.get_spilled_runs(), 0U);
+        Sort spilled(new TableScan(table, "_test_sort"), {"a", "b"}, {true, false}, 16 * 1024);
+        ASSERT_EQ(run(spilled), expected);
+        ASSERT_GT(spilled.get_spilled_runs(), 5U);
+
+        u_int64_t spilled_rows = Stats::local_count(COUNTER_ROWS_SPILLED);
+        TopN top(new TableScan(table, "_test_sort"), {"a", "b"}, {true, false}, 25);
+        ASSERT_EQ(top.get_description(), "Top-25 Sort (a DESC, b)");
+        expected.resize(25);
+        ASSERT_EQ(run(top), expected);
+        ASSERT_EQ(Stats::local_count(COUNTER_ROWS_SPILLED), spilled_rows);
+        table.drop();
+    }
+
+	TEST_F(BTFixture, hash_aggregate_spills)
+    {
+        remove_files({"_test_group"});
+        BTTable table("_test_group", {"g", "n", "s"},
+                      {ColumnAttribute(ColumnAttribute::TEXT), ColumnAttribute(ColumnAttribute::INT),
+                       ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 3000; i++)
+            rows.push_back(new ValueDict({{"g", Value("g" + std::to_string(i % 700))}, {"n", Value(i)},
+                                          {"s", Value(std::to_string(i))}}));
+        delete table.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+
+        typedef HashAggregate::Aggregate Aggregate;
+        std::vector<Aggregate> aggregates = {
+                {Aggregate::COUNT, "", ColumnAttribute::INT, "count(*)"},
+                {Aggregate::SUM, "n", ColumnAttribute::INT, "sum(n)"},
+                {Aggregate::MIN, "n", ColumnAttribute::INT, "min(n)"},
+                {Aggregate::MAX, "s", ColumnAttribute::TEXT, "max(s)"},
+                {Aggregate::AVG, "n", ColumnAttribute::INT, "avg(n)"}};
+        auto run = [&](size_t budget, u_int64_t &spilled) {
+            HashAggregate aggregate(new TableScan(table, "_test_group"), {"g"}, aggregates, budget);
+            std::map<std::string, ValueDict> groups;
+            aggregate.open();
+            while (ValueDict *row = aggregate.next()) {
+                EXPECT_EQ(groups.count(row->at("g").s), 0U);
+                groups[row->at("g").s] = *row;
+                delete row;
+            }
+            aggregate.close();
+            spilled = aggregate.get_spilled_rows();
+            return groups;
+        };
+        u_int64_t spilled;
+        auto in_memory = run(SIZE_MAX, spilled);
+        ASSERT_EQ(spilled, 0U);
+        ASSERT_EQ(in_memory.size(), 700U);
+        // g5: n = 5, 705, 1405, 2105, 2805
+        const ValueDict &g5 = in_memory["g5"];
+        ASSERT_EQ(g5.at("count(*)"), Value(5));
+        ASSERT_EQ(g5.at("sum(n)"), Value(7025));
+        ASSERT_EQ(g5.at("min(n)"), Value(5));
+        ASSERT_EQ(g5.at("max(s)"), Value("705"));
+        ASSERT_EQ(g5.at("avg(n)"), Value("1405"));
+        ASSERT_EQ(in_memory["g699"].at("count(*)"), Value(4));
+        ASSERT_EQ(run(8 * 1024, spilled), in_memory);
+        ASSERT_GT(spilled, 1000U);
+
+        // COUNT(*) alone counts batches, here through a vectorized filter
+        HashAggregate count(new VectorFilter(new TableScan(table, "_test_group"),
+                                             new Condition(Condition::LT, "n", Value(1234))),
+                            {}, {aggregates[0]}, SIZE_MAX);
+        ASSERT_EQ(count.get_description(), "Hash Aggregate (count(*)) by batch");
+        u_int64_t unmarshalled = Stats::local_count(COUNTER_BYTES_UNMARSHALLED);
+        count.open();
+        ValueDict *row = count.next();
+        ASSERT_NE(row, nullptr);
+        ASSERT_EQ(row->at("count(*)"), Value(1234));
+        delete row;
+        ASSERT_EQ(count.next(), nullptr);
+        count.close();
+        ASSERT_GT(Stats::local_count(COUNTER_BYTES_UNMARSHALLED), unmarshalled);
+        table.drop();
+    }
+
+	TEST_F(BTFixture, vector_filter_matches_filter)
+    {
+        remove_files({"_test_vector"});
+        BTTable table("_test_vector", {"a", "b"},
+                      {ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::TEXT)});
+        table.create();
+        ValueDicts rows;
+        for (int i = 0; i < 3000; i++)
+            rows.push_back(new ValueDict({{"a", Value((i * 7919) % 1000 - 500)}, {"b", Value(std::to_string(i % 10))}}));
+        delete table.insert(&rows);
+        for (ValueDict *row : rows)
+            delete row;
+
+        // (a >= -100 AND a < 250) OR NOT (b <> '3')
+        auto make_condition = []() {
+            return new Condition(Condition::OR,
+                                 new Condition(Condition::AND, new Condition(Condition::GE, "a", Value(-100)),
+                                               new Condition(Condition::LT, "a", Value(250))),
+                                 new Condition(Condition::NOT, new Condition(Condition::NE, "b", Value("3"))));
+        };
+        auto run = [](PlanNode &plan) {
+            std::vector<ValueDict> out;
+            plan.open();
+            while (ValueDict *row = plan.next()) {
+                out.push_back(*row);
+                delete row;
+            }
+            plan.close();
+            return out;
+        };
+        Filter filter(new TableScan(table, "_test_vector"), make_condition());
+        std::vector<ValueDict> expected = run(filter);
+        ASSERT_GT(expected.size(), 1000U);
+        for (int level = SIMD_SCALAR; level <= simd_supported(); level++) {
+            ASSERT_TRUE(set_simd_level((SimdLevel) level));
+            VectorFilter vector_filter(new TableScan(table, "_test_vector"), make_condition());
+            ASSERT_EQ(run(vector_filter), expected) << simd_level_name((SimdLevel) level);
+        }
+        set_simd_level(simd_supported());
+        table.drop();
+    }
+
+	TEST(simd_filter, levels_agree)
+	{
+		std::vector<int32_t> values(1021);  // not a multiple of any vector width
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] = (int32_t) ((i * 2654435761U) % 201) - 100;
+		values[3] = INT32_MIN;
+		values[4] = INT32_MAX;
+		for (int op = COMPARE_EQ; op <= COMPARE_GE; op++) {
+			u_int64_t expected[16], actual[16];
+			u_int16_t selection[1024];
+			set_simd_level(SIMD_SCALAR);
+			compare_int32(values.data(), values.size(), (CompareOp) op, 7, expected);
+			size_t count = bitmap_to_selection(expected, values.size(), selection);
+			for (size_t i = 1; i < count; i++)
+				ASSERT_LT(selection[i - 1], selection[i]);
+			for (int level = SIMD_SSE2; level <= simd_supported(); level++) {
+				set_simd_level((SimdLevel) level);
+				compare_int32(values.data(), values.size(), (CompareOp) op, 7, actual);
+				for (size_t i = 0; i < values.size(); i++)
+					ASSERT_EQ(expected[i / 64] >> (i % 64) & 1, actual[i / 64] >> (i % 64) & 1)
+						<< simd_level_name((SimdLevel) level) << " op " << op << " at " << i;
+			}
+		}
+		set_simd_level(simd_supported());
+	}
+
+	TEST_F(BTFixture, commit_queue_group_commit)
+    {
+        ColumnNames column_names = {"a", "b"};
+        ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT),
+                                              ColumnAttribute(ColumnAttribute::TEXT)};
+        BTTable table("_test_commit_queue", column_names, column_attributes);
+        table.create();
+
+        const int n_threads = 4, n_rows = 100;
+        CommitQueue queue(64, std::chrono::microseconds(2000));
+        std::vector<std::thread> threads;
+        std::vector<std::vector<std::future<Handle>>> futures(n_threads);
+        for (int t = 0; t < n_threads; t++) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < n_rows; i++) {
+                    ValueDict row = {{"a", Value(t * n_rows + i)}, {"b", Value("row")}};
+                    futures[t].push_back(queue.insert(table, row));
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+
+        // a row that fails validation only fails its own future
+        ValueDict bad = {{"a", Value(-1)}};
+        std::future<Handle> bad_future = queue.insert(table, bad);
+        ASSERT_THROW(bad_future.get(), std::invalid_argument);
+
+        for (auto &per_thread : futures)
+            for (auto &future : per_thread)
+                future.get();
+        ASSERT_EQ(queue.get_committed(), (u_int64_t) n_threads * n_rows);
+        ASSERT_LT(queue.get_batches(), (u_int64_t) n_threads * n_rows);
+
+        Handles *handles = table.select();
+        ASSERT_EQ(handles->size(), (size_t) n_threads * n_rows);
+        delete handles;
+
+        queue.stop();
+        ASSERT_THROW(queue.insert(table, bad).get(), DbRelationError);
+
+        // writes racing stop() are either committed or refused, none is left unresolved
+        CommitQueue racing(64, std::chrono::microseconds(2000));
+        std::vector<std::future<Handle>> raced[n_threads];
+        threads.clear();
+        for (int t = 0; t < n_threads; t++) {
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < n_rows; i++) {
+                    ValueDict row = {{"a", Value(i)}, {"b", Value("raced")}};
+                    raced[t].push_back(racing.insert(table, row));
+                }
+            });
+        }
+        racing.stop();
+        for (auto &thread : threads)
+            thread.join();
+        for (auto &per_thread : raced)
+            for (auto &future : per_thread) {
+                ASSERT_EQ(future.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+                try {
+                    future.get();
+                } catch (DbRelationError &) {
+                    // refused: submitted after stop() began
+                }
+            }
+        table.drop();
+
+        // under MDB_WRITEMAP (no nested transactions) a failing write rolls its batch back,
+        // which runs again without it
+        mdb_env_close(_MDB_ENV);
+        mdb_env_create(&_MDB_ENV);
+        mdb_env_set_mapsize(_MDB_ENV, 1UL * 1024UL * 1024UL * 1024UL);
+        mdb_env_set_maxdbs(_MDB_ENV, 5);
+        ASSERT_EQ(mdb_env_open(_MDB_ENV, envdir.c_str(), MDB_WRITEMAP, 0664), 0);
+        BTTable mapped("_test_commit_queue_writemap", column_names, column_attributes);
+        mapped.create();
+        CommitQueue writemap_queue(64, std::chrono::microseconds(20000));
+        std::vector<std::future<Handle>> batch;
+        for (int i = 0; i < 10; i++) {
+            ValueDict row = {{"a", Value(i)}, {"b", Value("row")}};
+            batch.push_back(writemap_queue.insert(mapped, i == 5 ? bad : row));
+        }
+        for (int i = 0; i < 10; i++) {
+            if (i == 5)
+                ASSERT_THROW(batch[i].get(), std::invalid_argument);
+            else
+                batch[i].get();
+        }
+        ASSERT_EQ(writemap_queue.get_committed(), 9U);
+        writemap_queue.stop();
+        handles = mapped.select();
+        ASSERT_EQ(handles->size(), 9U);
+        delete handles;
+        mapped.drop();
+    }
+
+	TEST(latency_histogram, percentiles)
+	{
+		LatencyHistogram a, b;
+		for (u_int64_t us = 1; us <= 1000; us++)
+			(us % 2 ? a : b).record(us * 1000);
+		a.merge(b);
+		ASSERT_EQ(a.count(), 1000U);
+		ASSERT_EQ(a.min(), 1000U);
+		ASSERT_EQ(a.max(), 1000000U);
+		// buckets are within ~3% of the values they hold
+		ASSERT_NEAR(a.percentile(0.50), 500000, 500000 * 0.04);
+		ASSERT_NEAR(a.percentile(0.99), 990000, 990000 * 0.04);
+		ASSERT_NEAR(a.percentile(0.999), 999000, 999000 * 0.04);
+		ASSERT_EQ(a.percentile(1.0), 1000000U);
+		a.reset();
+		ASSERT_EQ(a.count(), 0U);
+		ASSERT_EQ(a.percentile(0.5), 0U);
+	}
+
+	TEST(stats, per_thread_collect_and_reset)
+	{
+		Stats::reset();
+		std::thread other([]() {
+			for (int i = 0; i < 100; i++)
+				Stats::record(STAT_FILE_GET, 1000);
+			Stats::count(COUNTER_ROWS_SELECTED, 7);
+		});
+		for (int i = 0; i < 50; i++)
+			Stats::record(STAT_FILE_GET, 3000, i % 10 == 0);
+		try {
+			StatTimer timer(STAT_FILE_PUT);
+			throw std::runtime_error("put failed");
+		} catch (std::runtime_error &e) {
+		}
+		other.join();  // an exited thread's statistics are kept
+
+		Stats::Snapshot *snapshot = new Stats::Snapshot();
+		Stats::collect(*snapshot);
+		ASSERT_EQ(snapshot->latency[STAT_FILE_GET].count(), 150U);
+		ASSERT_EQ(snapshot->errors[STAT_FILE_GET], 5U);
+		ASSERT_EQ(snapshot->latency[STAT_FILE_GET].max(), 3000U);
+		ASSERT_EQ(snapshot->latency[STAT_FILE_PUT].count(), 1U);
+		ASSERT_EQ(snapshot->errors[STAT_FILE_PUT], 1U);
+		ASSERT_EQ(snapshot->counters[COUNTER_ROWS_SELECTED], 7U);
+		delete snapshot;
+
+		Stats::reset();
+		Stats::record(STAT_FILE_PUT, 500);
+		snapshot = new Stats::Snapshot();
+		Stats::collect(*snapshot);
+		ASSERT_EQ(snapshot->latency[STAT_FILE_GET].count(), 0U);
+		ASSERT_EQ(snapshot->latency[STAT_FILE_PUT].count(), 1U);
+		ASSERT_EQ(snapshot->errors[STAT_FILE_PUT], 0U);
+		ASSERT_EQ(snapshot->counters[COUNTER_ROWS_SELECTED], 0U);
+		delete snapshot;
+	}
+
+	TEST(db_env, config_options)
+	{
+		EnvConfig config;
+		std::vector<std::string> args = {"--map-size=64M", "--durability", "nosync", "data", "--max-dbs=20"};
+		config.parse_args(args);
+		ASSERT_EQ(args, std::vector<std::string>{"data"});
+		ASSERT_EQ(config.map_size, 64UL << 20);
+		ASSERT_EQ(config.max_dbs, 20U);
+		ASSERT_EQ(config.get_env_flags(), (unsigned int) MDB_NOSYNC);
+		ASSERT_TRUE(config.defers_sync());
+		ASSERT_THROW(config.set("durability", "reckless"), std::invalid_argument);
+		ASSERT_THROW(config.set("map-size", "lots"), std::invalid_argument);
+		ASSERT_THROW(config.set("map-size", "-1"), std::invalid_argument);
+		ASSERT_THROW(config.set("statement-cache", " -5"), std::invalid_argument);
+		ASSERT_EQ(config.map_size, 64UL << 20);
+		ASSERT_THROW(config.set("colour", "blue"), std::invalid_argument);
+		ASSERT_TRUE(config.has_bloom_filter("_columns", "table_name"));
+		config.set("bloom-filters", "t.a,u.b");
+		ASSERT_TRUE(config.has_bloom_filter("u", "b"));
+		ASSERT_FALSE(config.has_bloom_filter("t", "b"));
+		ASSERT_THROW(config.set("bloom-filters", "t.a,b"), std::invalid_argument);
+		config.set("stale-reader", "500");
+		ASSERT_EQ(config.stale_reader_ms, 500U);
+	}
+
+	TEST(db_env, map_grows_when_full)
+	{
+		std::string envdir = std::string(std::filesystem::temp_directory_path()) + "/lmdb-XXXXXX";
+		mkdtemp(envdir.data());
+		EnvConfig config;
+		config.set("map-size", "64K");
+		config.set("max-map-size", "8M");
+		config.set("durability", "nosync");
+		DbEnv::open(envdir.c_str(), config);
+
+		ColumnNames column_names = {"a", "b"};
+		ColumnAttributes column_attributes = {ColumnAttribute(ColumnAttribute::INT),
+		                                      ColumnAttribute(ColumnAttribute::TEXT)};
+		BTTable table("_test_map_growth", column_names, column_attributes);
+		table.create();
+		ValueDict row = {{"a", Value(1)}, {"b", Value(std::string(200, 'x'))}};
+		for (int i = 0; i < 500; i++)
+			table.insert(&row);
+
+		// and again with every insert in one transaction
+		DbEnv::write_transaction([&]() {
+			for (int i = 0; i < 500; i++)
+				table.insert(&row);
+		});
+		ASSERT_GT(DbEnv::get_growths(), 0U);
+		Handles *handles = table.select();
+		ASSERT_EQ(handles->size(), 1000U);
+		delete handles;
+
+		// and with a multi-row insert
+		u_int64_t growths = DbEnv::get_growths();
+		ValueDicts rows(3000, &row);
+		delete table.insert(&rows);
+		ASSERT_GT(DbEnv::get_growths(), growths);
+		handles = table.select();
+		ASSERT_EQ(handles->size(), 4000U);
+		delete handles;
+
+		// growth stops at max-map-size
+		row["b"] = Value(std::string(3000, 'y'));
+		ASSERT_THROW({
+			for (int i = 0; i < 5000; i++)
+				table.insert(&row);
+		}, DbException);
+
+		DbEnv::close();
+		std::filesystem::remove_all(envdir);
+	}
 }
 
 MDB_val *marshal_text(std::string text)